@@ -31,6 +31,7 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "fsck_hfs.h"
 #include "cache.h"
@@ -40,12 +41,69 @@
 
 #define CACHE_DEBUG  0
 
+/*
+ * Counters are bumped from several threads without holding any lock.
+ */
+#define CacheCount(counter)	((void)__sync_fetch_and_add(&(counter), 1))
+#define CacheCountBytes(counter, n)	((void)__sync_fetch_and_add(&(counter), (n)))
+
+/*
+ * CacheIO_t
+ *
+ *  One asynchronous read: a run of cache blocks that are contiguous on disk.
+ *  Their tags are already in the hash table, marked kInFlight and holding a
+ *  reference, so nothing else touches the buffers until the read completes.
+ */
+typedef struct CacheIO_t
+{
+	struct CacheIO_t *	Next;		/* Next request in the queue */
+	uint64_t		Offset;		/* Offset of the first cache block */
+	uint32_t		Count;		/* Number of cache blocks */
+	Tag_t *			Tags[MaxIOBlocks];
+} CacheIO_t;
+
+/*
+ * CacheShardOf
+ *
+ *  Return the shard that owns the cache block at the given offset.
+ */
+static inline CacheShard_t *
+CacheShardOf (Cache_t *cache, uint64_t off)
+{
+	return (&cache->Shards[(off / cache->BlockSize) & cache->ShardMask]);
+}
+
+/*
+ * CacheBucket
+ *
+ *  Return the hash chain for the cache block at the given offset.
+ */
+static inline Tag_t **
+CacheBucket (Cache_t *cache, CacheShard_t *shard, uint64_t off)
+{
+	return (&shard->Hash[((off / cache->BlockSize) >> cache->ShardShift) & shard->HashMask]);
+}
+
 /*
  * CacheAllocBlock
  *
- *  Allocate an unused cache block.
+ *  Allocate an unused cache block from a shard's free list.
+ */
+void *CacheAllocBlock (CacheShard_t *shard);
+
+/*
+ * CacheStealBlock
+ *
+ *  Take a free cache block from another shard.
  */
-void *CacheAllocBlock (Cache_t *cache);
+static void *CacheStealBlock (Cache_t *cache, CacheShard_t *shard);
+
+/*
+ * CachePutBlock
+ *
+ *  Return an unused cache block to a shard's free list.
+ */
+static void CachePutBlock (CacheShard_t *shard, void *block);
 
 /*
  * CacheFreeBlock
@@ -55,11 +113,48 @@ void *CacheAllocBlock (Cache_t *cache);
 static int 
 CacheFreeBlock( Cache_t *cache, Tag_t *tag );
 
+/*
+ * CacheInsertBlock
+ *
+ *  Create a tag for a cache block that has just been read from disk.
+ */
+static int CacheInsertBlock (Cache_t *cache, CacheShard_t *shard, uint64_t off, void *block,
+                             uint32_t flags, Tag_t **tagp);
+
+/*
+ * CacheIOSubmit
+ *
+ *  Hand a request to the I/O threads, or read it inline if there are none.
+ */
+static void CacheIOSubmit (Cache_t *cache, CacheIO_t *io);
+
+/*
+ * CacheIODo
+ *
+ *  Perform an asynchronous read request and complete its cache blocks.
+ */
+static void CacheIODo (Cache_t *cache, CacheIO_t *io);
+
+/*
+ * CacheIOWorker
+ *
+ *  Body of an I/O thread.
+ */
+static void *CacheIOWorker (void *arg);
+
+/*
+ * CacheIOStop
+ *
+ *  Finish the queued reads and stop the I/O threads.
+ */
+static void CacheIOStop (Cache_t *cache);
+
 /*
  * CacheLookup
  *
  *  Obtain a cache block. If one already exists, it is returned. Otherwise a
- *  new one is created and inserted into the cache.
+ *  new one is created and inserted into the cache.  The block's shard must be
+ *  locked by the caller.
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag);
 
@@ -86,12 +181,20 @@ int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf);
 static int
 CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove);
 
+/*
+ * CacheDetachBuf
+ *
+ *  Remove a buffer from the active list and put it back on the free list.
+ */
+static void CacheDetachBuf (Cache_t *cache, Buf_t *buf);
+
 /*
  * LRUInit
  *
- *  Initializes the LRU data structures.
+ *  Initializes the LRU data structures for a shard holding the given number
+ *  of cache blocks.
  */
-static int LRUInit (LRU_t *lru);
+static int LRUInit (LRU_t *lru, uint32_t blocks);
 
 /*
  * LRUDestroy
@@ -106,8 +209,8 @@ static int LRUDestroy (LRU_t *lru);
 /*
  * LRUHit
  *
- *  Registers data activity on the given node. If the node is already in the
- *  LRU, it is moved to the front. Otherwise, it is inserted at the front.
+ *  Registers data activity on the given node, moving it to the front of the
+ *  queue it belongs on.
  *
  *  NOTE: If the node is not in the LRU, we assume that its pointers are NULL.
  */
@@ -117,14 +220,16 @@ static int LRUHit (LRU_t *lru, LRUNode_t *node, int age);
  * LRUEvict
  *
  *  Chooses a buffer to release.
- *
- *  TODO: Under extreme conditions, it should be possible to release the buffer
- *        of an actively referenced cache buffer, leaving the tag behind as a
- *        placeholder. This would be required for implementing 2Q-LRU
- *        replacement.
  */
 static int LRUEvict (LRU_t *lru, LRUNode_t *node);
 
+/*
+ * LRURemove
+ *
+ *  Take a node off whichever queue it is on.
+ */
+static void LRURemove (LRU_t *lru, LRUNode_t *node);
+
 /*
  * CalculateCacheSizes
  *
@@ -192,34 +297,43 @@ out:
  *  be iterated through, with one byte per page touched.  (This is to ensure that
  *  the memory is actually created, and is used to avoid deadlocking due to swapping
  *  during a live verify of the boot volume.)
+ *
+ *  The cache is split into a power-of-two number of shards, each holding at
+ *  least MinBlocksPerShard blocks.  Every shard gets a hash table with at
+ *  least one bucket per cache block it can hold; hashSize is only a lower
+ *  bound on the total number of buckets.
  */
 int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
                uint32_t cacheBlockSize, uint32_t cacheTotalBlocks, uint32_t hashSize, int preTouch)
 {
 	void **		temp;
 	uint32_t	i;
+	uint32_t	shardCount;
+	uint32_t	bucketCount;
 	Buf_t *		buf;
+	CacheShard_t *	shard;
 	
 	memset (cache, 0x00, sizeof (Cache_t));
 
 	cache->FD_R = fdRead;
 	cache->FD_W = fdWrite;
 	cache->DevBlockSize = devBlockSize;
-	/* CacheFlush requires cleared cache->Hash  */
-	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * hashSize) );
-	cache->HashSize = hashSize;
 	cache->BlockSize = cacheBlockSize;
+	pthread_mutex_init (&cache->BufLock, NULL);
+	pthread_mutex_init (&cache->IOLock, NULL);
+	pthread_cond_init (&cache->IOWork, NULL);
+	pthread_cond_init (&cache->IOIdle, NULL);
 
 	/* Allocate the cache memory */
 	/* Break out of the loop on success, or when the proposed cache is < MinCacheSize */
 	while (1) {
-		cache->FreeHead = mmap (NULL,
-					cacheTotalBlocks * cacheBlockSize,
-					PROT_READ | PROT_WRITE,
-					MAP_ANON | MAP_PRIVATE,
-					-1,
-					0);
-		if (cache->FreeHead == (void *)-1) {
+		temp = mmap (NULL,
+			     cacheTotalBlocks * cacheBlockSize,
+			     PROT_READ | PROT_WRITE,
+			     MAP_ANON | MAP_PRIVATE,
+			     -1,
+			     0);
+		if (temp == (void *)-1) {
 			if ((cacheTotalBlocks * cacheBlockSize) <= MinCacheSize) {
 				if (debug)
 					printf("\tTried to allocate %dK, minimum is %dK\n",
@@ -240,18 +354,18 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 			break;
 		}
 	}
-	if (cache->FreeHead == (void*)-1) {
+	if (temp == (void*)-1) {
 #if CACHE_DEBUG
-		printf("%s(%d):  FreeHead = -1\n", __FUNCTION__, __LINE__);
+		printf("%s(%d):  mmap failed\n", __FUNCTION__, __LINE__);
 #endif
 		return (ENOMEM);
 	}
-
+	cache->TotalBlocks = cacheTotalBlocks;
 
 	/* If necessary, touch a byte in each page */
 	if (preTouch) {
 		size_t pageSize = getpagesize();
-		unsigned char *ptr = (unsigned char *)cache->FreeHead;
+		unsigned char *ptr = (unsigned char *)temp;
 		unsigned char *end = ptr + (cacheTotalBlocks * cacheBlockSize);
 		while (ptr < end) {
 			*ptr = 0;
@@ -259,14 +373,51 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 		}
 	}
 
-	/* Initialize the cache memory free list */
-	temp = cache->FreeHead;
-	for (i = 0; i < cacheTotalBlocks - 1; i++) {
-		*temp = ((char *)temp + cacheBlockSize);
-		temp  = (void **)((char *)temp + cacheBlockSize);
+	/* Pick the number of shards */
+	shardCount = 1;
+	cache->ShardShift = 0;
+	while (shardCount < MaxCacheShards &&
+	       (cacheTotalBlocks / (shardCount * 2)) >= MinBlocksPerShard) {
+		shardCount *= 2;
+		cache->ShardShift++;
+	}
+	cache->ShardMask = shardCount - 1;
+
+	/* Size each shard's hash table to the number of blocks it can hold */
+	bucketCount = 1;
+	while (bucketCount < (cacheTotalBlocks + shardCount - 1) / shardCount ||
+	       bucketCount * shardCount < hashSize)
+		bucketCount *= 2;
+	cache->HashSize = bucketCount * shardCount;
+
+	cache->Shards = (CacheShard_t *) calloc (shardCount, sizeof (CacheShard_t));
+	if (cache->Shards == NULL) {
+		munmap (temp, cacheTotalBlocks * cacheBlockSize);
+		return (ENOMEM);
+	}
+	for (i = 0; i < shardCount; i++) {
+		shard = &cache->Shards[i];
+		pthread_mutex_init (&shard->Lock, NULL);
+		pthread_cond_init (&shard->IODone, NULL);
+		shard->Cache = cache;
+		/* CacheFlush requires cleared shard->Hash  */
+		shard->Hash = (Tag_t **) calloc (bucketCount, sizeof (Tag_t *));
+		if (shard->Hash == NULL)
+			return (ENOMEM);
+		shard->HashMask = bucketCount - 1;
+		LRUInit (&shard->LRU, cacheTotalBlocks / shardCount +
+		                      (i < cacheTotalBlocks % shardCount ? 1 : 0));
+	}
+
+	/* Deal the cache memory out to the shards' free lists */
+	for (i = 0; i < cacheTotalBlocks; i++) {
+		void **block = (void **)((char *)temp + ((size_t)i * cacheBlockSize));
+
+		shard = &cache->Shards[i & cache->ShardMask];
+		*block = shard->FreeHead;
+		shard->FreeHead = block;
+		shard->FreeSize++;
 	}
-	*temp = NULL;
-	cache->FreeSize = cacheTotalBlocks;
 
 	buf = (Buf_t *)malloc(sizeof(Buf_t) * MAXBUFS);
 	if (buf == NULL) {
@@ -283,12 +434,12 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 	cache->FreeBufs = &buf[0];
 
 #if CACHE_DEBUG
-	printf( "%s - cacheTotalBlocks %d cacheBlockSize %d hashSize %d \n", 
-			__FUNCTION__, cacheTotalBlocks, cacheBlockSize, hashSize );
+	printf( "%s - cacheTotalBlocks %d cacheBlockSize %d shards %d hashSize %d \n", 
+			__FUNCTION__, cacheTotalBlocks, cacheBlockSize, shardCount, cache->HashSize );
 	printf( "%s - cache memory %d \n", __FUNCTION__, (cacheTotalBlocks * cacheBlockSize) );
 #endif  
 
-	return (LRUInit (&cache->LRU));
+	return (EOK);
 }
 
 
@@ -299,6 +450,9 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
  */
 int CacheDestroy (Cache_t *cache)
 {
+	uint32_t	i;
+
+	CacheIOStop( cache );
 	CacheFlush( cache );
 
 #if CACHE_DEBUG
@@ -309,9 +463,24 @@ int CacheDestroy (Cache_t *cache)
 	printf ("\tDisk Reads:     %d\n", cache->DiskRead);
 	printf ("\tDisk Writes:    %d\n", cache->DiskWrite);
 	printf ("\tSpans:          %d\n", cache->Span);
+	printf ("\tRead Ahead:     %d\n", cache->ReadAhead);
 #endif	
-	/* Shutdown the LRU */
-	LRUDestroy (&cache->LRU);
+	if (debug && cache->ReqRead != 0)
+		printf ("\tCache: %u reads, %u disk reads (%u blocks read ahead), %u%% hit rate\n",
+		        cache->ReqRead, cache->DiskRead, cache->ReadAhead,
+		        cache->DiskRead >= cache->ReqRead ? 0 :
+		        (uint32_t)(100 - ((uint64_t)cache->DiskRead * 100) / cache->ReqRead));
+
+	/* Shutdown the LRUs */
+	for (i = 0; i <= cache->ShardMask; i++) {
+		LRUDestroy (&cache->Shards[i].LRU);
+		pthread_cond_destroy (&cache->Shards[i].IODone);
+		pthread_mutex_destroy (&cache->Shards[i].Lock);
+	}
+	pthread_cond_destroy (&cache->IOIdle);
+	pthread_cond_destroy (&cache->IOWork);
+	pthread_mutex_destroy (&cache->IOLock);
+	pthread_mutex_destroy (&cache->BufLock);
 	
 	/* I'm lazy, I'll come back to it :P */
 	return (EOK);
@@ -332,17 +501,24 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 	Tag_t *		tag;
 	Buf_t *		searchBuf;
 	Buf_t *		buf;
+	CacheShard_t *	shard;
 	uint32_t	coff = (off % cache->BlockSize);
 	uint64_t	cblk = (off - coff);
+	uint64_t	raStart = 0;
+	pthread_t	self = pthread_self();
 	int			error;
 
-	/* Check for conflicts with other bufs */
+	pthread_mutex_lock (&cache->BufLock);
+
+	/* Check for conflicts with other bufs held by this thread */
 	searchBuf = cache->ActiveBufs;
 	while (searchBuf != NULL) {
-		if ((searchBuf->Offset >= off) && (searchBuf->Offset < off + len)) {
+		if ((searchBuf->Offset >= off) && (searchBuf->Offset < off + len) &&
+		    pthread_equal(searchBuf->Owner, self)) {
 #if CACHE_DEBUG
 			printf ("ERROR: CacheRead: Deadlock (searchBuff = <%llu, %u>, off = %llu, off+len = %llu)\n", searchBuf->Offset, searchBuf->Length, off, off+len);
 #endif
+			pthread_mutex_unlock (&cache->BufLock);
 			return (EDEADLK);
 		}
 		
@@ -354,9 +530,29 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRead: no more bufs!\n");
 #endif
+		pthread_mutex_unlock (&cache->BufLock);
 		return (ENOBUFS);
 	}
 	cache->FreeBufs = buf->Next; 
+
+	/*
+	 * Track sequential access.  Reads that stay within the last cache block
+	 * neither extend nor break the stream; once it is long enough, keep the
+	 * read-ahead window at least half a window in front of the reader.
+	 */
+	if (cblk == cache->SeqNext) {
+		cache->SeqCount++;
+	} else if (cblk + cache->BlockSize != cache->SeqNext) {
+		cache->SeqCount = 0;
+		cache->RaNext = 0;
+	}
+	cache->SeqNext = (off + len - 1) - ((off + len - 1) % cache->BlockSize) + cache->BlockSize;
+	if (cache->SeqCount >= ReadAheadTrigger &&
+	    cache->RaNext < cache->SeqNext + (ReadAheadBlocks / 2) * cache->BlockSize) {
+		raStart = (cache->RaNext > cache->SeqNext) ? cache->RaNext : cache->SeqNext;
+		cache->RaNext = raStart + ReadAheadBlocks * cache->BlockSize;
+	}
+	pthread_mutex_unlock (&cache->BufLock);
 	*bufp = buf;
 
 	/* Clear the buf structure */
@@ -365,6 +561,7 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 	buf->Flags	= 0;
 	buf->Offset	= off;
 	buf->Length	= len;
+	buf->Owner	= self;
 	buf->Buffer	= NULL;
 	
 	/* If this is unaligned or spans multiple cache blocks */
@@ -375,8 +572,11 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #if CACHE_DEBUG
 	printf("%s(%d):  Looking up cache block %llu for offset %llu, cache blockSize %u\n", __FUNCTION__, __LINE__, cblk, off, cache->BlockSize);
 #endif
+	shard = CacheShardOf (cache, cblk);
+	pthread_mutex_lock (&shard->Lock);
 	error = CacheLookup (cache, cblk, &tag);
 	if (error != EOK) {
+		pthread_mutex_unlock (&shard->Lock);
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRead: CacheLookup error %d\n", error);
 #endif
@@ -392,7 +592,8 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		tag->Refs++;
 		
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+		pthread_mutex_unlock (&shard->Lock);
 
 	/* Otherwise, things get ugly */
 	} else {
@@ -403,6 +604,7 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		/* Allocate a temp buffer */
 		buf->Buffer = (void *)malloc (len);
 		if (buf->Buffer == NULL) {
+			pthread_mutex_unlock (&shard->Lock);
 #if CACHE_DEBUG
 			printf ("ERROR: CacheRead: No Memory\n");
 #endif
@@ -421,7 +623,8 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		tag->Refs++;
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+		pthread_mutex_unlock (&shard->Lock);
 
 		/* Next cache block */
 		cblk += cache->BlockSize;
@@ -429,8 +632,12 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		/* Read data a cache block at a time */
 		while (blen) {
 			/* Fetch the next cache block */
+			shard = CacheShardOf (cache, cblk);
+			pthread_mutex_lock (&shard->Lock);
 			error = CacheLookup (cache, cblk, &tag);
 			if (error != EOK) {
+				pthread_mutex_unlock (&shard->Lock);
+
 				/* Free the allocated buffer */
 				free (buf->Buffer);
 				buf->Buffer = NULL;
@@ -438,6 +645,8 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 				/* Release all the held tags */
 				cblk -= cache->BlockSize;
 				while (!boff) {
+					shard = CacheShardOf (cache, cblk);
+					pthread_mutex_lock (&shard->Lock);
 					if (CacheLookup (cache, cblk, &tag) != EOK) {
 						fprintf (stderr, "CacheRead: Unrecoverable error\n");
 						exit (-1);
@@ -445,7 +654,8 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 					tag->Refs--;
 					
 					/* Kick the node into the right queue */
-					LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+					LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+					pthread_mutex_unlock (&shard->Lock);
 				}
 
 				return (error);
@@ -465,30 +675,34 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 			blen -= temp;
 			tag->Refs++;
 
+			/* Kick the node into the right queue */
+			LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+			pthread_mutex_unlock (&shard->Lock);
+
 			/* Advance to the next cache block */
 			cblk += cache->BlockSize;
-
-			/* Kick the node into the right queue */
-			LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
 		}
 
 		/* Count the spanned access */
-		cache->Span++;
+		CacheCount (cache->Span);
 	}
 
 	/* Attach to head of active buffers list */
-	if (cache->ActiveBufs != NULL) {
-		buf->Next = cache->ActiveBufs;
-		buf->Prev = NULL;
-
+	pthread_mutex_lock (&cache->BufLock);
+	buf->Next = cache->ActiveBufs;
+	buf->Prev = NULL;
+	if (cache->ActiveBufs != NULL)
 		cache->ActiveBufs->Prev = buf;
-
-	} else {
-		cache->ActiveBufs = buf;
-	}
+	cache->ActiveBufs = buf;
+	pthread_mutex_unlock (&cache->BufLock);
 
 	/* Update counters */
-	cache->ReqRead++;
+	CacheCount (cache->ReqRead);
+
+	/* Read ahead of a sequential stream; failures are left to the reader */
+	if (raStart != 0)
+		(void) CacheReadAsync (cache, raStart, (uint64_t)ReadAheadBlocks * cache->BlockSize);
+
 	return (EOK);
 }
 
@@ -505,13 +719,19 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 {
 	Tag_t *		tag;
+	CacheShard_t *	shard;
 	uint32_t	coff = (buf->Offset % cache->BlockSize);
 	uint64_t	cblk = (buf->Offset - coff);
 	int			error;
 
 	/* Fetch the first cache block */
+	shard = CacheShardOf (cache, cblk);
+	pthread_mutex_lock (&shard->Lock);
 	error = CacheLookup (cache, cblk, &tag);
-	if (error != EOK) return (error);
+	if (error != EOK) {
+		pthread_mutex_unlock (&shard->Lock);
+		return (error);
+	}
 	
 	/* If the buffer was a direct reference */
 	if (!(buf->Flags & BUF_SPAN)) {
@@ -527,7 +747,10 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 								   tag->Offset,
 								   cache->BlockSize,
 								   tag->Buffer);
-			if (error != EOK) return (error);
+			if (error != EOK) {
+				pthread_mutex_unlock (&shard->Lock);
+				return (error);
+			}
 		}
 		
 		/* Release the reference */
@@ -535,7 +758,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 			tag->Refs--;
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 
 	/* Otherwise, we do the ugly thing again */
 	} else {
@@ -560,7 +784,10 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 								   tag->Offset,
 								   cache->BlockSize,
 								   tag->Buffer);
-			if (error != EOK) return (error);
+			if (error != EOK) {
+				pthread_mutex_unlock (&shard->Lock);
+				return (error);
+			}
 		}
 		
 		/* Release the cache block reference */
@@ -568,7 +795,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 			tag->Refs--;
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 			
 		/* Next cache block */
 		cblk += cache->BlockSize;
@@ -576,6 +804,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		/* Write data a cache block at a time */
 		while (blen) {
 			/* Fetch the next cache block */
+			shard = CacheShardOf (cache, cblk);
+			pthread_mutex_lock (&shard->Lock);
 			error = CacheLookup (cache, cblk, &tag);
 			/* We must go through with the write regardless */
 
@@ -597,7 +827,10 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 									   tag->Offset,
 									   cache->BlockSize,
 									   tag->Buffer);
-				if (error != EOK) return (error);
+				if (error != EOK) {
+					pthread_mutex_unlock (&shard->Lock);
+					return (error);
+				}
 			}
 
 			/* Update counters */
@@ -607,7 +840,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 				tag->Refs--;
 
 			/* Kick the node into the right queue */
-			LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+			LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+			pthread_mutex_unlock (&shard->Lock);
 			/* And go to the next cache block */
 			cblk += cache->BlockSize;
 		}
@@ -617,20 +851,10 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 	}
 
 	/* Detach the buffer */
-	if (buf->Next != NULL)
-		buf->Next->Prev = buf->Prev;
-	if (buf->Prev != NULL)
-		buf->Prev->Next = buf->Next;
-	if (cache->ActiveBufs == buf)
-		cache->ActiveBufs = buf->Next;
-
-	/* Clear the buffer and put it back on free list */
-	memset (buf, 0x00, sizeof (Buf_t));
-	buf->Next = cache->FreeBufs; 
-	cache->FreeBufs = buf; 		
+	CacheDetachBuf (cache, buf);
 
 	/* Update counters */
-	cache->ReqWrite++;
+	CacheCount (cache->ReqWrite);
 
 	return (EOK);
 }
@@ -645,13 +869,17 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 {
 	Tag_t *		tag;
+	CacheShard_t *	shard;
 	uint32_t	coff = (buf->Offset % cache->BlockSize);
 	uint64_t	cblk = (buf->Offset - coff);
 	int			error;
 
 	/* Fetch the first cache block */
+	shard = CacheShardOf (cache, cblk);
+	pthread_mutex_lock (&shard->Lock);
 	error = CacheLookup (cache, cblk, &tag);
 	if (error != EOK) {
+		pthread_mutex_unlock (&shard->Lock);
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRelease: CacheLookup error\n");
 #endif
@@ -666,7 +894,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		}
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 
 	/* Otherwise, we do the ugly thing again */
 	} else {
@@ -681,7 +910,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		}
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 
 		/* Next cache block */
 		cblk += cache->BlockSize;
@@ -689,6 +919,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		/* Release cache blocks one at a time */
 		while (blen) {
 			/* Fetch the next cache block */
+			shard = CacheShardOf (cache, cblk);
+			pthread_mutex_lock (&shard->Lock);
 			error = CacheLookup (cache, cblk, &tag);
 			/* We must go through with the write regardless */
 
@@ -698,7 +930,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 				tag->Refs--;
 
 			/* Kick the node into the right queue */
-			LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+			LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+			pthread_mutex_unlock (&shard->Lock);
 			/* Advance to the next block */
 			cblk += cache->BlockSize;
 		}
@@ -707,6 +940,21 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		free (buf->Buffer);
 	}
 
+	/* Detach the buffer */
+	CacheDetachBuf (cache, buf);
+
+	return (EOK);
+}
+
+/*
+ * CacheDetachBuf
+ *
+ *  Remove a buffer from the active list and put it back on the free list.
+ */
+static void CacheDetachBuf (Cache_t *cache, Buf_t *buf)
+{
+	pthread_mutex_lock (&cache->BufLock);
+
 	/* Detach the buffer */
 	if (buf->Next != NULL)
 		buf->Next->Prev = buf->Prev;
@@ -720,32 +968,499 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 	buf->Next = cache->FreeBufs; 
 	cache->FreeBufs = buf; 		
 
+	pthread_mutex_unlock (&cache->BufLock);
+}
+
+/*
+ * CacheFind
+ *
+ *  Return the tag for a cache block if it is already in the hash table,
+ *  without reordering the hash chain or touching the disk.  The block's
+ *  shard must be locked.
+ */
+static Tag_t *
+CacheFind (Cache_t *cache, CacheShard_t *shard, uint64_t off)
+{
+	Tag_t *	temp;
+
+	for (temp = *CacheBucket(cache, shard, off); temp != NULL; temp = temp->Next) {
+		if (temp->Offset == off)
+			break;
+	}
+	return (temp);
+}
+
+/*
+ * CacheCopyOut
+ *
+ *  Copy [off, off + len) into the caller's buffer straight from the cache
+ *  blocks, loading the ones that are missing (or waiting for those that are
+ *  in flight).  Unlike CacheRead this never builds a temporary buffer for a
+ *  range spanning cache blocks, and leaves nothing to release.
+ */
+int CacheCopyOut (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
+{
+	CacheShard_t *	shard;
+	Tag_t *		tag;
+	uint64_t	cblk;
+	uint32_t	coff;
+	uint32_t	count;
+	int			error;
+
+	while (len != 0) {
+		coff = off % cache->BlockSize;
+		cblk = off - coff;
+		count = cache->BlockSize - coff;
+		if (count > len)
+			count = len;
+
+		shard = CacheShardOf (cache, cblk);
+		pthread_mutex_lock (&shard->Lock);
+		error = CacheLookup (cache, cblk, &tag);
+		if (error != EOK) {
+			pthread_mutex_unlock (&shard->Lock);
+			return (error);
+		}
+		memcpy (buf, tag->Buffer + coff, count);
+
+		/* Kick the node into the right queue */
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+		pthread_mutex_unlock (&shard->Lock);
+
+		buf = (char *)buf + count;
+		off += count;
+		len -= count;
+	}
+
+	CacheCount (cache->ReqRead);
+	return (EOK);
+}
+
+/*
+ * CachePrefetch
+ *
+ *  Load the cache blocks covering [off, off + len) into the cache, so that
+ *  a later CacheRead of that range is a hit.  Blocks that are already cached
+ *  (including blocks locked in by the journal replay simulation) are left
+ *  alone, and nothing is ever evicted: once a shard's free list is empty we
+ *  stop and return ENOSPC.
+ *
+ *  The disk read is done with the shard unlocked, so several threads can
+ *  prefetch different ranges in parallel.
+ */
+int CachePrefetch (Cache_t *cache, uint64_t off, uint32_t len)
+{
+	uint64_t	cblk = off - (off % cache->BlockSize);
+	uint64_t	end = off + len;
+	CacheShard_t *	shard;
+	void *		block;
+	ssize_t		nread;
+	int			error;
+
+	for (; cblk < end; cblk += cache->BlockSize) {
+		shard = CacheShardOf(cache, cblk);
+
+		pthread_mutex_lock(&shard->Lock);
+		if (CacheFind(cache, shard, cblk) != NULL) {
+			pthread_mutex_unlock(&shard->Lock);
+			continue;
+		}
+		block = CacheAllocBlock(shard);
+		pthread_mutex_unlock(&shard->Lock);
+		if (block == NULL)
+			return (ENOSPC);
+
+		nread = pread(cache->FD_R, block, cache->BlockSize, cblk);
+		error = (nread == -1) ? errno : EOK;
+		if (nread > 0)
+			CacheCountBytes(cache->BytesRead, nread);
+
+		pthread_mutex_lock(&shard->Lock);
+		/*
+		 * Give the block back on a failed or short read (the regular
+		 * CacheRead path will report the error), or if another thread
+		 * loaded the same cache block while we were reading.
+		 */
+		if (nread != cache->BlockSize || CacheFind(cache, shard, cblk) != NULL) {
+			CachePutBlock(shard, block);
+			pthread_mutex_unlock(&shard->Lock);
+			if (error != EOK)
+				return (error);
+			continue;
+		}
+
+		error = CacheInsertBlock(cache, shard, cblk, block, 0, NULL);
+		if (error != EOK)
+			CachePutBlock(shard, block);
+		pthread_mutex_unlock(&shard->Lock);
+		if (error != EOK)
+			return (error);
+		CacheCount (cache->DiskRead);
+	}
+
+	return (EOK);
+}
+
+/*
+ * CacheReadAsync
+ *
+ *  Queue the cache blocks covering [off, off + len) to be read by the I/O
+ *  threads, in runs of up to MaxIOBlocks blocks that are contiguous on disk.
+ *  Blocks that are cached or already in flight are skipped, and blocks whose
+ *  tag is remembered on Out are read back in.  New blocks land on In, so at
+ *  worst they push out other blocks that were seen once.
+ *
+ *  This is only a hint.  We stop early, without an error, once a quarter of
+ *  the cache is in flight or nothing more can be evicted, and read errors
+ *  are left for the CacheRead of the block to find and report.
+ */
+int CacheReadAsync (Cache_t *cache, uint64_t off, uint64_t len)
+{
+	uint64_t	cblk = off - (off % cache->BlockSize);
+	uint64_t	end = off + len;
+	CacheShard_t *	shard;
+	CacheIO_t *	io = NULL;
+	Tag_t *		tag;
+	void *		block;
+	int			error = EOK;
+
+	for (; cblk < end; cblk += cache->BlockSize) {
+		/* Don't let reads in flight take over the cache */
+		if (__atomic_load_n(&cache->IOBlocks, __ATOMIC_RELAXED) >= cache->TotalBlocks / 4)
+			break;
+
+		if (io == NULL) {
+			io = (CacheIO_t *)calloc(1, sizeof(CacheIO_t));
+			if (io == NULL) {
+				error = ENOMEM;
+				break;
+			}
+		}
+
+		shard = CacheShardOf(cache, cblk);
+		pthread_mutex_lock(&shard->Lock);
+		tag = CacheFind(cache, shard, cblk);
+		if (tag != NULL && (tag->Buffer != NULL || tag->Refs != 0)) {
+			/* Already there; this ends the current run */
+			pthread_mutex_unlock(&shard->Lock);
+			if (io->Count != 0) {
+				CacheIOSubmit(cache, io);
+				io = NULL;
+			}
+			continue;
+		}
+
+		block = CacheAllocBlock(shard);
+		if (block == NULL && LRUEvict(&shard->LRU, (LRUNode_t *)tag) == EOK)
+			block = CacheAllocBlock(shard);
+		if (block == NULL) {
+			pthread_mutex_unlock(&shard->Lock);
+			break;
+		}
+
+		if (tag != NULL) {
+			/* The tag was on Out; this is its second reference */
+			tag->Buffer = block;
+			tag->Flags |= kInFlight;
+			tag->Refs++;
+			LRUHit(&shard->LRU, (LRUNode_t *)tag, 0);
+		} else {
+			error = CacheInsertBlock(cache, shard, cblk, block, kInFlight, &tag);
+			if (error != EOK) {
+				CachePutBlock(shard, block);
+				pthread_mutex_unlock(&shard->Lock);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&shard->Lock);
+		CacheCount(cache->IOBlocks);
+
+		if (io->Count == 0)
+			io->Offset = cblk;
+		io->Tags[io->Count++] = tag;
+		if (io->Count == MaxIOBlocks) {
+			CacheIOSubmit(cache, io);
+			io = NULL;
+		}
+	}
+
+	if (io != NULL) {
+		if (io->Count != 0)
+			CacheIOSubmit(cache, io);
+		else
+			free(io);
+	}
+
+	return (error);
+}
+
+/*
+ * CacheIOSubmit
+ *
+ *  Hand a request to the I/O threads, or read it inline if there are none.
+ */
+static void CacheIOSubmit (Cache_t *cache, CacheIO_t *io)
+{
+	if (cache->IOThreads == 0) {
+		CacheIODo(cache, io);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->IOLock);
+	io->Next = NULL;
+	if (cache->IOTail != NULL)
+		cache->IOTail->Next = io;
+	else
+		cache->IOHead = io;
+	cache->IOTail = io;
+	cache->IOPending++;
+	pthread_cond_signal(&cache->IOWork);
+	pthread_mutex_unlock(&cache->IOLock);
+}
+
+/*
+ * CacheIODo
+ *
+ *  Read a request with one preadv, then complete its cache blocks: each one
+ *  drops its in-flight reference and goes on In (or the main LRU, if it was
+ *  brought back from Out).  A block that could not be read in full is
+ *  removed again, so that a later CacheRead reads it itself and reports the
+ *  error.  Waiters on each shard are woken as its blocks complete.
+ */
+static void CacheIODo (Cache_t *cache, CacheIO_t *io)
+{
+	struct iovec	iov[MaxIOBlocks];
+	CacheShard_t *	shard;
+	Tag_t *		tag;
+	ssize_t		nread;
+	uint32_t	i;
+
+	for (i = 0; i < io->Count; i++) {
+		iov[i].iov_base = io->Tags[i]->Buffer;
+		iov[i].iov_len = cache->BlockSize;
+	}
+
+	nread = preadv(cache->FD_R, iov, io->Count, io->Offset);
+	if (nread == -1) {
+		nread = 0;
+	} else {
+		CacheCount(cache->DiskRead);
+		CacheCountBytes(cache->BytesRead, nread);
+	}
+
+	for (i = 0; i < io->Count; i++) {
+		tag = io->Tags[i];
+		shard = CacheShardOf(cache, tag->Offset);
+
+		pthread_mutex_lock(&shard->Lock);
+		tag->Flags &= ~kInFlight;
+		tag->Refs--;
+		if ((uint64_t)nread < (uint64_t)(i + 1) * cache->BlockSize) {
+			CacheRemove(cache, tag);
+		} else {
+			LRUHit(&shard->LRU, (LRUNode_t *)tag, 0);
+			CacheCount(cache->ReadAhead);
+		}
+		pthread_cond_broadcast(&shard->IODone);
+		pthread_mutex_unlock(&shard->Lock);
+
+		(void)__sync_fetch_and_sub(&cache->IOBlocks, 1);
+	}
+
+	free(io);
+}
+
+/*
+ * CacheIOWorker
+ *
+ *  Body of an I/O thread: take requests off the queue until told to exit
+ *  and the queue is empty.
+ */
+static void *CacheIOWorker (void *arg)
+{
+	Cache_t *	cache = (Cache_t *)arg;
+	CacheIO_t *	io;
+
+	pthread_mutex_lock(&cache->IOLock);
+	for (;;) {
+		while (cache->IOHead == NULL && !cache->IOExit)
+			pthread_cond_wait(&cache->IOWork, &cache->IOLock);
+		if ((io = cache->IOHead) == NULL)
+			break;
+		cache->IOHead = io->Next;
+		if (cache->IOHead == NULL)
+			cache->IOTail = NULL;
+		pthread_mutex_unlock(&cache->IOLock);
+
+		CacheIODo(cache, io);
+
+		pthread_mutex_lock(&cache->IOLock);
+		if (--cache->IOPending == 0)
+			pthread_cond_broadcast(&cache->IOIdle);
+	}
+	pthread_mutex_unlock(&cache->IOLock);
+
+	return (NULL);
+}
+
+/*
+ * CacheIOStart
+ *
+ *  Start the threads that perform asynchronous reads.  With N threads, up
+ *  to N reads of MaxIOBlocks cache blocks are in flight at once.  Until this
+ *  is called (or if no thread could be started), CacheReadAsync reads
+ *  inline.
+ */
+int CacheIOStart (Cache_t *cache, uint32_t threads)
+{
+	uint32_t	i;
+
+	if (cache->IOThreads != 0 || threads == 0)
+		return (EOK);
+	if (threads > MaxIOThreads)
+		threads = MaxIOThreads;
+
+	cache->IOPool = (pthread_t *)calloc(threads, sizeof(pthread_t));
+	if (cache->IOPool == NULL)
+		return (ENOMEM);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&cache->IOPool[i], NULL, CacheIOWorker, cache) != 0)
+			break;
+	}
+	cache->IOThreads = i;
+	if (i == 0) {
+		free(cache->IOPool);
+		cache->IOPool = NULL;
+		return (EAGAIN);
+	}
+
+	return (EOK);
+}
+
+/*
+ * CacheIODrain
+ *
+ *  Wait until no asynchronous reads are queued or in flight.
+ */
+void CacheIODrain (Cache_t *cache)
+{
+	if (cache->IOThreads == 0)
+		return;
+
+	pthread_mutex_lock(&cache->IOLock);
+	while (cache->IOPending != 0)
+		pthread_cond_wait(&cache->IOIdle, &cache->IOLock);
+	pthread_mutex_unlock(&cache->IOLock);
+}
+
+/*
+ * CacheIOStop
+ *
+ *  Finish the queued reads and stop the I/O threads.
+ */
+static void CacheIOStop (Cache_t *cache)
+{
+	uint32_t	i;
+
+	if (cache->IOThreads == 0)
+		return;
+
+	pthread_mutex_lock(&cache->IOLock);
+	cache->IOExit = 1;
+	pthread_cond_broadcast(&cache->IOWork);
+	pthread_mutex_unlock(&cache->IOLock);
+
+	for (i = 0; i < cache->IOThreads; i++)
+		pthread_join(cache->IOPool[i], NULL);
+
+	free(cache->IOPool);
+	cache->IOPool = NULL;
+	cache->IOThreads = 0;
+}
+
+/*
+ * CacheInsertBlock
+ *
+ *  Create a tag for a cache block, put it at the head of its hash chain and
+ *  on In.  The shard must be locked and must not already hold a tag for the
+ *  block.  With kInFlight the block is still to be read; the tag then holds
+ *  a reference on behalf of the reader, and goes on the Busy queue instead.
+ */
+static int CacheInsertBlock (Cache_t *cache, CacheShard_t *shard, uint64_t off, void *block,
+                             uint32_t flags, Tag_t **tagp)
+{
+	Tag_t **	bucket;
+	Tag_t *		tag;
+
+	tag = (Tag_t *)calloc(sizeof(Tag_t), 1);
+	if (tag == NULL)
+		return (ENOMEM);
+	tag->Offset = off;
+	tag->Buffer = block;
+	tag->Flags = flags;
+	if (flags & kInFlight)
+		tag->Refs = 1;
+
+	/* Insert at the head of the hash chain */
+	bucket = CacheBucket(cache, shard, off);
+	tag->Next = *bucket;
+	if (tag->Next != NULL)
+		tag->Next->Prev = tag;
+	*bucket = tag;
+
+	LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+	if (tagp != NULL)
+		*tagp = tag;
 	return (EOK);
 }
 
+/*
+ * CacheFreeCount
+ *
+ *  Returns the number of unused cache blocks.
+ */
+uint32_t CacheFreeCount (Cache_t *cache)
+{
+	uint32_t	i;
+	uint32_t	count = 0;
+
+	for (i = 0; i <= cache->ShardMask; i++) {
+		pthread_mutex_lock (&cache->Shards[i].Lock);
+		count += cache->Shards[i].FreeSize;
+		pthread_mutex_unlock (&cache->Shards[i].Lock);
+	}
+	return (count);
+}
+
 /*
  * CacheRemove
  *
- *  Disposes of a particular buffer.
+ *  Disposes of a particular buffer.  The tag's shard must be locked.
  */
 int CacheRemove (Cache_t *cache, Tag_t *tag)
 {
+	CacheShard_t *	shard = CacheShardOf (cache, tag->Offset);
+	Tag_t **	bucket = CacheBucket (cache, shard, tag->Offset);
 	int			error;
 
 	/* Make sure it's not busy */
 	if (tag->Refs) return (EBUSY);
 	
+	/* Take it off the LRU */
+	LRURemove (&shard->LRU, (LRUNode_t *)tag);
+
 	/* Detach the tag */
 	if (tag->Next != NULL)
 		tag->Next->Prev = tag->Prev;
 	if (tag->Prev != NULL)
 		tag->Prev->Next = tag->Next;
 	else
-		cache->Hash[tag->Offset % cache->HashSize] = tag->Next;
+		*bucket = tag->Next;
 	
 	/* Make sure the head node doesn't have a back pointer */
-	if ((cache->Hash[tag->Offset % cache->HashSize] != NULL) &&
-	    (cache->Hash[tag->Offset % cache->HashSize]->Prev != NULL)) {
+	if ((*bucket != NULL) &&
+	    ((*bucket)->Prev != NULL)) {
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRemove: Corrupt hash chain\n");
 #endif
@@ -771,7 +1486,8 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 /*
  * CacheEvict
  *
- *  Only dispose of the buffer, leave the tag intact.
+ *  Only dispose of the buffer, leave the tag intact.  The tag's shard must be
+ *  locked.
  */
 int CacheEvict (Cache_t *cache, Tag_t *tag)
 {
@@ -795,32 +1511,72 @@ int CacheEvict (Cache_t *cache, Tag_t *tag)
 /*
  * CacheAllocBlock
  *
- *  Allocate an unused cache block.
+ *  Allocate an unused cache block from a shard's free list.  The shard must
+ *  be locked.
  */
-void *CacheAllocBlock (Cache_t *cache)
+void *CacheAllocBlock (CacheShard_t *shard)
 {
 	void *	temp;
 	
-	if (cache->FreeHead == NULL)
+	if (shard->FreeHead == NULL)
 		return (NULL);
-	if (cache->FreeSize == 0)
+	if (shard->FreeSize == 0)
 		return (NULL);
 
-	temp = cache->FreeHead;
-	cache->FreeHead = *((void **)cache->FreeHead);
-	cache->FreeSize--;
+	temp = shard->FreeHead;
+	shard->FreeHead = *((void **)shard->FreeHead);
+	shard->FreeSize--;
+
+	return (temp);
+}
+
+/*
+ * CachePutBlock
+ *
+ *  Return an unused cache block to a shard's free list.  The shard must be
+ *  locked.
+ */
+static void CachePutBlock (CacheShard_t *shard, void *block)
+{
+	*((void **)block) = shard->FreeHead;
+	shard->FreeHead = block;
+	shard->FreeSize++;
+}
+
+/*
+ * CacheStealBlock
+ *
+ *  Take a free cache block from another shard.  This keeps a shard that is
+ *  full of locked-in (kLockWrite) or busy blocks from failing while the rest
+ *  of the cache still has room.  The caller holds its own shard's lock, so
+ *  we only try-lock the others to avoid lock order reversals.
+ */
+static void *CacheStealBlock (Cache_t *cache, CacheShard_t *shard)
+{
+	CacheShard_t *	other;
+	void *		temp = NULL;
+	uint32_t	i;
 
+	for (i = 1; i <= cache->ShardMask && temp == NULL; i++) {
+		other = &cache->Shards[((shard - cache->Shards) + i) & cache->ShardMask];
+		if (pthread_mutex_trylock (&other->Lock) != 0)
+			continue;
+		temp = CacheAllocBlock (other);
+		pthread_mutex_unlock (&other->Lock);
+	}
 	return (temp);
 }
 
 /*
  * CacheFreeBlock
  *
- *  Release an active cache block.
+ *  Release an active cache block.  The block goes back on the free list of
+ *  the tag's shard, which must be locked.
  */
 static int 
 CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 {
+	CacheShard_t *	shard = CacheShardOf (cache, tag->Offset);
 	int			error;
 	
 	if ( (tag->Flags & kLazyWrite) != 0 )
@@ -841,11 +1597,7 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 	}
 
 	if ((tag->Flags & kLockWrite) == 0)
-	{
-		*((void **)tag->Buffer) = cache->FreeHead;
-		cache->FreeHead = (void **)tag->Buffer;
-		cache->FreeSize++;
-	}
+		CachePutBlock (shard, tag->Buffer);
 	return( EOK );
 }
 
@@ -858,37 +1610,46 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 int 
 CacheFlush( Cache_t *cache )
 {
-	int			error;
-	int			i;
+	int			error = EOK;
+	uint32_t	i, s;
+	CacheShard_t *	shard;
 	Tag_t *		myTagPtr;
 	
-	for ( i = 0; i < cache->HashSize; i++ )
+	for ( s = 0; s <= cache->ShardMask && error == EOK; s++ )
 	{
-		myTagPtr = cache->Hash[ i ];
-		
-		while ( NULL != myTagPtr )
+		shard = &cache->Shards[ s ];
+		pthread_mutex_lock( &shard->Lock );
+
+		for ( i = 0; i <= shard->HashMask && error == EOK; i++ )
 		{
-			if ( (myTagPtr->Flags & kLazyWrite) != 0 )
+			myTagPtr = shard->Hash[ i ];
+			
+			while ( NULL != myTagPtr )
 			{
-				/* this cache block has been marked for lazy write - do it now */
-				error = CacheRawWrite( cache,
-									   myTagPtr->Offset,
-									   cache->BlockSize,
-									   myTagPtr->Buffer );
-				if ( EOK != error ) 
+				if ( (myTagPtr->Flags & kLazyWrite) != 0 )
 				{
+					/* this cache block has been marked for lazy write - do it now */
+					error = CacheRawWrite( cache,
+										   myTagPtr->Offset,
+										   cache->BlockSize,
+										   myTagPtr->Buffer );
+					if ( EOK != error ) 
+					{
 #if CACHE_DEBUG
-					printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
+						printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
 #endif 
-					return( error );
+						break;
+					}
+					myTagPtr->Flags &= ~kLazyWrite;
 				}
-				myTagPtr->Flags &= ~kLazyWrite;
-			}
-			myTagPtr = myTagPtr->Next; 
-		} /* while */
+				myTagPtr = myTagPtr->Next; 
+			} /* while */
+		} /* for */
+
+		pthread_mutex_unlock( &shard->Lock );
 	} /* for */
 
-	return( EOK );
+	return( error );
 		
 } /* CacheFlush */
 
@@ -921,44 +1682,56 @@ RangeIntersect(uint64_t start1, uint64_t len1, uint64_t start2, uint64_t len2)
 static int
 CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove)
 {
-	int error;
-	int i;
+	int error = EOK;
+	uint32_t i, s;
+	CacheShard_t *shard;
 	Tag_t *currentTag, *nextTag;
 	
-	for ( i = 0; i < cache->HashSize; i++ )
+	/* The caller is about to go around the cache; nothing may be in flight */
+	CacheIODrain( cache );
+
+	for ( s = 0; s <= cache->ShardMask && error == EOK; s++ )
 	{
-		currentTag = cache->Hash[ i ];
-		
-		while ( NULL != currentTag )
-		{
-			/* Keep track of the next block, in case we remove the current block */
-			nextTag = currentTag->Next;
+		shard = &cache->Shards[ s ];
+		pthread_mutex_lock( &shard->Lock );
 
-			if ( currentTag->Flags & kLazyWrite &&
-				 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
+		for ( i = 0; i <= shard->HashMask && error == EOK; i++ )
+		{
+			currentTag = shard->Hash[ i ];
+			
+			while ( NULL != currentTag )
 			{
-				error = CacheRawWrite( cache,
-									   currentTag->Offset,
-									   cache->BlockSize,
-									   currentTag->Buffer );
-				if ( EOK != error )
+				/* Keep track of the next block, in case we remove the current block */
+				nextTag = currentTag->Next;
+
+				if ( currentTag->Flags & kLazyWrite &&
+					 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
 				{
+					error = CacheRawWrite( cache,
+										   currentTag->Offset,
+										   cache->BlockSize,
+										   currentTag->Buffer );
+					if ( EOK != error )
+					{
 #if CACHE_DEBUG
-					printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
+						printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
 #endif 
-					return error;
+						break;
+					}
+					currentTag->Flags &= ~kLazyWrite;
+
+					if ( remove && ((currentTag->Flags & kLockWrite) == 0))
+						CacheRemove( cache, currentTag );
 				}
-				currentTag->Flags &= ~kLazyWrite;
+				
+				currentTag = nextTag;
+			} /* while */
+		} /* for */
 
-				if ( remove && ((currentTag->Flags & kLockWrite) == 0))
-					CacheRemove( cache, currentTag );
-			}
-			
-			currentTag = nextTag;
-		} /* while */
+		pthread_mutex_unlock( &shard->Lock );
 	} /* for */
 	
-	return EOK;
+	return error;
 } /* CacheFlushRange */
 
 /* Function: CacheCopyDiskBlocks
@@ -1217,28 +1990,36 @@ out:
  * CacheLookup
  *
  *  Obtain a cache block. If one already exists, it is returned. Otherwise a
- *  new one is created and inserted into the cache.
+ *  new one is created and inserted into the cache.  The block's shard must be
+ *  locked by the caller; it stays locked across the disk read on a miss.
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 {
 	Tag_t *		temp;
-	uint32_t	hash = off % cache->HashSize;
+	CacheShard_t *	shard = CacheShardOf (cache, off);
+	Tag_t **	bucket = CacheBucket (cache, shard, off);
 	int			error;
 
 	*tag = NULL;
 	
 	/* Search the hash table */
 	error = 0;
-	temp = cache->Hash[hash];
+	temp = *bucket;
 	while (temp != NULL) {
 		if (temp->Offset == off) break;
 		temp = temp->Next;
 	}
 
+	/* Wait for an asynchronous read of the block, then look again */
+	if (temp != NULL && (temp->Flags & kInFlight)) {
+		pthread_cond_wait (&shard->IODone, &shard->Lock);
+		return (CacheLookup (cache, off, tag));
+	}
+
 	/* If it's a hit */
 	if (temp != NULL) {
 		/* Perform MTF if necessary */
-		if (cache->Hash[hash] != temp) {
+		if (*bucket != temp) {
 			/* Disconnect the tag */
 			if (temp->Next != NULL)
 				temp->Next->Prev = temp->Prev;
@@ -1253,40 +2034,41 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 		temp->Offset = off;
 
 		/* Kick the tag onto the LRU */
-		//LRUHit (&cache->LRU, (LRUNode_t *)temp, 0);
+		//LRUHit (&shard->LRU, (LRUNode_t *)temp, 0);
 	}
 
 	/* Insert at the head (if it's not already there) */
-	if (cache->Hash[hash] != temp) {
+	if (*bucket != temp) {
 		temp->Prev = NULL;
-		temp->Next = cache->Hash[hash];
+		temp->Next = *bucket;
 		if (temp->Next != NULL)
 			temp->Next->Prev = temp;
-		cache->Hash[hash] = temp;
+		*bucket = temp;
 	}
 
 	/* Make sure there's a buffer */
 	if (temp->Buffer == NULL) {
 		/* Find a free buffer */
-		temp->Buffer = CacheAllocBlock (cache);
+		temp->Buffer = CacheAllocBlock (shard);
 		if (temp->Buffer == NULL) {
-			/* Try to evict a buffer */
-			error = LRUEvict (&cache->LRU, (LRUNode_t *)temp);
-			if (error != EOK) return (error);
-
-			/* Try again */
-			temp->Buffer = CacheAllocBlock (cache);
+			/* Try to evict a buffer, or borrow one from another shard */
+			error = LRUEvict (&shard->LRU, (LRUNode_t *)temp);
+			if (error == EOK)
+				temp->Buffer = CacheAllocBlock (shard);
+			if (temp->Buffer == NULL)
+				temp->Buffer = CacheStealBlock (cache, shard);
 			if (temp->Buffer == NULL) {
 #if CACHE_DEBUG
-				printf("%s(%d):  CacheAllocBlock failed (FreeHead = %p, FreeSize = %u)\n", __FUNCTION__, __LINE__, cache->FreeHead, cache->FreeSize);
+				printf("%s(%d):  CacheAllocBlock failed (FreeHead = %p, FreeSize = %u)\n", __FUNCTION__, __LINE__, shard->FreeHead, shard->FreeSize);
 #endif
-				return (ENOMEM);
+				return (error != EOK ? error : ENOMEM);
 			}
 		}
 
 		/* Load the block from disk */
 		error = CacheRawRead (cache, off, cache->BlockSize, temp->Buffer);
 		if (error != EOK) return (error);
+		CacheCount (cache->Miss);
 	}
 
 #if 0
@@ -1302,33 +2084,28 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 /*
  * CacheRawRead
  *
- *  Perform a direct read on the file.
+ *  Perform a direct read on the file.  Uses pread so that several threads
+ *  can read through the same descriptor.
  */
 int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
 	ssize_t		nread;
 		
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
-	/* Seek to the position */
-	errno = 0;
-	result = lseek (cache->FD_R, off, SEEK_SET);
-	if (result == (off_t)-1 && errno != 0)
-		return errno;
-	if (result != off) return (ENXIO);
 	/* Read into the buffer */
 #if CACHE_DEBUG
 	printf("%s:  offset %llu, len %u\n", __FUNCTION__, off, len);
 #endif
-	nread = read (cache->FD_R, buf, len);
+	nread = pread (cache->FD_R, buf, len, off);
 	if (nread == -1) return (errno);
 	if (nread == 0) return (ENXIO);
 
 	/* Update counters */
-	cache->DiskRead++;
+	CacheCount (cache->DiskRead);
+	CacheCountBytes (cache->BytesRead, nread);
 	
 	return (EOK);
 }
@@ -1340,26 +2117,19 @@ int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
  */
 int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
 	ssize_t		nwritten;
 	
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
-	/* Seek to the position */
-	errno = 0;
-	result = lseek (cache->FD_W, off, SEEK_SET);
-	if (result == (off_t)-1 && errno != 0) return (errno);
-	if (result != off) return (ENXIO);
-	
 	/* Write into the buffer */
-	nwritten = write (cache->FD_W, buf, len);
+	nwritten = pwrite (cache->FD_W, buf, len, off);
 	if (nwritten == -1) return (errno);
 	if (nwritten == 0) return (ENXIO);
 	
 	/* Update counters */
-	cache->DiskWrite++;
+	CacheCount (cache->DiskWrite);
 	
 	return (EOK);
 }
@@ -1369,9 +2139,11 @@ int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 /*
  * LRUInit
  *
- *  Initializes the LRU data structures.
+ *  Initializes the LRU data structures.  In is allowed a quarter of the
+ *  shard's blocks and Out remembers half as many tags as the shard holds,
+ *  the settings suggested for 2Q by Johnson and Shasha.
  */
-static int LRUInit (LRU_t *lru)
+static int LRUInit (LRU_t *lru, uint32_t blocks)
 {
 	/* Make the dummy nodes point to themselves */
 	lru->Head.Next = &lru->Head;
@@ -1380,6 +2152,17 @@ static int LRUInit (LRU_t *lru)
 	lru->Busy.Next = &lru->Busy;
 	lru->Busy.Prev = &lru->Busy;
 
+	lru->In.Next = &lru->In;
+	lru->In.Prev = &lru->In;
+
+	lru->Out.Next = &lru->Out;
+	lru->Out.Prev = &lru->Out;
+
+	lru->InCount = 0;
+	lru->InMax = (blocks / 4) ? (blocks / 4) : 1;
+	lru->OutCount = 0;
+	lru->OutMax = (blocks / 2) ? (blocks / 2) : 1;
+
 	return (EOK);
 }
 
@@ -1397,69 +2180,122 @@ static int LRUDestroy (LRU_t *lru)
 	return (EOK);
 }
 
+/*
+ * LRURemove
+ *
+ *  Take a node off whichever queue it is on.  The node's Hot state is kept.
+ */
+static void LRURemove (LRU_t *lru, LRUNode_t *node)
+{
+	if (node->Queue == kLRUNone)
+		return;
+
+	/* Detach the node */
+	node->Next->Prev = node->Prev;
+	node->Prev->Next = node->Next;
+	node->Next = NULL;
+	node->Prev = NULL;
+
+	if (node->Queue == kLRUIn)
+		lru->InCount--;
+	else if (node->Queue == kLRUOut)
+		lru->OutCount--;
+	node->Queue = kLRUNone;
+}
+
+/*
+ * LRUInsert
+ *
+ *  Put a detached node at the head of a queue, or at its tail if age is set.
+ */
+static void LRUInsert (LRU_t *lru, LRUNode_t *list, LRUNode_t *node, uint16_t queue, int age)
+{
+	if (age) {
+		node->Next = list;
+		node->Prev = list->Prev;
+	} else {
+		node->Next = list->Next;
+		node->Prev = list;
+	}
+	node->Next->Prev = node;
+	node->Prev->Next = node;
+
+	node->Queue = queue;
+	if (queue == kLRUIn)
+		lru->InCount++;
+	else if (queue == kLRUOut)
+		lru->OutCount++;
+}
+
 /*
  * LRUHit
  *
- *  Registers data activity on the given node. If the node is already in the
- *  LRU, it is moved to the front. Otherwise, it is inserted at the front.
+ *  Registers data activity on the given node. A node seen for the first time
+ *  goes to the front of In; a node whose tag was on Out becomes hot and goes
+ *  to the front of the main LRU, as does any node that is already hot.
+ *  Repeated hits while a block is still on In do not make it hot, so the
+ *  several accesses a scan makes to one cache block count as one.
  *
  *  NOTE: If the node is not in the LRU, we assume that its pointers are NULL.
  */
 static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
 {
+	/* A second reference after the block left In */
+	if (node->Queue == kLRUOut)
+		node->Hot = 1;
+
 	/* Handle existing nodes */
-	if ((node->Next != NULL) && (node->Prev != NULL)) {
-		/* Detach the node */
-		node->Next->Prev = node->Prev;
-		node->Prev->Next = node->Next;
-	}
+	LRURemove (lru, node);
 
 	/* If it's busy (we can't evict it) */
 	if (((Tag_t *)node)->Refs) {
 		/* Insert at the head of the Busy queue */
-		node->Next = lru->Busy.Next;
-		node->Prev = &lru->Busy;
+		LRUInsert (lru, &lru->Busy, node, kLRUBusy, 0);
+
+	} else if (node->Hot) {
+		/* Insert into the main LRU (at its tail if aged) */
+		LRUInsert (lru, &lru->Head, node, kLRUMain, age);
 
-	} else if (age) {
-		/* Insert at the head of the LRU */
-		node->Next = &lru->Head;
-		node->Prev = lru->Head.Prev;
-		
 	} else {
-		/* Insert at the head of the LRU */
-		node->Next = lru->Head.Next;
-		node->Prev = &lru->Head;
+		/* Insert into In (at its tail if aged) */
+		LRUInsert (lru, &lru->In, node, kLRUIn, age);
 	}
 
-	node->Next->Prev = node;
-	node->Prev->Next = node;
-
 	return (EOK);
 }
 
+
 /*
  * LRUEvict
  *
- *  Chooses a buffer to release.
- *
- *  TODO: Under extreme conditions, it shoud be possible to release the buffer
- *        of an actively referenced cache buffer, leaving the tag behind as a
- *        placeholder. This would be required for implementing 2Q-LRU
- *        replacement.
+ *  Chooses a buffer to release.  While In holds more than its share (or
+ *  there is nothing hot to evict) the oldest block on In loses its buffer
+ *  and its tag moves to Out, trimming Out to OutMax tags.  Otherwise the
+ *  least recently used hot block is removed.
  *
  *  NOTE: Make sure we never evict the node we're trying to find a buffer for!
+ *        It may be sitting on Out.
  */
 static int LRUEvict (LRU_t *lru, LRUNode_t *node)
 {
+	Cache_t *	cache = ((CacheShard_t *)lru)->Cache;
+	LRUNode_t *	list;
 	LRUNode_t *	temp;
+	int			error;
 
 	/* Find a victim */
 	while (1) {
+		if (lru->In.Prev != &lru->In &&
+		    (lru->InCount > lru->InMax || lru->Head.Prev == &lru->Head))
+			list = &lru->In;
+		else
+			list = &lru->Head;
+
 		/* Grab the tail */
-		temp = lru->Head.Prev;
+		temp = list->Prev;
 		
 		/* Stop if we're empty */
-		if (temp == &lru->Head) {
+		if (temp == list) {
 #if CACHE_DEBUG
 			printf("%s(%d):  empty?\n", __FUNCTION__, __LINE__);
 #endif
@@ -1467,24 +2303,40 @@ static int LRUEvict (LRU_t *lru, LRUNode_t *node)
 		}
 
 		/* Detach the tail */
-		temp->Next->Prev = temp->Prev;
-		temp->Prev->Next = temp->Next;
+		LRURemove (lru, temp);
 
 		/* If it's not busy, we have a victim */
 		if (!((Tag_t *)temp)->Refs) break;
 
 		/* Insert at the head of the Busy queue */
-		temp->Next = lru->Busy.Next;
-		temp->Prev = &lru->Busy;
-				
-		temp->Next->Prev = temp;
-		temp->Prev->Next = temp;
+		LRUInsert (lru, &lru->Busy, temp, kLRUBusy, 0);
 
 		/* Try again */
 	}
 
-	/* Remove the tag */
-	CacheRemove ((Cache_t *)lru, (Tag_t *)temp);
+	/* A hot block goes away for good */
+	if (list == &lru->Head) {
+		CacheRemove (cache, (Tag_t *)temp);
+		return (EOK);
+	}
+
+	/* A block from In keeps its tag, on Out */
+	error = CacheEvict (cache, (Tag_t *)temp);
+	if (error != EOK) {
+		LRUInsert (lru, &lru->In, temp, kLRUIn, 0);
+		return (error);
+	}
+	LRUInsert (lru, &lru->Out, temp, kLRUOut, 0);
+
+	/* Forget the oldest tags on Out */
+	while (lru->OutCount > lru->OutMax) {
+		temp = lru->Out.Prev;
+		if (temp == node)
+			temp = temp->Prev;
+		if (temp == &lru->Out ||
+		    CacheRemove (cache, (Tag_t *)temp) != EOK)
+			break;
+	}
 
 	return (EOK);
 }
@@ -1497,26 +2349,32 @@ static int LRUEvict (LRU_t *lru, LRUNode_t *node)
 void
 dumpCache(Cache_t *cache)
 {
-	int i;
+	uint32_t i, s;
 	int numEntries = 0;
 
 	printf("Cache:\n");
 	printf("\tDevBlockSize = %u\n", cache->DevBlockSize);
 	printf("\tCache Block Size = %u\n", cache->BlockSize);
+	printf("\tShards = %u\n", cache->ShardMask + 1);
 	printf("\tHash Size = %u\n", cache->HashSize);
 	printf("\tHash Table:\n");
-	for (i = 0; i < cache->HashSize; i++) {
-		Tag_t *tag;
-
-		for (tag = cache->Hash[i]; tag; tag = tag->Next) {
-			numEntries++;
-			printf("\t\tOffset %llu, refs %u, Flags %#x (%skLazyWrite, %skLockWrite)\n",
-			       tag->Offset, tag->Refs, tag->Flags,
-			       (tag->Flags & kLazyWrite) ? "" : "no ",
-			       (tag->Flags & kLockWrite) ? "" : "no ");
+	for (s = 0; s <= cache->ShardMask; s++) {
+		CacheShard_t *shard = &cache->Shards[s];
+
+		pthread_mutex_lock(&shard->Lock);
+		for (i = 0; i <= shard->HashMask; i++) {
+			Tag_t *tag;
+
+			for (tag = shard->Hash[i]; tag; tag = tag->Next) {
+				numEntries++;
+				printf("\t\tOffset %llu, refs %u, Flags %#x (%skLazyWrite, %skLockWrite)\n",
+				       tag->Offset, tag->Refs, tag->Flags,
+				       (tag->Flags & kLazyWrite) ? "" : "no ",
+				       (tag->Flags & kLockWrite) ? "" : "no ");
+			}
 		}
+		pthread_mutex_unlock(&shard->Lock);
 	}
 	printf("\tNumber of entries: %u\n", numEntries);
 	return;
 }
-
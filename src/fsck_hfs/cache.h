@@ -28,7 +28,8 @@
  */
 #ifndef _CACHE_H_
 #define _CACHE_H_
-#include <sys/stdint.h>
+#include <stdint.h>
+#include <pthread.h>
 
 /* Different values for initializing cache */
 enum {
@@ -51,7 +52,19 @@ enum {
 #endif
 	/* MaxCacheSize will be 3G for 64-bit, and 1G for 32-bit */
 	MaxCacheSize			=	((unsigned)MaxCacheBlockSize * MaxCacheBlocks),
-	CacheHashSize			=	257,		/* prime number */
+	CacheHashSize			=	257,		/* minimum hash table size */
+
+	/* Lock striping */
+	MaxCacheShards			=	64,		/* power of two */
+	MinBlocksPerShard		=	256,
+
+	/* Read-ahead */
+	ReadAheadBlocks			=	8,		/* cache blocks read per read-ahead */
+	ReadAheadTrigger		=	2,		/* sequential cache blocks before reading ahead */
+
+	/* Asynchronous reads */
+	MaxIOThreads			=	64,
+	MaxIOBlocks				=	32,		/* cache blocks per disk read (1MB) */
 };
 
 /*
@@ -65,14 +78,41 @@ typedef struct LRUNode_t
 {
 	struct LRUNode_t *	Next;	/* Next node in the LRU */
 	struct LRUNode_t *	Prev;	/* Previous node in the LRU */
+	uint16_t			Queue;	/* Queue the node is on (kLRUNone...) */
+	uint16_t			Hot;	/* Referenced again after leaving In */
 } LRUNode_t;
 
+/*
+ * LRU_t
+ *
+ *  2Q replacement.  Blocks seen for the first time go on the In FIFO; when
+ *  they are pushed out of it their buffer is released but the tag is kept on
+ *  the Out list.  Only a block that is referenced again while its tag is on
+ *  Out is considered hot and moves to the main LRU.  A single pass over the
+ *  volume bitmap or the B-tree leaves therefore only ever cycles through In,
+ *  and cannot flush the index nodes that are looked up over and over.
+ */
 typedef struct LRU_t
 {
-	LRUNode_t			Head;	/* Dummy node for the head of the LRU */
+	LRUNode_t			Head;	/* Dummy node for the head of the LRU (hot blocks) */
 	LRUNode_t			Busy;	/* List of busy nodes */
+	LRUNode_t			In;		/* FIFO of blocks seen once */
+	LRUNode_t			Out;	/* Tags of blocks evicted from In, without buffers */
+	uint32_t			InCount;
+	uint32_t			InMax;	/* Evict from In while it holds more than this */
+	uint32_t			OutCount;
+	uint32_t			OutMax;	/* Tags remembered on Out */
 } LRU_t;
 
+/* LRUNode_t.Queue values */
+enum {
+	kLRUNone		= 0,
+	kLRUBusy		= 1,
+	kLRUIn			= 2,
+	kLRUOut			= 3,
+	kLRUMain		= 4,
+};
+
 
 #define MAXBUFS  48
 /*
@@ -90,6 +130,7 @@ typedef struct Buf_t
 	uint32_t		Flags;	/* Buffer flags */
 	uint64_t		Offset;	/* Start offset of the buffer */
 	uint32_t		Length;	/* Size of the buffer in bytes */
+	pthread_t		Owner;	/* Thread that read the buffer */
 
 	void *			Buffer;	/* Buffer */
 } Buf_t;
@@ -123,35 +164,74 @@ typedef struct Tag_t
 enum {
 	kLazyWrite		 = 0x00000001, 	/* only write this page when evicting or forced */
 	kLockWrite		 = 0x00000002,  /* Never evict this page -- will not work with writing yet! */
+	kInFlight		 = 0x00000004,	/* Buffer is still being read by the I/O threads */
 };
 
 /*
- * Cache_t
+ * CacheShard_t
  *
- *  The main cache data structure. The cache manages access between an open
- *  file and the cache client program.
+ *  One stripe of the cache.  Cache blocks are spread over the shards by
+ *  block number, and each shard has its own lock, hash table, LRU and share
+ *  of the cache memory, so threads working on different cache blocks do not
+ *  contend with each other.
  *
  *  NOTE: The LRU field must be the first field, so we can easily cast between
  *        the two.
  */
-typedef struct Cache_t
+typedef struct CacheShard_t
 {
 	LRU_t		LRU;		/* LRU replacement data structure */
-	
+
+	pthread_mutex_t	Lock;		/* Protects everything in this shard */
+	pthread_cond_t	IODone;		/* Broadcast when an in-flight block completes */
+	struct Cache_t *Cache;		/* Cache this shard belongs to */
+
+	Tag_t **	Hash;		/* Lookup hash table (move to front) */
+	uint32_t	HashMask;	/* Size of the hash table - 1 */
+
+	void *		FreeHead;	/* Head of the free list */
+	uint32_t	FreeSize;	/* Size of the free list */
+} CacheShard_t;
+
+/*
+ * Cache_t
+ *
+ *  The main cache data structure. The cache manages access between an open
+ *  file and the cache client program.  All entry points may be called from
+ *  several threads at once.
+ */
+typedef struct Cache_t
+{
 	int		FD_R;		/* File descriptor (read-only) */
 	int		FD_W;		/* File descriptor (write-only) */
 	uint32_t	DevBlockSize;	/* Device block size */
 	
-	Tag_t **	Hash;		/* Lookup hash table (move to front) */
-	uint32_t	HashSize;	/* Size of the hash table */
+	CacheShard_t *	Shards;		/* Lock stripes */
+	uint32_t	ShardMask;	/* Number of shards - 1 */
+	uint32_t	ShardShift;	/* log2(number of shards) */
+	uint32_t	HashSize;	/* Total hash buckets over all shards */
 	uint32_t	BlockSize;	/* Size of the cache page */
+	uint32_t	TotalBlocks;	/* Number of cache pages */
 
-	void *		FreeHead;	/* Head of the free list */
-	uint32_t	FreeSize;	/* Size of the free list */
-
+	pthread_mutex_t	BufLock;	/* Protects ActiveBufs and FreeBufs */
 	Buf_t *		ActiveBufs;	/* List of active buffers */
 	Buf_t *		FreeBufs;	/* List of free buffers */
 
+	pthread_mutex_t	IOLock;		/* Protects the I/O queue */
+	pthread_cond_t	IOWork;		/* Signalled when a request is queued */
+	pthread_cond_t	IOIdle;		/* Broadcast when the queue drains */
+	struct CacheIO_t *IOHead;	/* Queued reads */
+	struct CacheIO_t *IOTail;
+	uint32_t	IOPending;	/* Requests queued or being read */
+	uint32_t	IOBlocks;	/* Cache blocks in flight */
+	uint32_t	IOThreads;	/* Number of I/O threads (0 = read inline) */
+	pthread_t *	IOPool;		/* The I/O threads */
+	int		IOExit;		/* Tells the I/O threads to finish up */
+
+	uint64_t	SeqNext;	/* Cache block following the last read (BufLock) */
+	uint32_t	SeqCount;	/* Sequential cache blocks read in a row (BufLock) */
+	uint64_t	RaNext;		/* End of the last read-ahead window (BufLock) */
+
 	uint32_t	ReqRead;	/* Number of read requests */
 	uint32_t	ReqWrite;	/* Number of write requests */
 	
@@ -159,6 +239,9 @@ typedef struct Cache_t
 	uint32_t	DiskWrite;	/* Number of actual disk writes */
 
 	uint32_t	Span;		/* Requests that spanned cache blocks */
+	uint32_t	ReadAhead;	/* Cache blocks loaded ahead of use */
+	uint32_t	Miss;		/* Cache blocks read on demand */
+	uint64_t	BytesRead;	/* Bytes read from the device */
 } Cache_t;
 
 extern Cache_t fscache;
@@ -196,6 +279,9 @@ int CacheDestroy (Cache_t *cache);
  *  NOTE: The returned buffer may directly refer to a cache block, or an
  *        anonymous buffer. Do not make any assumptions about the nature of
  *        the returned buffer, except that it is contiguous.
+ *
+ *  Once ReadAheadTrigger cache blocks have been read in sequence, the next
+ *  ReadAheadBlocks cache blocks are queued with CacheReadAsync.
  */
 int CacheRead (Cache_t *cache, uint64_t start, uint32_t len, Buf_t **buf);
 
@@ -215,16 +301,61 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions );
  */
 int CacheRelease (Cache_t *cache, Buf_t *buf, int age);
 
+/*
+ * CacheCopyOut
+ *
+ *  Copies a byte range into a caller-supplied buffer through the cache.
+ */
+int CacheCopyOut (Cache_t *cache, uint64_t start, uint32_t len, void *buf);
+
+/*
+ * CachePrefetch
+ *
+ *  Loads the cache blocks covering a byte range without evicting anything.
+ */
+int CachePrefetch (Cache_t *cache, uint64_t start, uint32_t len);
+
+/*
+ * CacheIOStart
+ *
+ *  Start threads that keep asynchronous reads in flight.
+ */
+int CacheIOStart (Cache_t *cache, uint32_t threads);
+
+/*
+ * CacheReadAsync
+ *
+ *  Queue the cache blocks covering a byte range to be read in the
+ *  background.  This is only a hint: it returns without waiting, and a
+ *  CacheRead of a block that is still in flight waits for it.
+ */
+int CacheReadAsync (Cache_t *cache, uint64_t start, uint64_t len);
+
+/*
+ * CacheIODrain
+ *
+ *  Wait until no asynchronous reads are queued or in flight.
+ */
+void CacheIODrain (Cache_t *cache);
+
+/*
+ * CacheFreeCount
+ *
+ *  Returns the number of unused cache blocks.
+ */
+uint32_t CacheFreeCount (Cache_t *cache);
+
 /* CacheRemove
  *
- *  Disposes of a particular tag and buffer.
+ *  Disposes of a particular tag and buffer.  The tag's shard must be locked.
  */
 int CacheRemove (Cache_t *cache, Tag_t *tag);
 
 /*
  * CacheEvict
  *
- *  Only dispose of the buffer, leave the tag intact.
+ *  Only dispose of the buffer, leave the tag intact.  The tag's shard must be
+ *  locked.
  */
 int CacheEvict (Cache_t *cache, Tag_t *tag);
 
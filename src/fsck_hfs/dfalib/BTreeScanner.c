@@ -192,6 +192,13 @@ static int FindNextLeafNode(	BTScanState *scanState )
 //
 //	Purpose:	Read one or more nodes into the buffer.
 //
+//				The nodes are copied straight out of the cache blocks into the
+//				scanner's buffer (which is byte swapped in place, so it can't
+//				be the cache's own memory).  The kCatScanPrefetchSize bytes of
+//				the file after this buffer are kept queued for asynchronous
+//				reading, so the cache is filled while the current buffer is
+//				being verified.
+//
 //	Inputs:
 //		theScanStatePtr		Scanner's current state
 //
@@ -210,8 +217,12 @@ static int ReadMultipleNodes( BTScanState *theScanStatePtr )
 	SInt64  				myPhyOffset;
 	UInt64					mySectorOffset; // offset within file (in 512-byte sectors)
 	UInt32					myContiguousBytes;
+	UInt32					myBlockSize;
+	UInt32					myNextNode;
+	UInt32					myPrefetchNodes;
 	
 	myBTreeCBPtr = theScanStatePtr->btcb;
+	myBlockSize = myBTreeCBPtr->fcbPtr->fcbBlockSize;
 			
 	// map logical block in catalog btree file to physical block on volume
 	mySectorOffset = 
@@ -225,25 +236,27 @@ static int ReadMultipleNodes( BTScanState *theScanStatePtr )
 		goto ExitThisRoutine;
 	}
 	
+	// keep the nodes after this buffer queued, topping the window up once
+	// half of it has been consumed
+	myNextNode = theScanStatePtr->nodeNum + (myContiguousBytes / myBlockSize);
+	myPrefetchNodes = kCatScanPrefetchSize / myBlockSize;
+	if ( myNextNode + (myPrefetchNodes / 2) >= theScanStatePtr->prefetchNode )
+	{
+		if ( theScanStatePtr->prefetchNode < myNextNode )
+			theScanStatePtr->prefetchNode = myNextNode;
+		PrefetchFileBlocks( myBTreeCBPtr->fcbPtr, theScanStatePtr->prefetchNode, myPrefetchNodes );
+		theScanStatePtr->prefetchNode += myPrefetchNodes;
+	}
+
 	// now read blocks from the device 
 	myPhyOffset = (SInt64) ( ( (UInt64) myPhyBlockNum ) << kSectorShift );
 
 	// Go through the cache, so we can get any locked-in journal changes
-	Buf_t *tmpbuf = NULL;
-
-	myErr = CacheRead( myBTreeCBPtr->fcbPtr->fcbVolume->vcbBlockCache,
-			   myPhyOffset, myContiguousBytes, &tmpbuf );
+	myErr = CacheCopyOut( myBTreeCBPtr->fcbPtr->fcbVolume->vcbBlockCache,
+			      myPhyOffset, myContiguousBytes, theScanStatePtr->bufferPtr );
 
 	if ( myErr == noErr )
 	{
-		if (tmpbuf)
-		{
-			if (tmpbuf->Length < myContiguousBytes)
-				abort();
-			memcpy(theScanStatePtr->bufferPtr, tmpbuf->Buffer, myContiguousBytes);
-			CacheRelease(myBTreeCBPtr->fcbPtr->fcbVolume->vcbBlockCache, tmpbuf, 0);
-		} else
-			abort();
 #if DEBUG_BTREE
 		/*
 		 * This code was written to help debug a cache problem, where CacheRead()
@@ -347,6 +360,7 @@ int		BTScanInitialize(	const SFCB *	btreeFile,
 	scanState->currentNodePtr		= NULL;
 	scanState->nodesLeftInBuffer	= 0;		// no nodes currently in buffer
 	scanState->recordsFound			= 0;
+	scanState->prefetchNode			= 0;
 		
 	return noErr;
 	
@@ -31,6 +31,9 @@
 // btree node scanner buffer size.  Joe Sokol suggests 128K as a max (2002 WWDC)
 enum { kCatScanBufferSize = (128 * 1024) };
 
+// how far ahead of the scanner the B-tree file is read in the background
+enum { kCatScanPrefetchSize = (1024 * 1024) };
+
 
 /*
 	BTScanState - This structure is used to keep track of the current state
@@ -56,6 +59,7 @@ struct BTScanState
 	BTNodeDescriptor *	currentNodePtr;		// points to current node within buffer
 	int32_t				nodesLeftInBuffer;	// number of valid nodes still in the buffer
 	int64_t				recordsFound;		// number of leaf records seen so far
+	uint32_t			prefetchNode;		// first node not yet queued for reading
 };
 typedef struct BTScanState BTScanState;
 
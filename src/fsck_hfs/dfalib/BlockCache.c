@@ -220,6 +220,42 @@ ReleaseFileBlock (SFCB *file, BlockDescriptor *block, ReleaseBlockOptions option
 }
 
 
+/*
+ * Queue file blocks to be read into the cache in the background, so that
+ * the GetFileBlock calls that follow find them there.  This is only a hint:
+ * mapping errors stop it quietly, and read errors are reported by
+ * GetFileBlock.
+ */
+void
+PrefetchFileBlocks (SFCB *file, UInt32 blockNum, UInt32 blockCount)
+{
+	UInt64	diskBlock;
+	UInt64	sectorOffset;
+	UInt64	endSector;
+	UInt64	wantBytes;
+	UInt32	contiguousBytes;
+	Cache_t * cache;
+
+	cache = (Cache_t *)file->fcbVolume->vcbBlockCache;
+	sectorOffset = ((UInt64)blockNum * (UInt64)file->fcbBlockSize) >> kSectorShift;
+	endSector = (((UInt64)blockNum + blockCount) * (UInt64)file->fcbBlockSize) >> kSectorShift;
+	if (endSector > (file->fcbPhysicalSize >> kSectorShift))
+		endSector = file->fcbPhysicalSize >> kSectorShift;
+
+	while (sectorOffset < endSector) {
+		wantBytes = (endSector - sectorOffset) << kSectorShift;
+		if (wantBytes > 0x40000000)
+			wantBytes = 0x40000000;
+		if (MapFileBlockC(file->fcbVolume, file, (UInt32)wantBytes, sectorOffset,
+				&diskBlock, &contiguousBytes) != noErr || contiguousBytes == 0)
+			break;
+
+		(void) CacheReadAsync(cache, diskBlock << kSectorShift, contiguousBytes);
+		sectorOffset += contiguousBytes >> kSectorShift;
+	}
+}
+
+
 /*
  *
  */
@@ -85,12 +85,29 @@ static Boolean 	FixDecomps(	uint16_t charCount, const uint16_t *inFilename, HFSU
  * HFSPlusCatalogFolder records.  For now, this is only done on HFSX volumes.
  */
 struct folderCountInfo {
-	UInt32 folderID;
+	UInt32 folderID;	/* 0 if the entry is free */
 	UInt32 recordedCount;
 	UInt32 computedCount;
-	struct folderCountInfo *next;
 };
 
+/*
+ * The folder count cache keeps all of its entries in one array.  When the
+ * catalog node IDs are dense, that is when the array indexed directly by
+ * folder ID is no more than twice the size of a hash table holding the same
+ * folders, it is used that way.  Otherwise it is an open-addressed hash table
+ * with linear probing, never more than 3/4 full.  Either way the array is
+ * limited to FOLDERCOUNT_MAXMEM bytes; a volume needing more is checked with
+ * the slow method.
+ */
+struct folderCountCache {
+	struct folderCountInfo *entries;
+	UInt32 size;		/* number of entries, a power of 2 when hashed */
+	UInt32 used;		/* entries holding a folder ID */
+	int direct;		/* indexed by folder ID */
+};
+
+#define FOLDERCOUNT_MAXMEM	(64 * 1024 * 1024)	/* 64Mbytes, about 5.6M entries */
+
 /*
  * Print a symbolic link name given the fileid
  */
@@ -179,73 +196,134 @@ CountFolderRecords(HFSPlusCatalogKey *myKey, HFSPlusCatalogFolder *folder, SGlob
 }
 
 static void
-releaseFolderCountInfo(struct folderCountInfo *fcip, int numFolders)
+releaseFolderCountInfo(struct folderCountCache *fcc)
 {
-	int i;
+	free(fcc->entries);
+	fcc->entries = NULL;
+	fcc->size = fcc->used = 0;
+}
 
-	for (i = 0; i < numFolders; i++) {
-		struct folderCountInfo *f = &fcip[i];
+/* Smallest hash table size keeping 'count' entries at most 3/4 full */
+static UInt32
+folderCountHashSize(UInt32 count)
+{
+	UInt64 size = 256;
 
-		f = f->next;
-		while (f) {
-			struct folderCountInfo *t = f->next;
-			free(f);
-			f = t;
-		}
-	}
-	free(fcip);
+	while (size * 3 < (UInt64)count * 4)
+		size *= 2;
+	return (size > UINT32_MAX / 2) ? (UINT32_MAX / 2) + 1 : (UInt32)size;
+}
+
+static UInt32
+folderCountHash(UInt32 fid)
+{
+	fid ^= fid >> 16;
+	fid *= 0x85EBCA6B;
+	fid ^= fid >> 13;
+	fid *= 0xC2B2AE35;
+	fid ^= fid >> 16;
+	return fid;
 }
 
 static struct folderCountInfo *
-findFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
+findFolderSlot(struct folderCountCache *fcc, UInt32 fid)
 {
-	struct folderCountInfo *retval = NULL;
-	int indx;
+	struct folderCountInfo *retval;
+	UInt32 indx;
 
-	indx = fid % numFolders;	// Slot index
+	if (fcc->direct)
+		return &fcc->entries[fid];
 
-	retval = &fcip[indx];
-	if (retval->folderID == fid) {
-		goto done;
+	for (indx = folderCountHash(fid) & (fcc->size - 1); ;
+	     indx = (indx + 1) & (fcc->size - 1)) {
+		retval = &fcc->entries[indx];
+		if (retval->folderID == fid || retval->folderID == 0)
+			return retval;
 	}
-	while (retval->next != NULL) {
-		retval = retval->next;
-		if (retval->folderID == fid)
-			goto done;
+}
+
+/*
+ * Move the cache into a new array of 'size' entries, indexed directly by
+ * folder ID or hashed.  Fails, leaving the cache as it was, if the array
+ * would be larger than FOLDERCOUNT_MAXMEM or cannot be allocated.
+ */
+static int
+resizeFolderCountInfo(struct folderCountCache *fcc, UInt32 size, int direct)
+{
+	struct folderCountCache new;
+	struct folderCountInfo *curp;
+	UInt32 i;
+
+	if ((UInt64)size * sizeof(struct folderCountInfo) > FOLDERCOUNT_MAXMEM)
+		return ENOMEM;
+
+	new.entries = calloc(size, sizeof(struct folderCountInfo));
+	if (new.entries == NULL)
+		return ENOMEM;
+	new.size = size;
+	new.used = fcc->used;
+	new.direct = direct;
+
+	for (i = 0; i < fcc->size; i++) {
+		if (fcc->entries[i].folderID == 0)
+			continue;
+		curp = findFolderSlot(&new, fcc->entries[i].folderID);
+		*curp = fcc->entries[i];
 	}
-	retval = NULL;
-done:
-	return retval;
+
+	free(fcc->entries);
+	*fcc = new;
+	return 0;
+}
+
+/*
+ * Size the cache for a volume with the given number of folders and next
+ * catalog node ID.  Both come from the volume header and may be wrong; the
+ * cache grows, or stops being direct, as folders show up that don't fit.
+ */
+static int
+initFolderCountInfo(struct folderCountCache *fcc, UInt32 numFolders, UInt32 nextCNID)
+{
+	UInt32 hashSize;
+
+	ClearMemory(fcc, sizeof(*fcc));
+
+	/* The folder count may be garbage; let the table grow instead */
+	hashSize = folderCountHashSize(numFolders);
+	while ((UInt64)hashSize * sizeof(struct folderCountInfo) > FOLDERCOUNT_MAXMEM)
+		hashSize /= 2;
+	if (nextCNID != 0 && nextCNID <= hashSize * 2 &&
+	    resizeFolderCountInfo(fcc, nextCNID, 1) == 0)
+		return 0;
+
+	return resizeFolderCountInfo(fcc, hashSize, 0);
 }
 
+/*
+ * Return the entry for the given folder ID, adding it if needed.
+ * Returns NULL if the cache would have to grow past its limit.
+ */
 static struct folderCountInfo *
-addFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
+getFolderEntry(struct folderCountCache *fcc, UInt32 fid)
 {
-	struct folderCountInfo *retval = NULL;
-	int indx;
+	struct folderCountInfo *retval;
 
-	indx = fid % numFolders;
-	retval = &fcip[indx];
+	if (fcc->direct && fid >= fcc->size) {
+		if (resizeFolderCountInfo(fcc, folderCountHashSize(fcc->used + 1), 0) != 0)
+			return NULL;
+	}
 
+	retval = findFolderSlot(fcc, fid);
 	if (retval->folderID == fid)
-		goto done;
-	while (retval->folderID != 0) {
-		if (retval->next == NULL) {
-			retval->next = calloc(1, sizeof(struct folderCountInfo));
-			if (retval->next == NULL) {
-				retval = NULL;
-				goto done;
-			} else
-				retval = retval->next;
-		} else if (retval->folderID == fid) {
-			goto done;
-		} else
-			retval = retval->next;
-	}
+		return retval;
 
+	if (!fcc->direct && (UInt64)(fcc->used + 1) * 4 > (UInt64)fcc->size * 3) {
+		if (resizeFolderCountInfo(fcc, fcc->size * 2, 0) != 0)
+			return NULL;
+		retval = findFolderSlot(fcc, fid);
+	}
 	retval->folderID = fid;
-
-done:
+	fcc->used++;
 	return retval;
 }
 
@@ -254,10 +332,10 @@ done:
  * for folder count of the given parent directory.  For directory hard links, 
  * the folder ID and count should be zero.  For a folder record, the values 
  * read from the catalog record are provided which are used to add the 
- * given folderID to the cache (folderCountInfo *ficp).
+ * given folderID to the cache.
  */
 static int
-folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UInt32 folderID, UInt32 count)
+folderCountAdd(struct folderCountCache *fcc, UInt32 parentID, UInt32 folderID, UInt32 count)
 {
 	int retval = 0;
 	struct folderCountInfo *curp = NULL;
@@ -271,13 +349,10 @@ folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UI
 		 * we add it.  If we do find it, or if we add it, we set the recordedCount.
 		 */
 
-		curp = findFolderEntry(fcip, numFolders, folderID);
+		curp = getFolderEntry(fcc, folderID);
 		if (curp == NULL) {
-			curp = addFolderEntry(fcip, numFolders, folderID);
-			if (curp == NULL) {
-				retval = ENOMEM;
-				goto done;
-			}
+			retval = ENOMEM;
+			goto done;
 		}
 		curp->recordedCount = count;
 
@@ -286,14 +361,14 @@ folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UI
 	/*
 	 * After that, we try to find the parent to this entry.  When we find it
 	 * (or if we add it to the list), we increment the computedCount.
+	 * A parent ID of 0 is never a folder; 0 also marks free cache entries.
 	 */
-	curp = findFolderEntry(fcip, numFolders, parentID);
+	if (parentID == 0)
+		goto done;
+	curp = getFolderEntry(fcc, parentID);
 	if (curp == NULL) {
-		curp = addFolderEntry(fcip, numFolders, parentID);
-		if (curp == NULL) {
-			retval = ENOMEM;
-			goto done;
-		}
+		retval = ENOMEM;
+		goto done;
 	}
 	curp->computedCount++;
 
@@ -312,8 +387,9 @@ done:
  * However, since scanning the entire catalog can be a very costly operation, we dot
  * it one of two ways.  The first way is to simply iterate through the catalog once,
  * and keep track of each folder ID we come across.  This uses a fair bit of memory,
- * so we limit the cache to 5MBytes, which works out to some 400k folderCountInfo
- * entries (at the current size of three 4-byte entries per folderCountInfo entry).
+ * so we limit the cache to FOLDERCOUNT_MAXMEM, which works out to some 4M folders
+ * (at the current size of three 4-byte entries per folderCountInfo entry, in a
+ * hash table at most 3/4 full).
  * If the filesystem has more than that, we instead use the slower (but significantly
  * less memory-intensive) method in CountFolderRecords:  for each folder ID we
  * come across, we call CountFolderRecords, which does its own iteration through the
@@ -324,7 +400,6 @@ OSErr
 CheckFolderCount( SGlobPtr GPtr )
 {
 	OSErr err = 0;
-	int numFolders;
 	BTreeIterator iterator;
 	FSBufferDescriptor btRecord;
 	HFSPlusCatalogKey *key;
@@ -333,7 +408,8 @@ CheckFolderCount( SGlobPtr GPtr )
 		HFSPlusCatalogFile catFile;
 	} catRecord;
 	UInt16 recordSize = 0;
-	struct folderCountInfo *fcip = NULL;
+	struct folderCountCache cache;
+	struct folderCountCache *fcc = NULL;
 
 	ClearMemory(&iterator, sizeof(iterator));
 	if (!VolumeObjectIsHFSX(GPtr)) {
@@ -345,37 +421,17 @@ CheckFolderCount( SGlobPtr GPtr )
 		goto done;
 	}
 
-#if 0
 	/*
 	 * We add two so we can account for the root folder, and
 	 * the root folder's parent.  Neither of which is real,
 	 * but they show up as parent IDs in the catalog.
-	 */
-	numFolders = GPtr->calculatedVCB->vcbFolderCount + 2;
-#else
-	/*
-	 * Since we're using a slightly smarter hash method,
-	 * we don't care so much about the number of folders
-	 * allegedly on the volume; instead, we'll pick a nice
-	 * prime number to use as the number of buckets.
-	 * This bears some performance checking later.
-	 */
-	numFolders = 257;
-#endif
-
-	/*
-	 * Limit the size of the folder count cache to 5Mbytes;
-	 * if the requested number of folders don't fit, then
+	 * If the folders don't fit in FOLDERCOUNT_MAXMEM, then
 	 * we don't use the cache at all.
 	 */
-#define MAXCACHEMEM	(5 * 1024 * 1024)	/* 5Mbytes */
-#define LCALLOC(c, s, l)	\
-	({ __typeof(c) _count = (c); __typeof(s) _size = (s); __typeof(l) _lim = (l); \
-		((_count * _size) > _lim) ? NULL : calloc(_count, _size); })
-
-	fcip = LCALLOC(numFolders, sizeof(*fcip), MAXCACHEMEM);
-#undef MAXCACHEMEM
-#undef LCALLOC
+	if (initFolderCountInfo(&cache,
+			GPtr->calculatedVCB->vcbFolderCount + 2,
+			GPtr->calculatedVCB->vcbNextCatalogID) == 0)
+		fcc = &cache;
 
 restart:
 	/* these objects are used by the BT* functions to iterate through the catalog */
@@ -411,8 +467,8 @@ restart:
 				if (err != 0)
 					goto done;
 			}
-			if (fcip) {
-				if (folderCountAdd(fcip, numFolders,
+			if (fcc) {
+				if (folderCountAdd(fcc,
 					key->parentID,
 					catRecord.catRecord.folderID,
 					catRecord.catRecord.folderCount)) {
@@ -425,8 +481,8 @@ restart:
 					 * the cache was allocated, and start over as if we had never
 					 * allocated a cache in the first place.
 					 */
-					releaseFolderCountInfo(fcip, numFolders);
-					fcip = NULL;
+					releaseFolderCountInfo(fcc);
+					fcc = NULL;
 					goto restart;
 				}
 			} else {
@@ -450,12 +506,12 @@ restart:
 				 * performed, account for directory hard links 
 				 * in CountFolderRecords()
 				 */
-			    	if (fcip) {
-					if (folderCountAdd(fcip, numFolders, 
+			    	if (fcc) {
+					if (folderCountAdd(fcc, 
 						key->parentID, 0, 0)) {
 						/* See above for why we release & restart */
-						releaseFolderCountInfo(fcip, numFolders);
-						fcip = NULL;
+						releaseFolderCountInfo(fcc);
+						fcc = NULL;
 						goto restart;
 					}
 				}
@@ -466,42 +522,41 @@ restart:
 
 	if (err == btNotFound)
 		err = 0;	// We hit the end of the file, which is okay
-	if (err == 0 && fcip != NULL) {
-		int i;
+	if (err == 0 && fcc != NULL) {
+		UInt32 i;
 
 		/*
 		 * At this point, we are itereating through the cache, looking for
 		 * mis-counts. (If we're not using the cache, then CountFolderRecords has
 		 * already dealt with any miscounts.)
 		 */
-		for (i = 0; i < numFolders; i++) {
-			struct folderCountInfo *curp;
-
-			for (curp = &fcip[i]; curp; curp = curp->next) {
-				if (curp->folderID == 0) {
-					// fplog(stderr, "fcip[%d] has a folderID of 0?\n", i);
-				} else if (curp->folderID == kHFSRootParentID) {
-					// Root's parent doesn't really exist
-					continue;
-				} else {
-					if (curp->recordedCount != curp->computedCount) {
-						/* RcdFCntErr requests a repair order to correct the folder count */
-						err = RcdFCntErr( GPtr,
-									E_FldCount,
-									curp->computedCount,
-									curp->recordedCount,
-									curp->folderID );
-						if (err != 0)
-							goto done;
-					}
+		for (i = 0; i < fcc->size; i++) {
+			struct folderCountInfo *curp = &fcc->entries[i];
+
+			if (curp->folderID == 0) {
+				// Free entry
+				continue;
+			} else if (curp->folderID == kHFSRootParentID) {
+				// Root's parent doesn't really exist
+				continue;
+			} else {
+				if (curp->recordedCount != curp->computedCount) {
+					/* RcdFCntErr requests a repair order to correct the folder count */
+					err = RcdFCntErr( GPtr,
+								E_FldCount,
+								curp->computedCount,
+								curp->recordedCount,
+								curp->folderID );
+					if (err != 0)
+						goto done;
 				}
 			}
 		}
 	}
 done:
-	if (fcip) {
-		releaseFolderCountInfo(fcip, numFolders);
-		fcip = NULL;
+	if (fcc) {
+		releaseFolderCountInfo(fcc);
+		fcc = NULL;
 	}
 	return err;
 }
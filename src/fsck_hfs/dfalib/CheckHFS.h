@@ -77,3 +77,11 @@ extern int CheckHFS(	const char *rdevnode, int fsReadRef, int fsWriteRef,
 
 extern int journal_replay(const char *);
 
+/* Per-phase timing and counters (-t), see SStats.c */
+struct SGlob;
+
+extern void StatsStart( void );
+extern void StatsPhaseBegin( struct SGlob *GPtr, const char *name );
+extern void StatsPhaseEnd( void );
+extern int StatsWrite( const char *path, int plist, const char *device, int result );
+
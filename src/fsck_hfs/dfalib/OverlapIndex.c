@@ -0,0 +1,331 @@
+//
+//  OverlapIndex.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+	File:		OverlapIndex.c
+
+	Contains:	Hash and treap over the overlapped extents list, used by
+				AddExtentToOverlapList and DoesOverlap in SVerify1.c.
+
+	This file only depends on the C library, so that the index can be built
+	and benchmarked on its own (fsck_hfs/tests/hfs_overlap_bench.c).
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "OverlapIndex.h"
+
+typedef struct OverlapRun {
+	struct OverlapRun	*left;
+	struct OverlapRun	*right;
+	uint32_t			priority;
+	uint64_t			start;			/* first block of the run */
+	uint64_t			end;			/* block after the last block of the run */
+} OverlapRun;
+
+typedef struct OverlapKey {
+	uint32_t			fileID;
+	uint32_t			startBlock;
+	uint32_t			blockCount;
+	const char *		attrname;		/* shared with the ExtentsTable entry */
+	uint8_t				forkType;
+	uint8_t				used;
+} OverlapKey;
+
+struct OverlapIndex {
+	OverlapRun *		runs;			/* root of the treap */
+	uint32_t			seed;			/* treap priority generator */
+	OverlapKey *		keys;
+	uint32_t			keyMask;		/* hash table size - 1 */
+	uint32_t			keyCount;		/* hash table entries in use */
+};
+
+enum {
+	kOverlapKeyInitial	= 64			/* initial hash table size, a power of 2 */
+};
+
+
+OverlapIndex *	OverlapIndexCreate( void )
+{
+	OverlapIndex	*index;
+
+	index = calloc( 1, sizeof(OverlapIndex) );
+	if ( index == NULL )
+		return( NULL );
+
+	index->keys = calloc( kOverlapKeyInitial, sizeof(OverlapKey) );
+	if ( index->keys == NULL )
+	{
+		free( index );
+		return( NULL );
+	}
+	index->keyMask = kOverlapKeyInitial - 1;
+	index->seed = 0x2545F491;
+
+	return( index );
+}
+
+
+static	void	OverlapRunFree( OverlapRun *tree )
+{
+	if ( tree != NULL )
+	{
+		OverlapRunFree( tree->left );
+		OverlapRunFree( tree->right );
+		free( tree );
+	}
+}
+
+
+void	OverlapIndexDispose( OverlapIndex *index )
+{
+	if ( index != NULL )
+	{
+		OverlapRunFree( index->runs );
+		free( index->keys );
+		free( index );
+	}
+}
+
+
+static	uint32_t	OverlapKeyHash( const OverlapKey *probe )
+{
+	const unsigned char	*p;
+	uint32_t			hash;
+
+	hash = probe->fileID * 0x9E3779B1;
+	hash = (hash ^ probe->startBlock) * 0x85EBCA6B;
+	hash = (hash ^ probe->blockCount) * 0xC2B2AE35;
+	hash ^= probe->forkType;
+	if ( probe->attrname != NULL )
+	{
+		for ( p = (const unsigned char *)probe->attrname; *p != '\0'; p++ )
+			hash = (hash ^ *p) * 0x01000193;
+	}
+
+	return( hash ^ (hash >> 16) );
+}
+
+
+/*
+ * Return the slot holding the same extent as 'probe', or the empty slot
+ * where it would go.  Attribute names are part of the key; a name and no name
+ * never match.
+ */
+static	OverlapKey *	OverlapKeyLookup( OverlapIndex *index, const OverlapKey *probe )
+{
+	OverlapKey	*key;
+	uint32_t	i;
+
+	for ( i = OverlapKeyHash( probe ) & index->keyMask; ; i = (i + 1) & index->keyMask )
+	{
+		key = &index->keys[i];
+		if ( key->used == 0 )
+			return( key );
+
+		if (	key->fileID		== probe->fileID		&&
+				key->startBlock	== probe->startBlock	&&
+				key->blockCount	== probe->blockCount	&&
+				key->forkType	== probe->forkType		)
+		{
+			if ( key->attrname == NULL && probe->attrname == NULL )
+				return( key );
+			if ( key->attrname != NULL && probe->attrname != NULL &&
+				 strcmp( key->attrname, probe->attrname ) == 0 )
+				return( key );
+		}
+	}
+}
+
+
+static	int	OverlapKeyGrow( OverlapIndex *index )
+{
+	OverlapKey	*oldKeys = index->keys;
+	uint32_t	oldSize = index->keyMask + 1;
+	uint32_t	i;
+
+	index->keys = calloc( oldSize * 2, sizeof(OverlapKey) );
+	if ( index->keys == NULL )
+	{
+		index->keys = oldKeys;
+		return( ENOMEM );
+	}
+	index->keyMask = oldSize * 2 - 1;
+
+	for ( i = 0; i < oldSize; i++ )
+	{
+		if ( oldKeys[i].used )
+			*OverlapKeyLookup( index, &oldKeys[i] ) = oldKeys[i];
+	}
+
+	free( oldKeys );
+	return( 0 );
+}
+
+
+/* Split a treap into the runs starting before 'start' and the others. */
+static	void	OverlapRunSplit( OverlapRun *tree, uint64_t start, OverlapRun **lower, OverlapRun **upper )
+{
+	if ( tree == NULL )
+	{
+		*lower = *upper = NULL;
+	}
+	else if ( tree->start < start )
+	{
+		*lower = tree;
+		OverlapRunSplit( tree->right, start, &tree->right, upper );
+	}
+	else
+	{
+		*upper = tree;
+		OverlapRunSplit( tree->left, start, lower, &tree->left );
+	}
+}
+
+
+/* Join two treaps, every run of 'lower' starting before those of 'upper'. */
+static	OverlapRun *	OverlapRunJoin( OverlapRun *lower, OverlapRun *upper )
+{
+	if ( lower == NULL )
+		return( upper );
+	if ( upper == NULL )
+		return( lower );
+
+	if ( lower->priority > upper->priority )
+	{
+		lower->right = OverlapRunJoin( lower->right, upper );
+		return( lower );
+	}
+	upper->left = OverlapRunJoin( lower, upper->left );
+	return( upper );
+}
+
+
+/*
+ * Add blocks [start, end) to the runs, merging every run they overlap.
+ */
+static	int	OverlapRunInsert( OverlapIndex *index, uint64_t start, uint64_t end )
+{
+	OverlapRun	*lower, *middle, *upper;
+	OverlapRun	**link;
+	OverlapRun	*run;
+
+	if ( start == end )
+		return( 0 );
+
+	run = malloc( sizeof(OverlapRun) );
+	if ( run == NULL )
+		return( ENOMEM );
+
+	OverlapRunSplit( index->runs, start, &lower, &upper );
+
+	//	The last run starting before us may reach into the new one
+	for ( link = &lower; *link != NULL && (*link)->right != NULL; link = &(*link)->right )
+		;
+	if ( *link != NULL && (*link)->end > start )
+	{
+		middle = *link;
+		*link = middle->left;
+		start = middle->start;
+		if ( middle->end > end )
+			end = middle->end;
+		free( middle );
+	}
+
+	//	Every run starting inside the new one is absorbed by it
+	OverlapRunSplit( upper, end, &middle, &upper );
+	if ( middle != NULL )
+	{
+		for ( link = &middle; (*link)->right != NULL; link = &(*link)->right )
+			;
+		if ( (*link)->end > end )
+			end = (*link)->end;
+		OverlapRunFree( middle );
+	}
+
+	//	xorshift32, the priorities only need to be well spread
+	index->seed ^= index->seed << 13;
+	index->seed ^= index->seed >> 17;
+	index->seed ^= index->seed << 5;
+
+	run->left = run->right = NULL;
+	run->priority = index->seed;
+	run->start = start;
+	run->end = end;
+	index->runs = OverlapRunJoin( OverlapRunJoin( lower, run ), upper );
+
+	return( 0 );
+}
+
+
+int	OverlapIndexAdd( OverlapIndex *index, uint32_t fileID, const char *attrname,
+					 uint32_t startBlock, uint32_t blockCount, uint8_t forkType )
+{
+	OverlapKey	probe;
+	OverlapKey	*key;
+	int			err;
+
+	//	Make room for the new entry before looking for it, growing moves keys
+	if ( (index->keyCount + 1) * 2 > index->keyMask + 1 )
+	{
+		err = OverlapKeyGrow( index );
+		if ( err != 0 )
+			return( err );
+	}
+
+	probe.fileID		= fileID;
+	probe.startBlock	= startBlock;
+	probe.blockCount	= blockCount;
+	probe.attrname		= attrname;
+	probe.forkType		= forkType;
+	probe.used			= 1;
+
+	key = OverlapKeyLookup( index, &probe );
+	if ( key->used )
+		return( EEXIST );
+
+	//	Covered blocks first, so a failure leaves the index unchanged
+	err = OverlapRunInsert( index, startBlock, (uint64_t)startBlock + blockCount );
+	if ( err != 0 )
+		return( err );
+
+	*key = probe;
+	index->keyCount++;
+
+	return( 0 );
+}
+
+
+/*
+ * An empty extent overlaps a run that strictly contains its start, as it
+ * always has.
+ */
+int	OverlapIndexOverlaps( OverlapIndex *index, uint32_t startBlock, uint32_t blockCount )
+{
+	OverlapRun	*tree;
+	OverlapRun	*last = NULL;
+	uint64_t	end = (uint64_t)startBlock + blockCount;
+
+	//	Find the last run starting before the end of the extent
+	for ( tree = index->runs; tree != NULL; )
+	{
+		if ( tree->start < end )
+		{
+			last = tree;
+			tree = tree->right;
+		}
+		else
+		{
+			tree = tree->left;
+		}
+	}
+
+	return( last != NULL && last->end > startBlock );
+}
@@ -0,0 +1,44 @@
+//
+//  OverlapIndex.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _OVERLAPINDEX_H_
+#define _OVERLAPINDEX_H_
+
+#include <stdint.h>
+
+/*
+ * Lookup index over the overlapped extents list (GPtr->overlappedExtents).
+ * The list is kept as an ExtentsTable handle, which the repair code sorts in
+ * place, so the index never refers to entries by position.  It holds two
+ * things:
+ *
+ *	- an open-addressed hash of the extents, so that adding an extent that
+ *	  is already in the list is found without walking it;
+ *	- a treap, ordered by start block, of the runs of blocks covered by the
+ *	  list.  Runs that overlap are merged, runs that only touch are not, so
+ *	  an extent overlaps some entry of the list exactly when it overlaps one
+ *	  of the runs, and only the last run starting before its end can.
+ *
+ * Both are O(log n) per extent, where walking the list was O(n).
+ *
+ * The index keeps the attribute name pointers it is given; they must stay
+ * valid until the index is disposed of.
+ */
+typedef struct OverlapIndex OverlapIndex;
+
+OverlapIndex *	OverlapIndexCreate( void );
+void			OverlapIndexDispose( OverlapIndex *index );
+
+/* 0 once added, EEXIST if the extent is already in the index, or ENOMEM */
+int				OverlapIndexAdd( OverlapIndex *index, uint32_t fileID, const char *attrname,
+								 uint32_t startBlock, uint32_t blockCount, uint8_t forkType );
+
+/* Does any extent in the index share a block with this one? */
+int				OverlapIndexOverlaps( OverlapIndex *index, uint32_t startBlock, uint32_t blockCount );
+
+#endif /* _OVERLAPINDEX_H_ */
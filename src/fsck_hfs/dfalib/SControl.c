@@ -32,13 +32,6 @@
 	Copyright:	 1985, 1986, 1992-1999 by Apple Computer, Inc., all rights reserved.
 */
 
-#define SHOW_ELAPSED_TIMES  0
-
-
-#if SHOW_ELAPSED_TIMES
-#include <sys/time.h>
-#endif
-
 #include "Scavenger.h"
 #include "fsck_journal.h"
 #include <setjmp.h>
@@ -397,7 +390,9 @@ EarlyExitLabel:
 		    IsTrimSupported())
 		{
 			fsckPrint(dataArea.context, fsckTrimming);
+			StatsPhaseBegin(&dataArea, "trim");
 			TrimFreeBlocks(&dataArea);
+			StatsPhaseEnd();
 		}
 
 		if (scanCount == 0) {
@@ -568,12 +563,6 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 {
 	OSErr			result;
 	unsigned int		stat;
-#if SHOW_ELAPSED_TIMES
-	struct timeval 	myStartTime;
-	struct timeval 	myEndTime;
-	struct timeval 	myElapsedTime;
-	struct timezone zone;
-#endif
 
 	//
 	//	initialize some stuff
@@ -592,6 +581,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			Boolean modified; 
 			int clean;
 
+			StatsPhaseBegin( GPtr, "initialize" );
 			if ( ( result = ScavSetUp( GPtr ) ) )			//	set up BEFORE CheckForStop
 				break;
 			if ( IsBlueBoxSharedDrive( GPtr->DrvPtr ) )
@@ -720,32 +710,17 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 	
 		case scavVerify:								//	VERIFY
 		{
-
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StatsPhaseBegin( GPtr, "setup" );
 
 			/* Initialize volume bitmap structure */
 			if ( BitMapCheckBegin(GPtr) != 0)
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			plog( "\n%s - BitMapCheck elapsed time \n", __FUNCTION__ );
-			plog( "########## secs %d msecs %d \n\n", 
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
-
 			if ( IsBlueBoxSharedDrive( GPtr->DrvPtr ) )
 				break;
 			if ( ( result = CheckForStop( GPtr ) ) )
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
-
 			/* Create calculated BTree structures */
 			if ( ( result = CreateExtentsBTreeControlBlock( GPtr ) ) )	
 				break;
@@ -756,16 +731,29 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			if ( ( result = CreateExtendedAllocationsFCB( GPtr ) ) )
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			plog( "\n%s - create control blocks elapsed time \n", __FUNCTION__ );
-			plog( ">>>>>>>>>>>>> secs %d msecs %d \n\n", 
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			/*
+			 * With -j, read the three B-tree files into the cache in
+			 * parallel.  The checks below find their nodes already cached.
+			 */
+			if ( verifyJobs > 1 ) {
+				StatsPhaseBegin( GPtr, "prefetch" );
+				(void) ParallelPrefetchBTrees( GPtr, verifyJobs );
+			}
 
 			//	Now that preflight of the BTree structures is calculated, compute the CheckDisk items
 			CalculateItemCount( GPtr, &GPtr->itemsToProcess, &GPtr->onePercent );
+
+			/*
+			 * Then check the structure of the three B-trees in parallel.
+			 * BTCheck takes each clean scan over when it gets to that tree,
+			 * after the checks before it, and checks the tree again
+			 * serially if the scan found anything.
+			 */
+			if ( verifyJobs > 1 ) {
+				StatsPhaseBegin( GPtr, "scan" );
+				(void) ParallelScanBTrees( GPtr, verifyJobs );
+			}
+
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
 			
 			if ( ( result = VLockedChk( GPtr ) ) )
@@ -773,27 +761,17 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
 			fsckPrint(GPtr->context, hfsExtBTCheck);
+			StatsPhaseBegin( GPtr, "extents" );
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
-				
 			/* Verify extent btree structure */
 			if ((result = ExtBTChk(GPtr)))
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			plog( "\n%s - ExtBTChk elapsed time \n", __FUNCTION__ );
-			plog( ">>>>>>>>>>>>> secs %d msecs %d \n\n", 
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
-				
 			if ((result = CheckForStop(GPtr)))
 				break;
 			
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
+			StatsPhaseBegin( GPtr, "badblocks" );
 
 			/* Check extents of bad block file */
 			if ((result = BadBlockFileExtentCheck(GPtr)))
@@ -804,11 +782,8 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
 			GPtr->itemsProcessed += GPtr->onePercent;
 			fsckPrint(GPtr->context, hfsCatBTCheck);
+			StatsPhaseEnd();
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
-				
 			if ( GPtr->chkLevel == kPartialCheck )
 			{
 				/* skip the rest of the verify code path the first time */
@@ -831,43 +806,26 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			 * for all extents existing in catalog record as well as in
 			 * overflow extent btree
 			 */
+			StatsPhaseBegin( GPtr, "catalog" );
 			if ((result = CheckCatalogBTree(GPtr)))
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			plog( "\n%s - CheckCatalogBTree elapsed time \n", __FUNCTION__ );
-			plog( ">>>>>>>>>>>>> secs %d msecs %d \n\n", 
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
-
 			if ((result = CheckForStop(GPtr)))
 				break;
 
 			if (scanflag == 0) {
 				fsckPrint(GPtr->context, hfsCatHierCheck);
+				StatsPhaseBegin( GPtr, "hierarchy" );
 
-#if SHOW_ELAPSED_TIMES
-				gettimeofday( &myStartTime, &zone );
-#endif
-				
 				/* Check catalog hierarchy */
 				if ((result = CatHChk(GPtr)))
 					break;
 
-#if SHOW_ELAPSED_TIMES
-				gettimeofday( &myEndTime, &zone );
-				timersub( &myEndTime, &myStartTime, &myElapsedTime );
-				plog( "\n%s - CatHChk elapsed time \n", __FUNCTION__ );
-				plog( ">>>>>>>>>>>>> secs %d msecs %d \n\n", 
-					myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
-
 				if ((result = CheckForStop(GPtr)))
 					break;
 
 				if (VolumeObjectIsHFSX(GPtr)) {
+					StatsPhaseBegin( GPtr, "foldercount" );
 					result = CheckFolderCount(GPtr);
 					if (result)
 						break;
@@ -880,6 +838,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			 * for extended attributes whose values are stored in 
 			 * allocation blocks
 			 */
+			StatsPhaseBegin( GPtr, "attributes" );
 			if ((result = AttrBTChk(GPtr)))
 				break;
 
@@ -896,6 +855,8 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			 * know the orignal file involved overlapped extents.
 			 */
 			if (GPtr->VIStat & S_OverlappingExtents) {
+				StatsPhaseBegin( GPtr, "overlaps" );
+
 				/* Find original files involved in overlapped extents */
 				result = FindOrigOverlapFiles(GPtr);
 				if (result) {
@@ -911,6 +872,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 				 * an extended attribute.  Therefore start directory 
 				 * hard link check after extended attribute checks.
 				 */
+				StatsPhaseBegin( GPtr, "dirhardlinks" );
 				result = dirhardlink_check(GPtr);
 				/* On error or unrepairable corruption, stop the verification */
 				if ((result != 0) || (GPtr->CatStat & S_LinkErrNoRepair)) {
@@ -923,43 +885,22 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			}
 
 			fsckPrint(GPtr->context, hfsVolBitmapCheck);
+			StatsPhaseBegin( GPtr, "bitmap" );
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
-				
 			/* Compare in-memory volume bitmap with on-disk bitmap */
 			if ((result = CheckVolumeBitMap(GPtr, false)))
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			plog( "\n%s - CheckVolumeBitMap elapsed time \n", __FUNCTION__ );
-			plog( ">>>>>>>>>>>>> secs %d msecs %d \n\n", 
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif 
-
 			if ((result = CheckForStop(GPtr)))
 				break;
 
 			fsckPrint(GPtr->context, hfsVolInfoCheck);
-
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StatsPhaseBegin( GPtr, "volumeinfo" );
 
 			/* Verify volume level information */
 			if ((result = VInfoChk(GPtr)))
 				break;
-
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			plog( "\n%s - VInfoChk elapsed time \n", __FUNCTION__ );
-			plog( ">>>>>>>>>>>>> secs %d msecs %d \n\n", 
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			StatsPhaseEnd();
 
 			stat =	GPtr->VIStat  | GPtr->ABTStat | GPtr->EBTStat | GPtr->CBTStat | 
 					GPtr->CatStat | GPtr->JStat;
@@ -1004,17 +945,23 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 				if (embedded == 1 && debug == 0)
 					fsckPrint(GPtr->context, fsckLimitedRepairs);
 			}
+			StatsPhaseBegin( GPtr, "repair" );
 			result = RepairVolume( GPtr );
 			break;
 		}
 		
 		case scavTerminate:									//	CLEANUP AFTER SCAVENGE
 		{
+			StatsPhaseBegin( GPtr, "terminate" );
 			result = ScavTerm(GPtr);
 			break;
 		}
 	}													//	end ScavOp switch
 
+	/* Close the timing of whichever phase was running when we left the switch */
+	StatsPhaseEnd();
+	DisposePhaseScans( GPtr );
+
 
 	//
 	//	Map internal error codes to scavenger result codes
@@ -1395,9 +1342,6 @@ static int ScavTerm( SGlobPtr GPtr )
 	BTreeControlBlock	*btcbP;
 	RepairOrderPtr		rP;
 	OSErr			err;
-	ExtentsTable 		**extentsTableH;
-	ExtentInfo		*curExtentInfo;
-	int			i;
 
 	(void) BitMapCheckEnd();
 
@@ -1411,21 +1355,8 @@ static int ScavTerm( SGlobPtr GPtr )
 	if( GPtr->validFilesList != nil )
 		DisposeHandle( (Handle) GPtr->validFilesList );
 	
-	if( GPtr->overlappedExtents != nil ) {
- 		extentsTableH = GPtr->overlappedExtents;
- 	
-		/* Overlapped extents list also allocated memory for attribute name */
-		for (i=0; i<(**extentsTableH).count; i++) {
-			curExtentInfo = &((**extentsTableH).extentInfo[i]);
-
-			/* Deallocate memory for attribute name, if any */
-			if (curExtentInfo->attrname) {
-				free(curExtentInfo->attrname);
-			}
-		}
-
-		DisposeHandle( (Handle) GPtr->overlappedExtents );
-	}
+	DisposeOverlapList( GPtr );
+	DisposePhaseScans( GPtr );
 	
 	if( GPtr->fileIdentifierTable != nil )
 		DisposeHandle( (Handle) GPtr->fileIdentifierTable );
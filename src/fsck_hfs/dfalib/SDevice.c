@@ -193,20 +193,17 @@ OSErr GetDeviceSize(int driveRefNum, UInt64 *numBlocks, UInt32 *blockSize)
 OSErr DeviceRead(int device, int drive, void* buffer, SInt64 offset, UInt32 reqBytes, UInt32 *actBytes)
 {
 #if BSD
-	off_t seek_off;
 	ssize_t	nbytes;
 	
 	*actBytes = 0;
 
-	seek_off = lseek(device, offset, SEEK_SET);
-	if (seek_off == -1) {
-		if (debug) plog("# DeviceRead: lseek(%qd) failed with %d\n", offset, errno);
-		return (errno);
+	/* pread, so that several threads can share the device */
+	nbytes = pread(device, buffer, reqBytes, offset);
+	if (nbytes == -1) {
+		int err = errno;
+		if (debug) plog("# DeviceRead: pread(%qd) failed with %d\n", offset, err);
+		return (err);
 	}
-
-	nbytes = read(device, buffer, reqBytes);
-	if (nbytes == -1)
-		return (errno);
 	if (nbytes == 0) {
 		if (debug) plog("CANNOT READ: BLK %ld\n", (long)offset/512);
 		return (5);
@@ -245,20 +242,15 @@ OSErr DeviceRead(int device, int drive, void* buffer, SInt64 offset, UInt32 reqB
 OSErr DeviceWrite(int device, int drive, void* buffer, SInt64 offset, UInt32 reqBytes, UInt32 *actBytes)
 {
 #if BSD
-	off_t seek_off;
 	ssize_t	nbytes;
 
 	*actBytes = 0;
 
-	seek_off = lseek(device, offset, SEEK_SET);
-	if (seek_off == -1) {
-		if (debug) plog("# DeviceRead: lseek(%qd) failed with %d\n", offset, errno);
-		return (errno);
-	}
-
-	nbytes = write(device, buffer, reqBytes);
+	nbytes = pwrite(device, buffer, reqBytes, offset);
 	if (nbytes == -1) {
-		return (errno);
+		int err = errno;
+		if (debug) plog("# DeviceWrite: pwrite(%qd) failed with %d\n", offset, err);
+		return (err);
 	}
 	if (nbytes == 0) {
 		if (debug) plog("CANNOT WRITE: BLK %ld\n", (long)offset/512);
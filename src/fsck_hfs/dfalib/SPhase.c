@@ -0,0 +1,666 @@
+//
+//  SPhase.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+	File:		SPhase.c
+
+	Contains:	Parallel phases run ahead of the B-tree verification.
+
+	The extents, catalog and attributes B-tree checks all start by reading
+	every node of their file through the cache.  Those reads are independent
+	of each other and of any verification state, so when more than one job
+	is requested (-j) we resolve the physical extents of the three files on
+	the calling thread, then hand the runs to a pool of worker threads which
+	load them into the cache in parallel.
+
+	The structure half of those checks (BTCheck without its leaf record
+	callback) only reads the tree and fills in that tree's control block and
+	node bitmap, so the three trees are then also checked on worker threads,
+	each on a private copy of the globals with its own path table and its own
+	message context.  A worker's findings stay in its PhaseScan record; the
+	control blocks are put back as they were before the scan.  When the main
+	thread reaches BTCheck for a tree it takes the scan over if it was clean,
+	and only runs the leaf record checks.  A scan that found anything is
+	dropped and the tree is checked serially, so findings and output order
+	are exactly those of a serial run.
+*/
+
+#include "Scavenger.h"
+#include "../cache.h"
+#include "../fsck_hfs.h"
+#include <Block.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define DEBUG_PHASE		0
+
+enum {
+	kPhaseRunSize		= 1024 * 1024,	/* largest run handed to one worker */
+	kPhaseMaxJobs		= 64
+};
+
+typedef struct PhaseRun {
+	UInt64		offset;		/* byte offset on the device */
+	UInt32		length;		/* length in bytes */
+} PhaseRun;
+
+typedef struct PhaseQueue {
+	pthread_mutex_t	lock;
+	Cache_t *		cache;
+	PhaseRun *		runs;
+	UInt32			count;		/* runs in the queue */
+	UInt32			allocated;	/* runs allocated */
+	UInt32			next;		/* next run to hand out */
+	UInt64			budget;		/* bytes left before the cache is full */
+	int				error;		/* first error seen by a worker */
+} PhaseQueue;
+
+/*
+ * One B-tree whose structure is checked on a worker thread.
+ */
+typedef struct PhaseScan {
+	short				refNum;
+	SGlob *				globals;	/* the worker's copy of the globals */
+	Boolean				taken;		/* BTCheck has looked at it */
+	int					result;		/* BTCheck result on the worker */
+	UInt16				status;		/* B-tree status flags it set */
+	UInt32				messages;	/* messages it tried to print */
+	UInt32 *			leaves;		/* leaf nodes in traversal order */
+	UInt32				leafCount;
+	UInt32				leafAllocated;
+	BTreeControlBlock	saved;		/* control block before the scan */
+	BTreeControlBlock	btcb;		/* and as the scan left it */
+	Ptr					map;		/* the node bitmap the BTCB is not using */
+} PhaseScan;
+
+typedef struct PhaseScanSet {
+	pthread_mutex_t	lock;
+	PhaseScan		scans[3];
+	UInt32			count;
+	UInt32			next;		/* next scan to hand out */
+	volatile int	stray;		/* something printed to the main context */
+} PhaseScanSet;
+
+static int AddPhaseRun( PhaseQueue *queue, UInt64 offset, UInt32 length );
+static int QueueBTreeFile( SVCB *vcb, SFCB *fcb, PhaseQueue *queue );
+static void * PhaseWorker( void *arg );
+static int AddPhaseScan( SGlobPtr GPtr, PhaseScanSet *set, short refNum );
+static Boolean FCBHoldsFile( SVCB *vcb, SFCB *fcb );
+static Boolean FilesOverlap( SFCB *a, SFCB *b );
+static UInt16 * PhaseScanStatus( SGlobPtr GPtr, short refNum );
+static void SwapPhaseScan( PhaseScan *scan );
+static PhaseScan * FindPhaseScan( SGlobPtr GPtr, short refNum );
+static void * PhaseScanWorker( void *arg );
+
+
+/*------------------------------------------------------------------------------
+
+Function:	ParallelPrefetchBTrees
+
+Function:	Loads the extents, catalog and attributes B-tree files into the
+			cache using up to 'jobs' worker threads.  This is purely an I/O
+			optimization: any error is ignored here and will be found and
+			reported by the serial verification that follows.
+
+Input:		GPtr		-	pointer to scavenger global area
+			jobs		-	number of worker threads to use
+
+Output:		ParallelPrefetchBTrees	-	function result:
+								0	= no error
+								n 	= error code
+------------------------------------------------------------------------------*/
+
+int ParallelPrefetchBTrees( SGlobPtr GPtr, int jobs )
+{
+	SVCB *			vcb = GPtr->calculatedVCB;
+	PhaseQueue		queue;
+	pthread_t		threads[kPhaseMaxJobs];
+	int				started = 0;
+	int				i;
+	int				err;
+
+	if (jobs < 2)
+		return noErr;
+	if (jobs > kPhaseMaxJobs)
+		jobs = kPhaseMaxJobs;
+
+	ClearMemory( &queue, sizeof(queue) );
+	queue.cache = (Cache_t *)vcb->vcbBlockCache;
+	queue.budget = (UInt64)CacheFreeCount( queue.cache ) * queue.cache->BlockSize;
+	pthread_mutex_init( &queue.lock, NULL );
+
+	/*
+	 * Map the files serially: MapFileBlockC may have to search the extents
+	 * B-tree, which is not safe to do from several threads.  The extents file
+	 * goes first since it is small and consulted by everything else.
+	 */
+	err = QueueBTreeFile( vcb, vcb->vcbExtentsFile, &queue );
+	if (err == noErr)
+		err = QueueBTreeFile( vcb, vcb->vcbCatalogFile, &queue );
+	if (err == noErr)
+		err = QueueBTreeFile( vcb, vcb->vcbAttributesFile, &queue );
+	if (err != noErr && err != ENOSPC)
+		goto out;
+
+	if (queue.count < (UInt32)jobs)
+		jobs = queue.count;
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create( &threads[i], NULL, PhaseWorker, &queue ) != 0)
+			break;
+		started++;
+	}
+	/* If no thread could be started, fall back to the serial verify. */
+	for (i = 0; i < started; i++)
+		pthread_join( threads[i], NULL );
+
+#if DEBUG_PHASE
+	plog( "%s: %u runs, %d jobs, error %d\n", __FUNCTION__, queue.count, started, queue.error );
+#endif
+	err = queue.error;
+
+out:
+	pthread_mutex_destroy( &queue.lock );
+	if (queue.runs != NULL)
+		DisposeMemory( queue.runs );
+
+	return err;
+}
+
+
+/*
+ * Add the physical extents of a B-tree file to the queue, split into runs of
+ * at most kPhaseRunSize bytes.  Returns ENOSPC once the runs queued so far
+ * would fill the cache.
+ */
+static int QueueBTreeFile( SVCB *vcb, SFCB *fcb, PhaseQueue *queue )
+{
+	UInt64		sectorOffset;
+	UInt64		fileSectors;
+	UInt64		startSector;
+	UInt32		contigBytes;
+	int			err;
+
+	if (fcb == NULL || fcb->fcbPhysicalSize == 0)
+		return noErr;
+
+	fileSectors = fcb->fcbPhysicalSize >> kSectorShift;
+	for (sectorOffset = 0; sectorOffset < fileSectors; ) {
+		if (MapFileBlockC( vcb, fcb, kPhaseRunSize, sectorOffset,
+		                   &startSector, &contigBytes ) != noErr ||
+		    contigBytes == 0) {
+			/* Damaged extents; leave the rest to the verification. */
+			break;
+		}
+		if (contigBytes > queue->budget)
+			return ENOSPC;
+
+		err = AddPhaseRun( queue, startSector << kSectorShift, contigBytes );
+		if (err != noErr)
+			return err;
+
+		queue->budget -= contigBytes;
+		sectorOffset += contigBytes >> kSectorShift;
+	}
+
+	return noErr;
+}
+
+
+static int AddPhaseRun( PhaseQueue *queue, UInt64 offset, UInt32 length )
+{
+	PhaseRun *	runs;
+
+	if (queue->count == queue->allocated) {
+		UInt32 newCount = queue->allocated ? queue->allocated * 2 : 64;
+
+		runs = realloc( queue->runs, newCount * sizeof(PhaseRun) );
+		if (runs == NULL)
+			return R_NoMem;
+		queue->runs = runs;
+		queue->allocated = newCount;
+	}
+
+	queue->runs[queue->count].offset = offset;
+	queue->runs[queue->count].length = length;
+	queue->count++;
+
+	return noErr;
+}
+
+
+static void * PhaseWorker( void *arg )
+{
+	PhaseQueue *	queue = (PhaseQueue *)arg;
+	PhaseRun *		run;
+	int				err;
+
+	for (;;) {
+		pthread_mutex_lock( &queue->lock );
+		if (queue->error != 0 || queue->next >= queue->count) {
+			pthread_mutex_unlock( &queue->lock );
+			break;
+		}
+		run = &queue->runs[queue->next++];
+		pthread_mutex_unlock( &queue->lock );
+
+		err = CachePrefetch( queue->cache, run->offset, run->length );
+		if (err != EOK) {
+			pthread_mutex_lock( &queue->lock );
+			if (queue->error == 0)
+				queue->error = err;
+			pthread_mutex_unlock( &queue->lock );
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	ParallelScanBTrees
+
+Function:	Checks the structure of the extents, catalog and attributes
+			B-trees on up to 'jobs' worker threads.  Nothing is reported
+			here: the results are kept for BTCheck, which takes a clean scan
+			over with TakePhaseScan and checks the tree serially otherwise.
+
+			The scans are only run on HFS+ volumes whose B-tree files are
+			entirely described by the extents in their FCBs, so that no
+			worker ever has to search the extents B-tree, and whose B-tree
+			files do not overlap, so that no two workers hold the same node.
+
+Input:		GPtr		-	pointer to scavenger global area
+			jobs		-	number of worker threads to use
+
+Output:		ParallelScanBTrees	-	function result:
+								0	= no error
+								n 	= error code
+------------------------------------------------------------------------------*/
+
+int ParallelScanBTrees( SGlobPtr GPtr, int jobs )
+{
+	SVCB *			vcb = GPtr->calculatedVCB;
+	PhaseScanSet *	set;
+	pthread_t		threads[kPhaseMaxJobs];
+	fsckBlock_t		before = NULL;
+	int				started = 0;
+	int				i;
+
+	/* Debug output goes straight to stdout and cannot be held back. */
+	if (jobs < 2 || debug || cur_debug_level || !VolumeObjectIsHFSPlus())
+		return noErr;
+	if (jobs > kPhaseMaxJobs)
+		jobs = kPhaseMaxJobs;
+
+	set = (PhaseScanSet *) AllocateClearMemory( sizeof(PhaseScanSet) );
+	if (set == NULL)
+		return R_NoMem;
+	pthread_mutex_init( &set->lock, NULL );
+	GPtr->phaseScans = set;
+
+	/* The catalog goes first since it takes longest. */
+	if (GPtr->chkLevel != kPartialCheck) {
+		(void) AddPhaseScan( GPtr, set, kCalculatedCatalogRefNum );
+		if (vcb->vcbAttributesFile != NULL)
+			(void) AddPhaseScan( GPtr, set, kCalculatedAttributesRefNum );
+	}
+	(void) AddPhaseScan( GPtr, set, kCalculatedExtentRefNum );
+	if (set->count == 0)
+		return noErr;
+
+	/*
+	 * Workers print to their own contexts, but a few routines report through
+	 * the volume's globals (hfs_swap_BTNode, for one).  Keep such a message
+	 * off the main context, which may longjmp on errors, and drop the scans.
+	 */
+	if (GPtr->context != NULL) {
+		before = fsckGetBlock( GPtr->context, fsckPhaseBeforeMessage );
+		if (before != NULL)
+			before = Block_copy( before );
+		fsckSetBlock( GPtr->context, fsckPhaseBeforeMessage, (fsckBlock_t) ^(fsck_ctx_t c, int msgNum, va_list args) {
+			set->stray = 1;
+			return fsckBlockIgnore;
+		});
+	}
+
+	if ((UInt32)jobs > set->count)
+		jobs = set->count;
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create( &threads[i], NULL, PhaseScanWorker, set ) != 0)
+			break;
+		started++;
+	}
+	/* Scans that did not run keep their result and are checked serially. */
+	for (i = 0; i < started; i++)
+		pthread_join( threads[i], NULL );
+
+	if (GPtr->context != NULL) {
+		fsckSetBlock( GPtr->context, fsckPhaseBeforeMessage, before );
+		if (before != NULL)
+			Block_release( before );
+	}
+
+	/* Put the control blocks back the way the serial checks expect them. */
+	for (i = 0; i < (int)set->count; i++) {
+		PhaseScan *	scan = &set->scans[i];
+
+		scan->status = *PhaseScanStatus( scan->globals, scan->refNum );
+		SwapPhaseScan( scan );
+#if DEBUG_PHASE
+		plog( "%s: tree %d, result %d, status 0x%x, %u messages, %u leaves\n", __FUNCTION__,
+		      scan->refNum, scan->result, scan->status, scan->messages, scan->leafCount );
+#endif
+	}
+
+	return noErr;
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	PhaseScanClean
+
+Function:	True if the tree was checked by ParallelScanBTrees, nothing was
+			found, and the scan has not been taken yet.
+
+Input:		GPtr		-	pointer to scavenger global area
+			refNum		-	file refnum
+
+Output:		PhaseScanClean	-	true if TakePhaseScan will take it over
+------------------------------------------------------------------------------*/
+
+Boolean PhaseScanClean( SGlobPtr GPtr, short refNum )
+{
+	PhaseScan *		scan = FindPhaseScan( GPtr, refNum );
+
+	return scan != NULL && !GPtr->phaseScans->stray &&
+	       scan->result == noErr && scan->status == 0 && scan->messages == 0;
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	TakePhaseScan
+
+Function:	Called by BTCheck on the main thread.  If the scan of the tree is
+			clean, puts the control block and node bitmap as the scan left
+			them in place and returns the leaf nodes in traversal order.  Each
+			scan can only be taken once.
+
+Input:		GPtr		-	pointer to scavenger global area
+			refNum		-	file refnum
+
+Output:		leaves		-	leaf node numbers, owned by the scan
+			leafCount	-	number of leaf nodes
+			TakePhaseScan	-	true if the scan was taken over
+------------------------------------------------------------------------------*/
+
+Boolean TakePhaseScan( SGlobPtr GPtr, short refNum, UInt32 **leaves, UInt32 *leafCount )
+{
+	PhaseScan *		scan;
+
+	if (!PhaseScanClean( GPtr, refNum ))
+		return false;
+
+	scan = FindPhaseScan( GPtr, refNum );
+	scan->taken = true;
+	SwapPhaseScan( scan );
+	GPtr->itemsProcessed += scan->globals->itemsProcessed;
+	GPtr->btreeNodesVisited += scan->globals->btreeNodesVisited;
+	GPtr->btreeRecordsVisited += scan->globals->btreeRecordsVisited;
+
+	*leaves = scan->leaves;
+	*leafCount = scan->leafCount;
+	return true;
+}
+
+
+/*
+ * Called by BTCheck on a worker for each leaf node, in traversal order.
+ */
+int AddPhaseScanLeaf( SGlobPtr GPtr, UInt32 nodeNum )
+{
+	PhaseScan *	scan = GPtr->phaseScan;
+	UInt32 *	leaves;
+
+	if (scan->leafCount == scan->leafAllocated) {
+		UInt32 newCount = scan->leafAllocated ? scan->leafAllocated * 2 : 1024;
+
+		leaves = realloc( scan->leaves, newCount * sizeof(UInt32) );
+		if (leaves == NULL)
+			return R_NoMem;
+		scan->leaves = leaves;
+		scan->leafAllocated = newCount;
+	}
+	scan->leaves[scan->leafCount++] = nodeNum;
+
+	return noErr;
+}
+
+
+void DisposePhaseScans( SGlobPtr GPtr )
+{
+	PhaseScanSet *	set = GPtr->phaseScans;
+	PhaseScan *		scan;
+	UInt32			i;
+
+	if (set == NULL)
+		return;
+
+	for (i = 0; i < set->count; i++) {
+		scan = &set->scans[i];
+		if (scan->leaves != NULL)
+			DisposeMemory( scan->leaves );
+		if (scan->map != NULL)
+			DisposeMemory( scan->map );
+		if (scan->globals != NULL) {
+			if (scan->globals->BTPTPtr != NULL)
+				DisposeMemory( scan->globals->BTPTPtr );
+			if (scan->globals->context != NULL)
+				fsckDestroy( scan->globals->context );
+			DisposeMemory( scan->globals );
+		}
+	}
+	pthread_mutex_destroy( &set->lock );
+	DisposeMemory( set );
+	GPtr->phaseScans = NULL;
+}
+
+
+/*
+ * Set up a scan of one B-tree: a copy of the globals for the worker, with its
+ * own path table and a message context that only counts, and a copy of the
+ * node bitmap to put back afterwards.  Trees that cannot be scanned safely
+ * are left out.
+ */
+static int AddPhaseScan( SGlobPtr GPtr, PhaseScanSet *set, short refNum )
+{
+	extern fsck_message_t hfs_messages[];
+	extern fsck_message_t hfs_errors[];
+	SVCB *					vcb = GPtr->calculatedVCB;
+	BTreeControlBlock *		btcb = GetBTreeControlBlock( refNum );
+	BTreeExtensionsRec *	ext = (BTreeExtensionsRec *) btcb->refCon;
+	PhaseScan *				scan = &set->scans[set->count];
+	SGlob *					wg;
+	UInt32					i;
+
+	if (ext == NULL || !FCBHoldsFile( vcb, btcb->fcbPtr ))
+		return noErr;
+	for (i = 0; i < set->count; i++) {
+		if (FilesOverlap( btcb->fcbPtr, GetBTreeControlBlock( set->scans[i].refNum )->fcbPtr ))
+			return noErr;
+	}
+
+	ClearMemory( scan, sizeof(PhaseScan) );
+	scan->refNum = refNum;
+	scan->result = R_IntErr;	/* until a worker has run it */
+	scan->map = AllocateMemory( ext->BTCBMSize );
+	wg = (SGlob *) AllocateMemory( sizeof(SGlob) );
+	if (scan->map == NULL || wg == NULL)
+		goto nomem;
+	CopyMemory( ext->BTCBMPtr, scan->map, ext->BTCBMSize );
+	scan->saved = *btcb;
+
+	*wg = *GPtr;
+	scan->globals = wg;
+	wg->BTPTPtr = (SBTPT *) AllocateClearMemory( sizeof(SBTPT) );
+	wg->context = fsckCreate();
+	if (wg->BTPTPtr == NULL || wg->context == NULL ||
+	    fsckAddMessages( wg->context, hfs_messages ) == -1 ||
+	    fsckAddMessages( wg->context, hfs_errors ) == -1)
+		goto nomem;
+	fsckSetBlock( wg->context, fsckPhaseBeforeMessage, (fsckBlock_t) ^(fsck_ctx_t c, int msgNum, va_list args) {
+		scan->messages++;
+		return fsckBlockIgnore;
+	});
+	wg->userCancelProc = NULL;
+	wg->itemsProcessed = 0;
+	wg->btreeNodesVisited = wg->btreeRecordsVisited = 0;
+	wg->EBTStat = wg->CBTStat = wg->ABTStat = 0;
+	wg->phaseScans = NULL;
+	wg->phaseScan = scan;
+
+	set->count++;
+	return noErr;
+
+nomem:
+	if (scan->map != NULL)
+		DisposeMemory( scan->map );
+	if (wg != NULL) {
+		if (scan->globals != NULL) {
+			if (wg->BTPTPtr != NULL)
+				DisposeMemory( wg->BTPTPtr );
+			if (wg->context != NULL)
+				fsckDestroy( wg->context );
+		}
+		DisposeMemory( wg );
+	}
+	ClearMemory( scan, sizeof(PhaseScan) );
+	return R_NoMem;
+}
+
+
+/*
+ * True if the extents in the FCB cover the whole file, so that mapping any
+ * of its blocks never searches the extents B-tree.
+ */
+static Boolean FCBHoldsFile( SVCB *vcb, SFCB *fcb )
+{
+	UInt64		blocks = 0;
+	int			i;
+
+	if (fcb == NULL || fcb->fcbPhysicalSize == 0)
+		return false;
+	for (i = 0; i < kHFSPlusExtentDensity; i++)
+		blocks += fcb->fcbExtents32[i].blockCount;
+
+	return blocks * vcb->vcbBlockSize >= fcb->fcbPhysicalSize;
+}
+
+
+static Boolean FilesOverlap( SFCB *a, SFCB *b )
+{
+	int		i, j;
+
+	for (i = 0; i < kHFSPlusExtentDensity; i++) {
+		HFSPlusExtentDescriptor *x = &a->fcbExtents32[i];
+
+		if (x->blockCount == 0)
+			continue;
+		for (j = 0; j < kHFSPlusExtentDensity; j++) {
+			HFSPlusExtentDescriptor *y = &b->fcbExtents32[j];
+
+			if (y->blockCount != 0 &&
+			    x->startBlock < y->startBlock + y->blockCount &&
+			    y->startBlock < x->startBlock + x->blockCount)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+
+static PhaseScan * FindPhaseScan( SGlobPtr GPtr, short refNum )
+{
+	PhaseScanSet *	set = GPtr->phaseScans;
+	UInt32			i;
+
+	if (set == NULL)
+		return NULL;
+	for (i = 0; i < set->count; i++) {
+		if (set->scans[i].refNum == refNum && !set->scans[i].taken)
+			return &set->scans[i];
+	}
+
+	return NULL;
+}
+
+
+static UInt16 * PhaseScanStatus( SGlobPtr GPtr, short refNum )
+{
+	if (refNum == kCalculatedCatalogRefNum)
+		return &GPtr->CBTStat;
+	if (refNum == kCalculatedAttributesRefNum)
+		return &GPtr->ABTStat;
+	return &GPtr->EBTStat;
+}
+
+
+/*
+ * Exchange the tree's control block and node bitmap with the ones kept in the
+ * scan: after the workers are done the scan keeps what it found and the tree
+ * goes back to its state before the scan, and TakePhaseScan swaps them back.
+ */
+static void SwapPhaseScan( PhaseScan *scan )
+{
+	BTreeControlBlock *		btcb = GetBTreeControlBlock( scan->refNum );
+	BTreeExtensionsRec *	ext = (BTreeExtensionsRec *) btcb->refCon;
+	Ptr						map;
+
+	if (!scan->taken) {
+		scan->btcb = *btcb;
+		*btcb = scan->saved;
+	} else {
+		/* Only the fields BTCheck fills in; the rest may have moved on. */
+		btcb->treeDepth		= scan->btcb.treeDepth;
+		btcb->rootNode		= scan->btcb.rootNode;
+		btcb->firstLeafNode	= scan->btcb.firstLeafNode;
+		btcb->lastLeafNode	= scan->btcb.lastLeafNode;
+		btcb->leafRecords	= scan->btcb.leafRecords;
+		btcb->freeNodes		= scan->btcb.freeNodes;
+	}
+
+	map = ext->BTCBMPtr;
+	ext->BTCBMPtr = scan->map;
+	scan->map = map;
+}
+
+
+static void * PhaseScanWorker( void *arg )
+{
+	PhaseScanSet *	set = (PhaseScanSet *)arg;
+	PhaseScan *		scan;
+
+	for (;;) {
+		pthread_mutex_lock( &set->lock );
+		if (set->next >= set->count) {
+			pthread_mutex_unlock( &set->lock );
+			break;
+		}
+		scan = &set->scans[set->next++];
+		pthread_mutex_unlock( &set->lock );
+
+		scan->result = BTCheck( scan->globals, scan->refNum, NULL );
+	}
+
+	return NULL;
+}
@@ -137,6 +137,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	OSErr					myErr;
 	Boolean 				isHFSPlus;
 	UInt32					numRecords = 0;
+	UInt32					lastNodeNum = 0;	// last leaf node counted in btreeNodesVisited
 	
 #if SHOW_ELAPSED_TIMES 
 	struct timeval 			myStartTime;
@@ -286,6 +287,13 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 								  &myDataSize  );
 		if ( noErr != myErr )
 			break;
+
+		theSGlobPtr->btreeRecordsVisited++;
+		if ( theSGlobPtr->scanState.nodeNum != lastNodeNum )
+		{
+			lastNodeNum = theSGlobPtr->scanState.nodeNum;
+			theSGlobPtr->btreeNodesVisited++;
+		}
 		
 		/* do some validation on the record */
 		theSGlobPtr->TarBlock = theSGlobPtr->scanState.nodeNum;
@@ -480,6 +480,8 @@ extern OSStatus  ReleaseFileBlock (SFCB *file, BlockDescriptor *block,
 
 extern OSStatus  SetFileBlockSize (SFCB *file, ByteCount blockSize);
 
+extern void      PrefetchFileBlocks (SFCB *file, UInt32 blockNum, UInt32 blockCount);
+
 
 
 #if BSD || defined(__FreeBSD__)
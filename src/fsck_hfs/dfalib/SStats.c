@@ -0,0 +1,341 @@
+//
+//  SStats.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+	File:		SStats.c
+
+	Contains:	Per-phase timing and counters for the -t option.
+
+	Each scavenger phase (and the -S disk scan and the TRIM pass) is bracketed
+	by StatsPhaseBegin and StatsPhaseEnd.  For every phase we record the wall
+	clock and CPU time spent in it, the bytes read from the device and the
+	cache traffic it caused, the B-tree nodes and leaf records the checks and
+	rebuilds in it walked, how far it moved the progress counter (which
+	counts B-tree records and bitmap blocks in some phases and whole
+	percents in others, so is only comparable between runs) and the number
+	of repair orders it queued.  When the check is done StatsWrite dumps the
+	table as JSON, or as a plist when XML output (-x) was requested, so that
+	the cost of checking a volume can be tracked over time.
+
+	Nothing is recorded unless StatsStart has been called.
+*/
+
+#include "Scavenger.h"
+#include "../cache.h"
+#include <sys/resource.h>
+#include <time.h>
+
+typedef struct StatsSample {
+	struct timespec	wall;
+	struct timeval	user;
+	struct timeval	sys;
+	uint64_t		bytesRead;
+	uint32_t		reqRead;
+	uint32_t		miss;
+	uint32_t		diskRead;
+	uint32_t		readAhead;
+} StatsSample;
+
+typedef struct StatsPhase {
+	const char *	name;
+	int				pass;		/* 0 for the first verify, 1.. after each repair */
+	double			wallTime;	/* seconds */
+	double			userTime;
+	double			sysTime;
+	uint64_t		bytesRead;
+	uint32_t		cacheRequests;
+	uint32_t		cacheMisses;
+	uint32_t		diskReads;
+	uint32_t		readAhead;
+	uint64_t		nodesVisited;	/* B-tree nodes walked */
+	uint64_t		recordsVisited;	/* B-tree leaf records walked */
+	uint64_t		progress;	/* itemsProcessed, in the progress bar's units */
+	uint32_t		newRepairOrders;
+} StatsPhase;
+
+static struct {
+	int				enabled;
+	StatsSample		start;		/* StatsStart */
+	StatsPhase *	phases;
+	UInt32			count;
+	UInt32			allocated;
+
+	/* The phase in progress, if any */
+	StatsPhase *	open;
+	SGlobPtr		openGPtr;
+	StatsSample		openStart;
+	UInt64			openNodes;
+	UInt64			openRecords;
+	UInt64			openProgress;
+	UInt32			openOrders;
+} gStats;
+
+static void TakeSample( StatsSample *s );
+static void PutString( FILE *fp, const char *s, int plist );
+
+
+/*------------------------------------------------------------------------------
+
+Function:	StatsStart
+
+Function:	Turns on statistics collection and takes the baseline sample
+			that the run totals are measured from.
+------------------------------------------------------------------------------*/
+
+void StatsStart( void )
+{
+	gStats.enabled = 1;
+	TakeSample( &gStats.start );
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	StatsPhaseBegin
+
+Function:	Starts timing a phase, ending the one in progress if there is
+			one.  This lets ScavCtrl mark each phase as it starts and close
+			the last one once, whichever way it leaves the verify.
+
+Input:		GPtr		-	pointer to scavenger global area, or NULL outside
+							of the scavenger (no progress or repair counts)
+			name		-	phase name; must be a string constant
+------------------------------------------------------------------------------*/
+
+void StatsPhaseBegin( SGlobPtr GPtr, const char *name )
+{
+	StatsPhase *	phase;
+
+	if (!gStats.enabled)
+		return;
+	if (gStats.open != NULL)
+		StatsPhaseEnd();
+
+	if (gStats.count == gStats.allocated) {
+		UInt32 newCount = gStats.allocated ? gStats.allocated * 2 : 32;
+
+		phase = realloc( gStats.phases, newCount * sizeof(StatsPhase) );
+		if (phase == NULL)
+			return;		/* just lose this phase */
+		gStats.phases = phase;
+		gStats.allocated = newCount;
+	}
+
+	phase = &gStats.phases[gStats.count++];
+	ClearMemory( phase, sizeof(*phase) );
+	phase->name = name;
+	phase->pass = GPtr ? GPtr->scanCount : 0;
+
+	gStats.open = phase;
+	gStats.openGPtr = GPtr;
+	gStats.openNodes = GPtr ? GPtr->btreeNodesVisited : 0;
+	gStats.openRecords = GPtr ? GPtr->btreeRecordsVisited : 0;
+	gStats.openProgress = GPtr ? GPtr->itemsProcessed : 0;
+	gStats.openOrders = GPtr ? GPtr->minorRepairsQueued : 0;
+	TakeSample( &gStats.openStart );
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	StatsPhaseEnd
+
+Function:	Ends the phase in progress, if any, and records its counters.
+------------------------------------------------------------------------------*/
+
+void StatsPhaseEnd( void )
+{
+	StatsPhase *	phase = gStats.open;
+	StatsSample *	s0 = &gStats.openStart;
+	StatsSample		s1;
+	SGlobPtr		GPtr = gStats.openGPtr;
+
+	if (phase == NULL)
+		return;
+	TakeSample( &s1 );
+
+	phase->wallTime = (s1.wall.tv_sec - s0->wall.tv_sec) +
+	                  (s1.wall.tv_nsec - s0->wall.tv_nsec) / 1e9;
+	phase->userTime = (s1.user.tv_sec - s0->user.tv_sec) +
+	                  (s1.user.tv_usec - s0->user.tv_usec) / 1e6;
+	phase->sysTime  = (s1.sys.tv_sec - s0->sys.tv_sec) +
+	                  (s1.sys.tv_usec - s0->sys.tv_usec) / 1e6;
+	phase->bytesRead     = s1.bytesRead - s0->bytesRead;
+	phase->cacheRequests = s1.reqRead - s0->reqRead;
+	phase->cacheMisses   = s1.miss - s0->miss;
+	phase->diskReads     = s1.diskRead - s0->diskRead;
+	phase->readAhead     = s1.readAhead - s0->readAhead;
+
+	if (GPtr != NULL) {
+		/* The counters start again from zero for a new pass */
+		if (GPtr->btreeNodesVisited > gStats.openNodes)
+			phase->nodesVisited = GPtr->btreeNodesVisited - gStats.openNodes;
+		if (GPtr->btreeRecordsVisited > gStats.openRecords)
+			phase->recordsVisited = GPtr->btreeRecordsVisited - gStats.openRecords;
+		if (GPtr->itemsProcessed > gStats.openProgress)
+			phase->progress = GPtr->itemsProcessed - gStats.openProgress;
+		phase->newRepairOrders = GPtr->minorRepairsQueued - gStats.openOrders;
+	}
+
+	gStats.open = NULL;
+	gStats.openGPtr = NULL;
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	StatsWrite
+
+Function:	Writes the run totals and the phase table to 'path' ("-" for the
+			standard output), as JSON or as an XML property list.
+
+Input:		path		-	output file
+			plist		-	non-zero to write a plist instead of JSON
+			device		-	device that was checked
+			result		-	CheckHFS result
+
+Output:		StatsWrite	-	0 on success, else an errno value
+------------------------------------------------------------------------------*/
+
+int StatsWrite( const char *path, int plist, const char *device, int result )
+{
+	FILE *			fp;
+	StatsSample		s0 = gStats.start;
+	StatsSample		s1;
+	StatsPhase *	phase;
+	UInt32			i;
+	int				err = 0;
+
+	if (!gStats.enabled)
+		return 0;
+	StatsPhaseEnd();
+	TakeSample( &s1 );
+
+	if (strcmp( path, "-" ) == 0)
+		fp = stdout;
+	else if ((fp = fopen( path, "w" )) == NULL)
+		return errno;
+
+#define HEAD(k)		(plist ? fprintf( fp, "%s<key>%s</key> ", indent, k ) : fprintf( fp, "%s\"%s\": ", indent, k ))
+#define TAIL(last)	fputs( plist || (last) ? "\n" : ",\n", fp )
+#define PUT_INT(k, v, last)		do { HEAD(k); fprintf( fp, plist ? "<integer>%llu</integer>" : "%llu", (unsigned long long)(v) ); TAIL(last); } while (0)
+#define PUT_REAL(k, v, last)	do { HEAD(k); fprintf( fp, plist ? "<real>%.6f</real>" : "%.6f", (double)(v) ); TAIL(last); } while (0)
+#define PUT_STR(k, v, last)		do { HEAD(k); PutString( fp, v, plist ); TAIL(last); } while (0)
+
+	if (plist) {
+		fputs( "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		       "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+		       "<plist version=\"1.0\">\n<dict>\n", fp );
+	} else {
+		fputs( "{\n", fp );
+	}
+
+	{
+		const char *indent = "\t";
+
+		PUT_STR( "device", device ? device : "", 0 );
+		PUT_INT( "result", result, 0 );
+		PUT_REAL( "wallTime", (s1.wall.tv_sec - s0.wall.tv_sec) + (s1.wall.tv_nsec - s0.wall.tv_nsec) / 1e9, 0 );
+		PUT_REAL( "userTime", (s1.user.tv_sec - s0.user.tv_sec) + (s1.user.tv_usec - s0.user.tv_usec) / 1e6, 0 );
+		PUT_REAL( "systemTime", (s1.sys.tv_sec - s0.sys.tv_sec) + (s1.sys.tv_usec - s0.sys.tv_usec) / 1e6, 0 );
+		PUT_INT( "cacheBlockSize", fscache.BlockSize, 0 );
+		PUT_INT( "bytesRead", s1.bytesRead - s0.bytesRead, 0 );
+		PUT_INT( "cacheRequests", s1.reqRead - s0.reqRead, 0 );
+		PUT_INT( "cacheMisses", s1.miss - s0.miss, 0 );
+		PUT_INT( "diskReads", s1.diskRead - s0.diskRead, 0 );
+		PUT_INT( "readAheadBlocks", s1.readAhead - s0.readAhead, 0 );
+		HEAD( "phases" );
+		fputs( plist ? "\n\t<array>\n" : "[\n", fp );
+	}
+
+	for (i = 0; i < gStats.count; i++) {
+		const char *indent = "\t\t\t";
+
+		phase = &gStats.phases[i];
+		fputs( plist ? "\t\t<dict>\n" : "\t\t{\n", fp );
+		PUT_STR( "name", phase->name, 0 );
+		PUT_INT( "pass", phase->pass, 0 );
+		PUT_REAL( "wallTime", phase->wallTime, 0 );
+		PUT_REAL( "userTime", phase->userTime, 0 );
+		PUT_REAL( "systemTime", phase->sysTime, 0 );
+		PUT_INT( "bytesRead", phase->bytesRead, 0 );
+		PUT_INT( "cacheRequests", phase->cacheRequests, 0 );
+		PUT_INT( "cacheMisses", phase->cacheMisses, 0 );
+		PUT_INT( "diskReads", phase->diskReads, 0 );
+		PUT_INT( "readAheadBlocks", phase->readAhead, 0 );
+		PUT_INT( "nodesVisited", phase->nodesVisited, 0 );
+		PUT_INT( "recordsVisited", phase->recordsVisited, 0 );
+		PUT_INT( "progress", phase->progress, 0 );
+		PUT_INT( "newRepairOrders", phase->newRepairOrders, 1 );
+		if (plist)
+			fputs( "\t\t</dict>\n", fp );
+		else
+			fputs( i + 1 < gStats.count ? "\t\t},\n" : "\t\t}\n", fp );
+	}
+
+	fputs( plist ? "\t</array>\n</dict>\n</plist>\n" : "\t]\n}\n", fp );
+
+#undef PUT_STR
+#undef PUT_REAL
+#undef PUT_INT
+#undef TAIL
+#undef HEAD
+
+	if (fflush( fp ) != 0 || ferror( fp ))
+		err = errno ? errno : EIO;
+	if (fp != stdout && fclose( fp ) != 0 && err == 0)
+		err = errno;
+
+	return err;
+}
+
+
+static void TakeSample( StatsSample *s )
+{
+	struct rusage	ru;
+
+	clock_gettime( CLOCK_MONOTONIC, &s->wall );
+	if (getrusage( RUSAGE_SELF, &ru ) == 0) {
+		s->user = ru.ru_utime;
+		s->sys = ru.ru_stime;
+	} else {
+		timerclear( &s->user );
+		timerclear( &s->sys );
+	}
+
+	/* The I/O threads may still be updating these */
+	s->bytesRead = __atomic_load_n( &fscache.BytesRead, __ATOMIC_RELAXED );
+	s->reqRead   = __atomic_load_n( &fscache.ReqRead, __ATOMIC_RELAXED );
+	s->miss      = __atomic_load_n( &fscache.Miss, __ATOMIC_RELAXED );
+	s->diskRead  = __atomic_load_n( &fscache.DiskRead, __ATOMIC_RELAXED );
+	s->readAhead = __atomic_load_n( &fscache.ReadAhead, __ATOMIC_RELAXED );
+}
+
+
+/* Write a quoted JSON string or a plist <string>, escaped as needed */
+static void PutString( FILE *fp, const char *s, int plist )
+{
+	fputs( plist ? "<string>" : "\"", fp );
+	for (; *s; s++) {
+		if (plist) {
+			switch (*s) {
+			case '&':	fputs( "&amp;", fp );	break;
+			case '<':	fputs( "&lt;", fp );	break;
+			case '>':	fputs( "&gt;", fp );	break;
+			default:	fputc( *s, fp );		break;
+			}
+		} else if (*s == '"' || *s == '\\') {
+			fprintf( fp, "\\%c", *s );
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf( fp, "\\u%04x", (unsigned char)*s );
+		} else {
+			fputc( *s, fp );
+		}
+	}
+	fputs( plist ? "</string>" : "\"", fp );
+}
@@ -441,6 +441,7 @@ RepairOrderPtr AllocMinorRepairOrder( SGlobPtr GPtr, size_t n )						/* #extra b
 	{
 		p->link = GPtr->MinorRepairsP;			//	then link into list of repairs
 		GPtr->MinorRepairsP = p;
+		GPtr->minorRepairsQueued++;
 	}
     else if ( fsckGetVerbosity(GPtr->context) >= kDebugLog )
        	plog( "\t%s - AllocateClearMemory failed to allocate %d bytes \n", __FUNCTION__, n);
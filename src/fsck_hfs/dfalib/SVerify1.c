@@ -41,6 +41,7 @@
 #include <limits.h>
 
 #include <sys/endian.h>
+#include <hfs/hfs_cksum.h>
 #define SW16(x)	be16toh(x)
 #define	SW32(x)	be32toh(x)
 #define	SW64(x)	be64toh(x)
@@ -63,8 +64,6 @@ static OSErr	SeekVolumeHeader( SGlobPtr GPtr, UInt64 startSector, UInt32 numSect
 /* overlapping extents verification functions prototype */
 static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrName, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType );
 
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo);
-
 static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType); 
 
 static void CheckHFSExtentRecords(SGlobPtr GPtr, UInt32 fileID, HFSExtentRecord extent, UInt8 forkType);
@@ -273,21 +272,6 @@ out:
 	return (result);
 }
 
-/*
- * Journal checksum calculation, taken directly from TN1150.
- */
-static int
-calc_checksum(unsigned char *ptr, int len)
-{
-    int i, cksum=0;
-
-    for(i=0; i < len; i++, ptr++) {
-        cksum = (cksum << 8) ^ (cksum + *ptr);
-    }
-
-    return (~cksum);
-}
-
 /*
  * The journal_header structure is not defined in <hfs/hfs_format.h>;
  * it's described in TN1150.  It is on disk in the endian mode that was
@@ -404,7 +388,7 @@ IsJournalEmpty(SGlobPtr GPtr, fsckJournalInfo_t *jp)
 						UInt32 calc_sum;
 						jhdr->checksum = 0;
 						/* Checksum calculation needs the checksum field to be zero. */
-						calc_sum = calc_checksum((unsigned char*)jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+						calc_sum = hfs_jnl_cksum(jhdr, JOURNAL_HEADER_CKSUM_SIZE);
 						/* But, for now, this is for debugging purposes only */
 						if (calc_sum != cksum) {
 							if (debug)
@@ -3961,8 +3945,16 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	size_t			newHandleSize;
 	ExtentInfo		extentInfo;
 	ExtentsTable	**extentsTableH;
+	int				err;
 	size_t attrlen;
 	
+	if ( GPtr->overlapIndex == NULL )
+	{
+		GPtr->overlapIndex = OverlapIndexCreate();
+		if ( GPtr->overlapIndex == NULL )
+			return( memFullErr );
+	}
+
 	ClearMemory(&extentInfo, sizeof(extentInfo));
 	extentInfo.fileID		= fileNumber;
 	extentInfo.startBlock	= extentStartBlock;
@@ -3980,6 +3972,16 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 		strlcpy(extentInfo.attrname, attrname, attrlen);
 	}
 	
+	//	Already in the list?  The index keeps the name, which the list owns.
+	err = OverlapIndexAdd( GPtr->overlapIndex, fileNumber, extentInfo.attrname,
+						   extentStartBlock, extentBlockCount, forkType );
+	if ( err != 0 )
+	{
+		if ( extentInfo.attrname != NULL )
+			free( extentInfo.attrname );
+		return( err == EEXIST ? noErr : memFullErr );
+	}
+
 	//	If it's uninitialized
 	if ( GPtr->overlappedExtents == nil )
 	{
@@ -3990,9 +3992,6 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	{
 		extentsTableH	= GPtr->overlappedExtents;
 
-		if ( ExtentInfoExists( extentsTableH, &extentInfo) == true )
-			return( noErr );
-
 		//	Grow the Extents table for a new entry.
 		newHandleSize = ( sizeof(ExtentInfo) ) + ( GetHandleSize( (Handle)extentsTableH ) );
 		SetHandleSize( (Handle)extentsTableH, newHandleSize );
@@ -4011,53 +4010,34 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 }
 
 
-/* Compare if the given extentInfo exsists in the extents table */
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo)
+/*
+ * Release the overlapped extents list, its attribute names and its index.
+ */
+void DisposeOverlapList( SGlobPtr GPtr )
 {
-	UInt32		i;
-	ExtentInfo	*aryExtentInfo;
-	
+	ExtentsTable	**extentsTableH;
+	UInt32			i;
 
-	for ( i = 0 ; i < (**extentsTableH).count ; i++ )
+	if ( GPtr->overlappedExtents != nil )
 	{
-		aryExtentInfo	= &((**extentsTableH).extentInfo[i]);
-		
-		if ( extentInfo->fileID == aryExtentInfo->fileID )
-		{
-			if (	(extentInfo->startBlock == aryExtentInfo->startBlock)	&& 
-					(extentInfo->blockCount == aryExtentInfo->blockCount)	&&
-					(extentInfo->forkType	== aryExtentInfo->forkType)		)
-			{
-				/* startBlock, blockCount, forkType are same.  
-				 * Compare the extended attribute names, if they exist.
-				 */
-
-				/* If no attribute name exists, the two extents are same */
-				if ((extentInfo->attrname == NULL) &&
-					(aryExtentInfo->attrname == NULL)) {
-					return(true);
-				}
-
-				/* If only one attribute name exists, the two extents are not same */
-				if (((extentInfo->attrname != NULL) && (aryExtentInfo->attrname == NULL)) ||
-					((extentInfo->attrname == NULL) && (aryExtentInfo->attrname != NULL))) {
-					return(false);
-				}
+		extentsTableH = GPtr->overlappedExtents;
 
-				/* Both attribute name exist.  Compare the names */
-				if (!strcmp(extentInfo->attrname, aryExtentInfo->attrname)) {
-					return (true);
-				} else {
-					return (false);
-				}
-
-			}
+		/* Overlapped extents list also allocated memory for attribute name */
+		for ( i = 0; i < (**extentsTableH).count; i++ )
+		{
+			if ( (**extentsTableH).extentInfo[i].attrname != NULL )
+				free( (**extentsTableH).extentInfo[i].attrname );
 		}
+
+		DisposeHandle( (Handle) GPtr->overlappedExtents );
+		GPtr->overlappedExtents = nil;
 	}
-	
-	return( false );
+
+	OverlapIndexDispose( GPtr->overlapIndex );
+	GPtr->overlapIndex = NULL;
 }
 
+
 /* Function :  DoesOverlap
  * 
  * Description: 
@@ -4080,26 +4060,11 @@ static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *exten
  */
 static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType) 
 {
-	int i;
 	Boolean isOverlapped = false;
-	ExtentInfo	*curExtentInfo;
-	ExtentsTable **extentsTableH = GPtr->overlappedExtents;
-
-	for (i = 0; i < (**extentsTableH).count; i++) {
-		curExtentInfo = &((**extentsTableH).extentInfo[i]);
-		/* Check extents */
-		if (curExtentInfo->startBlock < startBlock) {
-			if ((curExtentInfo->startBlock + curExtentInfo->blockCount) > startBlock) {
-				isOverlapped = true;
-				break;
-			}
-		} else {	/* curExtentInfo->startBlock >= startBlock */
-			if (curExtentInfo->startBlock < (startBlock + blockCount)) {
-				isOverlapped = true;
-				break;
-			}
-		}
-	} /* for loop Extents Table */	
+
+	if (GPtr->overlapIndex != NULL) {
+		isOverlapped = OverlapIndexOverlaps(GPtr->overlapIndex, startBlock, blockCount);
+	}
 
 	/* Add this extent to overlap list */
 	if (isOverlapped) {
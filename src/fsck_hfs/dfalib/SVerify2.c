@@ -41,6 +41,8 @@
 
 //	Prototypes for internal subroutines
 static int BTKeyChk( SGlobPtr GPtr, NodeDescPtr nodeP, BTreeControlBlock *btcb );
+static int BTCheckSplitNodes( SGlobPtr GPtr, BTreeControlBlock *calculatedBTCB, UInt16 nodeSize, UInt16 *statusFlag );
+static Boolean BTCheckScanned( SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord, int *result );
 
 
 /*------------------------------------------------------------------------------
@@ -249,6 +251,10 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 		goto exit;
 	}
 
+	/* With -j the structure may already have been checked on a worker */
+	if ( BTCheckScanned( GPtr, refNum, checkLeafRecord, &result ) )
+		goto exit;
+
 	GPtr->TarBlock = 0;
 
 	/*
@@ -346,73 +352,15 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 	 *
 	 * If debug is set, then it continues examining the tree; otherwise,
 	 * it exits with a rebuilt error.
+	 *
+	 * A worker thread (SPhase.c) leaves this to the main thread, since
+	 * it searches the extents B-tree and reads the volume header.
 	 */
-	if (CheckIfJournaled(GPtr, true) &&
-	    header->nodeSize > calculatedBTCB->fcbPtr->fcbVolume->vcbBlockSize) {
-		/* If it's journaled, it's HFS+ */
-		HFSPlusExtentRecord *extp = &calculatedBTCB->fcbPtr->fcbExtents32;
-		int i;
-		int blocksPerNode = header->nodeSize / calculatedBTCB->fcbPtr->fcbVolume->vcbBlockSize;	// How many blocks in a node
-		UInt32 totalBlocks = 0;
-		
-		/*
-		 * First, go through the first 8 extents
-		 */
-		for (i = 0; i < kHFSPlusExtentDensity; i++) {
-			if (((*extp)[i].blockCount % blocksPerNode) != 0) {
-				result = errRebuildBtree;
-				*statusFlag |= S_RebuildBTree;
-				fsckPrint(GPtr->context, E_BTreeSplitNode, calculatedBTCB->fcbPtr->fcbFileID);
-				if (debug == 0) {
-					goto exit;
-				} else {
-					plog("Improperly split node in file id %u, offset %u (extent #%d), Extent <%u, %u>\n", calculatedBTCB->fcbPtr->fcbFileID, totalBlocks, i, (*extp)[i].startBlock, (*extp)[i].blockCount);
-				}
-			}
-			totalBlocks += (*extp)[i].blockCount;
-
-		}
-		/*
-		 * Now, iterate through the extents overflow file if necessary.
-		 * Style note:  This is in a block so I can have local variables.
-		 * It used to have a conditional, but that wasn't needed.
-		 */
-		{
-			int err;
-			BTreeIterator iterator = { 0 };
-			FSBufferDescriptor btRecord = { 0 };
-			HFSPlusExtentKey *key = (HFSPlusExtentKey*)&iterator.key;
-			HFSPlusExtentRecord extRecord = { 0 };
-			UInt16	recordSize;
-			UInt32	fileID = calculatedBTCB->fcbPtr->fcbFileID;
-			static const int kDataForkType = 0;
-
-			BuildExtentKey( true, kDataForkType, fileID, 0, (void*)key );
-			btRecord.bufferAddress = &extRecord;
-			btRecord.itemCount = 1;
-			btRecord.itemSize = sizeof(extRecord);
-
-			while (noErr == (err = BTIterateRecord(GPtr->calculatedExtentsFCB, kBTreeNextRecord, &iterator, &btRecord, &recordSize))) {
-				if (key->fileID != fileID ||
-				    key->forkType != kDataForkType) {
-					break;
-				}
-				for (i = 0; i < kHFSPlusExtentDensity; i++) {
-					if ((extRecord[i].blockCount % blocksPerNode) != 0) {
-						result = errRebuildBtree;
-						*statusFlag |= S_RebuildBTree;
-						fsckPrint(GPtr->context, E_BTreeSplitNode, fileID);
-						if (debug == 0) {
-							goto exit;
-						} else {
-							plog("Improperly split node in file id %u, startBlock %u, index %d (offset %u), extent <%u, %u>\n", fileID, key->startBlock, i, totalBlocks, extRecord[i].startBlock, extRecord[i].blockCount);
-						}
-					}
-					totalBlocks += extRecord[i].blockCount;
-				}
-				memset(&extRecord, 0, sizeof(extRecord));
-			}
-		}
+	if ( GPtr->phaseScan == NULL )
+	{
+		result = BTCheckSplitNodes( GPtr, calculatedBTCB, header->nodeSize, statusFlag );
+		if ( result != noErr && debug == 0 )
+			goto exit;
 	}
 
 #if 0
@@ -617,6 +565,7 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 			}
 			
 			GPtr->itemsProcessed++;
+			GPtr->btreeNodesVisited++;
 		}
 		
 		numRecs = nodeDescP->numRecords;
@@ -737,6 +686,14 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 			if ( tprP->TPRRtSib == 0 )
 				calculatedBTCB->lastLeafNode = nodeNum;
 			leafRecords	+= nodeDescP->numRecords;
+			GPtr->btreeRecordsVisited += nodeDescP->numRecords;
+
+			/* A worker hands the leaf order to the main thread */
+			if ( GPtr->phaseScan != NULL && AddPhaseScanLeaf( GPtr, nodeNum ) != noErr )
+			{
+				result = R_NoMem;
+				goto exit;
+			}
 
 			if (checkLeafRecord != NULL) {
 				/* For total number of records in this leaf node, get each record sequentially 
@@ -777,6 +734,203 @@ RebuildBTreeExit:
 
 
 
+/*------------------------------------------------------------------------------
+
+Routine:	BTCheckSplitNodes
+
+Function:	On a journaled HFS+ volume, checks that no node of the B-tree is
+			split across two extents of its file, looking at the extents in
+			the FCB and then at those in the extents B-tree.
+
+			With a status flag, the error is recorded and reported, and with
+			debug set every such extent is logged.  Without one it only
+			returns the result.
+
+Input:		GPtr		-	pointer to scavenger global area
+			calculatedBTCB	-	B-tree to check
+			nodeSize	-	node size from the B-tree header
+			statusFlag	-	B-tree status flags, or NULL
+
+Output:		BTCheckSplitNodes	-	function result:
+			0	= no error
+			errRebuildBtree = a node is split
+------------------------------------------------------------------------------*/
+
+static int
+BTCheckSplitNodes(SGlobPtr GPtr, BTreeControlBlock *calculatedBTCB, UInt16 nodeSize, UInt16 *statusFlag)
+{
+	int result = noErr;
+
+	if (CheckIfJournaled(GPtr, true) &&
+	    nodeSize > calculatedBTCB->fcbPtr->fcbVolume->vcbBlockSize) {
+		/* If it's journaled, it's HFS+ */
+		HFSPlusExtentRecord *extp = &calculatedBTCB->fcbPtr->fcbExtents32;
+		int i;
+		int blocksPerNode = nodeSize / calculatedBTCB->fcbPtr->fcbVolume->vcbBlockSize;	// How many blocks in a node
+		UInt32 totalBlocks = 0;
+		
+		/*
+		 * First, go through the first 8 extents
+		 */
+		for (i = 0; i < kHFSPlusExtentDensity; i++) {
+			if (((*extp)[i].blockCount % blocksPerNode) != 0) {
+				result = errRebuildBtree;
+				if (statusFlag == NULL)
+					return result;
+				*statusFlag |= S_RebuildBTree;
+				fsckPrint(GPtr->context, E_BTreeSplitNode, calculatedBTCB->fcbPtr->fcbFileID);
+				if (debug == 0) {
+					return result;
+				} else {
+					plog("Improperly split node in file id %u, offset %u (extent #%d), Extent <%u, %u>\n", calculatedBTCB->fcbPtr->fcbFileID, totalBlocks, i, (*extp)[i].startBlock, (*extp)[i].blockCount);
+				}
+			}
+			totalBlocks += (*extp)[i].blockCount;
+
+		}
+		/*
+		 * Now, iterate through the extents overflow file if necessary.
+		 * Style note:  This is in a block so I can have local variables.
+		 * It used to have a conditional, but that wasn't needed.
+		 */
+		{
+			int err;
+			BTreeIterator iterator = { 0 };
+			FSBufferDescriptor btRecord = { 0 };
+			HFSPlusExtentKey *key = (HFSPlusExtentKey*)&iterator.key;
+			HFSPlusExtentRecord extRecord = { 0 };
+			UInt16	recordSize;
+			UInt32	fileID = calculatedBTCB->fcbPtr->fcbFileID;
+			static const int kDataForkType = 0;
+
+			BuildExtentKey( true, kDataForkType, fileID, 0, (void*)key );
+			btRecord.bufferAddress = &extRecord;
+			btRecord.itemCount = 1;
+			btRecord.itemSize = sizeof(extRecord);
+
+			while (noErr == (err = BTIterateRecord(GPtr->calculatedExtentsFCB, kBTreeNextRecord, &iterator, &btRecord, &recordSize))) {
+				if (key->fileID != fileID ||
+				    key->forkType != kDataForkType) {
+					break;
+				}
+				for (i = 0; i < kHFSPlusExtentDensity; i++) {
+					if ((extRecord[i].blockCount % blocksPerNode) != 0) {
+						result = errRebuildBtree;
+						if (statusFlag == NULL)
+							return result;
+						*statusFlag |= S_RebuildBTree;
+						fsckPrint(GPtr->context, E_BTreeSplitNode, fileID);
+						if (debug == 0) {
+							return result;
+						} else {
+							plog("Improperly split node in file id %u, startBlock %u, index %d (offset %u), extent <%u, %u>\n", fileID, key->startBlock, i, totalBlocks, extRecord[i].startBlock, extRecord[i].blockCount);
+						}
+					}
+					totalBlocks += extRecord[i].blockCount;
+				}
+				memset(&extRecord, 0, sizeof(extRecord));
+			}
+		}
+	}
+
+	return result;
+}
+
+
+/*------------------------------------------------------------------------------
+
+Routine:	BTCheckScanned
+
+Function:	The rest of BTCheck for a tree whose structure was already
+			checked, without finding anything, by ParallelScanBTrees.  Runs
+			the split node check the worker left out, takes the scan over,
+			and passes the leaf records to checkLeafRecord in the order the
+			traversal visits them.
+
+			Returns false, having changed nothing, when there is no clean scan
+			or the split node check fails; BTCheck then checks the tree the
+			usual way, which finds and reports the problem.
+
+Input:		GPtr		-	pointer to scavenger global area
+			refNum		-	file refnum
+			checkLeafRecord -	function to call for every leaf record
+
+Output:		result		-	BTCheck result, if it returns true
+------------------------------------------------------------------------------*/
+
+static Boolean
+BTCheckScanned(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord, int *result)
+{
+	BTreeControlBlock	*calculatedBTCB	= GetBTreeControlBlock( refNum );
+	NodeRec			node;
+	NodeDescPtr		nodeDescP;
+	BTHeaderRec		*header;
+	UInt16			nodeSize;
+	UInt32			*leaves;
+	UInt32			leafCount;
+	UInt32			n;
+	short			i;
+	KeyPtr			keyPtr;
+	UInt8			*dataPtr;
+	UInt16			recSize;
+	int			err;
+
+	if ( GPtr->phaseScan != NULL || !PhaseScanClean( GPtr, refNum ) )
+		return false;
+
+	if ( GetNode( calculatedBTCB, kHeaderNodeNum, &node ) != noErr )
+		return false;
+	header = (BTHeaderRec*) ((Byte*)node.buffer + sizeof(BTNodeDescriptor));
+	nodeSize = header->nodeSize;
+	(void) ReleaseNode( calculatedBTCB, &node );
+
+	if ( BTCheckSplitNodes( GPtr, calculatedBTCB, nodeSize, NULL ) != noErr )
+		return false;
+	if ( !TakePhaseScan( GPtr, refNum, &leaves, &leafCount ) )
+		return false;
+
+	/* The worker's nodes and records were counted when it was taken over */
+	err = noErr;
+	for ( n = 0; checkLeafRecord != NULL && n < leafCount; n++ )
+	{
+		GPtr->TarBlock = leaves[n];
+		err = GetNode( calculatedBTCB, leaves[n], &node );
+		if ( err != noErr )
+		{
+			if ( err == fsBTInvalidNodeErr )	/* hfs_swap_BTNode failed */
+			{
+				RcdError( GPtr, E_BadNode );
+				err = E_BadNode;
+			}
+			break;
+		}
+		nodeDescP = node.buffer;
+		for ( i = 0; i < nodeDescP->numRecords; i++ )
+		{
+			GetRecordByIndex( calculatedBTCB, nodeDescP, i, &keyPtr, &dataPtr, &recSize );
+			err = checkLeafRecord( GPtr, keyPtr, dataPtr, recSize );
+			if ( err ) break;
+		}
+		(void) ReleaseNode( calculatedBTCB, &node );
+		if ( err == noErr )
+			err = CheckForStop( GPtr );
+		if ( err ) break;
+	}
+
+	/* The traversal finishes back at the root */
+	if ( err == noErr )
+	{
+		GPtr->TarBlock = calculatedBTCB->rootNode;
+		if ( calculatedBTCB->rootNode != 0 )
+			GPtr->BTLevel = 0;
+	}
+
+	*result = err;
+	return true;
+}
+
+
+
 /*------------------------------------------------------------------------------
 
 Routine:	BTMapChk - (BTree Map Check)
@@ -32,6 +32,7 @@
 #include "BTreePrivate.h"
 #include "CheckHFS.h"
 #include "BTreeScanner.h"
+#include "OverlapIndex.h"
 #include "hfs_endian.h"
 #include "../fsck_debug.h"
 #include "../fsck_messages.h"
@@ -700,6 +701,8 @@ typedef struct SGlob {
 	UInt64				TarBlock;				//	target block/node number being verified
 	SInt16				BTLevel;				//	current BTree enumeration level
 	SBTPT				*BTPTPtr;				//	BTree path table pointer
+	struct PhaseScanSet	*phaseScans;			//	B-tree scans run ahead on worker threads (-j)
+	struct PhaseScan	*phaseScan;			//	on a worker's copy of the globals, the scan it runs
 	SInt16				DirLevel;				//	current directory enumeration level
 	SDPR				*DirPTPtr;				//	directory path table pointer (pointer to array of SDPR)
 	uint32_t			dirPathCount;			//  number of SDPR entries allocated in directory path table
@@ -707,11 +710,13 @@ typedef struct SGlob {
 	UInt32				ParID;					//	current parent DirID
 	CatalogName			CName;					//	current CName
 	RepairOrderPtr		MinorRepairsP;			//	ptr to list of problems for later repair
+	UInt32				minorRepairsQueued;		//	number of orders ever put on MinorRepairsP
 	MissingThread		*missingThreadList;
 	Ptr 				FCBAPtr;				//	pointer to scavenger FCB array
 	UInt32				**validFilesList;		//	List of valid HFS file IDs
 
 	ExtentsTable		**overlappedExtents;	//	List of overlapped extents
+	OverlapIndex		*overlapIndex;			//	Index over overlappedExtents
 	FileIdentifierTable	**fileIdentifierTable;	//	List of files for post processing
 
 	UInt32				inputFlags;				//	Caller can specify some DFA behaviors
@@ -731,6 +736,8 @@ typedef struct SGlob {
 	UInt64				onePercent;
 	UInt64				itemsToProcess;
 	UInt64				itemsProcessed;
+	UInt64				btreeNodesVisited;		//	B-tree nodes walked by the checks and rebuilds
+	UInt64				btreeRecordsVisited;	//	and the leaf records in them
 	UInt64				lastProgress;
 	long				startTicks;
 	UInt16				secondsRemaining;
@@ -962,6 +969,15 @@ void			ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes );
 
 extern	short	CheckForStop( SGlobPtr GPtr );
 
+/* ------------------------------- From SPhase.c -------------------------------- */
+
+extern	int		ParallelPrefetchBTrees( SGlobPtr GPtr, int jobs );
+extern	int		ParallelScanBTrees( SGlobPtr GPtr, int jobs );
+extern	Boolean	PhaseScanClean( SGlobPtr GPtr, short refNum );
+extern	Boolean	TakePhaseScan( SGlobPtr GPtr, short refNum, UInt32 **leaves, UInt32 *leafCount );
+extern	int		AddPhaseScanLeaf( SGlobPtr GPtr, UInt32 nodeNum );
+extern	void	DisposePhaseScans( SGlobPtr GPtr );
+
 
 /* ------------------------------- From SRepair.c -------------------------------- */
 
@@ -1093,6 +1109,8 @@ extern  int FindOrigOverlapFiles(SGlobPtr GPtr);
 
 extern  void PrintOverlapFiles (SGlobPtr GPtr);
 
+extern  void DisposeOverlapList(SGlobPtr GPtr);
+
 /* ------------------------------- From SVerify2.c -------------------------------- */
 
 typedef int (* CheckLeafRecordProcPtr)(SGlobPtr GPtr, void *key, void *record, UInt16 recordLen);
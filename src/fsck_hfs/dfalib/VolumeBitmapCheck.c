@@ -22,21 +22,18 @@
  */
 
 /* Summary for in-memory volume bitmap:
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
- *	1. Full if the coresponding segment map bit is set
- *	2. Empty (implied)
+ * A table indexed by segment number holds the state of every bitmap
+ * segment.  An entry is either
+ *	1. NULL if the segment is empty
+ *	2. gFullBitmapSegment if the segment is full
+ *	3. a private copy of the segment if it is partially full
  */
 
 
 #include "Scavenger.h"
 
 #include <sys/disk.h>
-
-#include <bitstring.h>
-
-#define	bit_dealloc(p)	free(p)
+#include <hfs/hfs_bitmap.h>
 
 #define _VBC_DEBUG_	0
 
@@ -49,15 +46,13 @@ enum {
 
 	kBitsWithinWordMask	= kBitsPerWord-1,
 	kBitsWithinSegmentMask	= kBitsPerSegment-1,
+
+	kBitmapPrefetchSize	= 1024 * 1024,	/* allocation file read ahead of the compare */
 	
-	kBMS_NodesPerPool	= 450,
-	kBMS_PoolMax		= 2000
+	kBMS_SegmentsPerPool	= 512		/* 64K of partially full segments */
 };
 
 
-#define kAllBitsSetInWord	0xFFFFFFFFu
-#define kMSBBitSetInWord	0x80000000u
-
 enum {
 	kSettingBits		= 1,
 	kClearingBits		= 2,
@@ -70,10 +65,10 @@ enum {
 int gBitMapInited = 0;
 
 /*
- * Bitmap segments that are full are marked in
- * the gFullSegmentList (a bit string).
+ * Bitmap Segment (BMS) Table
+ * One entry per bitmap segment, see the summary above.
  */
-bitstr_t* gFullSegmentList;
+UInt32**  gSegmentTable;
 UInt32    gBitsMarked;
 UInt32    gTotalBits;
 UInt32    gTotalSegments;
@@ -81,37 +76,24 @@ UInt32*   gFullBitmapSegment;   /* points to a FULL bitmap segment*/
 UInt32*   gEmptyBitmapSegment;  /* points to an EMPTY bitmap segment*/
 
 /*
- * Bitmap Segment (BMS) Tree node
- * Bitmap segments that are partially full are
- * saved in the BMS Tree.
+ * Partially full segments are carved out of pools; free
+ * ones are chained through their first bytes.
  */
-typedef struct BMS_Node {
-	struct BMS_Node *left;
-	struct BMS_Node *right;
-	UInt32 segment;
-	UInt32 bitmap[kWordsPerSegment];
-} BMS_Node;
-
-BMS_Node *gBMS_Root;           /* root of BMS tree */
-BMS_Node *gBMS_FreeNodes;      /* list of free BMS nodes */
-BMS_Node *gBMS_PoolList[kBMS_PoolMax];  /* list of BMS node pools */
-int gBMS_PoolCount;            /* count of pools allocated */
+UInt32*   gBMS_FreeSegments;    /* list of free segments */
+UInt32**  gBMS_PoolList;        /* list of segment pools */
+int       gBMS_PoolCount;       /* count of pools allocated */
 
 /* Bitmap operations routines */
 static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBlock);
+static Boolean SetSegmentBits(UInt32 *buffer, UInt32 firstBit, UInt32 numBits);
+static Boolean ClearSegmentBits(UInt32 *buffer, UInt32 firstBit, UInt32 numBits);
 
-/* Segment Tree routines (binary search tree) */
-static int        BMS_InitTree(void);
-static int        BMS_DisposeTree(void);
-static BMS_Node * BMS_Lookup(UInt32 segment);
-static BMS_Node * BMS_Insert(UInt32 segment, int segmentType);
-static BMS_Node * BMS_Delete(UInt32 segment);
-static void	  BMS_GrowNodePool(void);
-
-#if _VBC_DEBUG_
-static void       BMS_PrintTree(BMS_Node * root);
-static void       BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth);
-#endif
+/* Segment Table routines */
+static int        BMS_InitTable(void);
+static void       BMS_DisposeTable(void);
+static UInt32 *   BMS_AllocSegment(int segmentType);
+static void       BMS_FreeSegment(UInt32 *buffer);
+static void       BMS_GrowSegmentPool(void);
 
 /*
  * Initialize our volume bitmap data structures
@@ -125,21 +107,20 @@ int BitMapCheckBegin(SGlobPtr g)
 
 	isHFSPlus = VolumeObjectIsHFSPlus( );
 
-	gFullBitmapSegment = (UInt32 *)malloc(kBytesPerSegment);
-	memset((void *)gFullBitmapSegment, 0xff, kBytesPerSegment);
-
-	gEmptyBitmapSegment = (UInt32 *)malloc(kBytesPerSegment);
-	memset((void *)gEmptyBitmapSegment, 0x00, kBytesPerSegment);
-
 	gTotalBits = g->calculatedVCB->vcbTotalBlocks;
 	gTotalSegments = (gTotalBits / kBitsPerSegment);
 	if (gTotalBits % kBitsPerSegment)
 		++gTotalSegments;
 
-	gFullSegmentList = bit_alloc(gTotalSegments);
-	bit_nclear(gFullSegmentList, 0, gTotalSegments - 1);
+	if (BMS_InitTable() != 0)
+		return (R_NoMem);
+
+	gFullBitmapSegment = (UInt32 *)malloc(kBytesPerSegment);
+	memset((void *)gFullBitmapSegment, 0xff, kBytesPerSegment);
+
+	gEmptyBitmapSegment = (UInt32 *)malloc(kBytesPerSegment);
+	memset((void *)gEmptyBitmapSegment, 0x00, kBytesPerSegment);
 
-	BMS_InitTree();
 	gBitMapInited = 1;
 	gBitsMarked = 0;
 
@@ -179,11 +160,8 @@ int BitMapCheckEnd(void)
 {
 	if (gBitMapInited) {
 #if _VBC_DEBUG_
-		int maxdepth = 0;
-
-		BMS_MaxDepth(gBMS_Root, 0, &maxdepth);
-		plog("   %d full segments, %d segment nodes (max depth was %d nodes)\n",
-		       gFullSegments, gSegmentNodes, maxdepth);
+		plog("   %d full segments, %d partial segments (%d pools)\n",
+		       gFullSegments, gSegmentNodes, gBMS_PoolCount);
 #endif
 		free(gFullBitmapSegment);
 		gFullBitmapSegment = NULL;
@@ -191,10 +169,7 @@ int BitMapCheckEnd(void)
 		free(gEmptyBitmapSegment);
 		gEmptyBitmapSegment = NULL;
 
-		bit_dealloc(gFullSegmentList);
-		gFullSegmentList = NULL;
-
-		BMS_DisposeTree();
+		BMS_DisposeTable();
 		gBitMapInited = 0;
 	}
 	return (0);
@@ -205,16 +180,15 @@ int BitMapCheckEnd(void)
  * Description: Return bitmap segment corresponding to given startBit.
  * 
  *	1. Calculate the segment number for given bit.
- *	2. If the segment exists in full segment list,
+ *	2. If the segment is full,
  *			If bitOperation is to clear bits, 
- *			a. Remove segment from full segment list.
- *			b. Insert a full segment in the bitmap tree.
+ *			replace it with a private full segment in the table.
  *			Else return pointer to dummy full segment
- *	3. If segment found in tree, it is partially full.  Return it.
- *	4. If (2) and (3) are not true, it is a empty segment.
+ *	3. If the segment is empty,
  *			If bitOperation is to set bits,
- *			a. Insert empty segment in the bitmap tree.
+ *			replace it with a private empty segment in the table.
  *			Else return pointer to dummy empty segment.
+ *	4. Otherwise it is partially full.  Return it.
  *
  * Input:	
  *	1. startBit - bit number (block number) to lookup
@@ -231,32 +205,33 @@ int BitMapCheckEnd(void)
 static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 {
 	UInt32 segment;
-	BMS_Node *segNode = NULL;
+	UInt32 *segBuffer;
 	
 	*buffer = NULL;
 	segment = startBit / kBitsPerSegment;
+	segBuffer = gSegmentTable[segment];
 
 	// for a full seqment...
-	if (bit_test(gFullSegmentList, segment)) {
+	if (segBuffer == gFullBitmapSegment) {
 		if (bitOperation == kClearingBits) {
-                    bit_clear(gFullSegmentList, segment);
-					--gFullSegments;
-                    if ((segNode = BMS_Insert(segment, kFullSegment)) != NULL)
-                        *buffer = &segNode->bitmap[0];
+			if ((*buffer = BMS_AllocSegment(kFullSegment)) != NULL) {
+				gSegmentTable[segment] = *buffer;
+				--gFullSegments;
+			}
 		} else
 			*buffer = gFullBitmapSegment;
 	
-	// for a  partially full segment..
-	} else if ((segNode = BMS_Lookup(segment)) != NULL) {
-			*buffer = &segNode->bitmap[0];
-	
 	// for an empty segment...
-	} else {
+	} else if (segBuffer == NULL) {
 		if (bitOperation == kSettingBits) { 
-			if ((segNode = BMS_Insert(segment, kEmptySegment)) != NULL)
-				*buffer = &segNode->bitmap[0];
+			if ((*buffer = BMS_AllocSegment(kEmptySegment)) != NULL)
+				gSegmentTable[segment] = *buffer;
 		} else	
 			*buffer = gEmptyBitmapSegment;
+
+	// for a  partially full segment..
+	} else {
+		*buffer = segBuffer;
 	}
 		
 	if (*buffer == NULL) {
@@ -267,18 +242,6 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 	}
 
 #if 0
-	if (segNode) {
-		int i;
-		plog("  segment %d: L=0x%08x, R=0x%08x \n< ",
-			(int)segNode->segment, (int)segNode->left, segNode->right);
-		for (i = 0; i < kWordsPerSegment; ++i) {
-			plog("0x%08x ", segNode->bitmap[i]);
-			if ((i & 0x3) == 0x3)
-				plog("\n  ");
-		}
-		plog("\n");
-	}
-
 	if (bitOperation == kSettingBits && *buffer && bcmp(*buffer, gFullBitmapSegment, kBytesPerSegment) == 0) {
 		plog("*** segment %d (start blk %d) is already full!\n", segment, startBit);
 		exit(5);
@@ -296,10 +259,10 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
  *
  * Description:  Test if the current bitmap segment is a full
  * segment or empty segment. 
- * If full segment, delete the segment, set corresponding full segment
- * bit in gFullSegmentList, and update counters.
- * If empty list, delete the segment from list.  Note that we update 
- * the counter only for debugging purposes.
+ * If full segment, free the segment and mark it full in the table.
+ * If empty segment, free the segment and mark it empty in the table.
+ * Partially full segments are therefore never all set or all clear.
+ * Note that we update the counters only for debugging purposes.
  *
  * Input: 
  *	startBit - startBit of segment to test
@@ -310,43 +273,56 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 void TestSegmentBitmap(UInt32 startBit)
 {
 	UInt32 segment;
-	BMS_Node *segNode = NULL;
+	UInt32 *segBuffer;
 
 	segment = startBit / kBitsPerSegment;
+	segBuffer = gSegmentTable[segment];
 
-	if (bit_test(gFullSegmentList, segment))
+	if (segBuffer == NULL || segBuffer == gFullBitmapSegment)
 		return;
 
-	if ((segNode = BMS_Lookup(segment)) != NULL) {
-#if 0
-		int i;
-		plog("> ");
-		for (i = 0; i < kWordsPerSegment; ++i) {
-			plog("0x%08x ", segNode->bitmap[i]);
-			if ((i & 0x3) == 0x3)
-				plog("\n  ");
-		}
-		plog("\n");
-#endif
-		if (segment != 0 && bcmp(&segNode->bitmap[0], gFullBitmapSegment, kBytesPerSegment) == 0) {
-			if (BMS_Delete(segment) != NULL) {
-				bit_set(gFullSegmentList, segment);
-				/* debugging stats */
-				++gFullSegments;
-				--gSegmentNodes;
-			}
-		}
-		
-		if (segment != 0 && bcmp(&segNode->bitmap[0], gEmptyBitmapSegment, kBytesPerSegment) == 0) {
-			if (BMS_Delete(segment) != NULL) {
-				/* debugging stats */
-				--gSegmentNodes;
-			}
-		}
+	if (bcmp(segBuffer, gFullBitmapSegment, kBytesPerSegment) == 0) {
+		BMS_FreeSegment(segBuffer);
+		gSegmentTable[segment] = gFullBitmapSegment;
+		/* debugging stats */
+		++gFullSegments;
+	} else if (bcmp(segBuffer, gEmptyBitmapSegment, kBytesPerSegment) == 0) {
+		BMS_FreeSegment(segBuffer);
+		gSegmentTable[segment] = NULL;
 	}
 }
 
 
+/* Function: SetSegmentBits
+ *
+ * Description: Set numBits bits of a private bitmap segment starting
+ * at bit firstBit of the segment.  All the bits must be within the
+ * segment.
+ *
+ * Output:
+ *	true if any of the bits was already set.
+ */
+static Boolean SetSegmentBits(UInt32 *buffer, UInt32 firstBit, UInt32 numBits)
+{
+	return hfs_bm_set(buffer, firstBit, numBits);
+}
+
+
+/* Function: ClearSegmentBits
+ *
+ * Description: Clear numBits bits of a private bitmap segment starting
+ * at bit firstBit of the segment.  All the bits must be within the
+ * segment.
+ *
+ * Output:
+ *	true if any of the bits was already clear.
+ */
+static Boolean ClearSegmentBits(UInt32 *buffer, UInt32 firstBit, UInt32 numBits)
+{
+	return hfs_bm_clear(buffer, firstBit, numBits);
+}
+
+
 /* Function: CaptureBitmapBits
  *
  * Description: Set bits in the segmented bitmap from startBit upto 
@@ -358,11 +334,11 @@ void TestSegmentBitmap(UInt32 startBit)
  * (which can be corrected using UpdateFreeBlockCount function).
  *
  * 1. Increment gBitsMarked with bitCount.
- * 2. If first bit does not start on word boundary, special case it.
- * 3. Set all whole words. 
- * 4. If not all bits in last word need to be set, special case it.
- * 5. For 2, 3, and 4, call TestSegmentBitmap after writing one segment or 
- * setting all bits to optimize full and empty segment list.
+ * 2. Work one bitmap segment at a time.
+ * 3. If all bits of the segment are to be set, just mark it full in the
+ * segment table; a partially full segment always has some bits set.
+ * 4. Otherwise set the bits with SetSegmentBits and call TestSegmentBitmap
+ * to optimize the full and empty segments.
  * 
  * Input:
  *	startBit - bit number in segment bitmap to start set operation.
@@ -376,18 +352,17 @@ int CaptureBitmapBits(UInt32 startBit, UInt32 bitCount)
 {
 	Boolean overlap;
 	OSErr   err;
-	UInt32  wordsLeft;
-	UInt32  bitMask;
+	UInt32  segment;
 	UInt32  firstBit;
 	UInt32  numBits;
 	UInt32  *buffer;
-	UInt32  *currentWord;
 
 	overlap = false;
+	err = noErr;
 	if (bitCount == 0)
 		return (0);
 
-	if ((startBit + bitCount) > gTotalBits) {
+	if (((UInt64)startBit + bitCount) > gTotalBits) {
 		err = vcInvalidExtentErr;
 		goto Exit;
 	}
@@ -395,106 +370,44 @@ int CaptureBitmapBits(UInt32 startBit, UInt32 bitCount)
 	/* count allocated bits */
 	gBitsMarked += bitCount;
 
-	/*
-	 * Get the bitmap segment containing the first word to check
-	 */
-	err = GetSegmentBitmap(startBit, &buffer, kSettingBits);
-	if (err != noErr) goto Exit;
-
-	/* Initialize buffer stuff */
-	{
-		UInt32 wordIndexInSegment;
-
-		wordIndexInSegment = (startBit & kBitsWithinSegmentMask) / kBitsPerWord;
-		currentWord = buffer + wordIndexInSegment;
-		wordsLeft = kWordsPerSegment - wordIndexInSegment;
-	}
-	
-	/*
-	 * If the first bit to check doesn't start on a word
-	 * boundary in the bitmap, then treat that first word
-	 * specially.
-	 */
-	firstBit = startBit % kBitsPerWord;
-	if (firstBit != 0) {
-		bitMask = kAllBitsSetInWord >> firstBit;  // turn off all bits before firstBit
-		numBits = kBitsPerWord - firstBit;	// number of remaining bits in this word
-		if (numBits > bitCount) {
-			numBits = bitCount;	// entire allocation is inside this one word
-			bitMask &= ~(kAllBitsSetInWord >> (firstBit + numBits)); // turn off bits after last
-		}
-
-		if (SWAP_BE32(*currentWord) & bitMask) {
-			overlap = true;
-
-			//plog("(1) overlapping file blocks! word: 0x%08x, mask: 0x%08x\n", *currentWord, bitMask);
-		}
-		
-		*currentWord |= SWAP_BE32(bitMask);  /* set the bits in the bitmap */
-		
-		bitCount -= numBits;
-		++currentWord;
-		--wordsLeft;
-		if (wordsLeft == 0 || bitCount == 0)
-			TestSegmentBitmap(startBit);
-	}
-
-	/*
-	 * Set whole words (32 bits) at a time.
-	 */
-	bitMask = kAllBitsSetInWord;
-	while (bitCount >= kBitsPerWord) {
-		/* See if it's time to move to the next bitmap segment */
-		if (wordsLeft == 0) {
-			startBit += kBitsPerSegment;	 // generate a bit in the next bitmap segment
-			
+	while (bitCount != 0) {
+		segment = startBit / kBitsPerSegment;
+		firstBit = startBit & kBitsWithinSegmentMask;
+		numBits = kBitsPerSegment - firstBit;
+		if (numBits > bitCount)
+			numBits = bitCount;
+
+		if (numBits == kBitsPerSegment) {
+			/* The whole segment becomes full */
+			buffer = gSegmentTable[segment];
+			if (buffer == gFullBitmapSegment) {
+				overlap = true;
+			} else {
+				if (buffer != NULL) {
+					overlap = true;
+					BMS_FreeSegment(buffer);
+				}
+				gSegmentTable[segment] = gFullBitmapSegment;
+				++gFullSegments;
+			}
+		} else {
 			err = GetSegmentBitmap(startBit, &buffer, kSettingBits);
 			if (err != noErr) goto Exit;
-			
-			// Readjust currentWord, wordsLeft
-			currentWord = buffer;
-			wordsLeft = kWordsPerSegment;
-		}
-		
-		if (SWAP_BE32(*currentWord) & bitMask) {
-			overlap = true;
 
-			//plog("(2) overlapping file blocks! word: 0x%08x, mask: 0x%08x\n", *currentWord, bitMask);
-		}
-		
-		*currentWord |= SWAP_BE32(bitMask);  /* set the bits in the bitmap */
-
-		bitCount -= kBitsPerWord;
-		++currentWord;
-		--wordsLeft;
-		if (wordsLeft == 0 || bitCount == 0)
-			TestSegmentBitmap(startBit);
-	}
-	
-	/*
-	 * Check any remaining bits.
-	 */
-	if (bitCount != 0) {
-		bitMask = ~(kAllBitsSetInWord >> bitCount);	// set first bitCount bits
-		if (wordsLeft == 0) {
-			startBit += kBitsPerSegment;
-			
-			err = GetSegmentBitmap(startBit, &buffer, kSettingBits);
-			if (err != noErr) goto Exit;
-			
-			currentWord = buffer;
-			wordsLeft = kWordsPerSegment;
-		}
-		
-		if (SWAP_BE32(*currentWord) & bitMask) {
-			overlap = true;
+			if (buffer == gFullBitmapSegment) {
+				overlap = true;
+			} else {
+				if (SetSegmentBits(buffer, firstBit, numBits)) {
+					overlap = true;
 
-			//plog("(3) overlapping file blocks! word: 0x%08x, mask: 0x%08x\n", *currentWord, bitMask);
+					//plog("overlapping file blocks! segment: %u\n", segment);
+				}
+				TestSegmentBitmap(startBit);
+			}
 		}
-		
-		*currentWord |= SWAP_BE32(bitMask);  /* set the bits in the bitmap */
 
-		TestSegmentBitmap(startBit);
+		startBit += numBits;
+		bitCount -= numBits;
 	}
 Exit:
 	return (overlap ? E_OvlExt : err);
@@ -512,11 +425,11 @@ Exit:
  * (which can be corrected using UpdateFreeBlockCount function).
  *
  * 1. Decrement gBitsMarked with bitCount.
- * 2. If first bit does not start on word boundary, special case it.
- * 3. Clear all whole words. 
- * 4. If partial bits in last word needs to be cleared, special case it.
- * 5. For 2, 3, and 4, call TestSegmentBitmap after writing one segment or 
- * clearing all bits to optimize full and empty segment list.
+ * 2. Work one bitmap segment at a time.
+ * 3. If all bits of the segment are to be cleared, just mark it empty in
+ * the segment table; a partially full segment always has some bits clear.
+ * 4. Otherwise clear the bits with ClearSegmentBits and call
+ * TestSegmentBitmap to optimize the full and empty segments.
  * 
  * Input:
  *	startBit - bit number in segment bitmap to start clear operation.
@@ -530,18 +443,17 @@ int ReleaseBitmapBits(UInt32 startBit, UInt32 bitCount)
 {
 	Boolean overlap;
 	OSErr   err;
-	UInt32  wordsLeft;
-	UInt32  bitMask;
+	UInt32  segment;
 	UInt32  firstBit;
 	UInt32  numBits;
 	UInt32  *buffer;
-	UInt32  *currentWord;
 
 	overlap = false;
+	err = noErr;
 	if (bitCount == 0)
 		return (0);
 
-	if ((startBit + bitCount) > gTotalBits) {
+	if (((UInt64)startBit + bitCount) > gTotalBits) {
 		err = vcInvalidExtentErr;
 		goto Exit;
 	}
@@ -549,106 +461,42 @@ int ReleaseBitmapBits(UInt32 startBit, UInt32 bitCount)
 	/* decrment allocated bits */
 	gBitsMarked -= bitCount;
 
-	/*
-	 * Get the bitmap segment containing the first word to check
-	 */
-	err = GetSegmentBitmap(startBit, &buffer, kClearingBits);
-	if (err != noErr) goto Exit;
-
-	/* Initialize buffer stuff */
-	{
-		UInt32 wordIndexInSegment;
-
-		wordIndexInSegment = (startBit & kBitsWithinSegmentMask) / kBitsPerWord;
-		currentWord = buffer + wordIndexInSegment;
-		wordsLeft = kWordsPerSegment - wordIndexInSegment;
-	}
-	
-	/*
-	 * If the first bit to check doesn't start on a word
-	 * boundary in the bitmap, then treat that first word
-	 * specially.
-	 */
-	firstBit = startBit % kBitsPerWord;
-	if (firstBit != 0) {
-		bitMask = kAllBitsSetInWord >> firstBit;  // turn off all bits before firstBit
-		numBits = kBitsPerWord - firstBit;	// number of remaining bits in this word
-		if (numBits > bitCount) {
-			numBits = bitCount;	// entire deallocation is inside this one word
-			bitMask &= ~(kAllBitsSetInWord >> (firstBit + numBits)); // turn off bits after last
-		}
-
-		if ((SWAP_BE32(*currentWord) & bitMask) != bitMask) {
-			overlap = true;
-
-			//plog("(1) overlapping file blocks! word: 0x%08x, mask: 0x%08x\n", *currentWord, bitMask);
-		}
-		
-		*currentWord &= SWAP_BE32(~bitMask);  /* clear the bits in the bitmap */
-		
-		bitCount -= numBits;
-		++currentWord;
-		--wordsLeft;
-		if (wordsLeft == 0 || bitCount == 0)
-			TestSegmentBitmap(startBit);
-	}
-
-	/*
-	 * Clear whole words (32 bits) at a time.
-	 */
-	bitMask = kAllBitsSetInWord;
-	while (bitCount >= kBitsPerWord) {
-		/* See if it's time to move to the next bitmap segment */
-		if (wordsLeft == 0) {
-			startBit += kBitsPerSegment;	 // generate a bit in the next bitmap segment
-			
+	while (bitCount != 0) {
+		segment = startBit / kBitsPerSegment;
+		firstBit = startBit & kBitsWithinSegmentMask;
+		numBits = kBitsPerSegment - firstBit;
+		if (numBits > bitCount)
+			numBits = bitCount;
+
+		if (numBits == kBitsPerSegment) {
+			/* The whole segment becomes empty */
+			buffer = gSegmentTable[segment];
+			if (buffer == gFullBitmapSegment) {
+				--gFullSegments;
+			} else {
+				overlap = true;
+				if (buffer != NULL)
+					BMS_FreeSegment(buffer);
+			}
+			gSegmentTable[segment] = NULL;
+		} else {
 			err = GetSegmentBitmap(startBit, &buffer, kClearingBits);
 			if (err != noErr) goto Exit;
-			
-			// Readjust currentWord, wordsLeft
-			currentWord = buffer;
-			wordsLeft = kWordsPerSegment;
-		}
-		
-		if ((SWAP_BE32(*currentWord) & bitMask) != bitMask) {
-			overlap = true;
-
-			//plog("(2) overlapping file blocks! word: 0x%08x, mask: 0x%08x\n", *currentWord, bitMask);
-		}
-		
-		*currentWord &= SWAP_BE32(~bitMask);  /* clear the bits in the bitmap */
 
-		bitCount -= kBitsPerWord;
-		++currentWord;
-		--wordsLeft;
-		if (wordsLeft == 0 || bitCount == 0)
-			TestSegmentBitmap(startBit);
-	}
-	
-	/*
-	 * Check any remaining bits.
-	 */
-	if (bitCount != 0) {
-		bitMask = ~(kAllBitsSetInWord >> bitCount);	// set first bitCount bits
-		if (wordsLeft == 0) {
-			startBit += kBitsPerSegment;
-			
-			err = GetSegmentBitmap(startBit, &buffer, kClearingBits);
-			if (err != noErr) goto Exit;
-			
-			currentWord = buffer;
-			wordsLeft = kWordsPerSegment;
-		}
-		
-		if ((SWAP_BE32(*currentWord) & bitMask) != bitMask) {
-			overlap = true;
+			if (buffer == gEmptyBitmapSegment) {
+				overlap = true;
+			} else {
+				if (ClearSegmentBits(buffer, firstBit, numBits)) {
+					overlap = true;
 
-			//plog("(3) overlapping file blocks! word: 0x%08x, mask: 0x%08x\n", *currentWord, bitMask);
+					//plog("overlapping file blocks! segment: %u\n", segment);
+				}
+				TestSegmentBitmap(startBit);
+			}
 		}
-		
-		*currentWord &= SWAP_BE32(~bitMask);  /* set the bits in the bitmap */
 
-		TestSegmentBitmap(startBit);
+		startBit += numBits;
+		bitCount -= numBits;
 	}
 Exit:
 	return (overlap ? E_OvlExt : err);
@@ -676,6 +524,8 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 	UInt64 bit;		/* 64-bit to avoid wrap around on volumes with 2^32 - 1 blocks */
 	UInt32 bitsWithinFileBlkMask;
 	UInt32 fileBlk;
+	UInt32 prefetchBlk;
+	UInt32 prefetchCount;
 	BlockDescriptor block;
 	ReleaseBlockOptions relOpt;
 	SFCB * fcb;
@@ -702,6 +552,10 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 		bitsWithinFileBlkMask = (kHFSBlockSize * 8) - 1;
 	fileBlk = (isHFSPlus ? 0 : vcb->vcbVBMSt);
 
+	/* Keep the next kBitmapPrefetchSize bytes of the allocation file in flight */
+	prefetchBlk = 0;
+	prefetchCount = isHFSPlus ? (kBitmapPrefetchSize / fcb->fcbBlockSize) : 0;
+
 	/* 
 	 * Loop through all the bitmap segments and compare
 	 * them against the on-disk bitmap.
@@ -714,6 +568,12 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 		 */
 		if ((bit & bitsWithinFileBlkMask) == 0) {
 			if (isHFSPlus) {
+				if (prefetchCount != 0 && fileBlk + prefetchCount / 2 >= prefetchBlk) {
+					if (prefetchBlk < fileBlk)
+						prefetchBlk = fileBlk;
+					PrefetchFileBlocks(fcb, prefetchBlk, prefetchCount);
+					prefetchBlk += prefetchCount;
+				}
 				if (block.buffer) {
 					err = ReleaseFileBlock(fcb, &block, relOpt);
 					ReturnIfError(err);
@@ -797,11 +657,10 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			 * Once we determine we have under-allocated, we can just stop and print out
 			 * the message.
 			 */
-			for (indx = 0; indx < kBytesPerSegment; indx++) {
-				uint8_t *bufp, *diskp;
-				bufp = (uint8_t *)buffer;
-				diskp = vbmBlockP + (bit & bitsWithinFileBlkMask)/8;
-				if (bufp[indx] & ~diskp[indx]) {
+			for (indx = 0; indx < kWordsPerSegment; indx++) {
+				UInt32 *diskp;
+				diskp = (UInt32 *)(vbmBlockP + (bit & bitsWithinFileBlkMask)/8);
+				if (buffer[indx] & ~diskp[indx]) {
 					underalloc++;
 					break;
 				}
@@ -848,11 +707,9 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
  */
 void UpdateFreeBlockCount(SGlobPtr g)
 {
-	int i;
 	UInt32 newBitsMarked = 0;
 	UInt32 bit;
 	UInt32 *buffer;
-	UInt32 curWord;
 	SVCB * vcb = g->calculatedVCB;
 	
 	/* Loop through all the bitmap segments */
@@ -871,17 +728,7 @@ void UpdateFreeBlockCount(SGlobPtr g)
 		}
 
 		/* Segment is partially full */
-		for (i = 0; i < kWordsPerSegment; i++) {
-			if (buffer[i] == kAllBitsSetInWord) {
-				newBitsMarked += kBitsPerWord;
-			} else {
-				curWord = SWAP_BE32(buffer[i]);
-				while (curWord) {
-					newBitsMarked += curWord & 1;
-					curWord >>= 1;
-				}
-			}
-		} 
+		newBitsMarked += hfs_bm_count_set(buffer, 0, kBitsPerSegment);
 	} 
 	
 	/* Update total bits marked count for in-memory bitmap */
@@ -930,13 +777,11 @@ void UpdateFreeBlockCount(SGlobPtr g)
  */
 static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBlock)
 {
-	int i, j;
 	int retval = ENOSPC;
 	UInt32 bit;
 	UInt32 *buffer;
-	UInt32 curWord;
+	UInt32 i, runStart, runEnd;		/* bit offsets within the segment */
 	UInt32 validBitsInSegment;		/* valid bits remaining (considering totalBits) in segment */
-	UInt32 validBitsInWord;			/* valid bits remaining (considering totalBits) in word */
 	UInt32 bitsRemain = numBlocks; 	/* total free bits more to search */
 	UInt32 startBlock = 0;			/* start bit for free bits sequence */
 	
@@ -945,11 +790,6 @@ static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *act
 	 */
 	validBitsInSegment = kBitsPerSegment;
 
-	/* For all words except the last word, the number of valid bits
-	 * is always total number of bits represented by the word 
-	 */
-	validBitsInWord = kBitsPerWord;
-
 	/* Loop through all the bitmap segments */
 	for (bit = 0; bit < gTotalBits; bit += kBitsPerSegment) {
 		(void) GetSegmentBitmap(bit, &buffer, kTestingBits);
@@ -989,51 +829,27 @@ static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *act
 			}
 		}
 
-		/* Segment is partially full */
-		for (i = 0; i < kWordsPerSegment; i++) {
-			/* All bits in a word are set */
-			if (buffer[i] == kAllBitsSetInWord) {
-				/* Reset our counters */ 
+		/* Segment is partially full; go through its runs of clear bits */
+		for (i = 0; i < validBitsInSegment; i = runEnd) {
+			runStart = hfs_bm_find_clear(buffer, i, validBitsInSegment);
+			if (runStart != i) {
+				/* Some bits are set, reset our counters */
 				startBlock = 0;
 				bitsRemain = numBlocks;
-			} else { 
-				/* Not all bits in a word are set */
-				
-				/* If this is the last segment, check if the current word
-				 * is the last word containing valid bits.
-				 */
-				if (validBitsInSegment != kBitsPerSegment) {
-					if ((validBitsInSegment - (i * kBitsPerWord)) < kBitsPerWord) {
-						/* Calculate the total valid bits in last word */
-						validBitsInWord = validBitsInSegment - (i * kBitsPerWord);
-					}
-				}
-
-				curWord = SWAP_BE32(buffer[i]);
-				/* Check every bit in the word */
-				for (j = 0; j < validBitsInWord; j++) { 
-					if (curWord & kMSBBitSetInWord) {
-						/* The bit is set, reset our counters */
-						startBlock = 0;
-						bitsRemain = numBlocks;
-					} else {
-						/* The bit is clear */
-						if (bitsRemain == numBlocks) {
-							startBlock = bit + (i * kBitsPerWord) + j;
-						}
-						bitsRemain--;
-						if (bitsRemain == 0) {
-							goto out;
-						}
-					}
-					curWord <<= 1;
-				} /* for - checking bits set in word */
+			}
+			if (runStart == validBitsInSegment) {
+				break;
+			}
 
-				/* If this is last valid word, stop the search */
-				if (validBitsInWord != kBitsPerWord) {
-					goto out;
-				}
-			} /* else - not all bits set in a word */ 
+			runEnd = hfs_bm_find_set(buffer, runStart, validBitsInSegment);
+			if (bitsRemain == numBlocks) {
+				startBlock = bit + runStart;
+			}
+			if (runEnd - runStart >= bitsRemain) {
+				bitsRemain = 0;
+				goto out;
+			}
+			bitsRemain -= runEnd - runStart;
 		} /* for - segment is partially full */
 	} /* for - loop over all segments */
 
@@ -1163,9 +979,8 @@ void TrimFreeBlocks(SGlobPtr g)
 {
 	UInt32 *buffer;
 	UInt32 bit;
-	UInt32 wordWithinSegment;
-	UInt32 bitWithinWordMask;
-	UInt32 currentWord;
+	UInt32 i, runStart, runEnd;		/* bit offsets within the segment */
+	UInt32 validBits;
 	UInt32 startBlock;
 	UInt32 blockCount;
 	UInt32 totalTrimmed = 0;
@@ -1215,40 +1030,31 @@ void TrimFreeBlocks(SGlobPtr g)
 		
 		/*
 		 * If we get here, the current segment has some free and some used
-		 * blocks, so we have to iterate over them.
+		 * blocks, so we have to go through its runs of free blocks.
 		 */
-		for (wordWithinSegment = 0;
-		     wordWithinSegment < kWordsPerSegment && bit < gTotalBits;
-		     ++wordWithinSegment)
-		{
-			assert((bit % kBitsPerWord) == 0);
-			
-			currentWord = SWAP_BE32(buffer[wordWithinSegment]);
-
-			/* Iterate over all the bits in the current word. */
-			for (bitWithinWordMask = kMSBBitSetInWord;
-			     bitWithinWordMask != 0 && bit < gTotalBits;
-			     ++bit, bitWithinWordMask >>= 1)
-			{
-				if (currentWord & bitWithinWordMask) {
-					/* Found a used block. */
-					if (blockCount != 0) {
-						TrimExtent(g, startBlock, blockCount);
-						totalTrimmed += blockCount;
-						blockCount = 0;
-					}
-				} else {
-					/*
-					 * Found an unused block.  Add it to the current extent,
-					 * or start a new one.
-					 */
-					if (blockCount == 0) {
-						startBlock = bit;
-					}
-					++blockCount;
-				}
+		validBits = MIN(gTotalBits - bit, kBitsPerSegment);
+		for (i = 0; i < validBits; i = runEnd) {
+			runStart = hfs_bm_find_clear(buffer, i, validBits);
+			if (runStart != i && blockCount != 0) {
+				/* Found a used block. */
+				TrimExtent(g, startBlock, blockCount);
+				totalTrimmed += blockCount;
+				blockCount = 0;
+			}
+			if (runStart == validBits)
+				break;
+
+			/*
+			 * Found unused blocks.  Add them to the current extent,
+			 * or start a new one.
+			 */
+			runEnd = hfs_bm_find_set(buffer, runStart, validBits);
+			if (blockCount == 0) {
+				startBlock = bit + runStart;
 			}
+			blockCount += runEnd - runStart;
 		}
+		bit += validBits;
 	}
 	if (blockCount != 0) {
 		TrimExtent(g, startBlock, blockCount);
@@ -1282,227 +1088,99 @@ int IsTrimSupported(void)
 }
 
 /*
- * BITMAP SEGMENT TREE
+ * BITMAP SEGMENT TABLE
  *
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
- *	1. Full if the coresponding segment map bit is set
- *	2. Empty (implied)
+ * The table has one entry per bitmap segment.  Only partially
+ * full segments need memory of their own; they are allocated
+ * kBMS_SegmentsPerPool at a time and recycled through a free
+ * list.
  */
 
 static int
-BMS_InitTree(void)
+BMS_InitTable(void)
 {
-	gBMS_PoolCount = 0;
-	BMS_GrowNodePool();
+	gSegmentTable = (UInt32 **)calloc(gTotalSegments, sizeof(UInt32 *));
+	if (gSegmentTable == NULL)
+		return (-1);
 
-	gBMS_Root = gBMS_FreeNodes;
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
-	gBMS_Root->right = NULL; 
+	gBMS_FreeSegments = NULL;
+	gBMS_PoolList = NULL;
+	gBMS_PoolCount = 0;
 
 	return (0);
 }
 
 
-static int
-BMS_DisposeTree(void)
+static void
+BMS_DisposeTable(void)
 {
-	while(gBMS_PoolCount > 0)
+	while (gBMS_PoolCount > 0)
 		free(gBMS_PoolList[--gBMS_PoolCount]);
+	free(gBMS_PoolList);
+	gBMS_PoolList = NULL;
+	gBMS_FreeSegments = NULL;
 
-	gBMS_Root = gBMS_FreeNodes = 0;
-	return (0);
+	free(gSegmentTable);
+	gSegmentTable = NULL;
 }
 
 
-static BMS_Node *
-BMS_Lookup(UInt32 segment)
+/* get a private segment, either full or empty */
+static UInt32 *
+BMS_AllocSegment(int segmentType)
 {
-	BMS_Node *ptree = gBMS_Root;
-
-	while (ptree && ptree->segment != segment) {
+	UInt32 *new;
 
-		if (segment > ptree->segment)
-			ptree = ptree->right;
-		else
-			ptree = ptree->left;
+	if ((new = gBMS_FreeSegments) == NULL) {
+		BMS_GrowSegmentPool();
+		if ((new = gBMS_FreeSegments) == NULL)
+			return (NULL);
 	}
 
-	return ((BMS_Node *)ptree);
-}
-
-
-static BMS_Node *
-BMS_InsertTree(BMS_Node *NewEntry)
-{
-	BMS_Node *ptree;
-	register UInt32 segment;
-
-	segment = NewEntry->segment;
-	ptree = gBMS_Root;
-	if (ptree == (BMS_Node *)NULL) {
-		gBMS_Root = NewEntry;
-		return (NewEntry);
-	}
-
-	while (ptree) {
-		if (segment > ptree->segment) { /* walk the right sub-tree */
-			if (ptree->right)
-				ptree = ptree->right;
-			else {
-				ptree->right = NewEntry;
-				return (ptree);
-			}
-		}
-		else { /* walk the left sub-tree */
-			if (ptree->left) 
-				ptree = ptree->left;
-			else {
-			    	ptree->left = NewEntry;
-				return (ptree);
-			}
-		}
-	}	
-
-	return ((BMS_Node *)NULL);
-}
-
-
-/* insert a new segment into the tree */
-static BMS_Node *
-BMS_Insert(UInt32 segment, int segmentType) 
-{
-	BMS_Node *new; 
-
-	if ((new = gBMS_FreeNodes) == NULL) {
-		BMS_GrowNodePool();
-		if ((new = gBMS_FreeNodes) == NULL)
-			return ((BMS_Node *)NULL);
-	}
-
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
+	bcopy(new, &gBMS_FreeSegments, sizeof(gBMS_FreeSegments));
 
 	++gSegmentNodes;  /* debugging stats */
 
-	new->right = NULL; 
-	new->segment = segment;
 	if (segmentType == kFullSegment)
-		bcopy(gFullBitmapSegment, new->bitmap, kBytesPerSegment);
+		bcopy(gFullBitmapSegment, new, kBytesPerSegment);
 	else
-		bzero(new->bitmap, sizeof(new->bitmap));	
+		bzero(new, kBytesPerSegment);
 
-	if (BMS_InsertTree(new) != NULL)
-		return (new);
-	else
-		return ((BMS_Node *)NULL);
+	return (new);
 }
 
 
-static BMS_Node *
-BMS_Delete(UInt32 segment)
+/* put a private segment back on the free list */
+static void
+BMS_FreeSegment(UInt32 *buffer)
 {
-	BMS_Node *seg_found, *pprevious, *pnext, *pnextl, *psub;
-
-	pprevious = NULL; 
-	seg_found = gBMS_Root;
-	
-	/* don't allow the root to be deleted! */
-	if (seg_found->segment == segment)
-		return ((BMS_Node *)NULL);
-
-	while (seg_found && seg_found->segment != segment) {
-		pprevious = seg_found;
-		if (segment > seg_found->segment)
-			seg_found = seg_found->right;
-		else
-			seg_found = seg_found->left;
-	}
+	--gSegmentNodes;  /* debugging stats */
 
-	if (seg_found) {
-		/*
-		 * we found the entry, now reorg the sub-trees
-		 * spanning from our node.
-		 */
-		if ((pnext = seg_found->right)) {
-			/*
-			 * Tree pruning: take the left branch of the
-			 * current node and place it at the lowest
-			 * left branch of the current right branch 
-			 */
-			psub = pnext;
-			
-			/* walk the Right/Left sub tree from current node */
-			while ((pnextl = psub->left))
-				psub = pnextl;	
-			
-			/* plug the old left tree to the new ->Right leftmost node */	
-			psub->left = seg_found->left;
-		} else {  /* only left sub-tree, simple case */
-			pnext = seg_found->left;
-		}
-		/* 
-		 * Now, plug the current node sub tree to
-		 * the good pointer of our parent node.
-		 */
-		if (pprevious->left == seg_found)
-			pprevious->left = pnext;
-		else
-			pprevious->right = pnext;	
-		
-		/* add node back to the free-list */
-		bzero(seg_found, sizeof(BMS_Node));
-		seg_found->right = gBMS_FreeNodes; 
-		gBMS_FreeNodes = seg_found; 		
-	}
-	
-	return (seg_found);
+	bcopy(&gBMS_FreeSegments, buffer, sizeof(gBMS_FreeSegments));
+	gBMS_FreeSegments = buffer;
 }
 
 
 static void
-BMS_GrowNodePool(void)
+BMS_GrowSegmentPool(void)
 {
-	BMS_Node *nodePool;
-	short i;
+	UInt32 **poolList;
+	UInt32 *segmentPool;
+	int i;
 
-	if (gBMS_PoolCount >= kBMS_PoolMax)
+	poolList = (UInt32 **)realloc(gBMS_PoolList, (gBMS_PoolCount + 1) * sizeof(UInt32 *));
+	if (poolList == NULL)
 		return;
+	gBMS_PoolList = poolList;
 
-	nodePool = (BMS_Node *)malloc(sizeof(BMS_Node) * kBMS_NodesPerPool);
-	if (nodePool != NULL) {
-		bzero(&nodePool[0], sizeof(BMS_Node) * kBMS_NodesPerPool);
-		for (i = 1 ; i < kBMS_NodesPerPool ; i++) {
-			(&nodePool[i-1])->right = &nodePool[i];
-		}
-	
-		gBMS_FreeNodes = &nodePool[0];
-		gBMS_PoolList[gBMS_PoolCount++] = nodePool;
-	}
-}
-
-
-#if _VBC_DEBUG_
-static void
-BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth)
-{
-	if (root) {
-		depth++;
-		if (depth > *maxdepth)
-			*maxdepth = depth;
-		BMS_MaxDepth(root->left, depth, maxdepth);
-		BMS_MaxDepth(root->right, depth, maxdepth);
-	}
-}
+	segmentPool = (UInt32 *)malloc(kBytesPerSegment * kBMS_SegmentsPerPool);
+	if (segmentPool != NULL) {
+		for (i = kBMS_SegmentsPerPool - 1; i >= 0; i--) {
+			UInt32 *segment = segmentPool + i * kWordsPerSegment;
 
-static void
-BMS_PrintTree(BMS_Node * root)
-{
-	if (root) {
-		BMS_PrintTree(root->left);
-		plog("seg %d\n", root->segment);
-		BMS_PrintTree(root->right);
+			bcopy(&gBMS_FreeSegments, segment, sizeof(gBMS_FreeSegments));
+			gBMS_FreeSegments = segment;
+		}
+		gBMS_PoolList[gBMS_PoolCount++] = segmentPool;
 	}
 }
-#endif
-
@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -51,6 +52,8 @@
 extern char debug;
 
 #include <hfs/hfs_format.h>
+#include <hfs/hfs_replay.h>
+#include <hfs/hfs_cksum.h>
 #include <sys/endian.h>
 
 typedef struct SwapType {
@@ -74,27 +77,6 @@ static swapper_t swappedEndian = {
 	^(uint64_t x) { return (uint64_t)bswap64(x); }
 };
 
-typedef int (^journal_write_block_t)(off_t, void *, size_t);
-
-//
-// this isn't a great checksum routine but it will do for now.
-// we use it to checksum the journal header and the block list
-// headers that are at the start of each transaction.
-//
-static uint32_t
-calc_checksum(char *ptr, int len)
-{
-	int i;
-	uint32_t cksum = 0;
-
-	// this is a lame checksum but for now it'll do
-	for(i = 0; i < len; i++, ptr++) {
-		cksum = (cksum << 8) ^ (cksum + *(unsigned char *)ptr);
-	}
-
-	return (~cksum);
-}
-
 typedef struct JournalIOInfo {
 	int		jfd;	// File descriptor for journal buffer
 	int		wrapCount;	// Incremented when it wraps around.
@@ -208,7 +190,7 @@ getJournalTransaction(JournalIOInfo_t *jinfo, swapper_t *swap)
 	uint32_t tmpChecksum = swap->swap32(hdr->checksum);
 	uint32_t compChecksum;
 	hdr->checksum = 0;
-	compChecksum = calc_checksum((void*)hdr, sizeof(*hdr));
+	compChecksum = hfs_jnl_cksum(hdr, sizeof(*hdr));
 	hdr->checksum = swap->swap32(tmpChecksum);
 
 	if (compChecksum != tmpChecksum) {
@@ -244,34 +226,307 @@ getJournalTransaction(JournalIOInfo_t *jinfo, swapper_t *swap)
 }
 
 /*
- * Replay a transaction.
+ * The replay is a pipeline.  A reader thread walks the journal, reading
+ * each transaction and checking its block list header, and queues it; the
+ * main thread checks the blocks in it and adds them to a jr_index
+ * (<hfs/hfs_replay.h>, shared with the kernel), which keeps only the newest
+ * copy of every block.  Once all the transactions are in, the index is
+ * sorted by block number, and a reader thread reads the blocks back from the
+ * journal in runs of adjacent blocks while the main thread hands each run to
+ * the writer.  So every block is written once, in block order, however many
+ * transactions wrote it, and the journal I/O overlaps the rest.
+ */
+#define JOURNAL_QUEUE_DEPTH	8		// How far ahead a reader thread may get
+#define JOURNAL_REPLAY_MAX_IO	(64 * 1024)	// Largest run handed to the writer
+
+typedef struct JournalQueue {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	void		*items[JOURNAL_QUEUE_DEPTH];
+	int		head;
+	int		count;
+	int		done;	// The reader has queued all it is going to
+	int		stop;	// The main thread does not want any more
+} JournalQueue_t;
+
+static void
+jqInit(JournalQueue_t *q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+/*
+ * Tear down a queue once its reader has been joined, releasing
+ * whatever was left in it.
+ */
+static void
+jqDestroy(JournalQueue_t *q, void (*release)(void *))
+{
+	int i;
+
+	for (i = 0; i < q->count; i++)
+		release(q->items[(q->head + i) % JOURNAL_QUEUE_DEPTH]);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/*
+ * Queue an item, waiting for room.  It returns -1 if the main thread
+ * has stopped taking them, in which case the item is still the caller's.
+ */
+static int
+jqPut(JournalQueue_t *q, void *item)
+{
+	int retval = -1;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == JOURNAL_QUEUE_DEPTH && !q->stop)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if (!q->stop) {
+		q->items[(q->head + q->count) % JOURNAL_QUEUE_DEPTH] = item;
+		q->count++;
+		pthread_cond_broadcast(&q->cond);
+		retval = 0;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return retval;
+}
+
+/*
+ * Take the next item, waiting for one.  It returns NULL once the
+ * reader is done and everything it queued has been taken.
+ */
+static void *
+jqGet(JournalQueue_t *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->done)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if (q->count != 0) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % JOURNAL_QUEUE_DEPTH;
+		q->count--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+static void
+jqDone(JournalQueue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void
+jqStop(JournalQueue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Everything about a replay in progress.  The reader threads only
+ * set bad_journal and read_error; the main thread looks at them
+ * after it has joined the reader.
+ */
+typedef struct JournalReplay {
+	JournalIOInfo_t	jinfo;		// Where the transaction reader is
+	journal_header	*jhdr;
+	swapper_t	*swap;
+	off_t		offset;		// Offset of the journal on the journal device
+	off_t		jnlSize;	// Size, in bytes, of the entire journal
+	off_t		startOffset;	// "start" from the journal header
+	size_t		blSize;		// Size of a block_list_header
+	size_t		blkSize;	// Unit of the block numbers: the journal header size
+	int		bad_journal;	// A transaction before the end could not be read
+	int		read_error;	// A run of blocks could not be read back
+	struct jr_index	index;
+	JournalQueue_t	queue;
+} JournalReplay_t;
+
+typedef struct JournalTxn {
+	block_list_header	*txn;
+	off_t			jnlOffset;	// Where it is, from the start of the journal
+	int			tentative;	// It is past the stated end of the journal
+} JournalTxn_t;
+
+typedef struct JournalRun {
+	off_t		start;		// Byte offset on the data device
+	size_t		length;
+	uint8_t		data[];
+} JournalRun_t;
+
+static void
+freeJournalTxn(void *item)
+{
+	JournalTxn_t *jt = item;
+
+	free(jt->txn);
+	free(jt);
+}
+
+/*
+ * The transaction reader.  It loops getting transactions, and stops
+ * when it hits a checksum error, or when the sequence number for a
+ * transaction doesn't match what it expects.  (That's the trickiest
+ * part -- the into_the_weeds portion of the code.  It doesn't match the
+ * TN11150 documentation, so I've had to go by both my experience with
+ * real-world journals and by looking at the kernel code.)
+ */
+static void *
+journalReadTransactions(void *arg)
+{
+	JournalReplay_t *r = arg;
+	swapper_t *jnlSwap = r->swap;
+	/*
+	 * The journal code was updated to be able to read past the "end" of the journal,
+	 * to see if there were any valid transactions there.  If we are peeking past the
+	 * end, we don't care if we have checksum errors -- that just means they're not
+	 * valid transactions.
+	 *
+	 */
+	int into_the_weeds = 0;
+	uint32_t last_sequence_number = 0;
+	const char *state = "";
+	block_list_header *txn = NULL;
+
+	while (1) {
+		JournalTxn_t *jt;
+		off_t txnOffset;
+
+		if (r->jinfo.current == r->jinfo.end && into_the_weeds == 0) {
+			/*
+			 * This is a bit weird, but it works:  if current == end, but gone_into_weeds is 1,
+			 * then this code will not execute.  If it does execute, it'll go to get a transaction.
+			 * That will put the pointer past end.
+			 */
+			if (r->jhdr->sequence_num == 0) {
+				/*
+				 * XXX
+				 * I am not sure about this; this behaviour is not in TN1150 at all,
+				 * but I _think_ this is what the kernel is doing.
+                 */
+#if DEBUG_JOURNAL
+                if (debug)
+                    plog("Journal sequence number is 0, is going into the end okay?\n");
+#endif
+			}
+			into_the_weeds = 1;
+#if DEBUG_JOURNAL
+			if (debug)
+				plog("Attempting to read past stated end of journal\n");
+#endif
+			state = "tentative ";
+			r->jinfo.end = (r->jinfo.base + r->startOffset - r->jinfo.bSize);
+			continue;
+		}
+#if DEBUG_JOURNAL
+		if (debug)
+			plog("Before getting %stransaction:  jinfo.current = %llu\n", state, r->jinfo.current);
+#endif
+		/*
+		 * Note that getJournalTransaction verifies the checksum on the block_list_header, so
+		 * if it's bad, it'll return NULL.
+		 */
+		txnOffset = r->jinfo.current - r->offset;
+		txn = getJournalTransaction(&r->jinfo, jnlSwap);
+		jt = (txn != NULL) ? malloc(sizeof(*jt)) : NULL;
+		if (jt == NULL) {
+#if DEBUG_JOURNAL
+			if (debug)
+				plog("txn is NULL, jinfo.current = %llu\n", r->jinfo.current);
+#endif
+			if (into_the_weeds) {
+#if DEBUG_JOURNAL
+				if (debug)
+					plog("\tBut we do not care, since it is past the end of the journal\n");
+#endif
+			} else {
+				r->bad_journal = 1;
+			}
+			break;
+		}
+#if DEBUG_JOURNAL
+		if (debug) {
+			plog("After getting %stransaction:  jinfo.current = %llu\n", state, r->jinfo.current);
+			plog("%stxn = { %u max_blocks, %u num_blocks, %u bytes_used, binfo[0].next = %u }\n", state, jnlSwap->swap32(txn->max_blocks), jnlSwap->swap32(txn->num_blocks), jnlSwap->swap32(txn->bytes_used), jnlSwap->swap32(txn->binfo[0].next));
+		}
+#endif
+		if (into_the_weeds) {
+			/*
+			 * This seems to be what the kernel was checking:  if the
+			 * last_sequence_number was set, and the txn sequence number
+			 * is set, and the txn sequence number doesn't match either
+			 * last_sequence_number _or_ an incremented version of it, then
+			 * the transaction isn't worth looking at, and we've reached
+			 * the end of the journal.
+			 */
+			if (last_sequence_number != 0 &&
+			    txn->binfo[0].next != 0 &&
+			    jnlSwap->swap32(txn->binfo[0].next) != last_sequence_number &&
+			    jnlSwap->swap32(txn->binfo[0].next) != (last_sequence_number + 1)) {
+				// Probably not a valid transaction
+#if DEBUG_JOURNAL
+				if (debug)
+					plog("\tTentative txn sequence %u is not expected %u, stopping journal replay\n", jnlSwap->swap32(txn->binfo[0].next), last_sequence_number + 1);
+#endif
+				free(jt);
+				break;
+			}
+		}
+		/*
+		 * Hand the transaction over to be checked and indexed.  If the
+		 * main thread finds it bad, it stops taking transactions, and
+		 * that's the end of the replay.
+		 */
+		last_sequence_number = jnlSwap->swap32(txn->binfo[0].next);
+		jt->txn = txn;
+		jt->jnlOffset = txnOffset;
+		jt->tentative = into_the_weeds;
+		if (jqPut(&r->queue, jt) == -1) {
+			free(jt);
+			break;
+		}
+		txn = NULL;
+	}
+	if (txn)
+		free(txn);
+	jqDone(&r->queue);
+	return NULL;
+}
+
+/*
+ * Index a transaction.
  * Transactions have a blockListSize amount of block_list_header, and
- * are then followed by data.  We read it in, verify the checksum, and
- * if it's good, we call the block that was passed in to do something
- * with it.  Maybe write it out.  Maybe laugh about it.
- *
- * It returns -1 if there was an error before it wrote anything out,
- * and -2 if there was an error after it wrote something out.
- *
- * The arguments are:
- * txn	-- a block_list_header pointer, which has the description and data
- * 	to be replayed.
- * blSize	-- the size of the block_list for this journal.  (The data
- *		are after the block_list, but part of the same buffer.)
- * blkSize	-- The block size used to convert block numbers to offsets.  This
- *		is defined to be the size of the journal header.
- * swap	-- A pointer to a swapper_t used to swap journal data structure elements.
- * writer	-- A block-of-code that does writing.
+ * are then followed by data.  Every block has to lie within the
+ * transaction, and, if the block list says so, has to match its
+ * checksum; if they all do, the blocks are added to the index, with
+ * where their data is in the journal.  Otherwise none of them are.
  *
- * "writer" should return -1 to stop the replay (this propagates an error up).
+ * It returns 0 on success, and -1 if the transaction is bad.
  */
 static int
-replayTransaction(block_list_header *txn, size_t blSize, size_t blkSize, swapper_t *swap, journal_write_block_t writer)
+indexTransaction(JournalReplay_t *r, JournalTxn_t *jt)
 {
+	block_list_header *txn = jt->txn;
+	swapper_t *swap = r->swap;
 	uint32_t i;
 	uint8_t *endPtr = ((uint8_t*)txn) + swap->swap32(txn->bytes_used);
-	uint8_t *dataPtr = ((uint8_t*)txn) + blSize;
-	int retval = -1;
+	uint8_t *dataPtr = ((uint8_t*)txn) + r->blSize;
+	uint32_t flags = swap->swap32(txn->flags);
+	int checkBlocks = (flags & (BLHDR_CHECK_CHECKSUMS | BLHDR_CRC32C_CHECKSUMS)) != 0;
+	int error;
+
 	for (i = 1; i < swap->swap32(txn->num_blocks); i++) {
 #if DEBUG_JOURNAL
 		if (debug)
@@ -286,17 +541,17 @@ replayTransaction(block_list_header *txn, size_t blSize, size_t blkSize, swapper
 		if (dataPtr > endPtr) {
 			if (debug)
 				plog("\tData out of range for block_list_header\n");
-			return retval;
+			return -1;
 		}
 		if ((endPtr - dataPtr) < swap->swap32(txn->binfo[i].bsize)) {
 			if (debug)
 				plog("\tData size for block %d out of range for block_list_header\n", i);
-			return retval;
+			return -1;
 		}
 		if ((dataPtr + swap->swap32(txn->binfo[i].bsize)) > endPtr) {
 			if (debug)
 				plog("\tData end out of range for block_list_header\n");
-			return retval;
+			return -1;
 		}
 #if DEBUG_JOURNAL
 		// Just for debugging
@@ -307,25 +562,126 @@ replayTransaction(block_list_header *txn, size_t blSize, size_t blkSize, swapper
 			}
 		}
 #endif
+		// As the kernel does, a checksum of 0 means the block has none
+		if (checkBlocks &&
+		    swap->swap64(txn->binfo[i].bnum) != ~(uint64_t)0 &&
+		    txn->binfo[i].next != 0 &&
+		    hfs_jnl_block_cksum(dataPtr, swap->swap32(txn->binfo[i].bsize), flags & BLHDR_CRC32C_CHECKSUMS) != swap->swap32(txn->binfo[i].next)) {
+			if (debug)
+				plog("\tBlock %d (blkNum %llu) does not match its checksum\n", i, swap->swap64(txn->binfo[i].bnum));
+			return -1;
+		}
+		dataPtr += swap->swap32(txn->binfo[i].bsize);
+	}
+
+	dataPtr = ((uint8_t*)txn) + r->blSize;
+	for (i = 1; i < swap->swap32(txn->num_blocks); i++) {
+		uint64_t bnum = swap->swap64(txn->binfo[i].bnum);
+		uint32_t bsize = swap->swap32(txn->binfo[i].bsize);
+
 		// It's in the spec, and I saw it come up once on a live volume.
-		if (swap->swap64(txn->binfo[i].bnum) == ~(uint64_t)0) {
+		if (bnum == ~(uint64_t)0) {
 #if DEBUG_JOURNAL
 			if (debug)
 				plog("\tSkipping this block due to magic skip number\n");
 #endif
-		} else {
-			// Should we set retval to -2 here?
-			if (writer) {
-				if ((writer)(swap->swap64(txn->binfo[i].bnum) * blkSize, dataPtr, swap->swap32(txn->binfo[i].bsize)) == -1)
-					return retval;
+		} else if (bsize != 0) {
+			error = jr_add(&r->index, (off_t)bnum, bsize,
+				       jt->jnlOffset + (dataPtr - (uint8_t*)txn),
+				       (int32_t)swap->swap32(txn->binfo[i].next));
+			if (error != 0) {
+				fplog(stderr, "%s:  cannot index block %llu: %s\n", __FUNCTION__, bnum, strerror(error));
+				return -1;
 			}
 		}
-		dataPtr += swap->swap32(txn->binfo[i].bsize);
-		retval = -2;
+		dataPtr += bsize;
+	}
+	return 0;
+}
+
+/*
+ * Read <length> bytes at <jnlOffset> from the start of the journal.
+ * Like the journal itself, it goes on from the end of the journal
+ * to just past the journal header.  It returns 0, or -1 on error.
+ */
+static int
+journalReadAt(JournalReplay_t *r, off_t jnlOffset, uint8_t *buffer, size_t length)
+{
+	while (length > 0) {
+		size_t amt;
+		ssize_t n;
+
+		if (jnlOffset >= r->jnlSize)
+			jnlOffset = r->blkSize + (jnlOffset - r->jnlSize);
+		amt = MIN(length, (size_t)(r->jnlSize - jnlOffset));
+		n = pread(r->jinfo.jfd, buffer, amt, r->offset + jnlOffset);
+		if (n == -1 || (size_t)n != amt) {
+			warn("pread(%d, %p, %zu, %llu)", r->jinfo.jfd, buffer, amt, (unsigned long long)(r->offset + jnlOffset));
+			return -1;
+		}
+		buffer += amt;
+		jnlOffset += amt;
+		length -= amt;
 	}
 	return 0;
 }
 
+/*
+ * The block reader.  It reads the blocks in the (finished) index back
+ * from the journal, in runs of adjacent blocks up to JOURNAL_REPLAY_MAX_IO
+ * long, and queues the runs for the writer.
+ */
+static void *
+journalReadRuns(void *arg)
+{
+	JournalReplay_t *r = arg;
+	struct jr_index *ji = &r->index;
+	uint32_t i, k, next;
+
+	for (i = 0; i < ji->ji_count; i = next) {
+		size_t length = ji->ji_entries[i].je_size;
+		size_t done = 0;
+		JournalRun_t *run;
+
+		for (next = i + 1; next < ji->ji_count && jr_adjacent(ji, next) &&
+		     length + ji->ji_entries[next].je_size <= JOURNAL_REPLAY_MAX_IO; next++) {
+			length += ji->ji_entries[next].je_size;
+		}
+
+		run = malloc(sizeof(*run) + length);
+		if (run == NULL) {
+			r->read_error = 1;
+			break;
+		}
+		run->start = ji->ji_entries[i].je_block * r->blkSize;
+		run->length = length;
+
+		// Blocks that follow one another in the journal are read together
+		for (k = i; k < next; ) {
+			off_t jnlOffset = ji->ji_entries[k].je_jnl_offset;
+			size_t amt = ji->ji_entries[k].je_size;
+
+			for (k++; k < next && ji->ji_entries[k].je_jnl_offset == jnlOffset + amt; k++)
+				amt += ji->ji_entries[k].je_size;
+			if (journalReadAt(r, jnlOffset, run->data + done, amt) == -1)
+				break;
+			done += amt;
+		}
+		if (done != length) {
+			r->read_error = 1;
+			free(run);
+			break;
+		}
+		if (jqPut(&r->queue, run) == -1) {
+			free(run);
+			break;
+		}
+	}
+	jqDone(&r->queue);
+	return NULL;
+}
+
+
 /*
  * Read a journal header in from the journal device.
  */
@@ -366,7 +722,10 @@ loadJournalHeader(int jfd, off_t offset, size_t blockSize, journal_header *jhp)
  * The function works by loading the journal header.  From there, it then starts
  * loading transactions, via block_list_header groups.  When it gets to the end
  * of the journal, it tries continuing, in case there were transactions that
- * didn't get updated in the header (this apparently happens).
+ * didn't get updated in the header (this apparently happens).  Each block
+ * is written once, with its newest contents, in block order, with adjacent
+ * blocks put together (see the pipeline above); do_write_b gets runs of up
+ * to JOURNAL_REPLAY_MAX_IO bytes, not the journal's blocks one at a time.
  * 
  * It returns 0 on success, and -1 on error.  Note that there's not a lot
  * fsck_hfs can probably do in the event of error.
@@ -436,7 +795,7 @@ journal_open(int jfd,
 	tempCksum = jnlSwap->swap32(jhdr.checksum);
 	jhdr.checksum = 0;
 	if (jnlSwap->swap32(jhdr.magic) == JOURNAL_HEADER_MAGIC &&
-	    (calc_checksum((void*)&jhdr, JOURNAL_HEADER_CKSUM_SIZE) != tempCksum)) {
+	    (hfs_jnl_cksum(&jhdr, JOURNAL_HEADER_CKSUM_SIZE) != tempCksum)) {
 		fplog(stderr, "%s:  Invalid journal checksum from %s\n", __FUNCTION__, jdev_name);
 		return -1;
 	}
@@ -451,156 +810,118 @@ journal_open(int jfd,
 	off_t endOffset =jnlSwap->swap64(jhdr.end);
 	off_t journalStart = offset + jnlSwap->swap32(jhdr.jhdr_size);
 
-	/*
-	 * The journal code was updated to be able to read past the "end" of the journal,
-	 * to see if there were any valid transactions there.  If we are peeking past the
-	 * end, we don't care if we have checksum errors -- that just means they're not
-	 * valid transactions.
-	 *
-	 */
-	int into_the_weeds = 0;
-	uint32_t last_sequence_number = 0;
-
-	JournalIOInfo_t jinfo = { 0 };
-
 #if DEBUG_JOURNAL
 	if (debug)
 		plog("Journal start sequence number = %u\n", jnlSwap->swap32(jhdr.sequence_num));
 #endif
 
+	JournalReplay_t r;
+	pthread_t reader;
+	JournalTxn_t *jt;
+	JournalRun_t *run;
+	uint32_t writes = 0;
+	int bad_journal = 0;
+	int error;
+
+	memset(&r, 0, sizeof(r));
+	r.jhdr = &jhdr;
+	r.swap = jnlSwap;
+	r.offset = offset;
+	r.jnlSize = journal_size;
+	r.startOffset = startOffset;
+	r.blSize = jnlSwap->swap32(jhdr.blhdr_size);
+	r.blkSize = jnlSwap->swap32(jhdr.jhdr_size);
+
 	/*
 	 * Now set up the JournalIOInfo object with the file descriptor,
 	 * the block size, start and end of the journal buffer, and where
 	 * the journal pointer currently is.
 	 */
-	jinfo.jfd = jfd;
-	jinfo.bSize = jnlSwap->swap32(jhdr.jhdr_size);
-	jinfo.base = journalStart;
-	jinfo.size = journal_size - jinfo.bSize;
-	jinfo.end = offset + endOffset;
-	jinfo.current = offset + startOffset;
-
-	const char *state = "";
-	int bad_journal = 0;
-	block_list_header *txn = NULL;
+	r.jinfo.jfd = jfd;
+	r.jinfo.bSize = r.blkSize;
+	r.jinfo.base = journalStart;
+	r.jinfo.size = journal_size - r.jinfo.bSize;
+	r.jinfo.end = offset + endOffset;
+	r.jinfo.current = offset + startOffset;
+
+	if (jr_init(&r.index, (uint32_t)r.blkSize, journal_size) != 0) {
+		fplog(stderr, "%s:  unable to set up journal replay for %s\n", __FUNCTION__, jdev_name);
+		return -1;
+	}
 
 	/*
-	 * Loop while getting transactions.  We exit when we hit a checksum
-	 * error, or when the sequence number for a transaction doesn't match
-	 * what we expect it to.  (That's the trickiest part -- the into_the_weeds
-	 * portion of the code.  It doesn't match the TN11150 documentation, so
-	 * I've had to go by both my experience with real-world journals and by
-	 * looking at the kernel code.)
+	 * Index the transactions as the reader gets them.  If one is bad,
+	 * we're done with the journal replay.  (If it's after the "end," then
+	 * we don't care, and it's not a bad journal.)
 	 */
-	while (1) {
-		int rv;
+	jqInit(&r.queue);
+	error = pthread_create(&reader, NULL, journalReadTransactions, &r);
+	if (error != 0) {
+		fplog(stderr, "%s:  unable to start journal reader for %s: %s\n", __FUNCTION__, jdev_name, strerror(error));
+		jqDestroy(&r.queue, freeJournalTxn);
+		jr_destroy(&r.index);
+		return -1;
+	}
+	while ((jt = jqGet(&r.queue)) != NULL) {
+		int rv = indexTransaction(&r, jt);
 
-		if (jinfo.current == jinfo.end && into_the_weeds == 0) {
-			/*
-			 * This is a bit weird, but it works:  if current == end, but gone_into_weeds is 1,
-			 * then this code will not execute.  If it does execute, it'll go to get a transaction.
-			 * That will put the pointer past end.
-			 */
-			if (jhdr.sequence_num == 0) {
-				/*
-				 * XXX
-				 * I am not sure about this; this behaviour is not in TN1150 at all,
-				 * but I _think_ this is what the kernel is doing.
-                 */
-#if DEBUG_JOURNAL
-                if (debug)
-                    plog("Journal sequence number is 0, is going into the end okay?\n");
-#endif
-			}
-			into_the_weeds = 1;
-#if DEBUG_JOURNAL
-			if (debug)
-				plog("Attempting to read past stated end of journal\n");
-#endif
-			state = "tentative ";
-			jinfo.end = (jinfo.base + startOffset - jinfo.bSize);
-			continue;
-		}
-#if DEBUG_JOURNAL
-		if (debug)
-			plog("Before getting %stransaction:  jinfo.current = %llu\n", state, jinfo.current);
-#endif
-		/*
-		 * Note that getJournalTransaction verifies the checksum on the block_list_header, so
-		 * if it's bad, it'll return NULL.
-		 */
-		txn = getJournalTransaction(&jinfo, jnlSwap);
-		if (txn == NULL) {
-#if DEBUG_JOURNAL
+		if (rv < 0) {
 			if (debug)
-				plog("txn is NULL, jinfo.current = %llu\n", jinfo.current);
-#endif
-			if (into_the_weeds) {
-#if DEBUG_JOURNAL
+				plog("\tTransaction replay failed, returned %d\n", rv);
+			if (jt->tentative) {
 				if (debug)
-					plog("\tBut we do not care, since it is past the end of the journal\n");
-#endif
+					plog("\t\tAnd we don't care\n");
 			} else {
 				bad_journal = 1;
 			}
+			freeJournalTxn(jt);
 			break;
 		}
-#if DEBUG_JOURNAL
-		if (debug) {
-			plog("After getting %stransaction:  jinfo.current = %llu\n", state, jinfo.current);
-			plog("%stxn = { %u max_blocks, %u num_blocks, %u bytes_used, binfo[0].next = %u }\n", state, jnlSwap->swap32(txn->max_blocks), jnlSwap->swap32(txn->num_blocks), jnlSwap->swap32(txn->bytes_used), jnlSwap->swap32(txn->binfo[0].next));
-		}
-#endif
-		if (into_the_weeds) {
-			/*
-			 * This seems to be what the kernel was checking:  if the
-			 * last_sequence_number was set, and the txn sequence number
-			 * is set, and the txn sequence number doesn't match either
-			 * last_sequence_number _or_ an incremented version of it, then
-			 * the transaction isn't worth looking at, and we've reached
-			 * the end of the journal.
-			 */
-			if (last_sequence_number != 0 &&
-			    txn->binfo[0].next != 0 &&
-			    jnlSwap->swap32(txn->binfo[0].next) != last_sequence_number &&
-			    jnlSwap->swap32(txn->binfo[0].next) != (last_sequence_number + 1)) {
-				// Probably not a valid transaction
-#if DEBUG_JOURNAL
-				if (debug)
-					plog("\tTentative txn sequence %u is not expected %u, stopping journal replay\n", jnlSwap->swap32(txn->binfo[0].next), last_sequence_number + 1);
-#endif
-				break;
-			}
-		}
-		/*
-		 * If we've got a valid transaction, then we replay it.
-		 * If there was an error, we're done with the journal replay.
-		 * (If the error occurred after the "end," then we don't care,
-		 * and it's not a bad journal.)
-		 */
-		rv = replayTransaction(txn,
-				       jnlSwap->swap32(jhdr.blhdr_size),
-				       jnlSwap->swap32(jhdr.jhdr_size),
-				       jnlSwap,
-				       do_write_b);
+		freeJournalTxn(jt);
+	}
+	jqStop(&r.queue);
+	pthread_join(reader, NULL);
+	jqDestroy(&r.queue, freeJournalTxn);
+	if (r.bad_journal)
+		bad_journal = 1;
 
-		if (rv < 0) {
-			if (debug)
-				plog("\tTransaction replay failed, returned %d\n", rv);
-			if (into_the_weeds) {
-				if (debug)
-					plog("\t\tAnd we don't care\n");
-			} else {
+	/*
+	 * Write out what was indexed -- even if the journal turned out to
+	 * be bad, everything before the bad transaction gets written, as it
+	 * always has.
+	 */
+	if (jr_finish(&r.index) != 0) {
+		fplog(stderr, "%s:  unable to sort the journal blocks from %s\n", __FUNCTION__, jdev_name);
+		bad_journal = 1;
+	} else if (do_write_b && r.index.ji_count > 0) {
+		jqInit(&r.queue);
+		error = pthread_create(&reader, NULL, journalReadRuns, &r);
+		if (error != 0) {
+			fplog(stderr, "%s:  unable to start journal reader for %s: %s\n", __FUNCTION__, jdev_name, strerror(error));
+			jqDestroy(&r.queue, free);
+			jr_destroy(&r.index);
+			return -1;
+		}
+		while ((run = jqGet(&r.queue)) != NULL) {
+			// "do_write_b" returns -1 to stop the replay
+			if ((do_write_b)(run->start, run->data, run->length) == -1) {
 				bad_journal = 1;
+				free(run);
+				break;
 			}
-			break;
+			writes++;
+			free(run);
 		}
-		last_sequence_number = jnlSwap->swap32(txn->binfo[0].next);
-		free(txn);
-		txn = NULL;
+		jqStop(&r.queue);
+		pthread_join(reader, NULL);
+		jqDestroy(&r.queue, free);
+		if (r.read_error)
+			bad_journal = 1;
+		if (debug)
+			plog("Journal replay wrote %u blocks in %u writes\n", r.index.ji_count, writes);
 	}
-	if (txn)
-		free(txn);
+	jr_destroy(&r.index);
+
 	if (bad_journal) {
 		if (debug)
 			plog("Journal was bad, stopped replaying\n");
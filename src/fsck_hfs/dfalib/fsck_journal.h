@@ -40,7 +40,7 @@
 typedef struct block_info {
 	uint64_t	bnum;
 	uint32_t	bsize;
-	uint32_t	next;
+	uint32_t	next;	// Sequence number in binfo[0], checksum of the data in the rest
 } __attribute__((__packed__)) block_info;
 
 /*
@@ -54,10 +54,14 @@ typedef struct block_list_header {
 	uint16_t	num_blocks;
 	uint32_t	bytes_used;
 	uint32_t	checksum;
-	uint32_t	pad;
+	uint32_t	flags;
 	block_info	binfo[1];
 } __attribute__((__packed__)) block_list_header;
 
+#define BLHDR_CHECK_CHECKSUMS	0x0001	// The blocks have checksums in binfo[].next
+#define BLHDR_FIRST_HEADER	0x0002	// First block_list_header of a transaction
+#define BLHDR_CRC32C_CHECKSUMS	0x0004	// The same, but CRC32C (<hfs/hfs_cksum.h>)
+
 /*
  * This is written to block zero of the journal and it
  * maintains overall state about the journal.
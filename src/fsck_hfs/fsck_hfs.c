@@ -42,6 +42,8 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <TargetConditionals.h>
 
@@ -89,6 +91,8 @@ int	rebuildOptions;	/* Options to indicate which btree should be rebuilt */
 char	modeSetting;	/* set the mode when creating "lost+found" directory */
 char	errorOnExit = 0;	/* Exit on first error */
 int		upgrading;		/* upgrading format */
+int		verifyJobs = 1;	/* worker threads for the verify read and B-tree phases (-j) */
+char	*statsFile;		/* where to write per-phase timing and counters (-t) */
 int		lostAndFoundMode = 0; /* octal mode used when creating "lost+found" directory */
 uint64_t reqCacheSize;	/* Cache size requested by the caller (may be specified by the user via -c) */
 int     detonator_run = 0;
@@ -102,11 +106,13 @@ Cache_t fscache;
  * Variables used to map physical block numbers to file paths
  */
 enum { BLOCK_LIST_INCREMENT = 512 };
+enum { MAXSCANJOBS = 64 };
 int gBlkListEntries = 0;
 uint64_t *gBlockList = NULL;
 int gFoundBlockEntries = 0;
 struct found_blocks *gFoundBlocksList = NULL;
 long gBlockSize = 512;
+static size_t scanSize = 1024 * 1024;	/* size of each read made by -S (-s) */
 static void ScanDisk(int);
 static int getblocklist(const char *filepath);
 
@@ -134,7 +140,7 @@ main(argc, argv)
 	else
 		progname = *argv;
 
-	while ((ch = getopt(argc, argv, "b:B:c:D:e:Edfglm:npqrR:SuyxJ")) != EOF) {
+	while ((ch = getopt(argc, argv, "b:B:c:D:e:Edfgj:lm:npqrR:s:St:uyxJ")) != EOF) {
 		switch (ch) {
 		case 'b':
 			gBlockSize = atoi(optarg);
@@ -147,6 +153,27 @@ main(argc, argv)
 		case 'S':
 			scanflag = 1;
 			break;
+		case 's':
+			/* Size of each read made by the disk scan */
+			scanSize = strtoull(optarg, &lastChar, 0);
+			if (*lastChar) {
+				switch (tolower(*lastChar)) {
+					case 'm':
+						scanSize *= 1024;
+						/* fall through */
+					case 'k':
+						scanSize *= 1024;
+						break;
+					default:
+						scanSize = 0;
+						break;
+				};
+			}
+			if (scanSize < 512 || scanSize > 64 * 1024 * 1024) {
+				(void) fplog(stderr, "%s: invalid scan size %s\n", progname, optarg);
+				usage();
+			}
+			break;
 		case 'B':
 			getblocklist(optarg);
 			break;
@@ -207,6 +234,18 @@ main(argc, argv)
 			guiControl++;
 			break;
 
+		case 'j':
+			verifyJobs = atoi(optarg);
+			if (verifyJobs < 1) {
+				(void) fplog(stderr, "%s: invalid job count %s\n", progname, optarg);
+				usage();
+			}
+			break;
+
+		case 't':
+			statsFile = optarg;
+			break;
+
 		case 'x':
 			guiControl = 1;
 			xmlControl++;
@@ -544,9 +583,13 @@ checkfilesys(char * filesys)
 		result = EEXIT;
 		goto ExitThisRoutine;
 	}
+	if (statsFile != NULL)
+		StatsStart();
 	if (scanflag != 0) {
 		plog("Scanning entire disk for bad blocks\n");
+		StatsPhaseBegin(NULL, "scan");
 		ScanDisk(fsreadfd);
+		StatsPhaseEnd();
 	}
 
 	result = CheckHFS( filesys, fsreadfd, fswritefd, chkLev, repLev, context,
@@ -555,6 +598,13 @@ checkfilesys(char * filesys)
     if (debug)
 		plog("\tCheckHFS returned %d, fsmodified = %d\n", result, fsmodified);
 
+	if (statsFile != NULL) {
+		int error = StatsWrite(statsFile, xmlControl, filesys, result);
+		if (error)
+			(void) fplog(stderr, "%s: cannot write statistics to %s: %s\n",
+				     progname, statsFile, strerror(error));
+	}
+
 	if (!hotmount) {
 		ckfini(1);
 		if (quick) {
@@ -800,6 +850,10 @@ setup( char *dev, int *canWritePtr )
 		return (0);
 	}	
 
+	/* With -j, keep that many reads in flight */
+	if (verifyJobs > 1)
+		(void) CacheIOStart (&fscache, verifyJobs);
+
 	return (1);
 }
 
@@ -885,7 +939,7 @@ ExitThisRoutine:
 static void
 usage()
 {
-	(void) fplog(stderr, "usage: %s [-b [size] B [path] c [size] e [mode] ESdfglx m [mode] npqruy] special-device\n", progname);
+	(void) fplog(stderr, "usage: %s [-b [size] B [path] c [size] e [mode] ESdfglx j [jobs] m [mode] npqru s [size] t [file] y] special-device\n", progname);
 	(void) fplog(stderr, "  b size = size of physical blocks (in bytes) for -B option\n");
 	(void) fplog(stderr, "  B path = file containing physical block numbers to map to paths\n");
 	(void) fplog(stderr, "  c size = cache size (ex. 512m, 1g)\n");
@@ -894,6 +948,7 @@ usage()
 	(void) fplog(stderr, "  d = output debugging info\n");
 	(void) fplog(stderr, "  f = force fsck even if clean (preen only) \n");
 	(void) fplog(stderr, "  g = GUI output mode\n");
+	(void) fplog(stderr, "  j jobs = number of threads used to read the B-trees, bitmap and disk\n");
 	(void) fplog(stderr, "  x = XML output mode\n");
 	(void) fplog(stderr, "  l = live fsck (lock down and test-only)\n");
 	(void) fplog(stderr, "  m arg = octal mode used when creating lost+found directory \n");
@@ -901,7 +956,9 @@ usage()
 	(void) fplog(stderr, "  p = just fix normal inconsistencies \n");
 	(void) fplog(stderr, "  q = quick check returns clean, dirty, or failure \n");
 	(void) fplog(stderr, "  r = rebuild catalog btree \n");
+	(void) fplog(stderr, "  s size = size of each read when scanning for bad blocks (ex. 256k, 1m)\n");
 	(void) fplog(stderr, "  S = Scan disk for bad blocks\n");
+	(void) fplog(stderr, "  t file = write per-phase timing and counters to file (JSON, plist with -x)\n");
 	(void) fplog(stderr, "  u = usage \n");
 	(void) fplog(stderr, "  y = assume a yes response \n");
 	
@@ -934,126 +991,296 @@ siginfo(int signo)
 	printStatus = 1;
 }
 
+/*
+ * State shared by the disk scan threads.  The device is handed out in
+ * ioSize chunks from 'next'; everything but 'done' is protected by 'lock'.
+ */
+typedef struct ScanState {
+	pthread_mutex_t	lock;
+	int		fd;
+	uint32_t	devBlockSize;
+	off_t		diskSize;	/* 0 if the device size is unknown */
+	size_t		ioSize;
+	off_t		next;		/* next offset to hand out */
+	off_t		done;		/* bytes scanned (updated atomically) */
+	int		stop;		/* end of disk, too many errors, or a fatal error */
+	uint32_t	numErrors;
+	uint32_t	maxErrors;
+	struct timespec	start;
+} ScanState;
+
+static double
+ScanElapsed(ScanState *scan)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - scan->start.tv_sec) +
+	       (now.tv_nsec - scan->start.tv_nsec) / 1000000000.0;
+}
+
+static int
+ScanStopped(ScanState *scan)
+{
+	int stop;
+
+	pthread_mutex_lock(&scan->lock);
+	stop = scan->stop;
+	pthread_mutex_unlock(&scan->lock);
+	return (stop);
+}
+
+static void
+ScanStop(ScanState *scan)
+{
+	pthread_mutex_lock(&scan->lock);
+	scan->stop = 1;
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static void
+ScanStatus(ScanState *scan)
+{
+	off_t done = __sync_fetch_and_add(&scan->done, 0);
+	double secs = ScanElapsed(scan);
+	unsigned long long rate = secs > 0 ? (unsigned long long)(done / secs) / (1024 * 1024) : 0;
+	uint32_t errors;
+
+	pthread_mutex_lock(&scan->lock);
+	errors = scan->numErrors;
+	pthread_mutex_unlock(&scan->lock);
+
+	if (scan->diskSize) {
+		fprintf(stderr, "Scanning offset %lld of %lld (%d%%), %llu MB/s, %u bad blocks\n",
+			(long long)done, (long long)scan->diskSize,
+			(int)((done * 100) / scan->diskSize), rate, errors);
+	} else {
+		fprintf(stderr, "Scanning offset %lld, %llu MB/s, %u bad blocks\n",
+			(long long)done, rate, errors);
+	}
+}
+
+/*
+ * Record a bad device block.  Returns non-zero once we have seen too many.
+ */
+static int
+ScanBadBlock(ScanState *scan, off_t offset)
+{
+	int stop;
+
+	pthread_mutex_lock(&scan->lock);
+	if (debug)
+		fprintf(stderr, "Bad block at offset %lld\n", (long long)offset);
+	AddBlockToList(offset / gBlockSize);
+	if (++scan->numErrors > scan->maxErrors) {
+		if (debug && !scan->stop)
+			fprintf(stderr, "Got %u errors, maxing out so stopping scan\n", scan->numErrors);
+		scan->stop = 1;
+	}
+	stop = scan->stop;
+	pthread_mutex_unlock(&scan->lock);
+
+	return (stop);
+}
+
+/*
+ * A read of [offset, offset + len) failed with EIO.  Rather than retry it a
+ * device block at a time, split it in half and only descend into the halves
+ * that fail again, so a single bad sector in a 1MB read costs about twenty
+ * reads instead of two thousand.
+ */
+static void
+ScanBisect(ScanState *scan, uint8_t *buffer, off_t offset, size_t len)
+{
+	size_t half;
+	ssize_t nread;
+	int i;
+
+	if (len <= scan->devBlockSize) {
+		(void) ScanBadBlock(scan, offset);
+		return;
+	}
+
+	half = ((len / scan->devBlockSize) / 2) * scan->devBlockSize;
+	for (i = 0; i < 2 && !ScanStopped(scan); i++) {
+		off_t off = (i == 0) ? offset : offset + half;
+		size_t size = (i == 0) ? half : len - half;
+
+		do {
+			nread = pread(scan->fd, buffer, size, off);
+		} while (nread == -1 && errno == EINTR);
+
+		if (nread == -1) {
+			if (errno == EIO) {
+				ScanBisect(scan, buffer, off, size);
+			} else {
+				pfatal("Got a non I/O error reading disk at offset %llu: %s\n",
+					(unsigned long long)off, strerror(errno));
+				exit(EEXIT);
+			}
+		} else if ((size_t)nread < size && (size_t)nread % scan->devBlockSize != 0) {
+			pwarn("During disk scan, did not get block size (%zd) read, got %zd instead.  Skipping rest of this block.\n", (size_t)scan->devBlockSize, nread);
+		}
+	}
+}
+
+/* One scanning thread, with its read buffer */
+typedef struct ScanJob {
+	ScanState	*scan;
+	uint8_t		*buffer;
+} ScanJob;
+
+static void *
+ScanWorker(void *arg)
+{
+	ScanState *scan = ((ScanJob *)arg)->scan;
+	uint8_t *buffer = ((ScanJob *)arg)->buffer;
+	off_t offset, end;
+	size_t len;
+	ssize_t nread;
+
+	for (;;) {
+		if (printStatus && __sync_bool_compare_and_swap(&printStatus, 1, 0))
+			ScanStatus(scan);
+
+		pthread_mutex_lock(&scan->lock);
+		if (scan->stop || (scan->diskSize && scan->next >= scan->diskSize)) {
+			pthread_mutex_unlock(&scan->lock);
+			break;
+		}
+		offset = scan->next;
+		len = scan->ioSize;
+		if (scan->diskSize && (off_t)len > scan->diskSize - offset)
+			len = scan->diskSize - offset;
+		scan->next += len;
+		pthread_mutex_unlock(&scan->lock);
+
+		/* A short read skips on to the next device block, as it always has. */
+		for (end = offset + len; offset < end && !ScanStopped(scan); ) {
+			len = end - offset;
+			do {
+				nread = pread(scan->fd, buffer, len, offset);
+			} while (nread == -1 && errno == EINTR);
+
+			if (nread == -1) {
+				if (errno == EIO) {
+					ScanBisect(scan, buffer, offset, len);
+				} else {
+					pfatal("Got a non I/O error reading disk at offset %llu:  %s\n",
+						(unsigned long long)offset, strerror(errno));
+					exit(EEXIT);
+				}
+				nread = len;
+			} else if (nread == 0) {
+				/* We're done with the disk */
+				ScanStop(scan);
+				break;
+			}
+			(void) __sync_fetch_and_add(&scan->done, (off_t)nread);
+			offset += roundup((size_t)nread, scan->devBlockSize);
+		}
+	}
+
+	return (NULL);
+}
+
+static int
+ScanCompare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Read the whole device looking for I/O errors, with up to verifyJobs reads
+ * of scanSize bytes in flight.  Bad device blocks are added to the block
+ * list, to be mapped to files later on.
+ */
 static void
 ScanDisk(int fd)
 {
-	uint32_t devBlockSize = 512;
-	uint64_t devBlockTotal;
-	off_t diskSize;
+	ScanState scan;
+	pthread_t threads[MAXSCANJOBS];
+	ScanJob job[MAXSCANJOBS];
+	int jobs = verifyJobs;
+	int started = 0;
+	int error;
+	int i;
 	uint8_t *buffer = NULL;
-	size_t bufSize = 1024 * 1024;
-	ssize_t nread;
-	off_t curPos = 0;
 	void (*oldhandler)(int);
-	uint32_t numErrors = 0;
-	uint32_t maxErrors = 40;	// Something more variable?
 
-	oldhandler = signal(SIGINFO, &siginfo);
+	memset(&scan, 0, sizeof(scan));
+	pthread_mutex_init(&scan.lock, NULL);
+	scan.fd = fd;
+	scan.maxErrors = 40;	// Something more variable?
 
-#define PRSTAT \
-	do { \
-		if (diskSize) { \
-			fprintf(stderr, "Scanning offset %lld of %lld (%d%%)\n", \
-				curPos, diskSize, (int)((curPos * 100) / diskSize)); \
-		} else { \
-			fprintf(stderr, "Scanning offset %lld\n", curPos); \
-		} \
-		printStatus = 0; \
-	} while (0)
+	oldhandler = signal(SIGINFO, &siginfo);
 
-    
-	if (ioctl(fd, DIOCGSECTORSIZE, &devBlockSize) == -1) {
-		devBlockSize = 512;
+	if (ioctl(fd, DIOCGSECTORSIZE, &scan.devBlockSize) == -1) {
+		scan.devBlockSize = 512;
 	}
 
-	if (ioctl(fd, DIOCGMEDIASIZE, &diskSize) == -1) {
-		diskSize = 0;
-	} else
-		devBlockTotal = diskSize / devBlockSize;
+	if (ioctl(fd, DIOCGMEDIASIZE, &scan.diskSize) == -1) {
+		scan.diskSize = 0;
+	}
 
-	while (buffer == NULL && bufSize >= devBlockSize) {
-		buffer = malloc(bufSize);
+	scan.ioSize = (scanSize / scan.devBlockSize) * scan.devBlockSize;
+	if (scan.ioSize == 0)
+		scan.ioSize = scan.devBlockSize;
+	while (buffer == NULL && scan.ioSize >= scan.devBlockSize) {
+		buffer = malloc(scan.ioSize);
 		if (buffer == NULL) {
-			bufSize /= 2;
+			scan.ioSize /= 2;
 		}
 	}
 	if (buffer == NULL) {
 		pfatal("Cannot allocate buffer for disk scan.\n");
 	}
-
-loop:
-
-	if (printStatus) {
-		PRSTAT;
-	}
-	while ((nread = pread(fd, buffer, bufSize, curPos)) == bufSize) {
-		curPos += bufSize;
-		if (printStatus) {
-			PRSTAT;
+	if (jobs > MAXSCANJOBS)
+		jobs = MAXSCANJOBS;
+	if (jobs < 1)
+		jobs = 1;
+
+	/* Every thread gets its buffer now, so none of them fails to start. */
+	job[0].scan = &scan;
+	job[0].buffer = buffer;
+	for (i = 1; i < jobs; i++) {
+		job[i].scan = &scan;
+		job[i].buffer = malloc(scan.ioSize);
+		if (job[i].buffer == NULL) {
+			pwarn("Cannot allocate buffers for %d disk scan threads, using %d.\n", jobs, i);
+			jobs = i;
+			break;
 		}
 	}
 
-	if (nread == 0) {
-		/* We're done with the disk */
-		goto done;
-	}
-	if (nread == -1) {
-		if (errno == EIO) {
-			/* Try reading devBlockSize blocks */
-			size_t total;
-			for (total = 0; total < bufSize; total += devBlockSize) {
-				nread = pread(fd, buffer, devBlockSize, curPos + total);
-				if (nread == -1) {
-					if (errno == EIO) {
-						if (debug)
-							fprintf(stderr, "Bad block at offset %lld\n", curPos + total);
-						AddBlockToList((curPos + total) / gBlockSize);
-						if (++numErrors > maxErrors) {
-							if (debug)
-								fprintf(stderr, "Got %u errors, maxing out so stopping scan\n", numErrors);
-							goto done;
-						}
-						continue;
-					} else {
-						pfatal("Got a non I/O error reading disk at offset %llu: %s\n",
-							curPos + total, strerror(errno));
-						// Hey, pfatal wasn't fatal!
-						// But that seems to work out for us for some reason.
-					}
-				}
-				if (nread == 0) {
-					/* End of disk, somehow. */
-					goto done;
-				}
-				if (nread != devBlockSize) {
-					pwarn("During disk scan, did not get block size (%zd) read, got %zd instead.  Skipping rest of this block.\n", (size_t)devBlockSize, nread);
-					continue;
-				}
-			}
-			curPos += total;
-			goto loop;
-		} else if (errno == EINTR) {
-			goto loop;
-		} else {
-			pfatal("Got a non I/O error reading disk at offset %llu:  %s\n", curPos, strerror(errno));
-			exit(EEXIT);
-		}
-	}
-	if (nread < bufSize) {
-		if ((nread % devBlockSize) == 0) {
-			curPos += nread;
-		} else {
-			curPos = curPos + (((nread % devBlockSize) + 1) * devBlockSize);
+	clock_gettime(CLOCK_MONOTONIC, &scan.start);
+	for (i = 1; i < jobs; i++) {
+		if ((error = pthread_create(&threads[started], NULL, ScanWorker, &job[i])) != 0) {
+			pwarn("Cannot start disk scan thread: %s\n", strerror(error));
+			break;
 		}
-		goto loop;
+		started++;
 	}
-	goto loop;
-done:
-	if (buffer)
-		free(buffer);
+	/* This thread scans as well */
+	(void) ScanWorker(&job[0]);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < jobs; i++)
+		free(job[i].buffer);
+
+	if (debug)
+		ScanStatus(&scan);
+
+	/* The threads find bad blocks out of order */
+	if (gBlkListEntries > 1)
+		qsort(gBlockList, gBlkListEntries, sizeof(uint64_t), ScanCompare);
+
+	pthread_mutex_destroy(&scan.lock);
 	signal(SIGINFO, oldhandler);
 	return;
-
 }
 
 static int
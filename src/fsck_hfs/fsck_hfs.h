@@ -37,6 +37,8 @@ extern char	hotroot;		/* checking root device */
 extern char	scanflag;		/* Scan disk for bad blocks */
 
 extern int	upgrading;		/* upgrading format */
+extern int	verifyJobs;		/* worker threads for the verify read and B-tree phases */
+extern char	*statsFile;		/* per-phase timing and counters output (-t) */
 
 extern int	fsmodified;		/* 1 => write done to file system */
 extern int	fsreadfd;		/* file descriptor for reading file system */
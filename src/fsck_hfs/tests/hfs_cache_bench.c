@@ -0,0 +1,397 @@
+//
+//  hfs_cache_bench.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Hit and miss latency of the fsck_hfs block cache (fsck_hfs/cache.c).
+ *
+ * A sparse image is laid out as a hit set of cache blocks, filled with a
+ * pattern and read until it is resident, followed by a miss region that is
+ * never read twice.  Three runs of 4 KB reads, the size of a B-tree node:
+ *
+ *	hit	random nodes from the hit set, one thread
+ *	miss	one node from each of the miss region's cache blocks, in a
+ *		shuffled order so that read-ahead never kicks in
+ *	hit/j	the hit run again, split over -j threads
+ *
+ * Every node read from the hit set is checked against the pattern, and the
+ * disk reads per operation show whether a run really hit or missed.
+ *
+ * The bench only uses the CacheInit/CacheRead/CacheRelease API, so the same
+ * source builds against the sharded cache and against the single-list cache
+ * it replaced.  The old cache is not thread-safe; build it with
+ * -DCACHE_SERIAL, which puts every call under one mutex, the way threads
+ * would have had to share it.  fsck_hfs/tests/Makefile builds the bench
+ * against the sharded cache; by hand, from this directory:
+ *
+ *	cc -O2 -I.. -o hfs_cache_bench hfs_cache_bench.c ../cache.c -lpthread
+ *
+ *	mkdir old && for f in cache.c cache.h fsck_hfs.h; do \
+ *		git show <rev>:src/fsck_hfs/$f | \
+ *		sed 's,<sys/stdint.h>,<stdint.h>,' > old/$f; done
+ *	cc -O2 -DCACHE_SERIAL -Iold -o hfs_cache_bench_old \
+ *		hfs_cache_bench.c old/cache.c -lpthread
+ *
+ *	hfs_cache_bench [-b cache-blocks] [-h hit-blocks] [-j threads]
+ *		[-n ops] [-s seed] [directory]
+ *
+ * The image (cache.img) goes in 'directory', /tmp by default.  -b sets the
+ * cache size in 32 KB blocks; the old cache hashes all of them into
+ * CacheHashSize chains.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsck_hfs.h"
+
+#define NODE_SIZE	4096
+
+char debug = 0;			/* cache.c logs through this */
+
+static Cache_t cache;
+static int fd;
+static u_int32_t block_size = DefaultCacheBlockSize;
+static u_int32_t hit_blocks;	/* cache blocks in the hit set */
+static u_int64_t miss_base;	/* start of the miss region */
+
+/* fsck_hfs.h turns printf into plog, which normally also writes the log file */
+void
+vplog(const char *fmt, va_list ap)
+{
+	vprintf(fmt, ap);
+}
+
+void
+plog(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+void
+fplog(FILE *stream, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stream, fmt, ap);
+	va_end(ap);
+}
+
+#ifdef CACHE_SERIAL
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_ENTER()	pthread_mutex_lock(&cache_lock)
+#define CACHE_EXIT()	pthread_mutex_unlock(&cache_lock)
+#else
+#define CACHE_ENTER()	((void)0)
+#define CACHE_EXIT()	((void)0)
+#endif
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	u_int64_t x = *(const u_int64_t *)a, y = *(const u_int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Each 64-bit word of the hit set holds its own offset */
+static void
+write_image(const char *path)
+{
+	u_int64_t *buf;
+	u_int64_t off;
+	size_t i;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		err(1, "%s", path);
+	buf = malloc(block_size);
+	if (buf == NULL)
+		err(1, "image buffer");
+	for (off = 0; off < miss_base; off += block_size) {
+		for (i = 0; i < block_size / sizeof(u_int64_t); i++)
+			buf[i] = off + i * sizeof(u_int64_t);
+		if (pwrite(fd, buf, block_size, (off_t)off) != (ssize_t)block_size)
+			err(1, "write %s", path);
+	}
+	free(buf);
+}
+
+static void
+read_node(u_int64_t off, bool check)
+{
+	Buf_t *bp;
+	u_int64_t first, last;
+	int error;
+
+	CACHE_ENTER();
+	error = CacheRead(&cache, off, NODE_SIZE, &bp);
+	if (error)
+		errx(1, "CacheRead %llu: %s", (unsigned long long)off, strerror(error));
+	memcpy(&first, bp->Buffer, sizeof(first));
+	memcpy(&last, (char *)bp->Buffer + NODE_SIZE - sizeof(last), sizeof(last));
+	CacheRelease(&cache, bp, 0);
+	CACHE_EXIT();
+
+	if (check && (first != off || last != off + NODE_SIZE - sizeof(last)))
+		errx(1, "node at %llu holds %llu..%llu", (unsigned long long)off,
+			 (unsigned long long)first, (unsigned long long)last);
+}
+
+static u_int64_t
+random_hit_node(unsigned *seed)
+{
+	u_int32_t nodes = block_size / NODE_SIZE;
+
+	return (u_int64_t)(rand_r(seed) % (hit_blocks * nodes)) * NODE_SIZE;
+}
+
+/*
+ * Read the hit set until a whole pass finds it resident.  The sharded cache
+ * keeps blocks seen only once on its In queue, so it takes a second pass for
+ * them to stay.
+ */
+static void
+warm(void)
+{
+	u_int32_t disk, i;
+	int pass;
+
+	for (pass = 0; pass < 8; pass++) {
+		disk = cache.DiskRead;
+		for (i = 0; i < hit_blocks; i++)
+			read_node((u_int64_t)i * block_size, true);
+		if (cache.DiskRead == disk)
+			return;
+	}
+	errx(1, "hit set of %u blocks does not stay in the cache", hit_blocks);
+}
+
+static void
+report(const char *name, int threads, u_int64_t *lat, long ops, u_int64_t wall,
+	   u_int32_t disk)
+{
+	u_int64_t sum = 0;
+	long i;
+
+	for (i = 0; i < ops; i++)
+		sum += lat[i];
+	qsort(lat, ops, sizeof(u_int64_t), cmp_u64);
+	printf("%-6s %7d %10.0f %10llu %10llu %12.0f %8.3f\n",
+		   name, threads, (double)sum / ops,
+		   (unsigned long long)lat[ops / 2],
+		   (unsigned long long)lat[ops * 99 / 100],
+		   (double)ops * 1e9 / wall, (double)disk / ops);
+}
+
+static void
+run_hit(long ops)
+{
+	unsigned seed = (unsigned)random();
+	u_int64_t *lat, t0;
+	u_int32_t disk = cache.DiskRead;
+	long i;
+
+	lat = calloc(ops, sizeof(u_int64_t));
+	if (lat == NULL)
+		err(1, "latencies");
+	t0 = now_ns();
+	for (i = 0; i < ops; i++) {
+		u_int64_t t = now_ns();
+
+		read_node(random_hit_node(&seed), true);
+		lat[i] = now_ns() - t;
+	}
+	report("hit", 1, lat, ops, now_ns() - t0, cache.DiskRead - disk);
+	free(lat);
+}
+
+static void
+run_miss(long ops)
+{
+	u_int32_t nodes = block_size / NODE_SIZE;
+	u_int64_t *lat, *off, t0;
+	u_int32_t disk = cache.DiskRead;
+	long i;
+
+	lat = calloc(ops, sizeof(u_int64_t));
+	off = calloc(ops, sizeof(u_int64_t));
+	if (lat == NULL || off == NULL)
+		err(1, "latencies");
+	for (i = 0; i < ops; i++)
+		off[i] = miss_base + (u_int64_t)i * block_size +
+			(u_int64_t)(random() % nodes) * NODE_SIZE;
+	for (i = ops - 1; i > 0; i--) {
+		long j = random() % (i + 1);
+		u_int64_t o = off[i];
+
+		off[i] = off[j];
+		off[j] = o;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < ops; i++) {
+		u_int64_t t = now_ns();
+
+		read_node(off[i], false);
+		lat[i] = now_ns() - t;
+	}
+	report("miss", 1, lat, ops, now_ns() - t0, cache.DiskRead - disk);
+	free(off);
+	free(lat);
+}
+
+struct worker {
+	pthread_t	thread;
+	unsigned	seed;
+	long		ops;
+	u_int64_t *	lat;
+};
+
+static void *
+hit_worker(void *arg)
+{
+	struct worker *w = arg;
+	long i;
+
+	for (i = 0; i < w->ops; i++) {
+		u_int64_t t = now_ns();
+
+		read_node(random_hit_node(&w->seed), true);
+		w->lat[i] = now_ns() - t;
+	}
+	return NULL;
+}
+
+static void
+run_hit_threads(long ops, int threads)
+{
+	struct worker *w;
+	u_int64_t *lat, t0, wall;
+	u_int32_t disk = cache.DiskRead;
+	long per = ops / threads;
+	int error, i;
+
+	w = calloc(threads, sizeof(*w));
+	lat = calloc(per * threads, sizeof(u_int64_t));
+	if (w == NULL || lat == NULL)
+		err(1, "workers");
+	t0 = now_ns();
+	for (i = 0; i < threads; i++) {
+		w[i].seed = (unsigned)random();
+		w[i].ops = per;
+		w[i].lat = lat + per * i;
+		error = pthread_create(&w[i].thread, NULL, hit_worker, &w[i]);
+		if (error)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(w[i].thread, NULL);
+	wall = now_ns() - t0;
+	report("hit/j", threads, lat, per * threads, wall, cache.DiskRead - disk);
+	free(lat);
+	free(w);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_cache_bench [-b cache-blocks] [-h hit-blocks] [-j threads] "
+			"[-n ops] [-s seed] [directory]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	u_int32_t blocks = 8192;
+	const char *dir = "/tmp";
+	char path[1024];
+	long ops = 200000;
+	int threads = 4;
+	int ch, error;
+
+	srandom(1);
+	hit_blocks = 0;
+	while ((ch = getopt(argc, argv, "b:h:j:n:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			blocks = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			hit_blocks = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		dir = argv[optind++];
+	if (hit_blocks == 0)
+		hit_blocks = blocks / 2;
+	if (optind != argc || blocks < MinCacheBlocks || hit_blocks > blocks / 2 ||
+		threads <= 0 || ops < threads)
+		usage();
+
+	miss_base = (u_int64_t)hit_blocks * block_size;
+	snprintf(path, sizeof(path), "%s/cache.img", dir);
+	write_image(path);
+	if (ftruncate(fd, (off_t)(miss_base + (u_int64_t)ops * block_size)) == -1)
+		err(1, "%s", path);
+
+	error = CacheInit(&cache, fd, fd, 512, block_size, blocks, CacheHashSize, 0);
+	if (error)
+		errx(1, "CacheInit: %s", strerror(error));
+	warm();
+
+	printf("%u cache blocks of %u KB, %u hash buckets, hit set %u blocks, %ld ops\n",
+		   blocks, block_size / 1024, cache.HashSize, hit_blocks, ops);
+	printf("test   threads   mean(ns) median(ns)    p99(ns)        ops/s  disk/op\n");
+	run_hit(ops);
+	run_miss(ops);
+	warm();
+	run_hit_threads(ops, threads);
+
+	CacheDestroy(&cache);
+	close(fd);
+	unlink(path);
+
+	return 0;
+}
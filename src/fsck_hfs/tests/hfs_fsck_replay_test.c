@@ -0,0 +1,340 @@
+//
+//  hfs_fsck_replay_test.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Check fsck_hfs's journal replay (fsck_hfs/dfalib/fsck_journal.c) against
+ * the journal it is given.
+ *
+ * Writes a synthetic journal: transactions of one to three block list
+ * headers, the first flagged BLHDR_FIRST_HEADER, of 512-byte, 4 KB and 8 KB
+ * blocks at random places on a small disk, some of them killed (block number
+ * ~0), wrapping around the end of the journal, and ending with a transaction
+ * past the end the journal header gives, with the next sequence number, the
+ * way a crash leaves it.  The blocks are also applied in journal order to a
+ * reference image.  journal_open() then replays the journal onto a second
+ * image, and the test fails unless it succeeds and the two images come out
+ * the same.
+ *
+ * The test only uses journal_open(), so the same source builds against the
+ * pipelined replay and against the serial one it replaced.
+ * fsck_hfs/tests/Makefile builds it against the pipelined one; by hand, with
+ * a compiler that has blocks, from this directory:
+ *
+ *	cc -O2 -fblocks -I../dfalib -I../../kmod/darwin -I../../kmod/core \
+ *		-o hfs_fsck_replay_test hfs_fsck_replay_test.c \
+ *		../dfalib/fsck_journal.c ../../kmod/core/hfs_replay.c \
+ *		../../kmod/core/hfs_cksum.c -lBlocksRuntime -lpthread
+ *
+ *	mkdir old && git show <rev>:src/fsck_hfs/dfalib/fsck_journal.c \
+ *		> old/fsck_journal.c
+ *	cc -O2 -fblocks -I../dfalib -I../../kmod/darwin -I../../kmod/core \
+ *		-o hfs_fsck_replay_test_old hfs_fsck_replay_test.c \
+ *		old/fsck_journal.c ../../kmod/core/hfs_cksum.c -lBlocksRuntime
+ *
+ *	hfs_fsck_replay_test [-cx] [-j journal-MB] [-s seed] [directory]
+ *
+ * The journal (journal.img) goes in 'directory', /tmp by default.  -c
+ * checksums the blocks with CRC32C instead of the legacy checksum.  -x
+ * corrupts a block of the first transaction, and then the replay has to
+ * fail.  The serial replay checks neither kind of block checksum, so both
+ * options only apply to the pipelined one.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsck_journal.h"
+#include "hfs_cksum.h"
+
+#define JHDR_SIZE	512			/* journal header and device block size */
+#define BLHDR_SIZE	4096		/* block list header size */
+#define MAX_BLOCKS	30			/* blocks per block list header */
+#define MAX_TXN		(3 * (BLHDR_SIZE + MAX_BLOCKS * 8192))
+#define DISK_SIZE	(4 << 20)
+
+char debug = 0;			/* fsck_journal.c logs through this */
+
+static u_int8_t *disk_ref;
+static u_int8_t *disk_new;
+static u_int32_t writes;
+
+/* fsck_hfs.h turns printf into plog, which normally also writes the log file */
+void
+vplog(const char *fmt, va_list ap)
+{
+	vprintf(fmt, ap);
+}
+
+void
+plog(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+void
+fplog(FILE *stream, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stream, fmt, ap);
+	va_end(ap);
+}
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t
+rnd(u_int32_t n)
+{
+	return n ? (u_int32_t)(random() % n) : 0;
+}
+
+static int
+write_disk(off_t offset, void *data, size_t length)
+{
+	if (offset < 0 || (u_int64_t)offset + length > DISK_SIZE)
+		errx(1, "replay wrote %zu bytes at %jd, past the disk", length, (intmax_t)offset);
+	memcpy(disk_new + offset, data, length);
+	writes++;
+	return 0;
+}
+
+/* Write 'length' bytes at 'pos' in the journal, wrapping past the header */
+static off_t
+write_journal(int fd, off_t size, off_t pos, const u_int8_t *buf, size_t length)
+{
+	size_t done, n;
+
+	for (done = 0; done < length; done += n) {
+		if (pos >= size)
+			pos = JHDR_SIZE;
+		n = length - done;
+		if (pos + (off_t)n > size)
+			n = (size_t)(size - pos);
+		if (pwrite(fd, buf + done, n, pos) != (ssize_t)n)
+			err(1, "journal");
+		pos += n;
+	}
+	return pos >= size ? JHDR_SIZE : pos;
+}
+
+/*
+ * Fill one block list header and its blocks in 'buf', applying the live
+ * blocks to the reference image.  Returns the bytes used.
+ */
+static u_int32_t
+make_blhdr(u_int8_t *buf, u_int32_t seq, bool first, bool crc32c)
+{
+	block_list_header *blhdr = (block_list_header *)buf;
+	u_int32_t nblocks = 1 + rnd(MAX_BLOCKS);
+	u_int32_t bytes = BLHDR_SIZE;
+	u_int32_t i, j, k, size;
+	u_int64_t bnum;
+	u_int8_t *data;
+
+	memset(buf, 0, BLHDR_SIZE);
+	blhdr->max_blocks = BLHDR_SIZE / sizeof(block_info) - 1;
+	blhdr->num_blocks = nblocks + 1;
+	blhdr->flags = crc32c ? BLHDR_CRC32C_CHECKSUMS : BLHDR_CHECK_CHECKSUMS;
+	if (first)
+		blhdr->flags |= BLHDR_FIRST_HEADER;
+	blhdr->binfo[0].next = seq;
+
+	for (i = 1; i <= nblocks; i++) {
+		k = rnd(100);
+		size = k < 5 ? 512 : k < 10 ? 8192 : 4096;
+		/* 4 KB aligned, or anywhere inside a 4 KB block for 512 bytes */
+		bnum = (u_int64_t)rnd(DISK_SIZE / 4096 - 2) * 8 + (size == 512 ? rnd(8) : 0);
+		data = buf + bytes;
+		for (j = 0; j < size; j++)
+			data[j] = (u_int8_t)random();
+
+		/* keep the first block live, -x corrupts it */
+		blhdr->binfo[i].bnum = i > 1 && rnd(50) == 0 ? ~0ULL : bnum;
+		blhdr->binfo[i].bsize = size;
+		blhdr->binfo[i].next = hfs_jnl_block_cksum(data, size, crc32c);
+		if (blhdr->binfo[i].bnum != ~0ULL)
+			memcpy(disk_ref + bnum * JHDR_SIZE, data, size);
+		bytes += size;
+	}
+
+	blhdr->bytes_used = bytes;
+	blhdr->checksum = 0;
+	blhdr->checksum = hfs_jnl_cksum(blhdr, sizeof(*blhdr));
+
+	return bytes;
+}
+
+/*
+ * Write the journal, starting near its end so that it wraps.  The last
+ * transaction is left past jh.end.  Returns the number of transactions, and
+ * in 'corrupt_at' where the first data block of the first one is.
+ */
+static u_int32_t
+make_journal(int fd, off_t size, bool crc32c, off_t *corrupt_at)
+{
+	journal_header jh;
+	u_int8_t *buf;
+	off_t start = size - 100 * JHDR_SIZE;
+	off_t pos = start, end = start;
+	u_int32_t seq = 100, txns = 0;
+	u_int32_t nhdrs, h, bytes;
+	u_int64_t used = 0;
+
+	buf = malloc(BLHDR_SIZE + MAX_BLOCKS * 8192);
+	if (buf == NULL)
+		err(1, "journal buffer");
+
+	*corrupt_at = start + BLHDR_SIZE;
+	if (*corrupt_at >= size)
+		*corrupt_at += JHDR_SIZE - size;
+
+	while (used + 2 * MAX_TXN < (u_int64_t)size - JHDR_SIZE) {
+		nhdrs = 1 + rnd(3);
+		for (h = 0; h < nhdrs; h++) {
+			bytes = make_blhdr(buf, seq, h == 0, crc32c);
+			pos = write_journal(fd, size, pos, buf, bytes);
+			used += bytes;
+		}
+		txns++;
+		seq++;
+		if (used + 2 * MAX_TXN < (u_int64_t)size - JHDR_SIZE)
+			end = pos;
+	}
+
+	/* Whatever comes after the last transaction must not replay */
+	memset(buf, 0, BLHDR_SIZE);
+	write_journal(fd, size, pos, buf, BLHDR_SIZE);
+
+	memset(&jh, 0, sizeof(jh));
+	jh.magic = JOURNAL_HEADER_MAGIC;
+	jh.endian = ENDIAN_MAGIC;
+	jh.start = start;
+	jh.end = end;
+	jh.size = size;
+	jh.blhdr_size = BLHDR_SIZE;
+	jh.jhdr_size = JHDR_SIZE;
+	jh.sequence_num = 100;
+	jh.checksum = hfs_jnl_cksum(&jh, JOURNAL_HEADER_CKSUM_SIZE);
+	if (pwrite(fd, &jh, sizeof(jh), 0) != sizeof(jh))
+		err(1, "journal header");
+
+	free(buf);
+	return txns;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_fsck_replay_test [-cx] [-j journal-MB] [-s seed] "
+			"[directory]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dir = "/tmp";
+	char path[1024];
+	off_t size = 8 << 20;
+	off_t corrupt_at;
+	bool crc32c = false, corrupt = false;
+	u_int32_t txns;
+	u_int64_t t0, t1;
+	u_int8_t c;
+	int ch, fd, rv;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "cj:s:x")) != -1) {
+		switch (ch) {
+		case 'c':
+			crc32c = true;
+			break;
+		case 'j':
+			size = (off_t)strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		case 'x':
+			corrupt = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		dir = argv[optind++];
+	if (optind != argc || size < 4 * MAX_TXN)
+		usage();
+
+	disk_ref = calloc(1, DISK_SIZE);
+	disk_new = calloc(1, DISK_SIZE);
+	if (disk_ref == NULL || disk_new == NULL)
+		err(1, "disk images");
+
+	snprintf(path, sizeof(path), "%s/journal.img", dir);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, size) == -1)
+		err(1, "%s", path);
+	txns = make_journal(fd, size, crc32c, &corrupt_at);
+	if (corrupt) {
+		if (pread(fd, &c, 1, corrupt_at) != 1)
+			err(1, "%s", path);
+		c ^= 0x5a;
+		if (pwrite(fd, &c, 1, corrupt_at) != 1)
+			err(1, "%s", path);
+	}
+
+	t0 = now_ns();
+	rv = journal_open(fd, 0, size, JHDR_SIZE, 0, "test",
+					  ^(off_t offset, void *data, size_t length) { return write_disk(offset, data, length); });
+	t1 = now_ns();
+
+	printf("%u transactions, %s checksums: journal_open %d, %u writes, %.3f s\n",
+		   txns, crc32c ? "crc32c" : "legacy", rv, writes, (double)(t1 - t0) / 1e9);
+
+	close(fd);
+	unlink(path);
+
+	if (corrupt) {
+		if (rv == 0)
+			errx(1, "corrupt journal replayed");
+	} else {
+		if (rv != 0)
+			errx(1, "journal_open failed");
+		if (memcmp(disk_ref, disk_new, DISK_SIZE) != 0)
+			errx(1, "replayed image differs from the reference");
+	}
+
+	free(disk_ref);
+	free(disk_new);
+
+	return 0;
+}
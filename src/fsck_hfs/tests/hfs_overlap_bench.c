@@ -0,0 +1,342 @@
+//
+//  hfs_overlap_bench.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Check and time the overlapped extents index (fsck_hfs/dfalib/OverlapIndex.c)
+ * against the linear list walks it replaced in SVerify1.c.
+ *
+ * Builds a synthetic volume of -e extents (10^6 by default) of up to -l
+ * blocks, dealt out at random to files so that every file is fragmented all
+ * over the volume, with some resource forks and attribute extents.  -o of
+ * the extents are then cross-linked into blocks that already belong to
+ * other extents.  Both versions then do what fsck_hfs does with them:
+ *
+ *	bitmap	walk the files in catalog order, marking each extent in the
+ *		volume bitmap, and add the extent to the overlap list when some
+ *		of its blocks are already in use (CheckFileExtents and
+ *		AddExtentToOverlapList)
+ *	orig	walk every extent again and add those overlapping an entry of
+ *		the list, to find the files that were there first
+ *		(FindOrigOverlapFiles and DoesOverlap)
+ *
+ * The two lists must come out the same, entry for entry.  Built by
+ * fsck_hfs/tests/Makefile, or by hand from this directory:
+ *
+ *	cc -O2 -I../dfalib -o hfs_overlap_bench \
+ *		hfs_overlap_bench.c ../dfalib/OverlapIndex.c
+ *
+ *	hfs_overlap_bench [-r] [-e extents] [-l blocks] [-o cross-links] [-s seed]
+ *
+ * -r skips the linear list, which is quadratic in the number of overlaps.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "OverlapIndex.h"
+
+#define DATA_FORK	0x00		/* kDataFork */
+#define EA_DATA		0x01		/* kEAData */
+#define RSRC_FORK	0xFF		/* kRsrcFork */
+#define NATTRS		16
+
+struct extent {
+	u_int32_t	fileID;
+	u_int32_t	startBlock;
+	u_int32_t	blockCount;
+	const char	*attrname;
+	u_int8_t	forkType;
+	u_int32_t	order;			/* shuffles the extents of a file */
+};
+
+/* The overlapped extents list, as an ExtentsTable holds it */
+struct list {
+	struct extent	*entries;
+	u_int32_t		count;
+	u_int32_t		alloc;
+	OverlapIndex	*index;		/* NULL for the linear version */
+};
+
+static struct extent *extents;
+static u_int32_t nextents;
+static u_int32_t total_blocks;
+static u_int8_t *bitmap;
+static char attrnames[NATTRS][32];
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t
+rnd(u_int32_t n)
+{
+	return n ? (u_int32_t)(random() % n) : 0;
+}
+
+static int
+cmp_catalog(const void *a, const void *b)
+{
+	const struct extent *x = a, *y = b;
+
+	if (x->fileID != y->fileID)
+		return x->fileID < y->fileID ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void
+make_volume(u_int32_t count, u_int32_t max_len, u_int32_t cross)
+{
+	u_int32_t files = count / 8 + 1;
+	u_int32_t block = 1;		/* a start block of 0 ends an extent record */
+	u_int32_t i;
+
+	extents = calloc(count, sizeof(*extents));
+	if (extents == NULL)
+		err(1, "extents");
+	for (i = 0; i < NATTRS; i++)
+		snprintf(attrnames[i], sizeof(attrnames[i]), "com.example.attr%u", i);
+
+	for (i = 0; i < count; i++) {
+		struct extent *e = &extents[i];
+		u_int32_t kind = rnd(64);
+
+		e->fileID = 16 + rnd(files);
+		e->startBlock = block;
+		e->blockCount = 1 + rnd(max_len);
+		e->order = (u_int32_t)random();
+		if (kind == 0) {
+			e->forkType = EA_DATA;
+			e->attrname = attrnames[rnd(NATTRS)];
+		} else if (kind < 5) {
+			e->forkType = RSRC_FORK;
+		} else {
+			e->forkType = DATA_FORK;
+		}
+		block += e->blockCount + (rnd(4) == 0 ? rnd(max_len) : 0);
+	}
+	total_blocks = block;
+
+	/* Point some extents into blocks already owned by others */
+	for (i = 0; i < cross; i++) {
+		struct extent *e = &extents[rnd(count)];
+		struct extent *victim = &extents[rnd(count)];
+
+		e->startBlock = victim->startBlock + rnd(victim->blockCount);
+		e->blockCount = 1 + rnd(max_len);
+		if (e->startBlock + e->blockCount > total_blocks)
+			e->blockCount = total_blocks - e->startBlock;
+	}
+
+	qsort(extents, count, sizeof(*extents), cmp_catalog);
+	nextents = count;
+
+	bitmap = malloc(total_blocks / 8 + 1);
+	if (bitmap == NULL)
+		err(1, "bitmap");
+}
+
+/* Mark the extent in use; true if some of it already was (E_OvlExt) */
+static bool
+capture_bits(const struct extent *e)
+{
+	u_int32_t b, end = e->startBlock + e->blockCount;
+	bool overlap = false;
+
+	for (b = e->startBlock; b < end; b++) {
+		if (bitmap[b / 8] & (1 << (b % 8)))
+			overlap = true;
+		bitmap[b / 8] |= 1 << (b % 8);
+	}
+	return overlap;
+}
+
+static bool
+same_extent(const struct extent *x, const struct extent *y)
+{
+	if (x->fileID != y->fileID || x->startBlock != y->startBlock ||
+		x->blockCount != y->blockCount || x->forkType != y->forkType)
+		return false;
+	if (x->attrname == NULL || y->attrname == NULL)
+		return x->attrname == y->attrname;
+	return strcmp(x->attrname, y->attrname) == 0;
+}
+
+static void
+list_append(struct list *l, const struct extent *e)
+{
+	if (l->count == l->alloc) {
+		l->alloc = l->alloc ? l->alloc * 2 : 64;
+		l->entries = realloc(l->entries, l->alloc * sizeof(*l->entries));
+		if (l->entries == NULL)
+			err(1, "overlap list");
+	}
+	l->entries[l->count++] = *e;
+}
+
+/* AddExtentToOverlapList */
+static void
+list_add(struct list *l, const struct extent *e)
+{
+	u_int32_t i;
+	int error;
+
+	if (l->index != NULL) {
+		error = OverlapIndexAdd(l->index, e->fileID, e->attrname,
+								e->startBlock, e->blockCount, e->forkType);
+		if (error == EEXIST)
+			return;
+		if (error)
+			errx(1, "OverlapIndexAdd: %s", strerror(error));
+	} else {
+		/* ExtentInfoExists */
+		for (i = 0; i < l->count; i++) {
+			if (same_extent(&l->entries[i], e))
+				return;
+		}
+	}
+	list_append(l, e);
+}
+
+/* DoesOverlap */
+static bool
+list_overlaps(struct list *l, const struct extent *e)
+{
+	const struct extent *cur;
+	u_int32_t i;
+
+	if (l->index != NULL)
+		return OverlapIndexOverlaps(l->index, e->startBlock, e->blockCount);
+
+	for (i = 0; i < l->count; i++) {
+		cur = &l->entries[i];
+		if (cur->startBlock < e->startBlock) {
+			if (cur->startBlock + cur->blockCount > e->startBlock)
+				return true;
+		} else if (cur->startBlock < e->startBlock + e->blockCount) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+run(const char *name, struct list *l)
+{
+	u_int64_t t0, t1, t2;
+	u_int32_t i, found;
+
+	memset(bitmap, 0, total_blocks / 8 + 1);
+
+	t0 = now_ns();
+	for (i = 0; i < nextents; i++) {
+		if (capture_bits(&extents[i]))
+			list_add(l, &extents[i]);
+	}
+	found = l->count;
+
+	t1 = now_ns();
+	for (i = 0; i < nextents; i++) {
+		if (list_overlaps(l, &extents[i]))
+			list_add(l, &extents[i]);
+	}
+	t2 = now_ns();
+
+	printf("%-7s %10.3f %10.3f %10u %10u %12.0f\n", name,
+		   (double)(t1 - t0) / 1e9, (double)(t2 - t1) / 1e9, found, l->count,
+		   (double)(t2 - t0) / nextents);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_overlap_bench [-r] [-e extents] [-l blocks] "
+			"[-o cross-links] [-s seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct list linear = { NULL, 0, 0, NULL };
+	struct list indexed = { NULL, 0, 0, NULL };
+	u_int32_t count = 1000000;
+	u_int32_t max_len = 16;
+	u_int32_t cross = 1000;
+	bool skip_linear = false;
+	u_int32_t i;
+	int ch;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "e:l:o:rs:")) != -1) {
+		switch (ch) {
+		case 'e':
+			count = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			max_len = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			cross = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			skip_linear = true;
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || count == 0 || max_len == 0 ||
+		(u_int64_t)count * max_len * 2 > UINT32_MAX)
+		usage();
+
+	make_volume(count, max_len, cross);
+	printf("%u extents over %u blocks, %u cross-linked\n", nextents, total_blocks, cross);
+	printf("list     bitmap(s)    orig(s)    overlap      final  ns/extent\n");
+
+	indexed.index = OverlapIndexCreate();
+	if (indexed.index == NULL)
+		errx(1, "OverlapIndexCreate failed");
+	run("index", &indexed);
+
+	if (!skip_linear) {
+		run("linear", &linear);
+		if (linear.count != indexed.count)
+			errx(1, "linear list has %u entries, index %u", linear.count, indexed.count);
+		for (i = 0; i < linear.count; i++) {
+			if (!same_extent(&linear.entries[i], &indexed.entries[i]))
+				errx(1, "entry %u: linear file %u %u+%u, index file %u %u+%u", i,
+					 linear.entries[i].fileID, linear.entries[i].startBlock,
+					 linear.entries[i].blockCount, indexed.entries[i].fileID,
+					 indexed.entries[i].startBlock, indexed.entries[i].blockCount);
+		}
+	}
+
+	OverlapIndexDispose(indexed.index);
+	free(indexed.entries);
+	free(linear.entries);
+	free(extents);
+	free(bitmap);
+
+	return 0;
+}
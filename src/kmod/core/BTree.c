@@ -152,6 +152,8 @@
 
 #include "BTreesPrivate.h"
 #include "hfs_btreeio.h"
+#include "hfs_btcache.h"
+#include "hfs_btseq.h"
 
 //////////////////////////////////// Globals ////////////////////////////////////
 
@@ -197,6 +199,7 @@ int BTOpenPath(FCB *filePtr, KeyCompareProcPtr keyCompareProc)
 	if ( filePtr->fcbBTCBPtr != nil && keyCompareProc != nil) {
 		btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
 		btreePtr->keyCompareProc = keyCompareProc;
+		hfs_btcache_setup(btreePtr);
 		return noErr;
 	}
 
@@ -351,6 +354,9 @@ int BTOpenPath(FCB *filePtr, KeyCompareProcPtr keyCompareProc)
 
 	// align LEOF to multiple of node size?	- just on close
 
+	hfs_btcache_setup(btreePtr);
+	hfs_btseq_setup(btreePtr);
+
 	return noErr;
 
 
@@ -400,6 +406,8 @@ int	BTClosePath			(FCB					*filePtr)
 	err = UpdateHeader (btreePtr, true);
 	M_ExitOnError (err);
 
+	hfs_btcache_destroy(btreePtr);
+	hfs_btseq_destroy(btreePtr);
 	hfs_free(btreePtr, sizeof(*btreePtr));
 	filePtr->fcbBTCBPtr = nil;
 
@@ -1883,6 +1891,10 @@ BTReloadData(FCB *filePtr)
 		btreePtr->btreeType     = header->btreeType;
 
 		btreePtr->flags &= (~kBTHeaderDirty);
+
+		/* The nodes may have changed on disk too */
+		hfs_btcache_flush(btreePtr);
+		hfs_btseq_flush(btreePtr);
 	} 
 
 	(void) ReleaseNode(btreePtr, &node);
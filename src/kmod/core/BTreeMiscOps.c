@@ -283,6 +283,37 @@ int UpdateHeader(BTreeControlBlockPtr btreePtr, boolean_t forceWrite)
 
 
 
+/*-------------------------------------------------------------------------------
+Routine:	IsKeyAtIndex	-	Check whether a record of a node has a given key.
+
+Function:	Lets FindIteratorPosition go straight to the record an earlier
+			iteration left the hint at, rather than search the node for it.
+
+Input:		btreePtr		- pointer to control block
+			node			- node to look in
+			searchKey		- key to look for
+			index			- record to check; may be past the last one
+
+Result:		true if record 'index' exists and has key searchKey
+-------------------------------------------------------------------------------*/
+
+static boolean_t	IsKeyAtIndex	(BTreeControlBlockPtr	 btreePtr,
+									 NodeDescPtr			 node,
+									 KeyPtr					 searchKey,
+									 u_int16_t				 index )
+{
+	KeyPtr			keyPtr;
+	u_int8_t *		recordPtr;
+	u_int16_t		recordLen;
+
+	if (GetRecordByIndex (btreePtr, node, index, &keyPtr, &recordPtr, &recordLen) != noErr)
+		return	false;
+
+	return	CompareKeys (btreePtr, searchKey, keyPtr) == 0;
+}
+
+
+
 /*-------------------------------------------------------------------------------
 Routine:	FindIteratorPosition	-	One_line_description.
 
@@ -366,6 +397,18 @@ int	FindIteratorPosition	(BTreeControlBlockPtr	 btreePtr,
 		goto SearchTheTree;
 	}	
 	
+	// The hint's index is where the key was when the hint was made, or for a
+	// directory enumeration that stopped on the record after it, one past it.
+	// Either way one compare finds it without searching the node.
+	index = iterator->hint.index;
+	if ( IsKeyAtIndex (btreePtr, middle->buffer, &iterator->key, index) ||
+		 (index > 0 && IsKeyAtIndex (btreePtr, middle->buffer, &iterator->key, --index)) )
+	{
+		foundIt = true;
+		++btreePtr->numValidHints;
+		goto SuccessfulExit;
+	}
+
 	foundIt = SearchNode (btreePtr, middle->buffer, &iterator->key, &index);
 	if (foundIt == true)
 	{
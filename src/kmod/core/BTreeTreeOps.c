@@ -96,6 +96,7 @@
 
 #include "BTreesPrivate.h"
 #include "hfs_btreeio.h"
+#include "hfs_btcache.h"
 
 //
 /////////////////////// Routines Internal To BTree Module ///////////////////////
@@ -210,10 +211,13 @@ int	SearchTree	(BTreeControlBlockPtr	 btreePtr,
 	KeyPtr		keyPtr;
 	u_int8_t *	dataPtr;
 	u_int16_t	dataSize;
+	u_int32_t	childNodeNum;
+	struct hfs_btcache_key	sortKey;	//	searchKey as the node cache compares it
 	
 	
 	curNodeNum		= btreePtr->rootNode;
 	level			= btreePtr->treeDepth;
+	sortKey.bk_len	= 0;
 	
 	if (level == 0)						// is the tree empty?
 	{
@@ -239,6 +243,21 @@ int	SearchTree	(BTreeControlBlockPtr	 btreePtr,
             err = btBadNode;
             goto ErrorExit;
         }
+
+        //
+        //	Index nodes in the node cache are searched there, without reading
+        //	them or comparing keys with keyCompareProc.
+        //
+        if (level > 1 &&
+            hfs_btcache_search(btreePtr, searchKey, &sortKey, curNodeNum, level,
+                               &index, &childNodeNum))
+        {
+            treePathTable [level].node	= curNodeNum;
+            treePathTable [level].index	= index;
+            curNodeNum = childNodeNum;
+            --level;
+            continue;
+        }
         
         err = GetNode (btreePtr, curNodeNum, 0, &nodeRec);
         if (err != noErr)
@@ -278,9 +297,15 @@ int	SearchTree	(BTreeControlBlockPtr	 btreePtr,
                 err = btBadNode;
                 goto ReleaseAndExit;
             }
+
+            hfs_btcache_fill(btreePtr, curNodeNum, nodeRec.buffer);
         }
         
-        keyFound = SearchNode (btreePtr, nodeRec.buffer, searchKey, &index);
+        //	The leaf is searched with the search name folded once, where we can
+        if (nodeKind != kBTLeafNode ||
+            !hfs_btcache_searchleaf(btreePtr, nodeRec.buffer, searchKey, &sortKey,
+                                    &index, &keyFound))
+            keyFound = SearchNode (btreePtr, nodeRec.buffer, searchKey, &index);
 
         treePathTable [level].node		= curNodeNum;
 
@@ -229,6 +229,9 @@ typedef struct BTreeControlBlock {					// fields specific to BTree CBs
 	u_int32_t					reservedNodes;
 	BTreeIterator   iterator; // useable when holding exclusive b-tree lock
 
+	struct hfs_btcache			*nodeCache;		// decoded index nodes (hfs_btcache.h)
+	struct hfs_btseq			*nodeSeq;		// node versions for unlocked searches (hfs_btseq.h)
+
 #if DEBUG
 	void						*madeDirtyBy[2];
 #endif
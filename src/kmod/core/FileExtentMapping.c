@@ -991,6 +991,62 @@ AddFileExtent(ExtendedVCB *vcb, FCB *fcb, u_int32_t startBlock, u_int32_t blockC
 }
 
 
+//_________________________________________________________________________________
+//
+// Routine:		LoanFileBlocksC
+//
+// Function: 	Reserves space for a file without allocating it (delayed
+//				allocation).  The blocks are added to the file's size and put
+//				on loan in vcb->loanedBlocks; the next ExtendFileC on the file
+//				gives them back and allocates real blocks for all of them in
+//				one request, which hfs_vnop_blockmap does when the data is
+//				written out.
+//
+//				Returns dskFulErr, having changed nothing, if the request is
+//				too large to defer or there isn't the free space for it.
+//				The caller must hold the bitmap lock.
+//_________________________________________________________________________________
+
+OSErr LoanFileBlocksC (
+	ExtendedVCB		*vcb,				// volume that file resides on
+	FCB				*fcb,				// FCB of file to extend
+	int64_t			bytesToAdd,			// number of bytes to reserve
+	__unused u_int32_t	flags,			// ExtendFileC flags
+	int64_t			*actualBytesAdded)	// number of bytes actually reserved
+{
+	struct hfsmount *hfsmp = (struct hfsmount*)vcb;
+	int64_t blocksToAdd;
+
+	*actualBytesAdded = 0;
+
+	blocksToAdd = howmany(bytesToAdd, vcb->blockSize);
+	bytesToAdd = blocksToAdd * (int64_t)vcb->blockSize;
+
+	if ((vcb->vcbSigWord != kHFSPlusSigWord)
+	||  (bytesToAdd >= (int64_t)HFS_MAX_DEFERED_ALLOC)
+	||  (blocksToAdd >= hfs_freeblks(hfsmp, 1))) {
+		return (dskFulErr);
+	}
+
+	hfs_lock_mount (hfsmp);
+	vcb->loanedBlocks += blocksToAdd;
+	hfs_unlock_mount(hfsmp);
+
+	fcb->ff_unallocblocks += blocksToAdd;
+	FTOC(fcb)->c_blocks   += blocksToAdd;
+	fcb->ff_blocks        += blocksToAdd;
+
+	/*
+	 * We haven't touched the disk here; no blocks have been
+	 * allocated and the volume will not be inconsistent if we
+	 * don't update the catalog record immediately.
+	 */
+	FTOC(fcb)->c_flag |= C_MINOR_MOD;
+	*actualBytesAdded = bytesToAdd;
+	return (noErr);
+}
+
+
 //_________________________________________________________________________________
 //
 // Routine:		Extendfile
@@ -1068,24 +1124,7 @@ OSErr ExtendFileC (
 	 * For deferred allocations just reserve the blocks.
 	 */
 	if ((flags & kEFDeferMask)
-	&&  (vcb->vcbSigWord == kHFSPlusSigWord)
-	&&  (bytesToAdd < (int64_t)HFS_MAX_DEFERED_ALLOC)
-	&&  (blocksToAdd < hfs_freeblks(VCBTOHFS(vcb), 1))) {
-		hfs_lock_mount (hfsmp);
-		vcb->loanedBlocks += blocksToAdd;
-		hfs_unlock_mount(hfsmp);
-
-		fcb->ff_unallocblocks += blocksToAdd;
-		FTOC(fcb)->c_blocks   += blocksToAdd;
-		fcb->ff_blocks        += blocksToAdd;
-
-		/*
-		 * We haven't touched the disk here; no blocks have been
-		 * allocated and the volume will not be inconsistent if we
-		 * don't update the catalog record immediately.
-		 */
-		FTOC(fcb)->c_flag |= C_MINOR_MOD;
-		*actualBytesAdded = bytesToAdd;
+	&&  LoanFileBlocksC(vcb, fcb, bytesToAdd, flags, actualBytesAdded) == noErr) {
 		return (0);
 	}
 	/* 
@@ -321,6 +321,16 @@ int hfs_find_free_extents(struct hfsmount *hfsmp,
 void hfs_free_tentative(hfsmount_t *hfsmp, struct rl_entry **reservation);
 void hfs_free_locked(hfsmount_t *hfsmp, struct rl_entry **reservation);
 
+void hfs_alloc_pools_init(hfsmount_t *hfsmp);
+void hfs_alloc_pools_drain(hfsmount_t *hfsmp);
+void hfs_alloc_pools_destroy(hfsmount_t *hfsmp);
+
+void hfs_discard_init(hfsmount_t *hfsmp);
+void hfs_discard_add(hfsmount_t *hfsmp, u_int32_t startBlock, u_int32_t numBlocks, bool wait);
+void hfs_discard_remove(hfsmount_t *hfsmp, u_int32_t startBlock, u_int32_t numBlocks);
+void hfs_discard_stop(hfsmount_t *hfsmp);
+void hfs_discard_destroy(hfsmount_t *hfsmp);
+
 /*	File Extent Mapping routines*/
 EXTERN_API_C( OSErr )
 FlushExtentFile					(ExtendedVCB *			vcb);
@@ -356,6 +366,13 @@ ExtendFileC						(ExtendedVCB *			vcb,
 								 u_int32_t 				flags,
 								 int64_t *				actualBytesAdded);
 
+EXTERN_API_C( OSErr )
+LoanFileBlocksC					(ExtendedVCB *			vcb,
+								 FCB *					fcb,
+								 int64_t 				bytesToAdd,
+								 u_int32_t 				flags,
+								 int64_t *				actualBytesAdded);
+
 EXTERN_API_C( OSErr )
 MapFileBlockC					(ExtendedVCB *			vcb,
 								 FCB *					fcb,
@@ -108,7 +108,7 @@ Internal routines:
 					returned.
 	BlockFindKnown
 					Try to allocate space from known free space in the volume's
-					free extent cache.
+					free extent index.
 	ReadBitmapBlock
 					Given an allocation block number, read the bitmap block that
 					contains that allocation block into a caller-supplied buffer.
@@ -125,14 +125,14 @@ Internal routines:
 					back into the UBC in order to prevent coherency issues.
 
 	remove_free_extent_cache
-					Remove an extent from the free extent cache.  Handles overlaps
-					with multiple extents in the cache, and handles splitting an
-					extent in the cache if the extent to be removed is in the middle
-					of a cached extent.
+					Remove an extent from the free extent index.  Handles overlaps
+					with multiple extents in the index, and handles splitting an
+					extent in the index if the extent to be removed is in the middle
+					of an indexed extent.
 	
 	add_free_extent_cache
-					Add an extent to the free extent cache.  It will merge the
-					input extent with extents already in the cache.
+					Add an extent to the free extent index.  It will merge the
+					input extent with extents already in the index.
 	CheckUnmappedBytes
 					Check whether or not the current transaction
 					has allocated blocks that were recently freed. This may have data safety implications.
@@ -172,6 +172,8 @@ Optimization Routines
 
 /* For VM Page size */
 #include <sys/libkern.h>
+#include <sys/pcpu.h>
+#include <sys/smp.h>
 #include "hfs_journal.h"
 #include "hfs.h"
 #include "hfs_endian.h"
@@ -191,6 +193,7 @@ Optimization Routines
 #include "hfs_kdebug.h"
 #include "rangelist.h"
 #include "hfs_extents.h"
+#include "hfs_bitmap.h"
 
 /* Headers for unmap-on-mount support */
 #include <sys/ddisk.h>
@@ -306,6 +309,15 @@ static OSErr BlockFindKnown(
 		u_int32_t		*actualStartBlock,
 		u_int32_t		*actualNumBlocks);
 
+static OSErr BlockFindIndexed(
+		struct hfsmount	*hfsmp,
+		u_int32_t		startingBlock,
+		u_int32_t		minBlocks,
+		u_int32_t		maxBlocks,
+		boolean_t		useMetaZone,
+		u_int32_t		*actualStartBlock,
+		u_int32_t		*actualNumBlocks);
+
 static OSErr hfs_alloc_try_hard(hfsmount_t *hfsmp,
 								HFSPlusExtentDescriptor *extent,
 								uint32_t max_blocks,
@@ -354,18 +366,15 @@ int hfs_isallocated_scan (struct hfsmount *hfsmp,
 		u_int32_t *bp_buf);
 
 /* Summary Table Functions */
-static int hfs_set_summary (struct hfsmount *hfsmp, uint32_t summarybit, uint32_t inuse);
+static int hfs_set_summary (struct hfsmount *hfsmp, uint32_t summarybit, uint32_t freeblocks);
 static int hfs_get_summary_index (struct hfsmount *hfsmp, uint32_t block, uint32_t *index);
-static int hfs_find_summary_free (struct hfsmount *hfsmp, uint32_t block, uint32_t *newblock);
-static int hfs_get_summary_allocblock (struct hfsmount *hfsmp, uint32_t summarybit, uint32_t *alloc);
+static int hfs_find_summary_free (struct hfsmount *hfsmp, uint32_t block, uint32_t minblocks,
+		uint32_t *newblock);
 static int hfs_release_summary (struct hfsmount *hfsmp, uint32_t start, uint32_t length);
+static int hfs_claim_summary (struct hfsmount *hfsmp, uint32_t start, uint32_t length);
 static int hfs_check_summary (struct hfsmount *hfsmp, uint32_t start, uint32_t *freeblocks);
 static int hfs_rebuild_summary (struct hfsmount *hfsmp);
 
-#if 0
-static int hfs_get_next_summary (struct hfsmount *hfsmp, uint32_t block, uint32_t *newblock);
-#endif
-
 /* Used in external mount code to initialize the summary table */
 int hfs_init_summary (struct hfsmount *hfsmp);
 
@@ -390,7 +399,7 @@ typedef struct bitmap_context {
 	uint32_t		chunk_end;				// number of valid bits in this chunk
 	struct hfsmount *hfsmp;
 	struct buf		*bp;
-	uint32_t		last_free_summary_bit;	// last marked free summary bit
+	uint32_t		next_summary_bit;		// first summary bit not yet reached by a run
 	int				lockflags;
 	uint64_t		lock_start;
 } bitmap_context_t;
@@ -403,7 +412,6 @@ static int hfs_bit_count(bitmap_context_t *bitmap_ctx, int (*fn)(void *, int ,in
 static int hfs_bit_count_set(bitmap_context_t *bitmap_ctx, uint32_t *count);
 static int hfs_bit_count_clr(bitmap_context_t *bitmap_ctx, uint32_t *count);
 static int update_summary_table(bitmap_context_t *bitmap_ctx, uint32_t start, uint32_t count, bool set);
-static int clzll(uint64_t x);
 
 #if ALLOC_DEBUG
 /*
@@ -566,7 +574,8 @@ static int hfs_track_unmap_blocks (struct hfsmount *hfsmp, u_int32_t start,
  ;
  ; Routine:		hfs_issue_unmap
  ;
- ; Function:	Issue a DKIOCUNMAP for all blocks currently tracked by the jnl_trim_list
+ ; Function:	Queue all blocks currently tracked by the jnl_trim_list for the
+ ;				discard thread to unmap, and empty the list.
  ;
  ; Input Arguments:
  ;	hfsmp			- The volume containing the allocation blocks.
@@ -576,45 +585,38 @@ static int hfs_track_unmap_blocks (struct hfsmount *hfsmp, u_int32_t start,
 
 static int hfs_issue_unmap (struct hfsmount *hfsmp, struct jnl_trim_list *list) 
 {
-	dk_unmap_t unmap;
-	int error = 0;
+	u_int32_t i;
+	u_int32_t startBlock, numBlocks;
 
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
 		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_TRIM | DBG_FUNC_START, hfsmp->hfs_raw_dev, 0, 0, 0, 0);
 	}
 
 	if (list->extent_count > 0 && list->extents != NULL) {
-		bzero(&unmap, sizeof(unmap));
-		unmap.extents = list->extents;
-		unmap.extentsCount = list->extent_count;
-
 		if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
-			KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_TRIM | DBG_FUNC_NONE, hfsmp->hfs_raw_dev, unmap.extentsCount, 0, 0, 0);
+			KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_TRIM | DBG_FUNC_NONE, hfsmp->hfs_raw_dev, list->extent_count, 0, 0, 0);
 		}
-	
-#if CONFIG_PROTECT
-		/* 
-		 * If we have not yet completed the first scan through the bitmap, then
-		 * optionally inform the block driver below us that this is an initialization
-		 * TRIM scan, if it can deal with this information.
+
+		/*
+		 * The scan may find far more free space than the discard queue
+		 * holds; rather than have it forget some, wait for the thread to
+		 * make room.  It takes no locks the scan holds.
 		 */
-		if ((hfsmp->scan_var & HFS_ALLOCATOR_SCAN_COMPLETED) == 0) {
-			unmap.options |= _DK_UNMAP_INITIALIZE;	
+		for (i = 0; i < list->extent_count; i++) {
+			startBlock = (u_int32_t) ((list->extents[i].offset - hfsmp->hfsPlusIOPosOffset) / hfsmp->blockSize);
+			numBlocks = (u_int32_t) (list->extents[i].length / hfsmp->blockSize);
+			hfs_discard_add(hfsmp, startBlock, numBlocks, true);
 		}
-#endif
-		/* Issue a TRIM and flush them out */
-		error = VNOP_IOCTL(hfsmp->hfs_devvp, HFSTOCP(hfsmp), DKIOCUNMAP, (caddr_t)&unmap, 0);
 
 		bzero (list->extents, (list->allocated_count * sizeof(dk_extent_t)));
-		bzero (&unmap, sizeof(unmap));
 		list->extent_count = 0;
 	}
 
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
-		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_TRIM | DBG_FUNC_END, error, hfsmp->hfs_raw_dev, 0, 0, 0);
+		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_TRIM | DBG_FUNC_END, 0, hfsmp->hfs_raw_dev, 0, 0, 0);
 	}
 
-	return error;
+	return 0;
 }
 
 /*
@@ -653,6 +655,8 @@ static void hfs_unmap_alloc_extent(struct hfsmount *hfsmp, u_int32_t startingBlo
 		}
 	}
 
+	hfs_discard_remove(hfsmp, startingBlock, numBlocks);
+
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_ALLOC | DBG_FUNC_END, err, 0, 0, 0, 0);
 }
@@ -666,14 +670,18 @@ static void hfs_unmap_alloc_extent(struct hfsmount *hfsmp, u_int32_t startingBlo
 ; Function:		This function is called when a transaction that freed extents
 ;				(via hfs_unmap_free_extent/journal_trim_add_extent) has been
 ;				written to the on-disk journal.  This routine will add those
-;				extents to the free extent cache so that they can be reused.
+;				extents to the free extent cache so that they can be reused,
+;				and queue them for the discard thread to unmap.
 ;
 ;				CAUTION: This routine is called while the journal's trim lock
 ;				is held shared, so that no other thread can reuse any portion
 ;				of those extents.  We must be very careful about which locks
 ;				we take from within this callback, to avoid deadlock.  The
 ;				call to add_free_extent_cache will end up taking the cache's
-;				lock (just long enough to add these extents to the cache).
+;				lock (just long enough to add these extents to the cache), and
+;				hfs_discard_add the discard queue's.  The extents are queued
+;				before they can be found in the cache, so that whoever
+;				allocates them next takes them back out of the queue.
 ;
 ;				CAUTION: If the journal becomes invalid (eg., due to an I/O
 ;				error when trying to write to the journal), this callback
@@ -701,6 +709,7 @@ hfs_trim_callback(void *arg, uint32_t extent_count, const dk_extent_t *extents)
 		/* Convert the byte range in *extents back to a range of allocation blocks. */
 		startBlock = (u_int) (extents[i].offset - hfsmp->hfsPlusIOPosOffset) / hfsmp->blockSize;
 		numBlocks = (u_int) extents[i].length / hfsmp->blockSize;
+		hfs_discard_add(hfsmp, startBlock, numBlocks, false);
 		(void) add_free_extent_cache(hfsmp, startBlock, numBlocks);
 	}
 
@@ -856,6 +865,14 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 		trimlist.extent_count = 0;
 	}
 
+	/*
+	 * Every free run goes into the free extent index as we go; if none of
+	 * them is dropped, the index is complete when we are done.
+	 */
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	hfsmp->vcbFreeExt.fi_complete = true;
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
+
 	while ((blocks_scanned < hfsmp->totalBlocks) && (error == 0)){
 
 		error = hfs_alloc_scan_range (hfsmp, blocks_scanned, &blocks_scanned, &trimlist);
@@ -866,6 +883,12 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 		}
 	}
 
+	if (error) {
+		lck_spin_lock(&hfsmp->vcbFreeExtLock);
+		hfsmp->vcbFreeExt.fi_complete = false;
+		lck_spin_unlock(&hfsmp->vcbFreeExtLock);
+	}
+
 	if ((hfsmp->hfs_flags & HFS_UNMAP) && 
 			((hfsmp->hfs_flags & HFS_READ_ONLY) == 0)) {
 		if (error == 0) {
@@ -904,10 +927,10 @@ static void add_to_reserved_list(hfsmount_t *hfsmp, uint32_t start,
 
 	if (list == HFS_TENTATIVE_BLOCKS) {
 		int nranges = 0;
-		// Don't allow more than 4 tentative reservations
+		// Don't allow more than 4 tentative reservations besides the allocation pools'
 		TAILQ_FOREACH_SAFE(range, &hfsmp->hfs_reserved_ranges[HFS_TENTATIVE_BLOCKS],
 						   rl_link, next_range) {
-			if (++nranges > 3)
+			if (++nranges > 3 + hfsmp->hfs_alloc_npools)
 				hfs_release_reserved(hfsmp, range, HFS_TENTATIVE_BLOCKS);
 		}
 	}
@@ -954,7 +977,6 @@ static void hfs_release_reserved(hfsmount_t *hfsmp,
 			hfs_assert(hfsmp->lockedBlocks >= rl_len(range));
 			hfsmp->lockedBlocks -= rl_len(range);
 		}
-		hfs_release_summary(hfsmp, (u_int)range->rl_start, (u_int)rl_len(range));
 		add_free_extent_cache(hfsmp, (u_int)range->rl_start, (u_int)rl_len(range));
 	}
 
@@ -983,6 +1005,134 @@ void hfs_free_locked(hfsmount_t *hfsmp, struct rl_entry **reservation)
 	hfs_free_locked_internal(hfsmp, reservation, HFS_LOCKED_BLOCKS);
 }
 
+/*
+ * Per-CPU allocation pools
+ *
+ * Each CPU has a tentative reservation of a run of free blocks, and ordinary
+ * file allocations made on it are carved off the front of that run with
+ * HFS_ALLOC_USE_TENTATIVE.  When the run is used up, or too short for a
+ * request, what is left goes back through hfs_free_tentative() and a new
+ * batch of HFS_ALLOC_POOL_BYTES is reserved with HFS_ALLOC_TENTATIVE.
+ *
+ * A pool allocation skips the free extent index and the bitmap search, and
+ * writers on different CPUs fill separate runs instead of interleaving their
+ * extents in one.  Tentative blocks still count as free, so freeBlocks stays
+ * exact, and when space runs short the allocator steals them back as it does
+ * any tentative reservation; the pools stop refilling well before that.
+ *
+ * Like the reservation lists, the pools are protected by the bitmap lock.
+ */
+#define HFS_ALLOC_POOL_BYTES	(8 * 1024 * 1024)
+
+/* Only refill while there is room for this many batches per pool */
+#define HFS_ALLOC_POOL_HEADROOM	4
+
+void hfs_alloc_pools_init(hfsmount_t *hfsmp)
+{
+	hfsmp->hfs_alloc_npools = mp_maxid + 1;
+	hfsmp->hfs_alloc_pools = hfs_mallocz(hfsmp->hfs_alloc_npools
+										 * sizeof(struct hfs_alloc_pool));
+}
+
+void hfs_alloc_pools_drain(hfsmount_t *hfsmp)
+{
+	int lockflags;
+	u_int32_t i;
+
+	if (hfsmp->hfs_alloc_pools == NULL)
+		return;
+
+	lockflags = hfs_systemfile_lock(hfsmp, SFL_BITMAP, HFS_EXCLUSIVE_LOCK);
+	for (i = 0; i < hfsmp->hfs_alloc_npools; i++)
+		hfs_free_tentative(hfsmp, &hfsmp->hfs_alloc_pools[i].ap_reservation);
+	hfs_systemfile_unlock(hfsmp, lockflags);
+}
+
+void hfs_alloc_pools_destroy(hfsmount_t *hfsmp)
+{
+	u_int32_t i;
+
+	if (hfsmp->hfs_alloc_pools == NULL)
+		return;
+
+	for (i = 0; i < hfsmp->hfs_alloc_npools; i++)
+		hfs_assert(hfsmp->hfs_alloc_pools[i].ap_reservation == NULL);
+
+	hfs_free(hfsmp->hfs_alloc_pools,
+			 hfsmp->hfs_alloc_npools * sizeof(struct hfs_alloc_pool));
+	hfsmp->hfs_alloc_pools = NULL;
+	hfsmp->hfs_alloc_npools = 0;
+}
+
+/*
+ * Allocate from this CPU's pool.  Returns dskFulErr, having changed nothing
+ * but the pool, if the request should go to the regular allocator instead:
+ * it is not an ordinary one, the volume is getting full, or its hint asks
+ * for blocks other than the ones at the front of the pool.
+ */
+static OSErr hfs_alloc_pool_alloc(hfsmount_t *hfsmp,
+								  HFSPlusExtentDescriptor *extent,
+								  u_int32_t minBlocks,
+								  u_int32_t maxBlocks,
+								  hfs_block_alloc_flags_t flags,
+								  hfs_alloc_extra_args_t *ap)
+{
+	struct hfs_alloc_pool *pool;
+	struct rl_entry *range;
+	u_int32_t batch;
+
+	if (hfsmp->hfs_alloc_pools == NULL
+		|| ISSET(hfsmp->hfs_flags, HFS_HAS_SPARSE_DEVICE)
+		|| ISSET(flags, ~(HFS_ALLOC_FORCECONTIG | HFS_ALLOC_FLUSHTXN | HFS_ALLOC_FAST_DEV))
+		|| (ap && (ap->reservation_in || ap->reservation_out || ap->alignment)))
+		return dskFulErr;
+
+	batch = MAX(HFS_ALLOC_POOL_BYTES / hfsmp->blockSize, 1);
+	if (maxBlocks > batch)
+		return dskFulErr;
+
+	pool = &hfsmp->hfs_alloc_pools[curcpu % hfsmp->hfs_alloc_npools];
+
+	if ((u_int64_t)hfs_freeblks(hfsmp, 0) < (u_int64_t)batch * hfsmp->hfs_alloc_npools
+											 * HFS_ALLOC_POOL_HEADROOM) {
+		hfs_free_tentative(hfsmp, &pool->ap_reservation);
+		return dskFulErr;
+	}
+
+	range = pool->ap_reservation;
+	if (range && range->rl_start != -1 && rl_len(range) >= minBlocks) {
+		if (extent->startBlock != 0 && extent->startBlock != range->rl_start)
+			return dskFulErr;
+	} else {
+		/* Give back what is left and reserve a new batch, near the hint if there is one */
+		HFSPlusExtentDescriptor refill = { extent->startBlock, minBlocks };
+		hfs_alloc_extra_args_t refill_args = {
+			.max_blocks = batch,
+			.reservation_out = &pool->ap_reservation,
+		};
+		OSErr err;
+
+		hfs_free_tentative(hfsmp, &pool->ap_reservation);
+		err = hfs_block_alloc_int(hfsmp, &refill,
+								  HFS_ALLOC_TENTATIVE | HFS_ALLOC_FORCECONTIG
+								  | (flags & HFS_ALLOC_FLUSHTXN),
+								  &refill_args);
+		if (err)
+			return err;
+	}
+
+	/* Carve the allocation off the front of the reservation */
+	hfs_alloc_extra_args_t use_args = {
+		.max_blocks = maxBlocks,
+		.reservation_in = &pool->ap_reservation,
+	};
+
+	extent->startBlock = (u_int)pool->ap_reservation->rl_start;
+	extent->blockCount = minBlocks;
+
+	return hfs_block_alloc_int(hfsmp, extent, flags | HFS_ALLOC_USE_TENTATIVE, &use_args);
+}
+
 OSErr BlockAllocate (
 		 hfsmount_t		*hfsmp,				/* which volume to allocate space on */
 		 u_int32_t		startingBlock,		/* preferred starting block, or 0 for no preference */
@@ -1095,7 +1245,8 @@ int hfs_block_alloc(hfsmount_t *hfsmp,
  */
 
 // MARK:UNUSED: Currently unused:
-// MARK: HFS_ALLOC_TENTATIVE, x, HFS_ALLOC_LOCKED, HFS_ALLOC_COMMIT, HFS_ALLOC_TRY_HARD
+// MARK: HFS_ALLOC_LOCKED, HFS_ALLOC_COMMIT, HFS_ALLOC_TRY_HARD
+// MARK: (HFS_ALLOC_TENTATIVE and HFS_ALLOC_USE_TENTATIVE are used by the allocation pools.)
 // MARK: HFS_ALLOC_ROLL_BACK (because hfs_ext_replace() is unused).
 OSErr hfs_block_alloc_int(hfsmount_t *hfsmp,
 						  HFSPlusExtentDescriptor *extent,
@@ -1126,8 +1277,7 @@ OSErr hfs_block_alloc_int(hfsmount_t *hfsmp,
 
 	freeBlocks = hfs_freeblks(hfsmp, 0);
 
-    // MARK:UNSED: This flag is not set anywhere when the function is called.
-    // MARK:UNSED: Furthermore, the reservation aren't set either (they're all null)
+	// Only the allocation pools use this; see hfs_alloc_pool_alloc().
 	if (ISSET(flags, HFS_ALLOC_USE_TENTATIVE)) {
 		struct rl_entry *range = *ap->reservation_in;
 
@@ -1209,6 +1359,17 @@ OSErr hfs_block_alloc_int(hfsmount_t *hfsmp,
 		}
 	}
 
+	/*
+	 * Ordinary allocations come out of this CPU's allocation pool if it
+	 * can take them.
+	 */
+	err = hfs_alloc_pool_alloc(hfsmp, extent, minBlocks, maxBlocks, flags, ap);
+	if (err != dskFulErr)
+		goto exit;
+	err = noErr;
+	extent->startBlock = startingBlock;
+	extent->blockCount = minBlocks;
+
 	if (ISSET(flags, HFS_ALLOC_TRY_HARD)) {
 		err = hfs_alloc_try_hard(hfsmp, extent, maxBlocks, flags);
 		if (err)
@@ -1408,7 +1569,7 @@ mark_allocated:
 
 		if (!ISSET(flags, HFS_ALLOC_USE_TENTATIVE | HFS_ALLOC_COMMIT)) {
 			lck_spin_lock(&hfsmp->vcbFreeExtLock);
-			if (hfsmp->vcbFreeExtCnt == 0 && hfsmp->hfs_freed_block_count == 0) {
+			if (hfsmp->vcbFreeExt.fi_count == 0 && hfsmp->hfs_freed_block_count == 0) {
 				hfsmp->sparseAllocation = extent->startBlock;
 			}
 			lck_spin_unlock(&hfsmp->vcbFreeExtLock);
@@ -1423,8 +1584,6 @@ mark_allocated:
 				 (extent->startBlock > hfsmp->hfs_metazone_end))) {
 				HFS_UPDATE_NEXT_ALLOCATION(hfsmp, extent->startBlock);
 			}
-
-			(void) remove_free_extent_cache(hfsmp, extent->startBlock, extent->blockCount);
 		}
 
 		if (ISSET(flags, HFS_ALLOC_USE_TENTATIVE)) {
@@ -1496,15 +1655,12 @@ mark_allocated:
 						if (start - range->rl_start > range->rl_end - end) {
 							// Discard the tail
 							hfsmp->tentativeBlocks -= range->rl_end + 1 - start;
-							hfs_release_summary(hfsmp, end + 1, (u_int)range->rl_end - end);
 							const uint32_t old_end = (u_int)range->rl_end;
 							range->rl_end = start - 1;
 							add_free_extent_cache(hfsmp, end + 1, old_end - end);
 						} else {
 							// Discard the head
 							hfsmp->tentativeBlocks -= end + 1 - range->rl_start;
-							hfs_release_summary(hfsmp, (u_int)range->rl_start,
-												start - (u_int)range->rl_start);
 							const uint32_t old_start = (u_int)range->rl_start;
 							range->rl_start = end + 1;
 							add_free_extent_cache(hfsmp, old_start,
@@ -1626,14 +1782,6 @@ OSErr BlockDeallocate (
 		}			
 	}
 
-	/*
-	 * If we're using the summary bitmap, then try to mark the bits
-	 * as potentially usable/free before actually deallocating them.
-	 * It is better to be slightly speculative here for correctness.
-	 */
-
-	(void) hfs_release_summary (hfsmp, firstBlock, numBlocks);
-
 	err = BlockMarkFreeInternal(vcb, firstBlock, numBlocks, true);
 
 	if (err) {
@@ -1660,12 +1808,10 @@ OSErr BlockDeallocate (
 
 	if (hfsmp->jnl == NULL) {
 		/*
-		 * In the journal case, we'll add the free extent once the journal
-		 * calls us back to tell us it wrote the transaction to disk.
-		 */
-		(void) add_free_extent_cache(vcb, firstBlock, numBlocks);
-
-		/*
+		 * BlockMarkFreeInternal has added the extent to the free extent
+		 * index.  In the journal case, that happens once the journal calls
+		 * us back to tell us it wrote the transaction to disk.
+		 *
 		 * If the journal case, we'll only update sparseAllocation once the
 		 * free extent cache becomes empty (when we remove the last entry
 		 * from the cache).  Skipping it here means we're less likely to
@@ -2178,6 +2324,65 @@ static OSErr hfs_alloc_try_hard(hfsmount_t *hfsmp,
 /*
 _______________________________________________________________________
 
+Routine:	BlockFindIndexed
+
+Function:   Find a contiguous group of allocation blocks in the free
+			extent index, the same way BlockFindContig would in the
+			bitmap: the lowest run of at least minBlocks at or after
+			startingBlock, else the lowest one before it.
+
+Inputs:
+	hfsmp			Pointer to volume where space is to be allocated
+	startingBlock	Preferred first block for allocation
+	minBlocks		Minimum number of contiguous blocks to allocate
+	maxBlocks		Maximum number of contiguous blocks to allocate
+	useMetaZone		Whether the metadata zone may be used
+
+Outputs:
+	actualStartBlock	First block of range found
+	actualNumBlocks		Number of blocks found
+
+Returns:
+	dskFulErr		No indexed extent is long enough
+_______________________________________________________________________
+*/
+static OSErr BlockFindIndexed(
+		struct hfsmount	*hfsmp,
+		u_int32_t		startingBlock,
+		u_int32_t		minBlocks,
+		u_int32_t		maxBlocks,
+		boolean_t		useMetaZone,
+		u_int32_t		*actualStartBlock,
+		u_int32_t		*actualNumBlocks)
+{
+	u_int32_t	lowBlock = 1;
+	boolean_t	found;
+
+	/* As in BlockFindContiguous, everything up to the end of the zone is off limits */
+	if (!useMetaZone && (hfsmp->hfs_flags & HFS_METADATA_ZONE))
+		lowBlock = hfsmp->hfs_metazone_end + 1;
+	if (startingBlock < lowBlock)
+		startingBlock = lowBlock;
+
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	found = fe_find_range(&hfsmp->vcbFreeExt, startingBlock, hfsmp->allocLimit,
+						  minBlocks, actualStartBlock, actualNumBlocks) ||
+			fe_find_range(&hfsmp->vcbFreeExt, lowBlock, startingBlock,
+						  minBlocks, actualStartBlock, actualNumBlocks);
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
+
+	if (!found)
+		return dskFulErr;
+
+	if (*actualNumBlocks > maxBlocks)
+		*actualNumBlocks = maxBlocks;
+
+	return noErr;
+}
+
+/*
+_______________________________________________________________________
+
 Routine:	BlockFindContig
 
 Function:   Find a contiguous group of allocation blocks.  If the
@@ -2226,6 +2431,15 @@ static OSErr BlockFindContig(
 	if (hfs_kdebug_allocation & HFSDBG_ALLOC_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_FIND_CONTIG_BITMAP | DBG_FUNC_START, startingBlock, minBlocks, maxBlocks, useMetaZone, 0);
 
+	/*
+	 * Everything in the free extent index can be reused right away, so there
+	 * is no collision to check for; only scan the bitmap if it has nothing.
+	 */
+	if (BlockFindIndexed(hfsmp, startingBlock, minBlocks, maxBlocks, useMetaZone,
+						 &foundStart, &foundCount) == noErr) {
+		goto bailout;
+	}
+
 	while ((retval == noErr) && (foundStart == 0) && (foundCount == 0)) {
 
 		/* Try and find something that works. */
@@ -2393,7 +2607,7 @@ static OSErr BlockFindAny(
 		 * have gotten to this point if the mount point made it look like there was possibly
 		 * free space in the FS. 
 		 */
-		err = hfs_find_summary_free (hfsmp, startingBlock, &suggested_start);
+		err = hfs_find_summary_free (hfsmp, startingBlock, 1, &suggested_start);
 		if (err == 0) {
 			start_blk = suggested_start;
 		}
@@ -2537,7 +2751,7 @@ restartSearchAny:
 					if (summary_block_scan != 0) {
 						uint32_t summary_bit;
 						(void) hfs_get_summary_index (hfsmp, summary_block_scan, &summary_bit);
-						hfs_set_summary (hfsmp, summary_bit, 1);
+						hfs_set_summary (hfsmp, summary_bit, 0);
 					}
 				}
 
@@ -2700,9 +2914,15 @@ _______________________________________________________________________
 
 Routine:	BlockFindKnown
 
-Function:   Return a potential extent from the free extent cache.  The
+Function:   Return a potential extent from the free extent index.  The
 		    returned extent *must* be marked allocated and removed
-		    from the cache by the *caller*.
+		    from the index by the *caller*.
+
+		    We take the smallest indexed extent that holds maxBlocks,
+		    so that large free extents are not chipped away by small
+		    allocations, or the largest one if none is long enough.
+		    On sparse devices, we take the lowest extent instead, to
+		    keep the backing store compact.
 
 Inputs:
 	vcb				Pointer to volume where space is to be allocated
@@ -2713,7 +2933,7 @@ Outputs:
 	actualNumBlocks		Number of blocks allocated, or 0 if error
 
 Returns:
-	dskFulErr		Free extent cache is empty
+	dskFulErr		Free extent index is empty
 _______________________________________________________________________
 */
 
@@ -2724,36 +2944,34 @@ static OSErr BlockFindKnown(
 		u_int32_t		*actualNumBlocks)
 {
 	OSErr			err;	
+	u_int32_t		foundStart;
 	u_int32_t		foundBlocks;
-	struct hfsmount *hfsmp = VCBTOHFS(vcb);
+	boolean_t		found;
 
 	if (hfs_kdebug_allocation & HFSDBG_ALLOC_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_ALLOC_FIND_KNOWN | DBG_FUNC_START, 0, 0, maxBlocks, 0, 0);
 
-	hfs_lock_mount (hfsmp);
 	lck_spin_lock(&vcb->vcbFreeExtLock);
-	if ( vcb->vcbFreeExtCnt == 0 || 
-			vcb->vcbFreeExt[0].blockCount == 0) {
-		lck_spin_unlock(&vcb->vcbFreeExtLock);
-		hfs_unlock_mount(hfsmp);
+	if (vcb->hfs_flags & HFS_HAS_SPARSE_DEVICE) {
+		found = fe_find_lowest(&vcb->vcbFreeExt, &foundStart, &foundBlocks);
+	} else {
+		found = fe_find_best(&vcb->vcbFreeExt, maxBlocks, &foundStart, &foundBlocks) ||
+				fe_find_largest(&vcb->vcbFreeExt, &foundStart, &foundBlocks);
+	}
+	lck_spin_unlock(&vcb->vcbFreeExtLock);
+
+	if (!found) {
 		if (hfs_kdebug_allocation & HFSDBG_ALLOC_ENABLED)
 			KERNEL_DEBUG_CONSTANT(HFSDBG_ALLOC_FIND_KNOWN | DBG_FUNC_END, dskFulErr, *actualStartBlock, *actualNumBlocks, 0, 0);
 		return dskFulErr;
 	}
-	lck_spin_unlock(&vcb->vcbFreeExtLock);
-	hfs_unlock_mount(hfsmp);
-
-	lck_spin_lock(&vcb->vcbFreeExtLock);
 
-	//	Just grab up to maxBlocks of the first (largest) free exent.
-	*actualStartBlock = vcb->vcbFreeExt[0].startBlock;
-	foundBlocks = vcb->vcbFreeExt[0].blockCount;
+	//	Just grab up to maxBlocks of the extent.
 	if (foundBlocks > maxBlocks)
 		foundBlocks = maxBlocks;
+	*actualStartBlock = foundStart;
 	*actualNumBlocks = foundBlocks;
 
-	lck_spin_unlock(&vcb->vcbFreeExtLock);
-
 	// sanity check
 	if ((*actualStartBlock + *actualNumBlocks) > vcb->allocLimit) 
 	{
@@ -2794,11 +3012,9 @@ Routine:	BlockMarkAllocatedInternal
 
 Function:	Mark a contiguous group of blocks as allocated (set in the
 			bitmap).  It assumes those bits are currently marked
-			deallocated (clear in the bitmap).  Note that this function
-			must be called regardless of whether or not the bitmap or
-			tree-based allocator is used, as all allocations must correctly
-			be marked on-disk.  If the tree-based approach is running, then
-			this will be done before the node is removed from the tree.
+			deallocated (clear in the bitmap).  The blocks are also
+			removed from the free extent index, including when they are
+			only being reserved (HFS_ALLOC_TENTATIVE/LOCKED).
 
 Inputs:
 	vcb				Pointer to volume where space is to be allocated
@@ -2814,15 +3030,11 @@ OSErr BlockMarkAllocatedInternal (
 								  hfs_block_alloc_flags_t flags)
 {
 	OSErr			err;
-	register u_int32_t	*currentWord;	//	Pointer to current word within bitmap block
-	register u_int32_t	wordsLeft;		//	Number of words left in this bitmap block
-	register u_int32_t	bitMask;		//	Word with given bits already set (ready to OR in)
-	u_int32_t		firstBit;		//	Bit index within word of first bit to allocate
-	u_int32_t		numBits;		//	Number of bits in word to allocate
 	u_int32_t		*buffer = NULL;
 	uintptr_t  blockRef = 0;
 	u_int32_t  bitsPerBlock;
-	u_int32_t  wordsPerBlock;
+	const u_int32_t  startingBlock_in = startingBlock;	//	both are advanced as the bits are set
+	const u_int32_t  numBlocks_in = numBlocks;
 	// XXXdbg
 	struct hfsmount *hfsmp = VCBTOHFS(vcb);
 
@@ -2863,6 +3075,9 @@ OSErr BlockMarkAllocatedInternal (
 
 	hfs_unmap_alloc_extent(vcb, startingBlock, numBlocks);
 
+	/* Reserved or not, nobody else may be handed these blocks now. */
+	remove_free_extent_cache(hfsmp, startingBlock, numBlocks);
+
 	/*
 	 * Don't make changes to the disk if we're just reserving.  Note that
 	 * we could do better in the tentative case because we could, in theory,
@@ -2876,130 +3091,39 @@ OSErr BlockMarkAllocatedInternal (
 	}
 
 	//
-	//	Pre-read the bitmap block containing the first word of allocation
-	//
-
-	err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef,
-						  HFS_ALLOC_IGNORE_RESERVED);
-	if (err != noErr) goto Exit;
-	//
-	//	Initialize currentWord, and wordsLeft.
+	//	Set the bits one bitmap block at a time.
 	//
-	{
-		u_int32_t wordIndexInBlock;
-
-		bitsPerBlock  = vcb->vcbVBMIOSize * kBitsPerByte;
-		wordsPerBlock = vcb->vcbVBMIOSize / kBytesPerWord;
-
-		wordIndexInBlock = (startingBlock & (bitsPerBlock-1)) / kBitsPerWord;
-		currentWord = buffer + wordIndexInBlock;
-		wordsLeft = wordsPerBlock - wordIndexInBlock;
-	}
 
-	// XXXdbg
-	if (hfsmp->jnl) {
-		journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
-	}
+	bitsPerBlock = vcb->vcbVBMIOSize * kBitsPerByte;
+	while (numBlocks != 0) {
+		u_int32_t firstBit = startingBlock & (bitsPerBlock - 1);
+		u_int32_t numBits = MIN(numBlocks, bitsPerBlock - firstBit);
 
-	//
-	//	If the first block to allocate doesn't start on a word
-	//	boundary in the bitmap, then treat that first word
-	//	specially.
-	//
+		err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef,
+							  HFS_ALLOC_IGNORE_RESERVED);
+		if (err != noErr) goto Exit;
 
-	firstBit = startingBlock % kBitsPerWord;
-	if (firstBit != 0) {
-		bitMask = kAllBitsSetInWord >> firstBit;	//	turn off all bits before firstBit
-		numBits = kBitsPerWord - firstBit;			//	number of remaining bits in this word
-		if (numBits > numBlocks) {
-			numBits = numBlocks;					//	entire allocation is inside this one word
-			bitMask &= ~(kAllBitsSetInWord >> (firstBit + numBits));	//	turn off bits after last
-		}
-#if DEBUG
-		if ((*currentWord & SWAP_BE32 (bitMask)) != 0) {
-			panic("hfs: BlockMarkAllocatedInternal: blocks already allocated!");
+		// XXXdbg
+		if (hfsmp->jnl) {
+			journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
 		}
-#endif
-		*currentWord |= SWAP_BE32 (bitMask);		//	set the bits in the bitmap
-		numBlocks -= numBits;						//	adjust number of blocks left to allocate
-
-		++currentWord;								//	move to next word
-		--wordsLeft;								//	one less word left in this block
-	}
-
-	//
-	//	Allocate whole words (32 blocks) at a time.
-	//
-
-	bitMask = kAllBitsSetInWord;					//	put this in a register for 68K
-	while (numBlocks >= kBitsPerWord) {
-		if (wordsLeft == 0) {
-			//	Read in the next bitmap block
-			startingBlock += bitsPerBlock;			//	generate a block number in the next bitmap block
-
-			buffer = NULL;
-			err = ReleaseBitmapBlock(vcb, blockRef, true);
-			if (err != noErr) goto Exit;
-
-			err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef,
-								  HFS_ALLOC_IGNORE_RESERVED);
-			if (err != noErr) goto Exit;
-
-			// XXXdbg
-			if (hfsmp->jnl) {
-				journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
-			}
 
-			//	Readjust currentWord and wordsLeft
-			currentWord = buffer;
-			wordsLeft = wordsPerBlock;
-		}
 #if DEBUG
-		if (*currentWord != 0) {
+		if (hfs_bm_set(buffer, firstBit, numBits)) {
 			panic("hfs: BlockMarkAllocatedInternal: blocks already allocated!");
 		}
+#else
+		(void) hfs_bm_set(buffer, firstBit, numBits);
 #endif
-		*currentWord = SWAP_BE32 (bitMask);
-		numBlocks -= kBitsPerWord;
+		startingBlock += numBits;
+		numBlocks -= numBits;
 
-		++currentWord;								//	move to next word
-		--wordsLeft;								//	one less word left in this block
+		buffer = NULL;
+		err = ReleaseBitmapBlock(vcb, blockRef, true);
+		if (err != noErr) goto Exit;
 	}
 
-	//
-	//	Allocate any remaining blocks.
-	//
-
-	if (numBlocks != 0) {
-		bitMask = ~(kAllBitsSetInWord >> numBlocks);	//	set first numBlocks bits
-		if (wordsLeft == 0) {
-			//	Read in the next bitmap block
-			startingBlock += bitsPerBlock;				//	generate a block number in the next bitmap block
-
-			buffer = NULL;
-			err = ReleaseBitmapBlock(vcb, blockRef, true);
-			if (err != noErr) goto Exit;
-
-			err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef,
-								  HFS_ALLOC_IGNORE_RESERVED);
-			if (err != noErr) goto Exit;
-
-			// XXXdbg
-			if (hfsmp->jnl) {
-				journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
-			}
-
-			currentWord = buffer;
-		}
-#if DEBUG
-		if ((*currentWord & SWAP_BE32 (bitMask)) != 0) {
-			panic("hfs: BlockMarkAllocatedInternal: blocks already allocated!");
-		}
-#endif
-		*currentWord |= SWAP_BE32 (bitMask);			//	set the bits in the bitmap
-
-		//	No need to update currentWord or wordsLeft
-	}
+	(void) hfs_claim_summary(hfsmp, startingBlock_in, numBlocks_in);
 
 Exit:
 
@@ -3126,7 +3250,10 @@ Routine:	BlockMarkFreeInternal
 
 Function:	Mark a contiguous group of blocks as free (clear in the
 			bitmap).  It assumes those bits are currently marked
-			allocated (set in the bitmap).
+			allocated (set in the bitmap).  Without a journal, the
+			blocks are added to the free extent index straight away;
+			with one, hfs_trim_callback adds them once the transaction
+			that freed them is on disk.
 
 Inputs:
 	vcb				Pointer to volume where space is to be freed
@@ -3152,14 +3279,11 @@ OSErr BlockMarkFreeInternal(
 	uint32_t	unmapCount = numBlocks_in;
 	uint32_t	wordIndexInBlock;
 	u_int32_t	*currentWord;	//	Pointer to current word within bitmap block
-	u_int32_t	wordsLeft;		//	Number of words left in this bitmap block
 	u_int32_t	bitMask;		//	Word with given bits already set (ready to OR in)
 	u_int32_t	currentBit;		//	Bit index within word of current bit to allocate
-	u_int32_t	numBits;		//	Number of bits in word to allocate
 	u_int32_t	*buffer = NULL;
 	uintptr_t	blockRef = 0;
 	u_int32_t	bitsPerBlock;
-	u_int32_t	wordsPerBlock;
 	// XXXdbg
 	struct hfsmount *hfsmp = VCBTOHFS(vcb);
 
@@ -3216,7 +3340,6 @@ OSErr BlockMarkFreeInternal(
 	//	Figure out how many bits and words per bitmap block.
 	//
 	bitsPerBlock  = vcb->vcbVBMIOSize * kBitsPerByte;
-	wordsPerBlock = vcb->vcbVBMIOSize / kBytesPerWord;
 	wordIndexInBlock = (startingBlock & (bitsPerBlock-1)) / kBitsPerWord;
 
 	//
@@ -3243,140 +3366,74 @@ OSErr BlockMarkFreeInternal(
 	}
 
 	//
-	//	If the first block to free doesn't start on a word
-	//	boundary in the bitmap, then treat that first word
-	//	specially.
+	//	Clear the bits one bitmap block at a time.  The first block is
+	//	already in.
 	//
 
-	currentWord = buffer + wordIndexInBlock;
-	wordsLeft = wordsPerBlock - wordIndexInBlock;
-	currentBit = startingBlock % kBitsPerWord;
-	if (currentBit != 0) {
-		bitMask = kAllBitsSetInWord >> currentBit;	//	turn off all bits before currentBit
-		numBits = kBitsPerWord - currentBit;		//	number of remaining bits in this word
-		if (numBits > numBlocks) {
-			numBits = numBlocks;					//	entire allocation is inside this one word
-			bitMask &= ~(kAllBitsSetInWord >> (currentBit + numBits));	//	turn off bits after last
-		}
-		if ((do_validate == true) && 
-				(*currentWord & SWAP_BE32 (bitMask)) != SWAP_BE32 (bitMask)) {
+	for (;;) {
+		u_int32_t firstBit = startingBlock & (bitsPerBlock - 1);
+		u_int32_t numBits = MIN(numBlocks, bitsPerBlock - firstBit);
+
+		if (hfs_bm_clear(buffer, firstBit, numBits) && (do_validate == true)) {
 			goto Corruption;
 		}
-		*currentWord &= SWAP_BE32 (~bitMask);		//	clear the bits in the bitmap
-		numBlocks -= numBits;						//	adjust number of blocks left to free
+		startingBlock += numBits;
+		numBlocks -= numBits;
+		if (numBlocks == 0)
+			break;
+
+		//	Read in the next bitmap block
+		buffer = NULL;
+		err = ReleaseBitmapBlock(vcb, blockRef, true);
+		if (err != noErr) goto Exit;
 
-		++currentWord;								//	move to next word
-		--wordsLeft;								//	one less word left in this block
+		err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef,
+							  HFS_ALLOC_IGNORE_RESERVED);
+		if (err != noErr) goto Exit;
+
+		// XXXdbg
+		if (hfsmp->jnl) {
+			journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
+		}
 	}
 
 	//
-	//	Free whole words (32 blocks) at a time.
+	// Look for a range of free blocks immediately after the range we just freed
+	// (up to the end of the current bitmap block, and not into max_unmap).
 	//
+	{
+		u_int32_t freedEnd = startingBlock_in + numBlocks_in;
+		u_int32_t firstBit = (freedEnd - 1) % bitsPerBlock + 1;
+		u_int32_t limit = bitsPerBlock;
 
-	while (numBlocks >= kBitsPerWord) {
-		if (wordsLeft == 0) {
-			//	Read in the next bitmap block
-			startingBlock += bitsPerBlock;			//	generate a block number in the next bitmap block
-
-			buffer = NULL;
-			err = ReleaseBitmapBlock(vcb, blockRef, true);
-			if (err != noErr) goto Exit;
+		if (max_unmap <= freedEnd)
+			limit = firstBit;
+		else if (max_unmap - freedEnd < limit - firstBit)
+			limit = firstBit + (max_unmap - freedEnd);
+		unmapCount += hfs_bm_find_set(buffer, firstBit, limit) - firstBit;
+	}
 
-			err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef,
-								  HFS_ALLOC_IGNORE_RESERVED);
-			if (err != noErr) goto Exit;
+Exit:
 
-			// XXXdbg
-			if (hfsmp->jnl) {
-				journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
-			}
+	if (buffer)
+		(void)ReleaseBitmapBlock(vcb, blockRef, true);
 
-			//	Readjust currentWord and wordsLeft
-			currentWord = buffer;
-			wordsLeft = wordsPerBlock;
-		}
-		if ((do_validate == true) && 
-				(*currentWord != SWAP_BE32 (kAllBitsSetInWord))) {
-			goto Corruption;
-		}
-		*currentWord = 0;							//	clear the entire word
-		numBlocks -= kBitsPerWord;
+	/*
+	 * Credit the summary table even on error: some of the bits may have been
+	 * cleared, and a count that is too high only costs a bitmap read later.
+	 */
+	(void) hfs_release_summary(hfsmp, startingBlock_in, numBlocks_in);
 
-		++currentWord;								//	move to next word
-		--wordsLeft;									//	one less word left in this block
+	if (err == noErr) {
+		hfs_unmap_free_extent(vcb, unmapStart, unmapCount);
+		if (hfsmp->jnl == NULL)
+			(void) add_free_extent_cache(vcb, startingBlock_in, numBlocks_in);
 	}
 
-	//
-	//	Free any remaining blocks.
-	//
-
-	if (numBlocks != 0) {
-		bitMask = ~(kAllBitsSetInWord >> numBlocks);	//	set first numBlocks bits
-		if (wordsLeft == 0) {
-			//	Read in the next bitmap block
-			startingBlock += bitsPerBlock;				//	generate a block number in the next bitmap block
-
-			buffer = NULL;
-			err = ReleaseBitmapBlock(vcb, blockRef, true);
-			if (err != noErr) goto Exit;
+	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
+		KERNEL_DEBUG_CONSTANT(HFSDBG_MARK_FREE_BITMAP | DBG_FUNC_END, err, 0, 0, 0, 0);
 
-			err = ReadBitmapBlock(vcb, startingBlock, &buffer, &blockRef, 
-								  HFS_ALLOC_IGNORE_RESERVED);
-			if (err != noErr) goto Exit;
-
-			// XXXdbg
-			if (hfsmp->jnl) {
-				journal_modify_block_start(hfsmp->jnl, (struct buf *)blockRef);
-			}
-
-			currentWord = buffer;
-		}
-		if ((do_validate == true) && 
-				(*currentWord & SWAP_BE32 (bitMask)) != SWAP_BE32 (bitMask)) {
-			goto Corruption;
-		}
-		*currentWord &= SWAP_BE32 (~bitMask);			//	clear the bits in the bitmap
-
-		//	No need to update currentWord or wordsLeft
-	}
-
-	//
-	// Look for a range of free blocks immediately after the range we just freed
-	// (up to the end of the current bitmap block).
-	//
-	wordIndexInBlock = ((startingBlock_in + numBlocks_in - 1) & (bitsPerBlock-1)) / kBitsPerWord;
-	wordsLeft = wordsPerBlock - wordIndexInBlock;
-	currentWord = buffer + wordIndexInBlock;
-	currentBit = (startingBlock_in + numBlocks_in - 1) % kBitsPerWord;
-	bitMask = kHighBitInWordMask >> currentBit;
-	while (unmapStart + unmapCount < max_unmap) {
-		// Move currentWord/bitMask/wordsLeft forward one bit
-		bitMask >>= 1;
-		if (bitMask == 0) {
-			if (--wordsLeft == 0)
-				break;
-			++currentWord;
-			bitMask = kHighBitInWordMask;
-		}
-
-		if (*currentWord & SWAP_BE32(bitMask))
-			break;	// Found an allocated block.  Stop searching.
-		++unmapCount;
-	}
-
-Exit:
-
-	if (buffer)
-		(void)ReleaseBitmapBlock(vcb, blockRef, true);
-
-	if (err == noErr) {
-		hfs_unmap_free_extent(vcb, unmapStart, unmapCount);
-	}
-
-	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
-		KERNEL_DEBUG_CONSTANT(HFSDBG_MARK_FREE_BITMAP | DBG_FUNC_END, err, 0, 0, 0, 0);
-
-	return err;
+	return err;
 
 Corruption:
 #if DEBUG
@@ -3440,13 +3497,12 @@ static OSErr BlockFindContiguous(
 	u_int32_t			stopBlock;			//	If we get to this block, stop searching for first free block.
 	u_int32_t			foundBlocks;		//	Number of contiguous free blocks in current extent.
 	u_int32_t			*buffer = NULL;
-	register u_int32_t	*currentWord;
-	register u_int32_t	bitMask;
-	register u_int32_t	wordsLeft;
-	register u_int32_t	tempWord;
+	u_int32_t			bufferBase;			//	First block covered by buffer.
+	u_int32_t			bitsPerBlock;
+	u_int32_t			offset, limit;		//	Bit range being scanned in buffer.
 	uintptr_t  blockRef = 0;
-	u_int32_t  wordsPerBlock;
 	u_int32_t  updated_free_extent = 0;
+	u_int32_t  summaryMin;				//	Shortest run worth scanning a bitmap block for.
 	struct hfsmount *hfsmp = (struct hfsmount*) vcb;
 	HFSPlusExtentDescriptor best = { 0, 0 };
 
@@ -3487,14 +3543,17 @@ static OSErr BlockFindContiguous(
 		currentBlock = NextBitmapBlock(vcb, currentBlock);
 
 	/*
-	 * Use the summary table if we can.  Skip over any totally
-	 * allocated blocks.  currentBlock should now point to the first
-	 * block beyond the metadata zone if the metazone allocations are not
+	 * Use the summary table if we can.  Skip over any bitmap blocks that
+	 * cannot hold the start of a run of minBlocks free blocks.  When trying
+	 * hard we want the largest run there is, however short, so only totally
+	 * allocated blocks can be skipped.  currentBlock should now point to the
+	 * first block beyond the metadata zone if the metazone allocations are not
 	 * allowed in this invocation.
 	 */
+	summaryMin = ISSET(flags, HFS_ALLOC_TRY_HARD) ? 1 : minBlocks;
 	if ((trustSummary) && (hfsmp->hfs_flags & HFS_SUMMARY_TABLE)) {
 		uint32_t suggestion;
-		err = hfs_find_summary_free (hfsmp, currentBlock, &suggestion);
+		err = hfs_find_summary_free (hfsmp, currentBlock, summaryMin, &suggestion);
 		if (err && err != ENOSPC)
 			goto ErrorExit;
 		if (err == ENOSPC || suggestion >= stopBlock)
@@ -3510,13 +3569,10 @@ static OSErr BlockFindContiguous(
 	if ( err != noErr ) goto ErrorExit;
 
 	//
-	//	Figure out where currentBlock is within the buffer.
+	//	Figure out which blocks the buffer covers.
 	//
-	wordsPerBlock = vcb->vcbVBMIOSize / kBytesPerWord;
-
-	wordsLeft = (currentBlock / kBitsPerWord) & (wordsPerBlock-1);	// Current index into buffer
-	currentWord = buffer + wordsLeft;
-	wordsLeft = wordsPerBlock - wordsLeft;
+	bitsPerBlock = vcb->vcbVBMIOSize * kBitsPerByte;
+	bufferBase = currentBlock & ~(bitsPerBlock - 1);
 
 	uint32_t remaining = (hfsmp->freeBlocks - hfsmp->lockedBlocks
 						  - (ISSET(flags, HFS_ALLOC_IGNORE_TENTATIVE)
@@ -3541,38 +3597,13 @@ static OSErr BlockFindContiguous(
 		uint32_t summary_block_scan = 0;
 		/*
 		 * Inner while loop 1:
-		 *		Look for free blocks, skipping over allocated ones.
-		 *
-		 * Initialization starts with checking the initial partial word
-		 * if applicable.
+		 *		Look for free blocks, skipping over allocated ones, a
+		 *		bitmap block at a time.
 		 */
-		bitMask = currentBlock & kBitsWithinWordMask;
-		if (bitMask)
-		{			
-			tempWord = SWAP_BE32(*currentWord);			//	Fetch the current word only once
-			bitMask = kHighBitInWordMask >> bitMask;
-			while (tempWord & bitMask)
-			{
-				bitMask >>= 1;
-				++currentBlock;
-			}
-
-			//	Did we find an unused bit (bitMask != 0), or run out of bits (bitMask == 0)? 
-			if (bitMask)
-				goto FoundUnused;
-
-			//	Didn't find any unused bits, so we're done with this word.
-			++currentWord;
-			--wordsLeft;
-		}
-
-		//
-		//	Check whole words
-		//
 		while (currentBlock < stopBlock)
 		{
 			//	See if it's time to read another block.
-			if (wordsLeft == 0)
+			if (currentBlock - bufferBase >= bitsPerBlock)
 			{
 				buffer = NULL;
 				if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
@@ -3588,7 +3619,7 @@ static OSErr BlockFindContiguous(
 					if (summary_block_scan != 0) {
 						uint32_t summary_bit;
 						(void) hfs_get_summary_index (hfsmp, summary_block_scan, &summary_bit);
-						hfs_set_summary (hfsmp, summary_bit, 1);
+						hfs_set_summary (hfsmp, summary_bit, 0);
 					}
 				}
 				err = ReleaseBitmapBlock(vcb, blockRef, false);
@@ -3604,10 +3635,10 @@ static OSErr BlockFindContiguous(
 					}
 				}
 
-				/* Skip over fully allocated bitmap blocks if we can */
+				/* Skip over bitmap blocks too full for the run we want, if we can */
 				if ((trustSummary) && (hfsmp->hfs_flags & HFS_SUMMARY_TABLE)) {
 					uint32_t suggestion;
-					err = hfs_find_summary_free (hfsmp, currentBlock, &suggestion);
+					err = hfs_find_summary_free (hfsmp, currentBlock, summaryMin, &suggestion);
 					if (err && err != ENOSPC)
 						goto ErrorExit;
 					if (err == ENOSPC || suggestion >= stopBlock)
@@ -3627,31 +3658,18 @@ static OSErr BlockFindContiguous(
 				 * through this loop again and set the appropriate summary bit as fully allocated.
 				 */	
 				summary_block_scan = currentBlock;
-				currentWord = buffer;
-				wordsLeft = wordsPerBlock;
-			}
-
-			//	See if any of the bits are clear
-			if ((tempWord = SWAP_BE32(*currentWord)) + 1)	//	non-zero if any bits were clear
-			{
-				//	Figure out which bit is clear
-				bitMask = kHighBitInWordMask;
-				while (tempWord & bitMask)
-				{
-					bitMask >>= 1;
-					++currentBlock;
-				}
-
-				break;		//	Found the free bit; break out to FoundUnused.
+				bufferBase = currentBlock & ~(bitsPerBlock - 1);
 			}
 
-			//	Keep looking at the next word
-			currentBlock += kBitsPerWord;
-			++currentWord;
-			--wordsLeft;
+			//	Look for a clear bit in the rest of this block
+			offset = currentBlock - bufferBase;
+			limit = MIN(bitsPerBlock, stopBlock - bufferBase);
+			offset = hfs_bm_find_clear(buffer, offset, limit);
+			currentBlock = bufferBase + offset;
+			if (offset < limit)
+				break;		//	Found the free bit.
 		}
 
-FoundUnused:
 		//	Make sure the unused bit is early enough to use
 		if (currentBlock >= stopBlock)
 		{
@@ -3665,38 +3683,12 @@ FoundUnused:
 		/*
 		 * Inner while loop 2:
 		 *		We get here if we find a free block. Count the number
-		 * 		of contiguous free blocks observed.
-		 * 
-		 * Initialization starts with checking the initial partial word
-		 * if applicable.
+		 * 		of contiguous free blocks observed, up to maxBlocks.
 		 */
-		bitMask = currentBlock & kBitsWithinWordMask;
-		if (bitMask)
-		{
-			tempWord = SWAP_BE32(*currentWord);			//	Fetch the current word only once
-			bitMask = kHighBitInWordMask >> bitMask;
-			while (bitMask && !(tempWord & bitMask))
-			{
-				bitMask >>= 1;
-				++currentBlock;
-			}
-
-			//	Did we find a used bit (bitMask != 0), or run out of bits (bitMask == 0)? 
-			if (bitMask)
-				goto FoundUsed;
-
-			//	Didn't find any used bits, so we're done with this word.
-			++currentWord;
-			--wordsLeft;
-		}
-
-		//
-		//	Check whole words
-		//
 		while (currentBlock < endingBlock)
 		{
 			//	See if it's time to read another block.
-			if (wordsLeft == 0)
+			if (currentBlock - bufferBase >= bitsPerBlock)
 			{
 				buffer = NULL;
 				err = ReleaseBitmapBlock(vcb, blockRef, false);
@@ -3717,35 +3709,22 @@ FoundUnused:
 				err = ReadBitmapBlock(vcb, currentBlock, &buffer, &blockRef, flags);
 				if ( err != noErr ) goto ErrorExit;
 
-				currentWord = buffer;
-				wordsLeft = wordsPerBlock;
-			}
-
-			//	See if any of the bits are set
-			if ((tempWord = SWAP_BE32(*currentWord)) != 0)
-			{
-				//	Figure out which bit is set
-				bitMask = kHighBitInWordMask;
-				while (!(tempWord & bitMask))
-				{
-					bitMask >>= 1;
-					++currentBlock;
-				}
-
-				break;		//	Found the used bit; break out to FoundUsed.
+				bufferBase = currentBlock & ~(bitsPerBlock - 1);
 			}
 
-			//	Keep looking at the next word
-			currentBlock += kBitsPerWord;
-			++currentWord;
-			--wordsLeft;
+			//	Look for a set bit in the rest of this block
+			offset = currentBlock - bufferBase;
+			limit = MIN(bitsPerBlock, endingBlock - bufferBase);
+			if ((u_int64_t)firstBlock + maxBlocks - bufferBase < limit)
+				limit = firstBlock + maxBlocks - bufferBase;
+			offset = hfs_bm_find_set(buffer, offset, limit);
+			currentBlock = bufferBase + offset;
 
-			//	If we found at least maxBlocks, we can quit early.
-			if ((currentBlock - firstBlock) >= maxBlocks)
+			//	Stop at the used bit, or once we have found maxBlocks.
+			if (offset < limit || (currentBlock - firstBlock) >= maxBlocks)
 				break;
 		}
 
-FoundUsed:
 		//	Make sure we didn't run out of bitmap looking for a used block.
 		//	If so, pin to the end of the bitmap.
 		if (currentBlock > endingBlock)
@@ -3854,17 +3833,13 @@ ErrorExit:
 	}
 
 	if (updated_free_extent && (vcb->hfs_flags & HFS_HAS_SPARSE_DEVICE)) {
-		int i;
 		u_int32_t min_start = vcb->totalBlocks;
+		u_int32_t min_count;
 
 		// set the nextAllocation pointer to the smallest free block number
 		// we've seen so on the next mount we won't rescan unnecessarily
 		lck_spin_lock(&vcb->vcbFreeExtLock);
-		for(i=0; i < (int)vcb->vcbFreeExtCnt; i++) {
-			if (vcb->vcbFreeExt[i].startBlock < min_start) {
-				min_start = vcb->vcbFreeExt[i].startBlock;
-			}
-		}
+		(void) fe_find_lowest(&vcb->vcbFreeExt, &min_start, &min_count);
 		lck_spin_unlock(&vcb->vcbFreeExtLock);
 		if (min_start != vcb->totalBlocks) {
 			if (min_start < vcb->nextAllocation) {
@@ -4122,18 +4097,19 @@ hfs_isallocated(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t numBl
 } 
 
 /*
- * CONFIG_HFS_RBTREE
- * Check to see if the red-black tree is live.  Allocation file lock must be held
- * shared or exclusive to call this function. Note that we may call this even if
- * HFS is built without activating the red-black tree code.
+ * Check to see if the free extent index is live, i.e. it was built by the
+ * mount-time bitmap scan and has not forgotten any extent since.  Allocation
+ * file lock must be held shared or exclusive to call this function.
  */
 int 
 hfs_isrbtree_active(struct hfsmount *hfsmp){
+	int active;
 
-#pragma unused (hfsmp)
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	active = hfsmp->vcbFreeExt.fi_complete;
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 
-	/* Just return 0 for now */
-	return 0;
+	return active;
 }
 
 
@@ -4151,8 +4127,8 @@ hfs_isrbtree_active(struct hfsmount *hfsmp){
  * 		hfsmp -- filesystem in question.
  * 
  * Output Arg:
- *		*freeblocks - set to 1 if we believe at least one free blocks in this vcbVBMIOSize
- * 		page of bitmap file.
+ *		*freeblocks - set to the most free blocks there can be in this vcbVBMIOSize
+ * 		page of bitmap file; zero if it is known to be full.
  * 
  *
  * Returns:
@@ -4172,22 +4148,7 @@ static int hfs_check_summary (struct hfsmount *hfsmp, uint32_t allocblock, uint3
 				return EINVAL;
 			}
 
-			/* Ok, now that we have the bit index into the array, what byte is it in ? */
-			uint32_t byteindex = index / kBitsPerByte;
-			uint8_t current_byte = hfsmp->hfs_summary_table[byteindex];
-			uint8_t bit_in_byte = index % kBitsPerByte;
-
-			if (current_byte & (1 << bit_in_byte)) {
-				/* 
-				 * We do not believe there is anything free in the
-				 * entire vcbVBMIOSize'd block.
-				 */
-				*freeblocks = 0;
-			}	
-			else {
-				/* Looks like there might be a free block here... */
-				*freeblocks = 1;
-			}
+			*freeblocks = sum_chunk_free (&hfsmp->hfs_summary, index);
 		}
 		err = 0;
 	}
@@ -4195,63 +4156,36 @@ static int hfs_check_summary (struct hfsmount *hfsmp, uint32_t allocblock, uint3
 	return err;
 }
 
-
-#if 0
 /*
- * hfs_get_next_summary
- *
- * From a given allocation block, jump to the allocation block at the start of the
- * next vcbVBMIOSize boundary.  This is useful when trying to quickly skip over
- * large swaths of bitmap once we have determined that the bitmap is relatively full. 
+ * hfs_release_summary 
+ * 
+ * Given an extent that has just been cleared in the bitmap, add its blocks back
+ * to the free counts of the vcbVBMIOSize chunks (and superchunks) it covers.
  *
- * Inputs: hfsmount, starting allocation block number
- * Output Arg: *newblock will contain the allocation block number to start
- * querying.
+ *	Inputs:
+ * 		hfsmp 		- hfs mount
+ * 		block 		- starting allocation block.
+ * 		length		- length of the extent.
  * 
- * Returns:
- *		0 on success
- * 		EINVAL if the block argument is too large to be used, or the summary table not live.
- * 		EFBIG if there are no more summary bits to be queried
+ * 	Returns:
+ *		EINVAL upon any errors.
  */
-static int 
-hfs_get_next_summary (struct hfsmount *hfsmp, uint32_t block, uint32_t *newblock) {
-
-	u_int32_t bits_per_iosize = hfsmp->vcbVBMIOSize * kBitsPerByte;
-	u_int32_t start_offset;
-	u_int32_t next_offset;
-	int err = EINVAL; 
+static int hfs_release_summary(struct hfsmount *hfsmp, uint32_t start_blk, uint32_t length) {
+	int err = EINVAL;
 
 	if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
-		if ((err = hfs_get_summary_index(hfsmp, block, &start_offset))) {
-			return err;
-		}
-
-		next_offset = start_offset++;	
-
-		if ((start_offset >= hfsmp->hfs_summary_size) || (next_offset >= hfsmp->hfs_summary_size)) {
-			/* Can't jump to the next summary bit. */
-			return EINVAL;
-		}
-
-		/* Otherwise, compute and return */
-		*newblock = next_offset * bits_per_iosize;
-		if (*newblock >= hfsmp->totalBlocks) {
-			return EINVAL;
-		}
+		sum_freed (&hfsmp->hfs_summary, start_blk, length);
 		err = 0;
 	}
 
 	return err;
 }
 
-#endif
-
 /*
- * hfs_release_summary 
+ * hfs_claim_summary 
  * 
- * Given an extent that is about to be de-allocated on-disk, determine the number
- * of summary bitmap bits that need to be marked as 'potentially available'.
- * Then go ahead and mark them as free.
+ * The counterpart of hfs_release_summary: given an extent that has just been set
+ * in the bitmap, take its blocks off the free counts of the chunks it covers.
  *
  *	Inputs:
  * 		hfsmp 		- hfs mount
@@ -4261,38 +4195,14 @@ hfs_get_next_summary (struct hfsmount *hfsmp, uint32_t block, uint32_t *newblock
  * 	Returns:
  *		EINVAL upon any errors.
  */
-static int hfs_release_summary(struct hfsmount *hfsmp, uint32_t start_blk, uint32_t length) {
+static int hfs_claim_summary(struct hfsmount *hfsmp, uint32_t start_blk, uint32_t length) {
 	int err = EINVAL;
-	uint32_t end_blk = (start_blk + length) - 1;
 
 	if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
-		/* Figure out what the starting / ending block's summary bits are */
-		uint32_t start_bit;
-		uint32_t end_bit;
-		uint32_t current_bit;
-
-		err = hfs_get_summary_index (hfsmp, start_blk, &start_bit);
-		if (err) {
-			goto release_err;
-		}
-		err = hfs_get_summary_index (hfsmp, end_blk, &end_bit);
-		if (err) {
-			goto release_err;
-		}
-
-		if (ALLOC_DEBUG) {
-			if (start_bit > end_bit) {
-				panic ("HFS: start > end!, %d %d ", start_bit, end_bit);
-			}
-		}
-		current_bit = start_bit;
-		while (current_bit <= end_bit) {
-			err = hfs_set_summary (hfsmp, current_bit, 0); 
-			current_bit++;
-		}
+		sum_allocated (&hfsmp->hfs_summary, start_blk, length);
+		err = 0;
 	}
 
-release_err:
 	return err;
 }
 
@@ -4300,13 +4210,14 @@ release_err:
  * hfs_find_summary_free
  * 
  * Given a allocation block as input, returns an allocation block number as output as a 
- * suggestion for where to start scanning the bitmap in order to find free blocks.  It will
- * determine the vcbVBMIOsize of the input allocation block, convert that into a summary
- * bit, then keep iterating over the summary bits in order to find the first free one.
+ * suggestion for where to start scanning the bitmap in order to find free blocks.  It
+ * skips every superchunk, then every chunk, whose free counts show that a run of
+ * 'minblocks' free blocks cannot start there, without reading any of the bitmap.
  * 
  * Inputs:
  *		hfsmp 		- hfs mount
  * 		block		- starting allocation block
+ *		minblocks	- length of the run the caller is looking for; 1 for any free block
  * 		newblock 	- output block as suggestion
  * 
  * Returns:
@@ -4314,142 +4225,39 @@ release_err:
  * 		ENOSPC if we could not find a free block 
  */
 
-int hfs_find_summary_free (struct hfsmount *hfsmp, uint32_t block,  uint32_t *newblock) {
+int hfs_find_summary_free (struct hfsmount *hfsmp, uint32_t block, uint32_t minblocks,
+		uint32_t *newblock) {
 
 	int err = ENOSPC;
-	uint32_t bit_index = 0;
-	uint32_t maybe_has_blocks = 0;
 
 	if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
-		uint32_t byte_index;
-		uint8_t curbyte;
-		uint8_t bit_in_byte;
-		uint32_t summary_cap;
-
 		/* 
-		 * We generate a cap for the summary search because the summary table
-		 * always represents a full summary of the bitmap FILE, which may
-		 * be way more bits than are necessary for the actual filesystem 
-		 * whose allocations are mapped by the bitmap.
-		 * 
-		 * Compute how much of hfs_summary_size is useable for the given number
-		 * of allocation blocks eligible on this FS.
-		 */
-		err = hfs_get_summary_index (hfsmp, hfsmp->allocLimit - 1, &summary_cap);
-		if (err) {
-			goto summary_exit;
-		}
-
-		/* Check the starting block first */
-		err = hfs_check_summary (hfsmp, block, &maybe_has_blocks);
-		if (err) {
-			goto summary_exit;
-		}
-
-		if (maybe_has_blocks) {
-			/* 
-			 * It looks like the initial start block could have something.  
-			 * Short-circuit and just use that.
-			 */
-			*newblock = block;
-			goto summary_exit;
-		}
-
-		/*
-		 * OK, now we know that the first block was useless.  
-		 * Get the starting summary bit, and find it in the array 
+		 * The summary table always represents a full summary of the bitmap FILE, which
+		 * may be way more bits than are necessary for the actual filesystem whose
+		 * allocations are mapped by the bitmap; stop at allocLimit.
 		 */
-		maybe_has_blocks = 0;
-		err = hfs_get_summary_index (hfsmp, block, &bit_index);
-		if (err) {
-			goto summary_exit;
-		}
-
-		/* Iterate until we find something. */
-		while (bit_index <= summary_cap) {
-			byte_index = bit_index / kBitsPerByte;
-			curbyte = hfsmp->hfs_summary_table[byte_index];
-			bit_in_byte = bit_index % kBitsPerByte;
-
-			if (curbyte & (1 << bit_in_byte)) {
-				/* nothing here.  increment and move on */
-				bit_index++;
-			}
-			else {
-				/* 
-				 * found something! convert bit_index back into 
-				 * an allocation block for use. 'newblock' will now
-				 * contain the proper allocation block # based on the bit
-				 * index.
-				 */
-				err = hfs_get_summary_allocblock (hfsmp, bit_index, newblock);	
-				if (err) {
-					goto summary_exit;
-				}
-				maybe_has_blocks = 1;
-				break;
-			}
-		}
-
-		/* If our loop didn't find anything, set err to ENOSPC */
-		if (maybe_has_blocks == 0) {
-			err = ENOSPC;
+		if (sum_find (&hfsmp->hfs_summary, block, hfsmp->allocLimit, minblocks, newblock)) {
+			err = 0;
 		}
 	}
 
 	/* If the summary table is not active for this mount, we'll just return ENOSPC */
-summary_exit:
-	if (maybe_has_blocks) {
-		err = 0;
-	}
-
 	return err;
 }
 
-/*
- * hfs_get_summary_allocblock
- * 
- * Convert a summary bit into an allocation block number to use to start searching for free blocks.
- * 
- * Inputs:
- *		hfsmp 			- hfs mount
- * 		summarybit 		- summmary bit index 
- *		*alloc			- allocation block number in the bitmap file.
- *
- * Output:
- *		0 on success
- * 		EINVAL on failure
- */
-int hfs_get_summary_allocblock (struct hfsmount *hfsmp, uint32_t
-		summarybit, uint32_t *alloc) {
-	uint32_t bits_per_iosize = hfsmp->vcbVBMIOSize * kBitsPerByte;
-	uint32_t allocblk;
-
-	allocblk = summarybit * bits_per_iosize;
-
-	if (allocblk >= hfsmp->totalBlocks) {
-		return EINVAL;
-	}
-	else {
-		*alloc = allocblk;
-	}
-
-	return 0;
-}
-
 
 /*
  * hfs_set_summary:
  * 
  * This function should be used to manipulate the summary table 
  *
- * The argument 'inuse' will set the value of the bit in question to one or zero
- * depending on its value.
+ * The argument 'freeblocks' is the number of free blocks just counted in the
+ * vcbVBMIOSize page of bitmap in question; zero marks it as full.
  *
  * Inputs:
  * 		hfsmp 		- hfs mount
- *		summarybit	- the bit index into the summary table to set/unset.
- * 		inuse		- the value to assign to the bit.
+ *		summarybit	- the index of the page in the summary table.
+ * 		freeblocks	- the free block count to record for it.
  *
  * Returns:
  * 		0 on success
@@ -4457,31 +4265,19 @@ int hfs_get_summary_allocblock (struct hfsmount *hfsmp, uint32_t
  * 	
  */
 
-static int hfs_set_summary (struct hfsmount *hfsmp, uint32_t summarybit, uint32_t inuse) {
+static int hfs_set_summary (struct hfsmount *hfsmp, uint32_t summarybit, uint32_t freeblocks) {
 
 	int err = EINVAL;
 	if (hfsmp->vcbVBMIOSize) {
 		if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {	
 
 			if (ALLOC_DEBUG) {
-				if (hfsmp->hfs_summary_table == NULL) {
+				if (hfsmp->hfs_summary.st_chunk_free == NULL) {
 					panic ("hfs_set_summary: no table for %p ", hfsmp);
 				}
 			}
 
-			/* Ok, now that we have the bit index into the array, what byte is it in ? */
-			uint32_t byte_index = summarybit / kBitsPerByte;
-			uint8_t current_byte = hfsmp->hfs_summary_table[byte_index];
-			uint8_t bit_in_byte = summarybit % kBitsPerByte;
-
-			if (inuse) {
-				current_byte = (current_byte | (1 << bit_in_byte));
-			}
-			else {
-				current_byte = (current_byte & ~(1 << bit_in_byte));
-			}
-
-			hfsmp->hfs_summary_table[byte_index] = current_byte;
+			sum_set (&hfsmp->hfs_summary, summarybit, freeblocks);
 		}
 		err = 0;
 	}
@@ -4527,11 +4323,40 @@ static int hfs_get_summary_index (struct hfsmount *hfsmp, uint32_t block, uint32
 	return err;
 }
 
+/*
+ * hfs_summary_chunks
+ *
+ * Number of vcbVBMIOSize chunks in the bitmap file, which is the number of
+ * entries the summary table needs.
+ */
+static uint32_t hfs_summary_chunks (struct hfsmount *hfsmp) {
+
+	uint32_t summary_size = hfsmp->hfs_allocation_cp->c_blocks;
+
+	/*
+	 * If the bitmap IO size is not the same as the allocation block size then
+	 * then re-compute the number of summary entries necessary.  Note that the 
+	 * default size is the number of allocation blocks in the bitmap *FILE* 
+	 * (not the number of bits in the bitmap itself).  If the allocation block size
+	 * is large enough though, we may need to increase this. 
+	 */
+	if (hfsmp->blockSize != hfsmp->vcbVBMIOSize) {
+		uint64_t lrg_size = (uint64_t) hfsmp->hfs_allocation_cp->c_blocks * (uint64_t) hfsmp->blockSize;
+		lrg_size = lrg_size / (uint64_t)hfsmp->vcbVBMIOSize;
+
+		/* With a full bitmap and 64k-capped iosize chunks, this would be 64k */
+		summary_size = (uint32_t) lrg_size;
+	}
+
+	return summary_size;
+}
+
 /*
  * hfs_init_summary
  * 
  * From a given mount structure, compute how big the summary table should be for the given
- * filesystem, then allocate and bzero the memory.
+ * filesystem, then allocate it.  Until the bitmap has been scanned, every chunk counts
+ * as entirely free.
  *
  * Returns:
  * 0 on success
@@ -4541,8 +4366,7 @@ int
 hfs_init_summary (struct hfsmount *hfsmp) {
 
 	uint32_t summary_size;	
-	uint32_t summary_size_bytes;
-	uint8_t *summary_table;
+	int err;
 
 	if (hfsmp->hfs_allocation_cp == NULL) {
 		if (ALLOC_DEBUG) {
@@ -4551,14 +4375,14 @@ hfs_init_summary (struct hfsmount *hfsmp) {
 		return EINVAL;
 	}
 	/* 
-	 * The practical maximum size of the summary table is 16KB:  
+	 * The practical maximum size of the summary table is 128K entries:  
 	 *
-	 *		(512MB maximum bitmap size / (4k -- min alloc block size)) / 8 bits/byte.
+	 *		512MB maximum bitmap size / (4k -- min alloc block size).
 	 * 
 	 * HFS+ will allow filesystems with allocation block sizes smaller than 4k, but
 	 * the end result is that we'll start to issue I/O in 2k or 1k sized chunks, which makes
 	 * supporting this much worse.  The math would instead look like this:
-	 * (512MB / 2k) / 8 == 32k. 
+	 * 512MB / 2k == 256K. 
 	 * 
 	 * So, we will disallow the summary table if the allocation block size is < 4k.
 	 */
@@ -4568,140 +4392,63 @@ hfs_init_summary (struct hfsmount *hfsmp) {
 		return EINVAL;
 	}
 
-	summary_size = hfsmp->hfs_allocation_cp->c_blocks;
-
 	if (ALLOC_DEBUG) {
 		printf("HFS Summary Table Initialization: Bitmap %u blocks\n", 
 				hfsmp->hfs_allocation_cp->c_blocks);
 	}
 
-	/*
-	 * If the bitmap IO size is not the same as the allocation block size then
-	 * then re-compute the number of summary bits necessary.  Note that above, the 
-	 * the default size is the number of allocation blocks in the bitmap *FILE* 
-	 * (not the number of bits in the bitmap itself).  If the allocation block size
-	 * is large enough though, we may need to increase this. 
-	 */
-	if (hfsmp->blockSize != hfsmp->vcbVBMIOSize) {
-		uint64_t lrg_size = (uint64_t) hfsmp->hfs_allocation_cp->c_blocks * (uint64_t) hfsmp->blockSize;
-		lrg_size = lrg_size / (uint64_t)hfsmp->vcbVBMIOSize;
-
-		/* With a full bitmap and 64k-capped iosize chunks, this would be 64k */
-		summary_size = (uint32_t) lrg_size;
-	}
-
-	/* 
-	 * If the block size is the same as the IO Size, then the total number of blocks
-	 * is already equal to the number of IO units, which is our number of summary bits.
-	 */
-
-	summary_size_bytes = summary_size / kBitsPerByte;
-	/* Always add one byte, just in case we have a dangling number of bits */
-	summary_size_bytes++;
+	summary_size = hfs_summary_chunks (hfsmp);
 
 	if (ALLOC_DEBUG) {
-		printf("HFS Summary Table: vcbVBMIOSize %d summary bits %d \n", hfsmp->vcbVBMIOSize, summary_size); 
-		printf("HFS Summary Table Size (in bytes) %d \n", summary_size_bytes); 
+		printf("HFS Summary Table: vcbVBMIOSize %d summary chunks %d \n", hfsmp->vcbVBMIOSize, summary_size); 
 	}
 
-	/* Store the field in the mount point */
-	hfsmp->hfs_summary_size = summary_size;
-	hfsmp->hfs_summary_bytes = summary_size_bytes;
+	/* A table left over from an earlier mount state would otherwise leak */
+	sum_destroy (&hfsmp->hfs_summary);
 
-	summary_table = hfs_mallocz(summary_size_bytes);
+	err = sum_init (&hfsmp->hfs_summary, summary_size, hfsmp->vcbVBMIOSize * kBitsPerByte);
+	if (err) {
+		return EINVAL;
+	}
 
 	/* enable the summary table */
 	hfsmp->hfs_flags |= HFS_SUMMARY_TABLE;
-	hfsmp->hfs_summary_table = summary_table;
 
-	if (ALLOC_DEBUG) {
-		if (hfsmp->hfs_summary_table == NULL) {
-			panic ("HFS Summary Init: no table for %p\n", hfsmp);
-		}
-	}
 	return 0;
 }
 
 /*
  * hfs_rebuild_summary
  *
- * This function should be used to allocate a new hunk of memory for use as a summary
- * table, then copy the existing data into it.  We use it whenever the filesystem's size
- * changes.  When a resize is in progress, you can still use the extant summary
- * table if it is active.
+ * This function should be used to resize the summary table, keeping the counts
+ * it already has.  We use it whenever the filesystem's size changes.  When a resize
+ * is in progress, you can still use the extant summary table if it is active.
+ * Chunks that appear at the end count as entirely free until they are scanned.
  * 
  * Inputs:
  * 		hfsmp 		-- FS in question
- * 		newlength	-- new length of the FS in allocation blocks.
  *
  * Outputs: 
- *		0 on success, EINVAL on failure.  If this function fails,  the summary table
- * 		will be disabled for future use.
+ *		0 on success, EINVAL on failure.
  *
  */
 static int hfs_rebuild_summary (struct hfsmount *hfsmp) {
 
 	uint32_t new_summary_size;
 
-	new_summary_size = hfsmp->hfs_allocation_cp->c_blocks;
-
-
-	if (ALLOC_DEBUG) {
-		printf("HFS Summary Table Re-init: bitmap %u blocks\n", new_summary_size);
+	if ((hfsmp->hfs_flags & HFS_SUMMARY_TABLE) == 0) {
+		return 0;
 	}
 
-	/* 
-	 * If the bitmap IO size is not the same as the allocation block size, then re-compute
-	 * the number of summary bits necessary.  Note that above, the default size is the number
-	 * of allocation blocks in the bitmap *FILE* (not the number of bits that the bitmap manages).
-	 * If the allocation block size is large enough though, we may need to increase this, as 
-	 * bitmap IO is capped at 64k per IO
-	 */
-	if (hfsmp->blockSize != hfsmp->vcbVBMIOSize) {
-		uint64_t lrg_size = (uint64_t) hfsmp->hfs_allocation_cp->c_blocks * (uint64_t) hfsmp->blockSize;
-		lrg_size = lrg_size / (uint64_t)hfsmp->vcbVBMIOSize;
+	new_summary_size = hfs_summary_chunks (hfsmp);
 
-		/* With a full bitmap and 64k-capped iosize chunks, this would be 64k */
-		new_summary_size = (uint32_t) lrg_size;
+	if (ALLOC_DEBUG) {
+		printf("HFS Summary Table Re-init: bitmap %u blocks, %u chunks\n",
+				hfsmp->hfs_allocation_cp->c_blocks, new_summary_size);
 	}
 
-	/* 
-	 * Ok, we have the new summary bitmap theoretical max size.  See if it's the same as 
-	 * what we've got already...
-	 */
-	if (new_summary_size != hfsmp->hfs_summary_size) {
-		uint32_t summarybytes = new_summary_size / kBitsPerByte;
-		uint32_t copysize;
-		uint8_t *newtable;
-		/* Add one byte for slop */
-		summarybytes++;
-
-		if (ALLOC_DEBUG) {
-			printf("HFS Summary Table: vcbVBMIOSize %d summary bits %d \n", hfsmp->vcbVBMIOSize, new_summary_size);
-			printf("HFS Summary Table Size (in bytes) %d \n", summarybytes);
-		}
-
-		newtable = hfs_mallocz(summarybytes);
-
-		/* 
-		 * The new table may be smaller than the old one. If this is true, then
-		 * we can't copy the full size of the existing summary table into the new
-		 * one. 
-		 * 
-		 * The converse is not an issue since we bzeroed the table above. 
-		 */ 
-		copysize = hfsmp->hfs_summary_bytes;
-		if (summarybytes < hfsmp->hfs_summary_bytes) {	
-			copysize = summarybytes;
-		}
-		memcpy (newtable, hfsmp->hfs_summary_table, copysize); 
-
-		/* We're all good.  Destroy the old copy and update ptrs */
-		hfs_free(hfsmp->hfs_summary_table, hfsmp->hfs_summary_bytes);
-
-		hfsmp->hfs_summary_table = newtable;
-		hfsmp->hfs_summary_size = new_summary_size;	
-		hfsmp->hfs_summary_bytes = summarybytes;
+	if (sum_resize (&hfsmp->hfs_summary, new_summary_size)) {
+		return EINVAL;
 	}
 
 	return 0;
@@ -4722,18 +4469,17 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
 	int err;
 
 	/* 
-	 * Iterate over all of the bits in the summary table, and verify if 
-	 * there really are free blocks in the pages that we believe may
-	 * may contain free blocks.
+	 * Iterate over all of the pages in the summary table, and verify that
+	 * none of them holds more free blocks than the table says it may.
 	 */
 
-	if (hfsmp->hfs_summary_table == NULL) {
+	if (hfsmp->hfs_summary.st_chunk_free == NULL) {
 		panic ("HFS Summary: No HFS summary table!");
 	}	
 
-	/* 131072 bits == 16384 bytes.  This is the theoretical max size of the summary table. we add 1 byte for slop */
-	if (hfsmp->hfs_summary_size == 0 || hfsmp->hfs_summary_size > 131080) {
-		panic("HFS Summary: Size is bad! %d", hfsmp->hfs_summary_size);
+	/* 131072 entries is the theoretical max size of the summary table. we add 8 for slop */
+	if (hfsmp->hfs_summary.st_chunks == 0 || hfsmp->hfs_summary.st_chunks > 131080) {
+		panic("HFS Summary: Size is bad! %d", hfsmp->hfs_summary.st_chunks);
 	}
 
 	if (hfsmp->vcbVBMIOSize == 0) {
@@ -4741,11 +4487,12 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
 	}
 
 	printf("hfs: summary validation beginning on %s\n", hfsmp->vcbVN);
-	printf("hfs: summary validation %d summary bits, %d summary blocks\n", hfsmp->hfs_summary_size, hfsmp->totalBlocks);
+	printf("hfs: summary validation %d summary bits, %d summary blocks\n", hfsmp->hfs_summary.st_chunks, hfsmp->totalBlocks);
 
 
-	/* iterate through all possible summary bits */
-	for (i = 0; i < hfsmp->hfs_summary_size ; i++) {
+	/* iterate through all summary bits that cover the volume */
+	for (i = 0; i < hfsmp->hfs_summary.st_chunks &&
+			(uint64_t)i * hfsmp->vcbVBMIOSize * kBitsPerByte < hfsmp->totalBlocks; i++) {
 
 		uint32_t bits_per_iosize = hfsmp->vcbVBMIOSize * kBitsPerByte;
 		uint32_t byte_offset = hfsmp->vcbVBMIOSize * i;
@@ -4761,39 +4508,28 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
 		struct buf *bp;
 		int counter;
 		int counter_max;
-		int saw_free_bits = 0;
+		uint32_t free_bits = 0;
 
 		/* Get the block */
 		if ((err = ReadBitmapRange (hfsmp, byte_offset, hfsmp->vcbVBMIOSize, &block_data,  &bp))) {
 			panic ("HFS Summary: error (%d) in ReadBitmapRange!", err);
 		}
 
-		/* Query the status of the bit and then make sure we match */
-		uint32_t maybe_has_free_blocks;
-		err = hfs_check_summary (hfsmp, alloc_block, &maybe_has_free_blocks);
+		/* Query the count for the page and then make sure the bitmap agrees */
+		uint32_t max_free_blocks;
+		err = hfs_check_summary (hfsmp, alloc_block, &max_free_blocks);
 		if (err) {
 			panic ("HFS Summary: hfs_check_summary returned error (%d) ", err);
 		}
 		counter_max = hfsmp->vcbVBMIOSize / kBytesPerWord;
 
 		for (counter = 0; counter < counter_max; counter++) {
-			uint32_t word = block_data[counter];
-
-			/* We assume that we'll not find any free bits here. */
-			if (word != kAllBitsSetInWord) {
-				if (maybe_has_free_blocks) {
-					/* All done */
-					saw_free_bits = 1;
-					break;
-				}
-				else {
-					panic ("HFS Summary: hfs_check_summary saw free bits!");
-				}
-			}
+			free_bits += __builtin_popcount (~block_data[counter]);
 		}
 
-		if (maybe_has_free_blocks && (saw_free_bits == 0)) {
-			panic ("HFS Summary: did not see free bits !");	
+		if (free_bits > max_free_blocks) {
+			panic ("HFS Summary: page %u has %u free blocks, summary says at most %u!",
+					i, free_bits, max_free_blocks);
 		}
 
 		/* Release the block. */
@@ -4857,12 +4593,13 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 	u_int32_t byte_off; // byte offset into the bitmap file.
 	u_int32_t completed_size; // how much io was actually completed
 	u_int32_t last_bitmap_block;
-	u_int32_t current_word;	
-	u_int32_t word_index = 0;	
+	u_int32_t chunk_blocks = hfsmp->vcbVBMIOSize * kBitsPerByte;
+	u_int64_t chunk_end;
+	u_int32_t off, end;
 
 	/* summary table building */
 	uint32_t summary_bit = 0;
-	uint32_t saw_free_blocks = 0;
+	uint32_t chunk_free_blocks = 0;
 	uint32_t last_marked = 0;
 
 	if (hfsmp->hfs_flags & HFS_READ_ONLY) {
@@ -4936,7 +4673,6 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 
 	/* curAllocBlock represents the logical block we're analyzing. */
 	curAllocBlock = startbit;	
-	word_index = 0;
 	size = 0;
 
 	if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
@@ -4952,15 +4688,13 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 		 * the allocation block of the first bit that we're supposed to scan
 		 */ 
 	}
-	saw_free_blocks = 0;
+	chunk_free_blocks = 0;
 
 	while (curAllocBlock < last_bitmap_block) {
-		u_int32_t bit;
-
 		/* Update the summary table as needed */
 		if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
 			if (ALLOC_DEBUG) {
-				if (hfsmp->hfs_summary_table == NULL) {
+				if (hfsmp->hfs_summary.st_chunk_free == NULL) {
 					panic ("hfs_alloc_scan_range: no summary table!");
 				}
 			}	
@@ -4987,61 +4721,55 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 			 * bit.
 			 */ 
 			if (temp_summary > summary_bit) {
-				if (saw_free_blocks == 0) {
-					/* Mark the bit as totally consumed in the summary table */
-					hfs_set_summary (hfsmp, summary_bit, 1);
-				}
-				else {
-					/* Mark the bit as potentially free in summary table */
-					hfs_set_summary (hfsmp, summary_bit, 0);
-				}
+				/* Record how many free blocks we counted in it; zero marks it full */
+				hfs_set_summary (hfsmp, summary_bit, chunk_free_blocks);
 				last_marked = summary_bit;
 				/* 
 				 * Any time we set the summary table, update our counter which tracks
 				 * what the last bit that was fully marked in the summary table. 
 				 *  
-				 * Then reset our marker which says we haven't seen a free bit yet.
+				 * Then start counting the free blocks of the next one.
 				 */
-				saw_free_blocks = 0;
+				chunk_free_blocks = 0;
 				summary_bit = temp_summary;
 			}
 		} /* End summary table conditions */
 
-		current_word = SWAP_BE32(buffer[word_index]);
-		/* Iterate through the word 1 bit at a time... */
-		for (bit = 0 ; bit < kBitsPerWord ; bit++, curAllocBlock++) {
-			if (curAllocBlock >= last_bitmap_block) {
-				break;
-			}
-			u_int32_t allocated = (current_word & (kHighBitInWordMask >> bit));
-
-			if (allocated) { 
-				if (size != 0) {
-					if (readwrite) {
-						/* Insert the previously tracked range of free blocks to the trim list */
-						hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
-					}
-					add_free_extent_cache (hfsmp, free_offset, size);
-					size = 0;
-					free_offset = 0;
+		/*
+		 * Walk the rest of this chunk a run at a time.  'off' and 'end' are
+		 * bit offsets into the buffer, which starts at startbit.
+		 */
+		chunk_end = MIN((uint64_t)last_bitmap_block,
+						 (uint64_t)(curAllocBlock / chunk_blocks + 1) * chunk_blocks);
+		off = curAllocBlock - startbit;
+		end = (u_int32_t)chunk_end - startbit;
+		while (off < end) {
+			u_int32_t run_start = hfs_bm_find_clear(buffer, off, end);
+			u_int32_t run_end;
+
+			if (run_start != off && size != 0) {
+				if (readwrite) {
+					/* Insert the previously tracked range of free blocks to the trim list */
+					hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
 				}
+				add_free_extent_cache (hfsmp, free_offset, size);
+				size = 0;
+				free_offset = 0;
 			}
-			else {
-				/* Not allocated */
-				size++;
-				if (free_offset == 0) {
-					/* Start a new run of free spcae at curAllocBlock */
-					free_offset = curAllocBlock;
-				}
-				if (saw_free_blocks == 0) {
-					saw_free_blocks = 1;
-				}
+			if (run_start == end) {
+				break;
 			}
-		} /* end for loop iterating through the word */
 
-		if (curAllocBlock < last_bitmap_block) {
-			word_index++;
+			/* Not allocated; start a new run of free space or extend the current one */
+			run_end = hfs_bm_find_set(buffer, run_start, end);
+			if (size == 0) {
+				free_offset = startbit + run_start;
+			}
+			size += run_end - run_start;
+			chunk_free_blocks += run_end - run_start;
+			off = run_end;
 		}
+		curAllocBlock = (u_int32_t)chunk_end;
 
 	} /* End while loop (iterates through last_bitmap_block) */
 
@@ -5071,12 +4799,16 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 
 		/* Did we already update this in the table? */
 		if (temp_summary > last_marked) {
-			if (saw_free_blocks == 0) {
-				hfs_set_summary (hfsmp, temp_summary, 1);
-			}
-			else {
-				hfs_set_summary (hfsmp, temp_summary, 0);
+			/*
+			 * If the volume ends part way through this page, the bits past the end
+			 * were not scanned.  Count them as free so that the page is not taken
+			 * for full if the volume grows into them.
+			 */
+			uint64_t page_end = (uint64_t)(temp_summary + 1) * hfsmp->vcbVBMIOSize * kBitsPerByte;
+			if (last_bitmap_block < page_end) {
+				chunk_free_blocks += (uint32_t)(page_end - last_bitmap_block);
 			}
+			hfs_set_summary (hfsmp, temp_summary, chunk_free_blocks);
 		}
 	}
 
@@ -5284,25 +5016,18 @@ Exit:
  */
 void ResetVCBFreeExtCache(struct hfsmount *hfsmp) 
 {
-	int bytes;
-	void *freeExt;
+	struct fe_chunk *chunks;
 
 	if (hfs_kdebug_allocation & HFSDBG_EXT_CACHE_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_RESET_EXTENT_CACHE | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	lck_spin_lock(&hfsmp->vcbFreeExtLock);
-
-	/* reset Free Extent Count */
-	hfsmp->vcbFreeExtCnt = 0;
-
-	/* reset the actual array */
-	bytes = kMaxFreeExtents * sizeof(HFSPlusExtentDescriptor);
-	freeExt = (void*)(hfsmp->vcbFreeExt);
-
-	bzero (freeExt, bytes);
-
+	chunks = fe_destroy(&hfsmp->vcbFreeExt);
 	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 
+	/* The index memory can only be released without the spin lock held */
+	fe_chunk_free(chunks);
+
 	if (hfs_kdebug_allocation & HFSDBG_EXT_CACHE_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_RESET_EXTENT_CACHE | DBG_FUNC_END, 0, 0, 0, 0, 0);
 
@@ -5355,126 +5080,37 @@ u_int32_t UpdateAllocLimit (struct hfsmount *hfsmp, u_int32_t new_end_block) {
 }
 
 /*
- * Remove an extent from the list of free extents.
- *
- * This is a low-level routine.	 It does not handle overlaps or splitting;
- * that is the responsibility of the caller.  The input extent must exactly
- * match an extent already in the list; it will be removed, and any following
- * extents in the list will be shifted up.
- *
- * Inputs:
- *	startBlock - Start of extent to remove
- *	blockCount - Number of blocks in extent to remove
- *
- * Result:
- *	The index of the extent that was removed.
- */
-static void remove_free_extent_list(struct hfsmount *hfsmp, int index)
-{
-	if (index < 0 || (uint32_t)index >= hfsmp->vcbFreeExtCnt) {
-		if (ALLOC_DEBUG)
-			panic("hfs: remove_free_extent_list: %p: index (%d) out of range (0, %u)", hfsmp, index, hfsmp->vcbFreeExtCnt);
-		else
-			printf("hfs: remove_free_extent_list: %p: index (%d) out of range (0, %u)", hfsmp, index, hfsmp->vcbFreeExtCnt);
-		return;
-	}
-	int shift_count = hfsmp->vcbFreeExtCnt - index - 1;
-	if (shift_count > 0) {
-		memmove(&hfsmp->vcbFreeExt[index], &hfsmp->vcbFreeExt[index+1], shift_count * sizeof(hfsmp->vcbFreeExt[0]));
-	}
-	hfsmp->vcbFreeExtCnt--;
-}
-
-
-/*
- * Add an extent to the list of free extents.
+ * Make sure the free extent index has the spare nodes for one update.
  *
- * This is a low-level routine.	 It does not handle overlaps or coalescing;
- * that is the responsibility of the caller.  This routine *does* make
- * sure that the extent it is adding is inserted in the correct location.
- * If the list is full, this routine will handle either removing the last
- * extent in the list to make room for the new extent, or ignoring the
- * new extent if it is "worse" than the last extent in the list.
- *
- * Inputs:
- *	startBlock - Start of extent to add
- *	blockCount - Number of blocks in extent to add
- *
- * Result:
- *	The index where the extent that was inserted, or kMaxFreeExtents
- *	if the extent was not inserted (the list was full, and the extent
- *	being added was "worse" than everything in the list).
+ * The index is protected by a spin lock, under which we cannot allocate
+ * memory, and some callers hold the mount mutex, so the nodes are allocated
+ * here, without sleeping, before the lock is taken.  If that fails, the
+ * update will simply forget an extent; the bitmap scanners will find it.
  */
-static int add_free_extent_list(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
+static void free_extent_cache_prime(struct hfsmount *hfsmp)
 {
-	uint32_t i;
-
-	/* ALLOC_DEBUG: Make sure no extents in the list overlap or are contiguous with the input extent. */
-	if (ALLOC_DEBUG) {
-		uint32_t endBlock = startBlock + blockCount;
-		for (i = 0; i < hfsmp->vcbFreeExtCnt; ++i) {
-			if (endBlock < hfsmp->vcbFreeExt[i].startBlock ||
-					startBlock > (hfsmp->vcbFreeExt[i].startBlock + hfsmp->vcbFreeExt[i].blockCount)) {
-				continue;
-			}
-			panic("hfs: add_free_extent_list: %p: extent(%u %u) overlaps existing extent (%u %u) at index %d",
-					hfsmp, startBlock, blockCount, hfsmp->vcbFreeExt[i].startBlock, hfsmp->vcbFreeExt[i].blockCount, i);
-		}
-	}	 
-
-	/* Figure out what index the new extent should be inserted at. */
-	for (i = 0; i < hfsmp->vcbFreeExtCnt; ++i) {
-		if (hfsmp->hfs_flags & HFS_HAS_SPARSE_DEVICE) {
-			/* The list is sorted by increasing offset. */
-			if (startBlock < hfsmp->vcbFreeExt[i].startBlock) {
-				break;
-			}
-		} else {
-			/* The list is sorted by decreasing size. */
-			if (blockCount > hfsmp->vcbFreeExt[i].blockCount) {
-				break;
-			}
-		}
-	}
-
-	/* When we get here, i is the index where the extent should be inserted. */
-	if (i == kMaxFreeExtents) {
-		/*
-		 * The new extent is worse than anything already in the list,
-		 * and the list is full, so just ignore the extent to be added.
-		 */
-		return i;
-	}
+	struct fe_chunk *chunk;
 
-	/*
-	 * Grow the list (if possible) to make room for an insert.
-	 */
-	if (hfsmp->vcbFreeExtCnt < kMaxFreeExtents)
-		hfsmp->vcbFreeExtCnt++;
+	/* Unlocked peek; at worst we allocate a chunk we did not need. */
+	if (hfsmp->vcbFreeExt.fi_spare_count >= FE_SPARE_LOW)
+		return;
 
-	/*
-	 * If we'll be keeping any extents after the insert position, then shift them.
-	 */
-	int shift_count = hfsmp->vcbFreeExtCnt - i - 1;
-	if (shift_count > 0) {
-		memmove(&hfsmp->vcbFreeExt[i+1], &hfsmp->vcbFreeExt[i], shift_count * sizeof(hfsmp->vcbFreeExt[0]));
-	}
+	chunk = fe_chunk_alloc();
+	if (chunk == NULL)
+		return;
 
-	/* Finally, store the new extent at its correct position. */
-	hfsmp->vcbFreeExt[i].startBlock = startBlock;
-	hfsmp->vcbFreeExt[i].blockCount = blockCount;
-	return i;
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	fe_chunk_add(&hfsmp->vcbFreeExt, chunk);
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 }
 
 
 /*
  * Remove an entry from free extent cache after it has been allocated.
  *
- * This is a high-level routine.  It handles removing a portion of a
- * cached extent, potentially splitting it into two (if the cache was
- * already full, throwing away the extent that would sort last).  It
- * also handles removing an extent that overlaps multiple extents in
- * the cache.
+ * This is a high-level routine.  It handles removing a portion of an
+ * indexed extent, potentially splitting it into two.  It also handles
+ * removing an extent that overlaps multiple extents in the index.
  *
  * Inputs: 
  *	hfsmp		- mount point structure 
@@ -5483,92 +5119,15 @@ static int add_free_extent_list(struct hfsmount *hfsmp, u_int32_t startBlock, u_
  */
 static void remove_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
 {
-	u_int32_t i, insertedIndex;
-	u_int32_t currentStart, currentEnd, endBlock;
-	int extentsRemoved = 0;
+	u_int32_t extentsRemoved;
 
 	if (hfs_kdebug_allocation & HFSDBG_EXT_CACHE_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_REMOVE_EXTENT_CACHE | DBG_FUNC_START, startBlock, blockCount, 0, 0, 0);
 
-	endBlock = startBlock + blockCount;
+	free_extent_cache_prime(hfsmp);
 
 	lck_spin_lock(&hfsmp->vcbFreeExtLock);
-
-	/*
-	 * Iterate over all of the extents in the free extent cache, removing or
-	 * updating any entries that overlap with the input extent.
-	 */
-	for (i = 0; i < hfsmp->vcbFreeExtCnt; ++i) {
-		currentStart = hfsmp->vcbFreeExt[i].startBlock;
-		currentEnd = currentStart + hfsmp->vcbFreeExt[i].blockCount;
-
-		/*
-		 * If the current extent is entirely before or entirely after the
-		 * the extent to be removed, then we keep it as-is.
-		 */
-		if (currentEnd <= startBlock || currentStart >= endBlock) {
-			continue;
-		}
-
-		/*
-		 * If the extent being removed entirely contains the current extent,
-		 * then remove the current extent.
-		 */
-		if (startBlock <= currentStart && endBlock >= currentEnd) {
-			remove_free_extent_list(hfsmp, i);
-
-			/*
-			 * We just removed the extent at index i.  The extent at
-			 * index i+1 just got shifted to index i.  So decrement i
-			 * to undo the loop's "++i", and the next iteration will
-			 * examine index i again, which contains the next extent
-			 * in the list.
-			 */
-			--i;
-			++extentsRemoved;
-			continue;
-		}
-
-		/*
-		 * If the extent being removed is strictly "in the middle" of the
-		 * current extent, then we need to split the current extent into
-		 * two discontiguous extents (the "head" and "tail").  The good
-		 * news is that we don't need to examine any other extents in
-		 * the list.
-		 */
-		if (startBlock > currentStart && endBlock < currentEnd) {
-			remove_free_extent_list(hfsmp, i);
-			add_free_extent_list(hfsmp, currentStart, startBlock - currentStart);
-			add_free_extent_list(hfsmp, endBlock, currentEnd - endBlock);
-			break;
-		}
-
-		/*
-		 * The only remaining possibility is that the extent to be removed
-		 * overlaps the start or end (but not both!) of the current extent.
-		 * So we need to replace the current extent with a shorter one.
-		 *
-		 * The only tricky part is that the updated extent might be at a
-		 * different index than the original extent.  If the updated extent
-		 * was inserted after the current extent, then we need to re-examine
-		 * the entry at index i, since it now contains the extent that was
-		 * previously at index i+1.	 If the updated extent was inserted
-		 * before or at the same index as the removed extent, then the
-		 * following extents haven't changed position.
-		 */
-		remove_free_extent_list(hfsmp, i);
-		if (startBlock > currentStart) {
-			/* Remove the tail of the current extent. */
-			insertedIndex = add_free_extent_list(hfsmp, currentStart, startBlock - currentStart);
-		} else {
-			/* Remove the head of the current extent. */
-			insertedIndex = add_free_extent_list(hfsmp, endBlock, currentEnd - endBlock);
-		}
-		if (insertedIndex > i) {
-			--i;	/* Undo the "++i" in the loop, so we examine the entry at index i again. */
-		}
-	}
-
+	extentsRemoved = fe_remove(&hfsmp->vcbFreeExt, startBlock, blockCount);
 	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 
 	sanity_check_free_ext(hfsmp, 0);
@@ -5590,29 +5149,30 @@ static void remove_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBloc
  * clipped to allocLimit (so that we won't accidentally find and allocate
  * space beyond allocLimit).
  *
+ * Only extents that can be reused right away belong in the index: with a
+ * journal, blocks freed by a transaction are added by hfs_trim_callback
+ * once that transaction is on disk.
+ *
  * Inputs: 
  *	hfsmp		- mount point structure 
  *	startBlock	- starting block of the extent to be removed. 
  *	blockCount	- number of blocks of the extent to be removed.
  *
  * Returns:
- *	true		- if the extent was added successfully to the list
- *	false		- if the extent was not added to the list, maybe because 
- *			  the extent was beyond allocLimit, or is not best 
- *			  candidate to be put in the cache.
+ *	true		- if the extent was added successfully to the index
+ *	false		- if the extent was not added to the index, maybe because 
+ *			  the extent was beyond allocLimit, or the index is full
+ *			  and holds only longer extents, or we ran out of memory.
  */
 static boolean_t add_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
 {
 	boolean_t retval = false;
-	uint32_t endBlock;
-	uint32_t currentEnd;
-	uint32_t i; 
 
 	if (hfs_kdebug_allocation & HFSDBG_EXT_CACHE_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_ADD_EXTENT_CACHE | DBG_FUNC_START, startBlock, blockCount, 0, 0, 0);
 
 #if DEBUG
-	for (i = 0; i < 2; ++i) {
+	for (int i = 0; i < 2; ++i) {
 		struct rl_entry *range;
 		TAILQ_FOREACH(range, &hfsmp->hfs_reserved_ranges[i], rl_link) {
 			hfs_assert(rl_overlap(range, startBlock,
@@ -5631,39 +5191,10 @@ static boolean_t add_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBl
 		blockCount = hfsmp->allocLimit - startBlock;
 	}
 
-	lck_spin_lock(&hfsmp->vcbFreeExtLock);
-
-	/*
-	 * Make a pass through the free extent cache, looking for known extents that
-	 * overlap or are contiguous with the extent to be added.  We'll remove those
-	 * extents from the cache, and incorporate them into the new extent to be added.
-	 */
-	endBlock = startBlock + blockCount;
-	for (i=0; i < hfsmp->vcbFreeExtCnt; ++i) {
-		currentEnd = hfsmp->vcbFreeExt[i].startBlock + hfsmp->vcbFreeExt[i].blockCount;
-		if (hfsmp->vcbFreeExt[i].startBlock > endBlock || currentEnd < startBlock) {
-			/* Extent i does not overlap and is not contiguous, so keep it. */
-			continue;
-		} else {
-			/* We need to remove extent i and combine it with the input extent. */
-			if (hfsmp->vcbFreeExt[i].startBlock < startBlock)
-				startBlock = hfsmp->vcbFreeExt[i].startBlock;
-			if (currentEnd > endBlock)
-				endBlock = currentEnd;
-
-			remove_free_extent_list(hfsmp, i);
-			/*
-			 * We just removed the extent at index i.  The extent at
-			 * index i+1 just got shifted to index i.  So decrement i
-			 * to undo the loop's "++i", and the next iteration will
-			 * examine index i again, which contains the next extent
-			 * in the list.
-			 */
-			--i;
-		}
-	}
-	add_free_extent_list(hfsmp, startBlock, endBlock - startBlock);
+	free_extent_cache_prime(hfsmp);
 
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	retval = fe_add(&hfsmp->vcbFreeExt, startBlock, blockCount);
 	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 
 out_not_locked:
@@ -5675,10 +5206,42 @@ out_not_locked:
 	return retval;
 }
 
+struct free_ext_check {
+	struct hfsmount *hfsmp;
+	u_int32_t		next;		/* first block the next extent may start at */
+	u_int32_t		extents;
+};
+
+static int sanity_check_free_ext_callback(void *arg, u_int32_t start, u_int32_t nblocks)
+{
+	struct free_ext_check *check = arg;
+	struct hfsmount *hfsmp = check->hfsmp;
+
+	if (nblocks == 0)
+		panic("hfs: %p: empty extent (%u,%u) in the free extent index\n", hfsmp, start, nblocks);
+
+	/* Check if any part of the extent is beyond allocLimit */
+	if ((start > hfsmp->allocLimit) || ((start + nblocks) > hfsmp->allocLimit)) {
+		panic ("hfs: %p: extent (%u,%u) in the free extent index is beyond allocLimit=%u\n",
+				hfsmp, start, nblocks, hfsmp->allocLimit);
+	}
+
+	/* Extents must be in order, and must neither overlap nor touch */
+	if (check->extents && start <= check->next) {
+		panic("hfs: %p: extent (%u,%u) in the free extent index overlaps or touches its predecessor\n",
+				hfsmp, start, nblocks);
+	}
+
+	check->next = start + nblocks;
+	check->extents++;
+	return 0;
+}
+
 /* Debug function to check if the free extent cache is good or not */
 static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated)
 {
-	u_int32_t i, j;
+	struct free_ext_check check = { hfsmp, 0, 0 };
+	u_int32_t start, nblocks;
 
 	/* Do not do anything if debug is not on */
 	if (ALLOC_DEBUG == 0) {
@@ -5686,85 +5249,39 @@ static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated)
 	}
 
 	lck_spin_lock(&hfsmp->vcbFreeExtLock);
-
-	if (hfsmp->vcbFreeExtCnt > kMaxFreeExtents)
-		panic("hfs: %p: free extent count (%u) is too large", hfsmp, hfsmp->vcbFreeExtCnt);
+	(void) fe_iterate(&hfsmp->vcbFreeExt, sanity_check_free_ext_callback, &check);
+	if (check.extents != hfsmp->vcbFreeExt.fi_count)
+		panic("hfs: %p: free extent index holds %u extents, counts %u", 
+				hfsmp, check.extents, hfsmp->vcbFreeExt.fi_count);
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 
 	/* 
-	 * Iterate the Free extent cache and ensure no entries are bogus or refer to
-	 * allocated blocks.
+	 * Check if any of the blocks in the free extent index are allocated.  
+	 * This should not be enabled always because it might take 
+	 * very long for large extents that get added to the index.
+	 *
+	 * We have to drop vcbFreeExtLock while we call hfs_isallocated
+	 * because it is going to do I/O, so look the extents up one at a
+	 * time.  Note that the index could change in between.  That's a
+	 * risk we take when using this debugging code.
 	 */
-	for(i=0; i < hfsmp->vcbFreeExtCnt; i++) {
-		u_int32_t start, nblocks;
-
-		start   = hfsmp->vcbFreeExt[i].startBlock;
-		nblocks = hfsmp->vcbFreeExt[i].blockCount;
-
-		/* Check if any of the blocks in free extent cache are allocated.  
-		 * This should not be enabled always because it might take 
-		 * very long for large extents that get added to the list.
-		 *
-		 * We have to drop vcbFreeExtLock while we call hfs_isallocated
-		 * because it is going to do I/O.  Note that the free extent
-		 * cache could change.  That's a risk we take when using this
-		 * debugging code.  (Another alternative would be to try to
-		 * detect when the free extent cache changed, and perhaps
-		 * restart if the list changed while we dropped the lock.)
-		 */
-		if (check_allocated) {
-			lck_spin_unlock(&hfsmp->vcbFreeExtLock);
-			if (hfs_isallocated(hfsmp, start, nblocks)) {
-				panic("hfs: %p: slot %d:(%u,%u) in the free extent array is allocated\n",
-						hfsmp, i, start, nblocks);
-			}
+	if (check_allocated) {
+		check.next = 0;
+		for (;;) {
 			lck_spin_lock(&hfsmp->vcbFreeExtLock);
-		}
-
-		/* Check if any part of the extent is beyond allocLimit */
-		if ((start > hfsmp->allocLimit) || ((start + nblocks) > hfsmp->allocLimit)) {
-			panic ("hfs: %p: slot %d:(%u,%u) in the free extent array is beyond allocLimit=%u\n",
-					hfsmp, i, start, nblocks, hfsmp->allocLimit);
-		}
-
-		/* Check if there are any duplicate start blocks */
-		for(j=i+1; j < hfsmp->vcbFreeExtCnt; j++) {
-			if (start == hfsmp->vcbFreeExt[j].startBlock) {
-				panic("hfs: %p: slot %d:(%u,%u) and %d:(%u,%u) are duplicate\n", 
-						hfsmp, i, start, nblocks, j, hfsmp->vcbFreeExt[j].startBlock, 
-						hfsmp->vcbFreeExt[j].blockCount);
+			if (!fe_find_range(&hfsmp->vcbFreeExt, check.next, hfsmp->allocLimit, 1, &start, &nblocks)) {
+				lck_spin_unlock(&hfsmp->vcbFreeExtLock);
+				break;
 			}
-		}
+			lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 
-		/* Check if the entries are out of order */
-		if ((i+1) != hfsmp->vcbFreeExtCnt) {
-			if (hfsmp->hfs_flags & HFS_HAS_SPARSE_DEVICE) {
-				/* sparse devices are sorted by starting block number (ascending) */
-				if (hfsmp->vcbFreeExt[i].startBlock > hfsmp->vcbFreeExt[i+1].startBlock) {
-					panic ("hfs: %p: SPARSE %d:(%u,%u) and %d:(%u,%u) are out of order\n", 
-							hfsmp, i, start, nblocks, i+1, hfsmp->vcbFreeExt[i+1].startBlock, 
-							hfsmp->vcbFreeExt[i+1].blockCount);
-				}
-			} else {
-				/* normally sorted by block count (descending) */
-				if (hfsmp->vcbFreeExt[i].blockCount < hfsmp->vcbFreeExt[i+1].blockCount) {
-					panic ("hfs: %p: %d:(%u,%u) and %d:(%u,%u) are out of order\n", 
-							hfsmp, i, start, nblocks, i+1, hfsmp->vcbFreeExt[i+1].startBlock, 
-							hfsmp->vcbFreeExt[i+1].blockCount);
-				}
+			if (hfs_isallocated(hfsmp, start, nblocks)) {
+				panic("hfs: %p: extent (%u,%u) in the free extent index is allocated\n",
+						hfsmp, start, nblocks);
 			}
+			check.next = start + nblocks;
 		}
 	}
-	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
-}
-
-#define BIT_RIGHT_MASK(bit)	(0xffffffffffffffffull >> (bit))
-
-static int clzll(uint64_t x)
-{
-	if (x == 0)
-		return 64;
-	else
-		return __builtin_clzll(x);
 }
 
 #if !HFS_ALLOC_TEST
@@ -5913,49 +5430,9 @@ static int get_more_bits(bitmap_context_t *bitmap_ctx)
 // Returns number of contiguous bits set at start
 static int bit_count_set(void *bitmap, int start, int end)
 {
-	if (start == end)
-		return 0;
-
-	hfs_assert(end > start);
-
-	const int start_bit = start & 63;
-	const int end_bit   = end & 63;
-
-	uint64_t *p = (uint64_t *)bitmap + start / 64;
-	uint64_t x = ~be64toh(*p);
-
-	if ((start & ~63) == (end & ~63)) {
-		// Start and end in same 64 bits
-		x = (x & BIT_RIGHT_MASK(start_bit)) | BIT_RIGHT_MASK(end_bit);
-		return clzll(x) - start_bit;
-	}
-
-	// Deal with initial unaligned bit
-	x &= BIT_RIGHT_MASK(start_bit);
-
-	if (x)
-		return clzll(x) - start_bit;
+	hfs_assert(end >= start);
 
-	// Go fast
-	++p;
-	int count = 64 - start_bit;
-	int nquads = (end - end_bit - start - 1) / 64;
-
-	while (nquads--) {
-		if (*p != 0xffffffffffffffffull) {
-			x = ~be64toh(*p);
-			return count + clzll(x);
-		}
-		++p;
-		count += 64;
-	}
-
-	if (end_bit) {
-		x = ~be64toh(*p) | BIT_RIGHT_MASK(end_bit);
-		count += clzll(x);
-	}
-
-	return count;
+	return hfs_bm_find_clear(bitmap, start, end) - start;
 }
 
 /* Returns the number of a run of cleared bits:
@@ -5965,51 +5442,9 @@ static int bit_count_set(void *bitmap, int start, int end)
  */
 static int bit_count_clr(void *bitmap, int start, int end)
 {
-	if (start == end)
-		return 0;
-
-	hfs_assert(end > start);
-
-	const int start_bit = start & 63;
-	const int end_bit   = end & 63;
-
-	uint64_t *p = (uint64_t *)bitmap + start / 64;
-	uint64_t x = be64toh(*p);
-
-	if ((start & ~63) == (end & ~63)) {
-		// Start and end in same 64 bits
-		x = (x & BIT_RIGHT_MASK(start_bit)) | BIT_RIGHT_MASK(end_bit);
-
-		return clzll(x) - start_bit;
-	}
-
-	// Deal with initial unaligned bit
-	x &= BIT_RIGHT_MASK(start_bit);
-
-	if (x)
-		return clzll(x) - start_bit;
-
-	// Go fast
-	++p;
-	int count = 64 - start_bit;
-	int nquads = (end - end_bit - start - 1) / 64;
+	hfs_assert(end >= start);
 
-	while (nquads--) {
-		if (*p) {
-			x = be64toh(*p);
-			return count + clzll(x);
-		}
-		++p;
-		count += 64;
-	}
-
-	if (end_bit) {
-		x = be64toh(*p) | BIT_RIGHT_MASK(end_bit);
-
-		count += clzll(x);
-	}
-
-	return count;
+	return hfs_bm_find_set(bitmap, start, end) - start;
 }
 
 #if !HFS_ALLOC_TEST
@@ -6035,15 +5470,18 @@ static int update_summary_table(bitmap_context_t *bitmap_ctx, uint32_t start, ui
 		goto out;
 	}
 
-	// if summary table bit has been updated with free block previously, leave it.
-	if ((start_summary_bit == bitmap_ctx->last_free_summary_bit) && set)
-		start_summary_bit++;
+	// runs come in bitmap order: zero each summary bit's count when a run first reaches it
+	if (start_summary_bit < bitmap_ctx->next_summary_bit)
+		start_summary_bit = bitmap_ctx->next_summary_bit;
 
 	for (uint32_t summary_bit = start_summary_bit; summary_bit <= end_summary_bit; summary_bit++)
-		hfs_set_summary (bitmap_ctx->hfsmp, summary_bit, set);
+		hfs_set_summary (bitmap_ctx->hfsmp, summary_bit, 0);
 
+	bitmap_ctx->next_summary_bit = end_summary_bit + 1;
+
+	// then credit it with the free runs inside it
 	if (!set)
-		bitmap_ctx->last_free_summary_bit = end_summary_bit;
+		hfs_release_summary (bitmap_ctx->hfsmp, start, count);
 
 out:
 	return error;
@@ -6209,6 +5647,16 @@ int hfs_find_free_extents(struct hfsmount *hfsmp,
 			goto out;
 	}
 
+	/*
+	 * Bits past the end of the volume in its last bitmap page were not
+	 * counted; credit them as free, as hfs_alloc_scan_range() does.
+	 */
+	if (hfsmp->totalBlocks % (hfsmp->vcbVBMIOSize * kBitsPerByte)) {
+		uint32_t bits_per_iosize = hfsmp->vcbVBMIOSize * kBitsPerByte;
+		(void) hfs_release_summary (hfsmp, hfsmp->totalBlocks,
+				bits_per_iosize - hfsmp->totalBlocks % bits_per_iosize);
+	}
+
 out:
 	if (bitmap_ctx.lockflags) {
 		hfs_systemfile_unlock(hfsmp, bitmap_ctx.lockflags);
@@ -76,6 +76,8 @@
 #include "hfs_macos_defs.h"
 #include "hfs_hotfiles.h"
 #include "hfs_fsctl.h"
+#include "hfs_freeext.h"
+#include "hfs_summary.h"
 
 __BEGIN_DECLS
 
@@ -124,8 +126,8 @@ enum { kMDBOffset = kMasterDirectoryBlock * 512 };	/* MDB offset on disk in byte
 extern struct timezone gTimeZone;
 
 
-/* How many free extents to cache per volume */
-#define kMaxFreeExtents		10
+/* How many free extents to index per volume */
+#define kMaxFreeExtents		(256 * 1024)
 
 /* Maximum file size that we're willing to defrag on open */
 #define HFS_MAX_DEFRAG_SIZE 104857600   // 100 * 1024 * 1024 (100MB)  
@@ -173,6 +175,40 @@ extern struct timezone gTimeZone;
 
 /* Internal Data structures*/
 
+/*
+ * Per-CPU allocation pool: a tentative reservation that ordinary file
+ * allocations are carved from.  See hfs_alloc_pool_alloc().
+ */
+struct hfs_alloc_pool {
+	struct rl_entry	*ap_reservation;
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * Freed space waiting for the discard thread to unmap it.  See hfs_discard.c.
+ */
+struct hfs_discard {
+	lck_mtx_t		hd_lock;
+	struct fe_index	hd_queue;			/* queued extents, in allocation blocks */
+	struct thread	*hd_thread;
+	u_int32_t		hd_flags;
+	int				hd_queued_at;		/* ticks when the queue was last empty */
+	dk_extent_t		*hd_batch;			/* being unmapped, in bytes, by offset */
+	u_int32_t		hd_batch_count;
+	u_int32_t		hd_batch_alloc;
+};
+
+/*
+ * Directory hints kept after their directory went out of use, by directory
+ * ID and cookie.  See hfs_dirhint.c.
+ */
+struct hfs_dirhints {
+	lck_mtx_t		dhc_lock;
+	LIST_HEAD(, directoryhint) *dhc_hashtbl;	/* by directory ID */
+	u_long			dhc_hashmask;
+	struct hfs_hinthead	dhc_lru;			/* most recently kept first */
+	u_int32_t		dhc_count;
+};
+
 /* This structure describes the HFS specific mount structure data. */
 typedef struct hfsmount {
     bool          hfs_ignore_permissions;
@@ -274,15 +310,12 @@ typedef struct hfsmount {
 	u_int32_t 			hfsPlusIOPosOffset;	/* Disk block where HFS+ starts */
 	u_int32_t 			vcbVBMIOSize;		/* volume bitmap I/O size */
 	
-	/* cache of largest known free extents */
-	u_int32_t			vcbFreeExtCnt;
-	HFSPlusExtentDescriptor vcbFreeExt[kMaxFreeExtents];
+	/* index of known free extents */
+	struct fe_index		vcbFreeExt;
 	lck_spin_t			vcbFreeExtLock;
 	
-	/* Summary Table */
-	u_int8_t			*hfs_summary_table; /* Each bit is 1 vcbVBMIOSize of bitmap, byte indexed */
-	u_int32_t			hfs_summary_size;	/* number of BITS in summary table defined above (not bytes!) */
-	u_int32_t			hfs_summary_bytes;	/* number of BYTES in summary table */
+	/* Summary Table: free block counts per vcbVBMIOSize of bitmap, and per superchunk */
+	struct sum_table	hfs_summary;
 	
 	u_int32_t 			scan_var;			/* For initializing the summary table */
 
@@ -460,6 +493,16 @@ typedef struct hfsmount {
 	};
 	// These lists are not sorted like a range list usually is
 	struct rl_head hfs_reserved_ranges[2];
+
+	// Per-CPU allocation pools, one per CPU id; protected by the bitmap lock
+	struct hfs_alloc_pool *hfs_alloc_pools;
+	u_int32_t		hfs_alloc_npools;
+
+	// Freed space waiting to be unmapped
+	struct hfs_discard hfs_discard;
+
+	// Directory hints of directories no longer in core
+	struct hfs_dirhints hfs_dirhints;
 } hfsmount_t;
 
 /*
@@ -750,6 +793,7 @@ int hfs_vnop_lookup(struct vop_lookup_args *);            /* in hfs_lookup.c */
 int hfs_vnop_read(struct vop_read_args *);           /* in hfs_readwrite.c */
 int hfs_vnop_write(struct vop_write_args *);         /* in hfs_readwrite.c */
 int hfs_vnop_ioctl(struct vop_ioctl_args *);         /* in hfs_readwrite.c */
+int hfs_readdirplus(struct vnode *, struct hfs_readdirplus *, struct thread *); /* in hfs_readdirplus.c */
 //int hfs_vnop_select(struct vop_select_args *);       /* in hfs_readwrite.c */
 int hfs_vnop_strategy(struct vop_strategy_args *);   /* in hfs_readwrite.c */
 int hfs_vnop_allocate(struct vop_allocate_args *);   /* in hfs_readwrite.c */
@@ -971,6 +1015,15 @@ extern void  hfs_reldirhint(struct cnode *, directoryhint_t *);
 extern void  hfs_reldirhints(struct cnode *, int);
 extern void  hfs_insertdirhint(struct cnode *, directoryhint_t *);
 
+/* in hfs_dirhint.c */
+extern void  hfs_dirhint_init(struct hfsmount *);
+extern void  hfs_dirhint_destroy(struct hfsmount *);
+extern void  hfs_dirhint_purge(struct hfsmount *, cnid_t);
+extern void  hfs_savedirhints(struct hfsmount *, struct cnode *);
+extern directoryhint_t * hfs_dirhint_restore(struct hfsmount *, cnid_t, int);
+extern int16_t hfs_dirhint_lasttag(struct hfsmount *, cnid_t);
+extern unsigned int hfs_newdirhinttag(struct hfsmount *, struct cnode *);
+
 extern int hfs_namecmp(const u_int8_t *str1, size_t len1, const u_int8_t *str2, size_t len2);
 
 extern int     hfs_early_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp,
@@ -1025,6 +1078,7 @@ int unicode_to_hfs(ExtendedVCB *vcb, ByteCount srcLen, u_int16_t* srcStr, Str31
 #endif
 
 void *hfs_malloc(size_t size);
+void *hfs_malloc_nowait(size_t size);
 void hfs_free(void *ptr, size_t size);
 void *hfs_mallocz(size_t size);
 
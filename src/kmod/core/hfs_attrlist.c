@@ -559,7 +559,7 @@ hfs_readdirattr_internal(struct vnode *dvp, struct attrlist *alist,
 
 exit1:
 	/* Pack directory index and tag into uio_offset. */
-	while (tag == 0) tag = (++dcp->c_dirhinttag) << HFS_INDEX_BITS;	
+	if (tag == 0) tag = hfs_newdirhinttag(hfsmp, dcp);
 	uio_setoffset(uio, index | tag);
 	dirhint->dh_index |= tag;
 
@@ -0,0 +1,232 @@
+//
+//  hfs_bitmap.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_BITMAP_H_
+#define _HFS_BITMAP_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/*
+ * Bit-run routines for the volume bitmap, shared by the allocator, the
+ * mount-time scan and fsck_hfs (as <hfs/hfs_bitmap.h>).
+ *
+ * The bitmap is a string of big-endian words with block 0 in the most
+ * significant bit of the first one; read as bytes it is in block order, high
+ * bit first.  A big-endian 64-bit load therefore holds the next 64 blocks in
+ * order from the top bit down, and these routines go through the bitmap a
+ * word like that at a time: a leading zero count finds the first bit of
+ * interest in it, a population count adds it up.  Both compile to single
+ * instructions (LZCNT/POPCNT, CLZ/CNT) on targets that have them.  The
+ * unaligned ends of a range are done a 32-bit word at a time with masks, as
+ * the old loops did, so a routine only touches the 32-bit words that hold
+ * some of the range; a buffer of whole bitmap words is all they need.
+ *
+ * Ranges are bit offsets [start, end) from the start of 'map', which must be
+ * 32-bit aligned; the bits themselves need not be.
+ */
+
+static inline u_int32_t
+hfs_bm_load32(const u_int8_t *p)
+{
+	u_int32_t w;
+
+	__builtin_memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap32(w);
+#endif
+	return w;
+}
+
+static inline void
+hfs_bm_store32(u_int8_t *p, u_int32_t w)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap32(w);
+#endif
+	__builtin_memcpy(p, &w, sizeof(w));
+}
+
+static inline u_int64_t
+hfs_bm_load64(const u_int8_t *p)
+{
+	u_int64_t w;
+
+	__builtin_memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+/* Bits of the 32-bit word holding 'bit' that fall within [bit, end). */
+static inline u_int32_t
+hfs_bm_mask32(u_int64_t bit, u_int64_t end)
+{
+	u_int64_t word_end = (bit | 31) + 1;
+	u_int32_t mask = 0xffffffffu >> (bit & 31);
+
+	if (end < word_end)
+		mask &= 0xffffffffu << (word_end - end);
+	return mask;
+}
+
+/* Is there a whole aligned 64-bit word at 'bit' before 'end'? */
+static inline bool
+hfs_bm_whole64(u_int64_t bit, u_int64_t end)
+{
+	return (bit & 63) == 0 && end - bit >= 64;
+}
+
+/* First bit in [start, end) that is set (or clear), or 'end' if none is. */
+static inline u_int32_t
+hfs_bm_find(const void *map, u_int32_t start, u_int32_t end, bool set)
+{
+	const u_int8_t *p = map;
+	const u_int32_t flip = set ? 0 : 0xffffffffu;
+	const u_int64_t flip64 = set ? 0 : ~0ULL;
+	u_int64_t bit = start;
+
+	while (bit < end) {
+		if (hfs_bm_whole64(bit, end)) {
+			u_int64_t w = hfs_bm_load64(p + (bit >> 3)) ^ flip64;
+
+			if (w != 0)
+				return (u_int32_t)(bit + __builtin_clzll(w));
+			bit += 64;
+		} else {
+			u_int32_t w = (hfs_bm_load32(p + ((bit >> 3) & ~3ULL)) ^ flip) &
+						  hfs_bm_mask32(bit, end);
+
+			if (w != 0)
+				return (u_int32_t)((bit & ~31ULL) + __builtin_clz(w));
+			bit = (bit | 31) + 1;
+		}
+	}
+	return end;
+}
+
+static inline u_int32_t
+hfs_bm_find_set(const void *map, u_int32_t start, u_int32_t end)
+{
+	return hfs_bm_find(map, start, end, true);
+}
+
+static inline u_int32_t
+hfs_bm_find_clear(const void *map, u_int32_t start, u_int32_t end)
+{
+	return hfs_bm_find(map, start, end, false);
+}
+
+/*
+ * Start of the first run of at least 'count' clear bits that lies within
+ * [start, end), or 'end' if there is none.
+ */
+static inline u_int32_t
+hfs_bm_find_clear_run(const void *map, u_int32_t start, u_int32_t end, u_int32_t count)
+{
+	while (start < end) {
+		u_int32_t run_end;
+
+		start = hfs_bm_find_clear(map, start, end);
+		if (end - start < count)
+			break;
+		run_end = hfs_bm_find_set(map, start, start + count);
+		if (run_end - start >= count)
+			return start;
+		start = run_end;
+	}
+	return end;
+}
+
+/* Number of bits in [start, end) that are set (or clear). */
+static inline u_int32_t
+hfs_bm_count(const void *map, u_int32_t start, u_int32_t end, bool set)
+{
+	const u_int8_t *p = map;
+	const u_int32_t flip = set ? 0 : 0xffffffffu;
+	const u_int64_t flip64 = set ? 0 : ~0ULL;
+	u_int64_t bit = start;
+	u_int32_t n = 0;
+
+	while (bit < end) {
+		if (hfs_bm_whole64(bit, end)) {
+			n += __builtin_popcountll(hfs_bm_load64(p + (bit >> 3)) ^ flip64);
+			bit += 64;
+		} else {
+			n += __builtin_popcount((hfs_bm_load32(p + ((bit >> 3) & ~3ULL)) ^ flip) &
+									hfs_bm_mask32(bit, end));
+			bit = (bit | 31) + 1;
+		}
+	}
+	return n;
+}
+
+static inline u_int32_t
+hfs_bm_count_set(const void *map, u_int32_t start, u_int32_t end)
+{
+	return hfs_bm_count(map, start, end, true);
+}
+
+static inline u_int32_t
+hfs_bm_count_clear(const void *map, u_int32_t start, u_int32_t end)
+{
+	return hfs_bm_count(map, start, end, false);
+}
+
+/*
+ * Set (or clear) 'count' bits from 'start'.  Returns true if any of them
+ * already had the new value, which for the bitmap means a double allocation
+ * (or a double free).
+ */
+static inline bool
+hfs_bm_fill(void *map, u_int32_t start, u_int32_t count, bool set)
+{
+	u_int8_t *p = map;
+	const u_int32_t flip = set ? 0 : 0xffffffffu;
+	const u_int64_t flip64 = set ? 0 : ~0ULL;
+	u_int64_t bit = start;
+	u_int64_t end = bit + count;
+	u_int64_t seen = 0;
+
+	while (bit < end) {
+		if (hfs_bm_whole64(bit, end)) {
+			u_int8_t *q = p + (bit >> 3);
+			u_int64_t w;
+
+			__builtin_memcpy(&w, q, sizeof(w));
+			seen |= w ^ flip64;
+			w = ~flip64;
+			__builtin_memcpy(q, &w, sizeof(w));
+			bit += 64;
+		} else {
+			u_int8_t *q = p + ((bit >> 3) & ~3ULL);
+			u_int32_t mask = hfs_bm_mask32(bit, end);
+			u_int32_t w = hfs_bm_load32(q);
+
+			seen |= (w ^ flip) & mask;
+			hfs_bm_store32(q, set ? (w | mask) : (w & ~mask));
+			bit = (bit | 31) + 1;
+		}
+	}
+	return seen != 0;
+}
+
+static inline bool
+hfs_bm_set(void *map, u_int32_t start, u_int32_t count)
+{
+	return hfs_bm_fill(map, start, count, true);
+}
+
+static inline bool
+hfs_bm_clear(void *map, u_int32_t start, u_int32_t count)
+{
+	return hfs_bm_fill(map, start, count, false);
+}
+
+#endif /* ! _HFS_BITMAP_H_ */
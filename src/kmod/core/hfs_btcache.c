@@ -0,0 +1,588 @@
+//
+//  hfs_btcache.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Decoded B-tree index node cache.  See hfs_btcache.h.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/sysctl.h>
+
+#include "hfs.h"
+#include "hfs_catalog.h"
+#include "hfs_btcache.h"
+
+#include "BTreesPrivate.h"
+#include "hfs_unifold.h"
+
+extern lck_grp_t *hfs_mutex_group;
+extern lck_attr_t *hfs_lock_attr;
+
+/* Nodes in a bucket; the least recently used one is replaced */
+#define BTC_WAYS		4
+
+/* bk_len of a search key that has no sort key */
+#define BTC_NOKEY		((u_int32_t)-1)
+
+/* bk_flags */
+#define BK_HOSTORDER	0x0001		/* folded name turned back to host order for the leaf */
+
+static unsigned int hfs_btcache_nodes = 256;
+
+static struct {
+	uint64_t	hits;			// index nodes searched in the cache
+	uint64_t	misses;			// index nodes read and searched
+	uint64_t	fills;			// index nodes decoded into the cache
+	uint64_t	invalidations;	// cached nodes dropped because they changed
+} hfs_btcache_stats;
+
+HFS_SYSCTL(NODE, _vfs_generic_hfs, OID_AUTO, btcache, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "B-tree index node cache")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_btcache, OID_AUTO, nodes, CTLFLAG_RW, &hfs_btcache_nodes, 0, "index nodes cached per B-tree opened after this is set (0 to disable)")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btcache, OID_AUTO, hits, CTLFLAG_RD, &hfs_btcache_stats.hits, 0, "index nodes searched in the cache")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btcache, OID_AUTO, misses, CTLFLAG_RD, &hfs_btcache_stats.misses, 0, "index nodes read to be searched")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btcache, OID_AUTO, fills, CTLFLAG_RD, &hfs_btcache_stats.fills, 0, "index nodes decoded into the cache")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btcache, OID_AUTO, invalidations, CTLFLAG_RD, &hfs_btcache_stats.invalidations, 0, "cached index nodes dropped because they changed")
+
+/*
+ * Turns a key into its sort key at 'out', which is 2-byte aligned and has
+ * room for HFS_BTCACHE_MAXKEY bytes, and returns its length, or 0 if the key
+ * is malformed.
+ */
+typedef u_int32_t (*btc_encode_t)(const BTreeKey *key, u_int8_t *out);
+
+struct btc_node {
+	u_int32_t		bn_node;		/* node number, 0 if the slot is free */
+	u_int16_t		bn_height;
+	u_int16_t		bn_count;		/* records */
+	u_int16_t		bn_prefix;		/* bytes every sort key starts with */
+	u_int16_t		bn_reserved;
+	u_int32_t		bn_used;		/* bc_clock when last searched */
+	u_int32_t		bn_size;		/* bytes allocated at bn_child */
+	u_int32_t		*bn_child;		/* child node of each record */
+	u_int16_t		*bn_keyoff;		/* bn_count + 1 suffix offsets in bn_keys */
+	u_int8_t		*bn_keys;		/* the prefix, then every key's suffix */
+};
+
+struct hfs_btcache {
+	lck_mtx_t		bc_lock;
+	btc_encode_t	bc_encode;
+	u_int32_t		bc_mask;		/* buckets - 1 */
+	u_int32_t		bc_clock;
+	struct btc_node	*bc_nodes;		/* BTC_WAYS per bucket */
+};
+
+static inline void
+btc_put32(u_int8_t *out, u_int32_t v)
+{
+	out[0] = v >> 24;
+	out[1] = v >> 16;
+	out[2] = v >> 8;
+	out[3] = v;
+}
+
+/* Store the characters at 'out' as big-endian, so memcmp() orders them. */
+static inline void
+btc_swap16(u_int16_t *out, ItemCount count)
+{
+	while (count--) {
+		*out = SWAP_BE16(*out);
+		out++;
+	}
+}
+
+/*
+ * Case-insensitive HFS+ catalog key (CompareExtendedCatalogKeys): parent ID,
+ * then, if the name is not empty, two bytes to put every name after the
+ * empty one and the case-folded name.
+ */
+static u_int32_t
+btc_catalog_key(const BTreeKey *key, u_int8_t *out)
+{
+	const HFSPlusCatalogKey *ck = (const HFSPlusCatalogKey *)key;
+	u_int32_t count;
+
+	if (ck->nodeName.length > kHFSPlusMaxFileNameChars ||
+		ck->keyLength < kHFSPlusCatalogKeyMinimumLength + 2 * ck->nodeName.length)
+		return 0;
+
+	btc_put32(out, ck->parentID);
+	if (ck->nodeName.length == 0)
+		return 4;
+	out[4] = 0;
+	out[5] = 1;
+	count = FastUnicodeFold(ck->nodeName.unicode, ck->nodeName.length,
+							(u_int16_t *)(out + 6));
+	btc_swap16((u_int16_t *)(out + 6), count);
+
+	return (u_int32_t)(6 + 2 * count);
+}
+
+/* Case-sensitive HFSX catalog key (cat_binarykeycompare) */
+static u_int32_t
+btc_catalog_binary_key(const BTreeKey *key, u_int8_t *out)
+{
+	const HFSPlusCatalogKey *ck = (const HFSPlusCatalogKey *)key;
+
+	if (ck->nodeName.length > kHFSPlusMaxFileNameChars ||
+		ck->keyLength < kHFSPlusCatalogKeyMinimumLength + 2 * ck->nodeName.length)
+		return 0;
+
+	btc_put32(out, ck->parentID);
+	memcpy(out + 4, ck->nodeName.unicode, 2 * ck->nodeName.length);
+	btc_swap16((u_int16_t *)(out + 4), ck->nodeName.length);
+
+	return 4 + 2 * ck->nodeName.length;
+}
+
+/* HFS+ extents key (CompareExtentKeysPlus) */
+static u_int32_t
+btc_extent_key(const BTreeKey *key, u_int8_t *out)
+{
+	const HFSPlusExtentKey *ek = (const HFSPlusExtentKey *)key;
+
+	btc_put32(out, ek->fileID);
+	out[4] = ek->forkType;
+	btc_put32(out + 5, ek->startBlock);
+
+	return 9;
+}
+
+/*
+ * The sort key for a compare routine, if we know one.  The attributes
+ * B-tree's names are followed by a start block, so they would need escaping
+ * to sort as hfs_attrkeycompare() does; that tree is searched the old way.
+ */
+static btc_encode_t
+btc_encoder(KeyCompareProcPtr compare)
+{
+	if (compare == (KeyCompareProcPtr)CompareExtendedCatalogKeys)
+		return btc_catalog_key;
+	if (compare == (KeyCompareProcPtr)cat_binarykeycompare)
+		return btc_catalog_binary_key;
+	if (compare == (KeyCompareProcPtr)CompareExtentKeysPlus)
+		return btc_extent_key;
+	return NULL;
+}
+
+static inline struct btc_node *
+btc_bucket(struct hfs_btcache *bc, u_int32_t node)
+{
+	return &bc->bc_nodes[BTC_WAYS * (((node * 0x9e3779b1U) >> 8) & bc->bc_mask)];
+}
+
+static struct btc_node *
+btc_lookup(struct hfs_btcache *bc, u_int32_t node)
+{
+	struct btc_node *bn = btc_bucket(bc, node);
+	int i;
+
+	for (i = 0; i < BTC_WAYS; i++, bn++) {
+		if (bn->bn_node == node)
+			return bn;
+	}
+	return NULL;
+}
+
+/* Empty a slot; returns what its contents have to be freed with. */
+static void *
+btc_clear(struct btc_node *bn, u_int32_t *size)
+{
+	void *p = bn->bn_child;
+
+	*size = bn->bn_size;
+	memset(bn, 0, sizeof(*bn));
+	return p;
+}
+
+static void
+btc_free_all(struct hfs_btcache *bc)
+{
+	u_int32_t i, size;
+	void *p;
+
+	for (i = 0; i < BTC_WAYS * (bc->bc_mask + 1); i++) {
+		if (bc->bc_nodes[i].bn_node != 0) {
+			p = btc_clear(&bc->bc_nodes[i], &size);
+			hfs_free(p, size);
+		}
+	}
+}
+
+/*
+ * Called when the tree is opened, or its compare routine changed: start a
+ * cache for it, or drop the one it has if the new key order is not one we
+ * can make sort keys for.
+ */
+void
+hfs_btcache_setup(BTreeControlBlockPtr btcb)
+{
+	struct hfs_btcache *bc = btcb->nodeCache;
+	btc_encode_t encode = btc_encoder(btcb->keyCompareProc);
+	u_int32_t buckets;
+
+	if (bc != NULL) {
+		if (encode == NULL) {
+			hfs_btcache_destroy(btcb);
+		} else {
+			hfs_btcache_flush(btcb);
+			bc->bc_encode = encode;
+		}
+		return;
+	}
+
+	if (encode == NULL || hfs_btcache_nodes == 0)
+		return;
+
+	buckets = 1;
+	while (buckets * BTC_WAYS < MIN(hfs_btcache_nodes, 65536))
+		buckets <<= 1;
+
+	bc = hfs_mallocz(sizeof(*bc));
+	bc->bc_nodes = hfs_mallocz(BTC_WAYS * buckets * sizeof(*bc->bc_nodes));
+	bc->bc_mask = buckets - 1;
+	bc->bc_encode = encode;
+	lck_mtx_init(&bc->bc_lock, hfs_mutex_group, hfs_lock_attr);
+
+	btcb->nodeCache = bc;
+}
+
+void
+hfs_btcache_destroy(BTreeControlBlockPtr btcb)
+{
+	struct hfs_btcache *bc = btcb->nodeCache;
+
+	if (bc == NULL)
+		return;
+
+	btcb->nodeCache = NULL;
+	btc_free_all(bc);
+	lck_mtx_destroy(&bc->bc_lock, hfs_mutex_group);
+	hfs_free(bc->bc_nodes, BTC_WAYS * (bc->bc_mask + 1) * sizeof(*bc->bc_nodes));
+	hfs_free(bc, sizeof(*bc));
+}
+
+/* Forget every node, as when the tree has been reread from disk. */
+void
+hfs_btcache_flush(BTreeControlBlockPtr btcb)
+{
+	struct hfs_btcache *bc = btcb->nodeCache;
+
+	if (bc == NULL)
+		return;
+
+	lck_mtx_lock(&bc->bc_lock);
+	btc_free_all(bc);
+	lck_mtx_unlock(&bc->bc_lock);
+}
+
+/* Forget 'node', which is about to change. */
+void
+hfs_btcache_invalidate(BTreeControlBlockPtr btcb, u_int32_t node)
+{
+	struct hfs_btcache *bc;
+	struct btc_node *bn;
+	u_int32_t size = 0;
+	void *p = NULL;
+
+	if (btcb == NULL || (bc = btcb->nodeCache) == NULL)
+		return;
+
+	lck_mtx_lock(&bc->bc_lock);
+	bn = btc_lookup(bc, node);
+	if (bn != NULL)
+		p = btc_clear(bn, &size);
+	lck_mtx_unlock(&bc->bc_lock);
+
+	if (p != NULL) {
+		hfs_free(p, size);
+		atomic_add_64(&hfs_btcache_stats.invalidations, 1);
+	}
+}
+
+static inline int
+btc_compare(const u_int8_t *a, u_int32_t alen, const u_int8_t *b, u_int32_t blen)
+{
+	int result = memcmp(a, b, MIN(alen, blen));
+
+	if (result == 0 && alen != blen)
+		result = alen < blen ? -1 : 1;
+	return result;
+}
+
+/*
+ * Decode the index node 'desc', which the caller has just read and checked,
+ * into the cache.  Nodes whose keys are malformed or out of order are left
+ * for SearchNode() to deal with.
+ */
+void
+hfs_btcache_fill(BTreeControlBlockPtr btcb, u_int32_t node, BTNodeDescriptor *desc)
+{
+	struct hfs_btcache *bc = btcb->nodeCache;
+	struct btc_node *bn, *victim;
+	u_int32_t count = desc->numRecords;
+	u_int32_t *child;
+	u_int16_t *start, *len, *keyoff;
+	u_int8_t *work, *keys, *out;
+	u_int32_t worksize, keyspace, pos, prefix, total, i;
+	u_int32_t outsize = 0, oldsize = 0;
+	void *old = NULL;
+
+	if (bc == NULL || count == 0)
+		return;
+
+	/*
+	 * Work area: children, then key starts and lengths, then the whole sort
+	 * keys, each 2-byte aligned.  A sort key is never longer than the key it
+	 * came from, so the keys fit in a node's worth of bytes, plus the padding;
+	 * the last key gets a whole HFS_BTCACHE_MAXKEY so a bad one cannot run
+	 * off the end.
+	 */
+	keyspace = btcb->nodeSize + count + HFS_BTCACHE_MAXKEY;
+	worksize = count * (sizeof(*child) + 2 * sizeof(*start)) + keyspace;
+	work = hfs_malloc(worksize);
+	child = (u_int32_t *)work;
+	start = (u_int16_t *)(child + count);
+	len = start + count;
+	keys = (u_int8_t *)(len + count);
+
+	pos = 0;
+	for (i = 0; i < count; i++) {
+		BTreeKeyPtr keyPtr;
+		u_int8_t *dataPtr;
+		u_int16_t dataSize;
+
+		if (GetRecordByIndex(btcb, desc, i, &keyPtr, &dataPtr, &dataSize) != noErr ||
+			dataSize < sizeof(u_int32_t))
+			goto done;
+		child[i] = *(u_int32_t *)dataPtr;
+
+		pos = roundup2(pos, 2);
+		if (pos + HFS_BTCACHE_MAXKEY > keyspace)
+			goto done;
+		start[i] = pos;
+		len[i] = bc->bc_encode(keyPtr, keys + pos);
+		if (len[i] == 0)
+			goto done;
+		if (i > 0 && btc_compare(keys + start[i - 1], len[i - 1],
+								 keys + pos, len[i]) >= 0)
+			goto done;
+		pos += len[i];
+	}
+
+	/* Keys are in order, so what the first and last share, they all share */
+	prefix = 0;
+	while (prefix < len[0] && prefix < len[count - 1] &&
+		   keys[start[0] + prefix] == keys[start[count - 1] + prefix])
+		prefix++;
+
+	total = prefix;
+	for (i = 0; i < count; i++)
+		total += len[i] - prefix;
+
+	outsize = count * sizeof(*child) + (count + 1) * sizeof(*keyoff) + total;
+	out = hfs_malloc(outsize);
+	memcpy(out, child, count * sizeof(*child));
+	keyoff = (u_int16_t *)(out + count * sizeof(*child));
+	memcpy(keyoff + count + 1, keys + start[0], prefix);
+	pos = prefix;
+	for (i = 0; i < count; i++) {
+		keyoff[i] = pos;
+		memcpy((u_int8_t *)(keyoff + count + 1) + pos, keys + start[i] + prefix,
+			   len[i] - prefix);
+		pos += len[i] - prefix;
+	}
+	keyoff[count] = pos;
+
+	lck_mtx_lock(&bc->bc_lock);
+	victim = btc_lookup(bc, node);
+	if (victim == NULL) {
+		bn = victim = btc_bucket(bc, node);
+		for (i = 0; i < BTC_WAYS; i++, bn++) {
+			if (bn->bn_node == 0) {
+				victim = bn;
+				break;
+			}
+			if ((int32_t)(bn->bn_used - victim->bn_used) < 0)
+				victim = bn;
+		}
+	}
+	if (victim->bn_node != 0)
+		old = btc_clear(victim, &oldsize);
+	victim->bn_node = node;
+	victim->bn_height = desc->height;
+	victim->bn_count = count;
+	victim->bn_prefix = prefix;
+	victim->bn_used = bc->bc_clock++;
+	victim->bn_size = outsize;
+	victim->bn_child = (u_int32_t *)out;
+	victim->bn_keyoff = keyoff;
+	victim->bn_keys = (u_int8_t *)(keyoff + count + 1);
+	lck_mtx_unlock(&bc->bc_lock);
+
+	atomic_add_64(&hfs_btcache_stats.fills, 1);
+
+done:
+	if (old != NULL)
+		hfs_free(old, oldsize);
+	hfs_free(work, worksize);
+}
+
+/* Make the search key's sort key if it has not been made. */
+static bool
+btc_make_key(struct hfs_btcache *bc, const BTreeKey *key, struct hfs_btcache_key *sortKey)
+{
+	if (sortKey->bk_len == 0) {
+		sortKey->bk_flags = 0;
+		sortKey->bk_len = bc->bc_encode(key, sortKey->bk_bytes);
+		if (sortKey->bk_len == 0)
+			sortKey->bk_len = BTC_NOKEY;
+	}
+	return sortKey->bk_len != BTC_NOKEY;
+}
+
+/*
+ * Search 'node', an index node at 'height', for 'key' as SearchTree() would,
+ * if it is in the cache: return the index of the record to descend through
+ * and the child node it points to.  'sortKey' is made from 'key' the first
+ * time; pass the same one for every node of a search.
+ */
+bool
+hfs_btcache_search(BTreeControlBlockPtr btcb, const BTreeKey *key,
+				   struct hfs_btcache_key *sortKey, u_int32_t node,
+				   u_int16_t height, u_int16_t *index, u_int32_t *child)
+{
+	struct hfs_btcache *bc = btcb->nodeCache;
+	struct btc_node *bn;
+	const u_int8_t *sk;
+	u_int32_t sklen, suffixlen;
+	int32_t lower, upper, mid;
+	int result;
+
+	if (bc == NULL || !btc_make_key(bc, key, sortKey) ||
+		(sortKey->bk_flags & BK_HOSTORDER))
+		return false;
+	sk = sortKey->bk_bytes;
+	sklen = sortKey->bk_len;
+
+	lck_mtx_lock(&bc->bc_lock);
+	bn = btc_lookup(bc, node);
+	if (bn == NULL || bn->bn_height != height) {
+		lck_mtx_unlock(&bc->bc_lock);
+		atomic_add_64(&hfs_btcache_stats.misses, 1);
+		return false;
+	}
+	bn->bn_used = bc->bc_clock++;
+
+	/* Against the shared prefix first: before or after every key? */
+	result = memcmp(sk, bn->bn_keys, MIN(sklen, bn->bn_prefix));
+	if (result == 0 && sklen < bn->bn_prefix)
+		result = -1;
+
+	if (result < 0) {
+		lower = 0;
+	} else if (result > 0) {
+		lower = bn->bn_count;
+	} else {
+		sk += bn->bn_prefix;
+		sklen -= bn->bn_prefix;
+		lower = 0;
+		upper = bn->bn_count - 1;
+		while (lower <= upper) {
+			mid = (lower + upper) >> 1;
+			suffixlen = bn->bn_keyoff[mid + 1] - bn->bn_keyoff[mid];
+			result = btc_compare(sk, sklen, bn->bn_keys + bn->bn_keyoff[mid], suffixlen);
+			if (result < 0) {
+				upper = mid - 1;
+			} else if (result > 0) {
+				lower = mid + 1;
+			} else {
+				/* An exact match descends through that record */
+				lower = mid + 1;
+				break;
+			}
+		}
+	}
+
+	/* The last record whose key is not greater than the search key, or the first */
+	*index = lower > 0 ? lower - 1 : 0;
+	*child = bn->bn_child[*index];
+	lck_mtx_unlock(&bc->bc_lock);
+
+	atomic_add_64(&hfs_btcache_stats.hits, 1);
+	return true;
+}
+
+/*
+ * Search the case-insensitive catalog leaf 'desc' for 'key' as SearchNode()
+ * would, but with the search name folded once, in 'sortKey', and compared
+ * with each name probed by FastUnicodeCompareFolded().  Returns false, for
+ * SearchNode() to do the search, for the other trees and for names that are
+ * not ASCII, which FastUnicodeCompare() does faster.  Leaves come last in a
+ * search, so the folded name is put back into host order here, for good.
+ */
+bool
+hfs_btcache_searchleaf(BTreeControlBlockPtr btcb, BTNodeDescriptor *desc,
+					   const BTreeKey *key, struct hfs_btcache_key *sortKey,
+					   u_int16_t *index, boolean_t *found)
+{
+	struct hfs_btcache *bc = btcb->nodeCache;
+	const HFSPlusCatalogKey *searchKey = (const HFSPlusCatalogKey *)key;
+	const HFSPlusCatalogKey *trialKey;
+	const u_int16_t *folded;
+	u_int16_t *offset;
+	u_int32_t foldedLength;
+	int32_t lower, upper, mid;
+	int32_t result;
+
+	if (bc == NULL || bc->bc_encode != btc_catalog_key || !btc_make_key(bc, key, sortKey))
+		return false;
+
+	folded = (const u_int16_t *)(sortKey->bk_bytes + 6);
+	foldedLength = sortKey->bk_len > 6 ? (sortKey->bk_len - 6) / 2 : 0;
+	if (!(sortKey->bk_flags & BK_HOSTORDER)) {
+		btc_swap16((u_int16_t *)folded, foldedLength);
+		sortKey->bk_flags |= BK_HOSTORDER;
+	}
+	if (!FastUnicodeIsASCII(folded, foldedLength))
+		return false;
+
+	lower = 0;
+	upper = desc->numRecords - 1;
+	offset = (u_int16_t *)((u_int8_t *)desc + btcb->nodeSize - kOffsetSize);
+
+	while (lower <= upper) {
+		mid = (lower + upper) >> 1;
+		trialKey = (const HFSPlusCatalogKey *)((u_int8_t *)desc + *(offset - mid));
+
+		/* As CompareExtendedCatalogKeys() */
+		if (searchKey->parentID != trialKey->parentID)
+			result = searchKey->parentID > trialKey->parentID ? 1 : -1;
+		else if (searchKey->nodeName.length == 0 || trialKey->nodeName.length == 0)
+			result = searchKey->nodeName.length - trialKey->nodeName.length;
+		else
+			result = FastUnicodeCompareFolded(folded, foldedLength,
+											  trialKey->nodeName.unicode,
+											  trialKey->nodeName.length);
+
+		if (result < 0) {
+			upper = mid - 1;
+		} else if (result > 0) {
+			lower = mid + 1;
+		} else {
+			*index = mid;
+			*found = true;
+			return true;
+		}
+	}
+
+	*index = lower;
+	*found = false;
+	return true;
+}
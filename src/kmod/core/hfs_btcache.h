@@ -0,0 +1,71 @@
+//
+//  hfs_btcache.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_BTCACHE_H_
+#define _HFS_BTCACHE_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "BTreesInternal.h"
+
+/*
+ * Cache of decoded B-tree index nodes, one per B-tree.
+ *
+ * SearchTree() used to read every node on the way down through the buffer
+ * cache and binary search it with the tree's key compare routine, which for
+ * a case-insensitive catalog case folds both names on every probe.  For the
+ * trees whose key order it knows (see btc_encoder()), this cache keeps the
+ * index nodes it has seen with each key turned into a sort key: a byte string
+ * that memcmp() orders as the compare routine orders the keys, with catalog
+ * names already case folded.  The prefix every key in a node shares is kept
+ * once, and the rest of each key is packed after it, so a search compares
+ * the search key's sort key, made once per search, with the prefix and then
+ * with a few short suffixes.
+ *
+ * A node is dropped from the cache when it is about to be modified or is
+ * released dirty or trashed (hfs_btreeio.c), and the whole cache when the
+ * tree is reloaded.  Nodes are only added while their buffer is held, so a
+ * writer cannot change a node between it being read and being cached.
+ *
+ * The leaf a search of the case-insensitive catalog ends in is not cached,
+ * but it is searched with the name in the sort key, already folded, compared
+ * with each name probed by FastUnicodeCompareFolded() (hfs_unifold.h), rather
+ * than by CompareExtendedCatalogKeys(), which folds both every time.
+ */
+
+/* Longest sort key: a catalog key with a 255 character name */
+#define HFS_BTCACHE_MAXKEY	(4 + 2 + 2 * 255)
+
+/* The search key's sort key, made the first time it is needed */
+struct hfs_btcache_key {
+	u_int32_t	bk_len;			/* 0 if not made yet */
+	u_int32_t	bk_flags;
+	u_int8_t	bk_bytes[HFS_BTCACHE_MAXKEY] __aligned(2);
+};
+
+struct BTreeControlBlock;
+struct hfs_btcache;
+
+__BEGIN_DECLS
+void hfs_btcache_setup(struct BTreeControlBlock *btcb);
+void hfs_btcache_destroy(struct BTreeControlBlock *btcb);
+void hfs_btcache_flush(struct BTreeControlBlock *btcb);
+void hfs_btcache_invalidate(struct BTreeControlBlock *btcb, u_int32_t node);
+
+void hfs_btcache_fill(struct BTreeControlBlock *btcb, u_int32_t node,
+					  BTNodeDescriptor *desc);
+bool hfs_btcache_search(struct BTreeControlBlock *btcb, const BTreeKey *key,
+						struct hfs_btcache_key *sortKey, u_int32_t node,
+						u_int16_t height, u_int16_t *index, u_int32_t *child);
+bool hfs_btcache_searchleaf(struct BTreeControlBlock *btcb, BTNodeDescriptor *desc,
+							const BTreeKey *key, struct hfs_btcache_key *sortKey,
+							u_int16_t *index, boolean_t *found);
+__END_DECLS
+
+#endif /* ! _HFS_BTCACHE_H_ */
@@ -40,6 +40,8 @@
 #include "hfs_dbg.h"
 #include "hfs_endian.h"
 #include "hfs_btreeio.h"
+#include "hfs_btcache.h"
+#include "hfs_btseq.h"
 
 #include "FileMgrInternal.h"
 #include "BTreesPrivate.h"
@@ -215,6 +217,16 @@ void ModifyBlockStart(FileReference vp, BlockDescPtr blockPtr)
 	struct hfsmount	*hfsmp = VTOHFS(vp);
     struct buf *bp = NULL;
 
+	/*
+	 * The node is about to change; the decoded copy must not outlive it,
+	 * and searches without the tree lock must not trust it until the
+	 * writer is done.
+	 */
+	hfs_btcache_invalidate((BTreeControlBlockPtr)VTOF(vp)->fcbBTCBPtr,
+						   (u_int32_t)blockPtr->blockNum);
+	hfs_btseq_modify((BTreeControlBlockPtr)VTOF(vp)->fcbBTCBPtr,
+					 (u_int32_t)blockPtr->blockNum);
+
 	if (hfsmp->jnl == NULL) {
 		return;
 	}
@@ -275,6 +287,19 @@ int ReleaseBTreeBlock(FileReference vp, BlockDescPtr blockPtr, ReleaseBlockOptio
         goto exit;
     }
 
+	/*
+	 * Anything but a clean release may mean the node has changed, or is
+	 * going away; drop it from the decoded node cache, and have unlocked
+	 * searches wait for the writer to be done with it.
+	 */
+	if ((options & (kTrashBlock | kForceWriteBlock | kMarkBlockDirty)) ||
+		blockPtr->isModified) {
+		hfs_btcache_invalidate((BTreeControlBlockPtr)VTOF(vp)->fcbBTCBPtr,
+							   (u_int32_t)blockPtr->blockNum);
+		hfs_btseq_modify((BTreeControlBlockPtr)VTOF(vp)->fcbBTCBPtr,
+						 (u_int32_t)blockPtr->blockNum);
+	}
+
     if (options & kTrashBlock) {
                 (bp)->b_flags |= B_INVAL;
 
@@ -0,0 +1,345 @@
+//
+//  hfs_btseq.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Catalog searches without the catalog lock.  See hfs_btseq.h.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/sysctl.h>
+
+#include "hfs.h"
+#include "hfs_cnode.h"
+#include "hfs_btcache.h"
+#include "hfs_btseq.h"
+
+#include "BTreesPrivate.h"
+
+/* Version counters; node numbers hash into them */
+#define BTS_SLOTS		1024
+
+/* Searches made before giving up on versions that keep changing */
+#define BTS_TRIES		3
+
+/* bts_search(): the versions did not check out, search again */
+#define BTS_RETRY		(-1)
+
+struct hfs_btseq {
+	volatile u_int32_t	bs_seq[BTS_SLOTS];
+	u_int32_t			bs_npending;			/* slots made odd by the writer */
+	u_int16_t			bs_pending[BTS_SLOTS];
+};
+
+/* A node a search has been through, and its version then */
+struct bts_path {
+	u_int32_t	bp_slot;
+	u_int32_t	bp_seq;
+};
+
+static unsigned int hfs_btseq_enable = 1;
+
+static struct {
+	uint64_t	searches;		// catalog searches made without the lock
+	uint64_t	retries;		// searches made again as a node changed under them
+	uint64_t	fallbacks;		// searches left to be made under the lock
+} hfs_btseq_stats;
+
+HFS_SYSCTL(NODE, _vfs_generic_hfs, OID_AUTO, btseq, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "Catalog searches without the catalog lock")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_btseq, OID_AUTO, enable, CTLFLAG_RW, &hfs_btseq_enable, 0, "search the catalog without its lock where possible")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btseq, OID_AUTO, searches, CTLFLAG_RD, &hfs_btseq_stats.searches, 0, "catalog searches made without the lock")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btseq, OID_AUTO, retries, CTLFLAG_RD, &hfs_btseq_stats.retries, 0, "searches made again as a node changed under them")
+HFS_SYSCTL(U64, _vfs_generic_hfs_btseq, OID_AUTO, fallbacks, CTLFLAG_RD, &hfs_btseq_stats.fallbacks, 0, "searches left to be made under the lock")
+
+static inline u_int32_t
+bts_slot(u_int32_t node)
+{
+	return (node * 0x9E3779B1U) >> 22;		/* top 10 bits: BTS_SLOTS */
+}
+
+/* Only the catalog is searched without its lock. */
+void
+hfs_btseq_setup(BTreeControlBlockPtr btcb)
+{
+	struct vnode *vp = (struct vnode *)btcb->fileRefNum;
+
+	if (btcb->nodeSeq != NULL || VTOC(vp)->c_fileid != kHFSCatalogFileID)
+		return;
+
+	btcb->nodeSeq = hfs_mallocz(sizeof(struct hfs_btseq));
+}
+
+void
+hfs_btseq_destroy(BTreeControlBlockPtr btcb)
+{
+	struct hfs_btseq *bs = btcb->nodeSeq;
+
+	if (bs == NULL)
+		return;
+
+	btcb->nodeSeq = NULL;
+	hfs_free(bs, sizeof(*bs));
+}
+
+/*
+ * The tree has been reread from disk: move every version on, so that no
+ * search that was under way can stand.
+ */
+void
+hfs_btseq_flush(BTreeControlBlockPtr btcb)
+{
+	struct hfs_btseq *bs = btcb->nodeSeq;
+	u_int32_t i;
+
+	if (bs == NULL)
+		return;
+
+	for (i = 0; i < BTS_SLOTS; i++)
+		atomic_add_rel_32(&bs->bs_seq[i], 2);
+}
+
+/*
+ * 'node' is about to change.  Called with the tree locked exclusive, so
+ * there is one writer, and it alone keeps the pending list.
+ */
+void
+hfs_btseq_modify(BTreeControlBlockPtr btcb, u_int32_t node)
+{
+	struct hfs_btseq *bs;
+	u_int32_t slot;
+
+	if (btcb == NULL || (bs = btcb->nodeSeq) == NULL)
+		return;
+
+	slot = bts_slot(node);
+	if (bs->bs_seq[slot] & 1)
+		return;
+
+	atomic_add_rel_32(&bs->bs_seq[slot], 1);
+	bs->bs_pending[bs->bs_npending++] = slot;
+}
+
+/*
+ * The writer is dropping the tree's lock, with all its changes made: the
+ * nodes it changed are stable again.
+ */
+void
+hfs_btseq_commit(BTreeControlBlockPtr btcb)
+{
+	struct hfs_btseq *bs;
+	u_int32_t i;
+
+	if (btcb == NULL || (bs = btcb->nodeSeq) == NULL)
+		return;
+
+	for (i = 0; i < bs->bs_npending; i++)
+		atomic_add_rel_32(&bs->bs_seq[bs->bs_pending[i]], 1);
+	bs->bs_npending = 0;
+}
+
+/*
+ * Note the version of 'node' in the path before it is read; false if a
+ * writer is changing it.
+ */
+static inline bool
+bts_enter(struct hfs_btseq *bs, u_int32_t node, struct bts_path *path, int *depth)
+{
+	u_int32_t slot = bts_slot(node);
+	u_int32_t seq = atomic_load_acq_32(&bs->bs_seq[slot]);
+
+	if (seq & 1)
+		return false;
+
+	path[*depth].bp_slot = slot;
+	path[*depth].bp_seq = seq;
+	(*depth)++;
+	return true;
+}
+
+/* Has any node in the path changed since it was entered? */
+static inline bool
+bts_valid(struct hfs_btseq *bs, const struct bts_path *path, int depth)
+{
+	int i;
+
+	atomic_thread_fence_acq();
+	for (i = 0; i < depth; i++) {
+		if (bs->bs_seq[path[i].bp_slot] != path[i].bp_seq)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * One search, as BTSearchRecord() makes it: the hint, then the tree.
+ * Returns noErr or fsBTRecordNotFoundErr if the result stands, BTS_RETRY if
+ * a node changed on the way, or EAGAIN if a writer is in the way or the
+ * tree looks damaged (for the search under the lock to report).
+ */
+static int
+bts_search(BTreeControlBlockPtr btcb, struct hfs_btseq *bs, BTreeIterator *searchIterator,
+		   FSBufferDescriptor *record, u_int16_t *recordLen, BTreeIterator *resultIterator)
+{
+	struct bts_path path[kMaxTreeDepth + 1];
+	struct hfs_btcache_key sortKey;
+	BlockDescriptor node;
+	BTNodeDescriptor *desc;
+	BTreeKeyPtr keyPtr;
+	u_int8_t *dataPtr;
+	u_int16_t dataSize;
+	u_int32_t rootNode, nodeNum, childNum;
+	u_int16_t treeDepth, level, index = 0;
+	boolean_t found = false;
+	int depth = 0;
+
+	sortKey.bk_len = 0;
+	node.buffer = nil;
+	node.blockHeader = nil;
+	rootNode = btcb->rootNode;
+	treeDepth = btcb->treeDepth;
+
+	/* The hint first, as BTSearchRecord() takes it */
+	nodeNum = searchIterator->hint.nodeNum;
+	if (nodeNum != 0 && nodeNum < btcb->totalNodes &&
+		bts_enter(bs, nodeNum, path, &depth)) {
+		if (GetNode(btcb, nodeNum, kGetNodeHint, &node) == noErr) {
+			desc = (BTNodeDescriptor *)node.buffer;
+			if (desc->kind == kBTLeafNode && desc->numRecords > 0)
+				found = SearchNode(btcb, desc, &searchIterator->key, &index);
+			if (found)
+				goto leaf;
+			(void) ReleaseNode(btcb, &node);
+		}
+		depth = 0;
+	}
+
+	if (rootNode == 0 || treeDepth == 0 || treeDepth > kMaxTreeDepth)
+		return EAGAIN;
+
+	nodeNum = rootNode;
+	level = treeDepth;
+	for (;;) {
+		if (nodeNum == 0 || nodeNum >= btcb->totalNodes)
+			goto damaged;
+		if (!bts_enter(bs, nodeNum, path, &depth))
+			return EAGAIN;
+
+		if (level > 1 &&
+			hfs_btcache_search(btcb, &searchIterator->key, &sortKey, nodeNum, level,
+							   &index, &childNum)) {
+			nodeNum = childNum;
+			--level;
+			continue;
+		}
+
+		/* A node freed under us may be all zeroes; let that be seen below */
+		if (GetNode(btcb, nodeNum, kGetNodeHint, &node) != noErr)
+			goto damaged;
+
+		desc = (BTNodeDescriptor *)node.buffer;
+		if (desc->height != level || desc->numRecords == 0 ||
+			desc->kind != (level == 1 ? kBTLeafNode : kBTIndexNode))
+			goto release;
+
+		if (level == 1) {
+			if (!hfs_btcache_searchleaf(btcb, desc, &searchIterator->key, &sortKey,
+										&index, &found))
+				found = SearchNode(btcb, desc, &searchIterator->key, &index);
+			break;
+		}
+
+		hfs_btcache_fill(btcb, nodeNum, desc);
+		if (!SearchNode(btcb, desc, &searchIterator->key, &index) && index != 0)
+			--index;
+		if (GetRecordByIndex(btcb, desc, index, &keyPtr, &dataPtr, &dataSize) != noErr ||
+			dataSize < sizeof(u_int32_t))
+			goto release;
+		childNum = *(u_int32_t *)dataPtr;
+		(void) ReleaseNode(btcb, &node);
+
+		/* Don't follow a pointer out of a node that has since changed */
+		if (!bts_valid(bs, path, depth))
+			return BTS_RETRY;
+
+		nodeNum = childNum;
+		--level;
+	}
+
+leaf:
+	desc = (BTNodeDescriptor *)node.buffer;
+	if (found) {
+		if (GetRecordByIndex(btcb, desc, index, &keyPtr, &dataPtr, &dataSize) != noErr)
+			goto release;
+
+		if (recordLen != nil)
+			*recordLen = dataSize;
+		if (record != nil) {
+			ByteCount recordSize = record->itemCount * record->itemSize;
+
+			BlockMoveData(dataPtr, record->bufferAddress, MIN(dataSize, recordSize));
+		}
+	}
+
+	if (resultIterator != nil) {
+		if (found) {
+			resultIterator->hint.writeCount = btcb->writeCount;
+			resultIterator->hint.nodeNum = nodeNum;
+			resultIterator->hint.index = index;
+			BlockMoveData((Ptr)keyPtr, (Ptr)&resultIterator->key, CalcKeySize(btcb, keyPtr));
+		} else if (resultIterator != searchIterator) {
+			BlockMoveData((Ptr)&searchIterator->key, (Ptr)&resultIterator->key,
+						  CalcKeySize(btcb, &searchIterator->key));
+		}
+	}
+	(void) ReleaseNode(btcb, &node);
+
+	if (!bts_valid(bs, path, depth) ||
+		btcb->rootNode != rootNode || btcb->treeDepth != treeDepth)
+		return BTS_RETRY;
+
+	return found ? noErr : fsBTRecordNotFoundErr;
+
+release:
+	(void) ReleaseNode(btcb, &node);
+damaged:
+	/* Most likely a node changed under us; if not, the tree is damaged */
+	return bts_valid(bs, path, depth) ? EAGAIN : BTS_RETRY;
+}
+
+/*
+ * BTSearchRecord() for a tree set up by hfs_btseq_setup(), made without
+ * the tree's lock.  Returns EAGAIN if the search has to be made under the
+ * lock after all.
+ */
+int
+hfs_btseq_search(FCB *filePtr, BTreeIterator *searchIterator, FSBufferDescriptor *record,
+				 u_int16_t *recordLen, BTreeIterator *resultIterator)
+{
+	BTreeControlBlockPtr btcb = (BTreeControlBlockPtr)filePtr->fcbBTCBPtr;
+	struct hfs_btseq *bs;
+	int err = EAGAIN;
+	int tries;
+
+	if (btcb == NULL || (bs = btcb->nodeSeq) == NULL || !hfs_btseq_enable)
+		return EAGAIN;
+
+	atomic_add_64(&hfs_btseq_stats.searches, 1);
+	for (tries = 0; tries < BTS_TRIES; tries++) {
+		err = bts_search(btcb, bs, searchIterator, record, recordLen, resultIterator);
+		if (err != BTS_RETRY)
+			break;
+		atomic_add_64(&hfs_btseq_stats.retries, 1);
+	}
+
+	if (err == BTS_RETRY || err == EAGAIN) {
+		atomic_add_64(&hfs_btseq_stats.fallbacks, 1);
+		return EAGAIN;
+	}
+	return err;
+}
@@ -0,0 +1,58 @@
+//
+//  hfs_btseq.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_BTSEQ_H_
+#define _HFS_BTSEQ_H_
+
+#include <sys/types.h>
+
+#include "BTreesInternal.h"
+
+/*
+ * Node versions for searching the catalog B-tree without its lock.
+ *
+ * Every catalog search used to take the catalog lock shared, and so waited
+ * for any writer, which holds it exclusive across a whole cat_create(),
+ * cat_rename() or cat_delete().  Here each catalog node has a version,
+ * kept in a table of counters the node numbers hash into:
+ *
+ *	- a writer makes the version of a node odd when it starts to change
+ *	  it (ModifyBlockStart(), or a dirty release), and all the versions it
+ *	  made odd even again when it drops the catalog lock, as by then its
+ *	  changes are all in place;
+ *
+ *	- hfs_btseq_search() goes down the tree as SearchTree() does, but
+ *	  without the lock, noting the version of each node before it reads
+ *	  it.  Each node is read under its buffer lock, so it is whole; once
+ *	  the search is done, the versions are checked again, and the result
+ *	  only stands if none of them has changed.
+ *
+ * A search that meets a node a writer is changing, or whose versions do not
+ * check out a couple of times over, returns EAGAIN, and the caller takes the
+ * lock and searches with BTSearchRecord() as before.  So a lookup only
+ * waits for a writer when the writer has changed a node the lookup needs,
+ * rather than for every writer on the volume.
+ */
+
+struct BTreeControlBlock;
+struct hfs_btseq;
+
+__BEGIN_DECLS
+void hfs_btseq_setup(struct BTreeControlBlock *btcb);
+void hfs_btseq_destroy(struct BTreeControlBlock *btcb);
+void hfs_btseq_flush(struct BTreeControlBlock *btcb);
+
+void hfs_btseq_modify(struct BTreeControlBlock *btcb, u_int32_t node);
+void hfs_btseq_commit(struct BTreeControlBlock *btcb);
+
+int hfs_btseq_search(FCB *filePtr, BTreeIterator *searchIterator,
+					 FSBufferDescriptor *record, u_int16_t *recordLen,
+					 BTreeIterator *resultIterator);
+__END_DECLS
+
+#endif /* ! _HFS_BTSEQ_H_ */
@@ -42,6 +42,7 @@
 #include "hfs_catalog.h"
 #include "hfs_format.h"
 #include "hfs_endian.h"
+#include "hfs_btseq.h"
 
 #include "BTreesInternal.h"
 #include "BTreesPrivate.h"
@@ -93,6 +94,7 @@ u_char modetodirtype[16] = {
 #define HFS_LOOKUP_SYSFILE	0x1	/* If set, allow lookup of system files */
 #define HFS_LOOKUP_HARDLINK	0x2	/* If set, allow lookup of hard link records and not resolve the hard links */
 #define HFS_LOOKUP_CASESENSITIVE	0x4	/* If set, verify results of a file/directory record match input case */
+#define HFS_LOOKUP_UNLOCKED	0x8	/* If set, search without the catalog lock (see hfs_btseq.h) */
 static int cat_lookupbykey(struct hfsmount *hfsmp, CatalogKey *keyp, int flags, u_int32_t hint, int wantrsrc,
                   struct cat_desc *descp, struct cat_attr *attrp, struct cat_fork *forkp, cnid_t *desc_cnid);
 
@@ -562,6 +564,53 @@ exit:
 	return (result);
 }
 
+/*
+ * cat_lookup_unlocked - cat_lookup without the catalog b-tree lock
+ *
+ * The caller does not hold the catalog lock.  Returns EAGAIN if the lookup
+ * could not be made without it, in which case the caller takes the lock
+ * and uses cat_lookup.  Hard links and mangled names are always left to
+ * cat_lookup, as resolving them takes more catalog lookups.
+ */
+int
+cat_lookup_unlocked(struct hfsmount *hfsmp, struct cat_desc *descp, int force_casesensitive_lookup,
+                    struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp)
+{
+	CatalogKey * keyp;
+	u_int32_t prefixlen;
+	int result;
+	int flags;
+
+	if (HFSTOVCB(hfsmp)->vcbSigWord == kHFSSigWord)
+		return (EAGAIN);
+	/*
+	 * Reading a catalog node may mean mapping its block through the
+	 * extents b-tree, which needs that tree's lock.
+	 */
+	if (overflow_extents(VTOF(hfsmp->hfs_catalog_vp)))
+		return (EAGAIN);
+
+	flags = HFS_LOOKUP_UNLOCKED;
+	if (force_casesensitive_lookup)
+		flags |= HFS_LOOKUP_CASESENSITIVE;
+
+	keyp = hfs_malloc(sizeof(CatalogKey));
+
+	result = buildkey(hfsmp, descp, (HFSPlusCatalogKey *)keyp, 1);
+	if (result == 0)
+		result = cat_lookupbykey(hfsmp, keyp, flags, descp->cd_hint, 0, outdescp, attrp, forkp, NULL);
+
+	/* Not there, but cat_lookupmangled may find it by the file ID in its name */
+	if (result == ENOENT &&
+	    GetEmbeddedFileID(descp->cd_nameptr, descp->cd_namelen, &prefixlen) >=
+	    (cnid_t)kHFSFirstUserCatalogNodeID)
+		result = EAGAIN;
+
+	hfs_free(keyp, sizeof(*keyp));
+
+	return (result);
+}
+
 int
 cat_insertfilethread(struct hfsmount *hfsmp, struct cat_desc *descp)
 {
@@ -886,8 +935,12 @@ cat_lookupbykey(struct hfsmount *hfsmp, CatalogKey *keyp, int flags, u_int32_t h
 	iterator->hint.nodeNum = hint;
 	bcopy(keyp, &iterator->key, sizeof(CatalogKey));
 
-	result = BTSearchRecord(VTOF(HFSTOVCB(hfsmp)->catalogRefNum), iterator,
-				&btdata, &datasize, iterator);
+	if (flags & HFS_LOOKUP_UNLOCKED)
+		result = hfs_btseq_search(VTOF(HFSTOVCB(hfsmp)->catalogRefNum), iterator,
+					&btdata, &datasize, iterator);
+	else
+		result = BTSearchRecord(VTOF(HFSTOVCB(hfsmp)->catalogRefNum), iterator,
+					&btdata, &datasize, iterator);
 	if (result) 
 		goto exit;
 
@@ -947,6 +1000,10 @@ cat_lookupbykey(struct hfsmount *hfsmp, CatalogKey *keyp, int flags, u_int32_t h
 			isdirlink = 1;
 		}
 		if ((isfilelink || isdirlink) && !(flags & HFS_LOOKUP_HARDLINK)) {
+			if (flags & HFS_LOOKUP_UNLOCKED) {
+				result = EAGAIN;
+				goto exit;
+			}
 			ilink = recp->hfsPlusFile.hl_linkReference;
 			(void) cat_resolvelink(hfsmp, ilink, isdirlink, (struct HFSPlusCatalogFile *)recp);
 		}
@@ -2836,6 +2893,7 @@ getentriesattr_callback(const CatalogKey *key, const CatalogRecord *rec,
 			cep->ce_datablks = rec->hfsPlusFile.dataFork.totalBlocks;
 			cep->ce_rsrcsize = rec->hfsPlusFile.resourceFork.logicalSize;
 			cep->ce_rsrcblks = rec->hfsPlusFile.resourceFork.totalBlocks;
+			bcopy(rec->hfsPlusFile.dataFork.extents, cep->ce_dataext, sizeof(cep->ce_dataext));
 
 			/* Save link reference for later processing. */
 			if ((SWAP_BE32(rec->hfsPlusFile.userInfo.fdType) == kHardLinkFileType) &&
@@ -2914,6 +2972,7 @@ cat_getentriesattr(struct hfsmount *hfsmp, directoryhint_t *dirhint, struct cat_
 	key = (CatalogKey *)&iterator->key;
 	have_key = 0;
 	iterator->hint.nodeNum = dirhint->dh_desc.cd_hint;
+	iterator->hint.index = dirhint->dh_recindex;
 	index = dirhint->dh_index + 1;
 
 	/*
@@ -2977,6 +3036,7 @@ cat_getentriesattr(struct hfsmount *hfsmp, directoryhint_t *dirhint, struct cat_
 	/* Fill list with entries starting at iterator->key. */
 	result = BTIterateRecords(fcb, kBTreeNextRecord, iterator,
 			(IterateCallBackProcPtr)getentriesattr_callback, &state);
+	dirhint->dh_recindex = iterator->hint.index;
 
 	if (state.error) {
 		result = state.error;
@@ -3030,6 +3090,7 @@ cat_getentriesattr(struct hfsmount *hfsmp, directoryhint_t *dirhint, struct cat_
 			cep->ce_datablks = filerec.dataFork.totalBlocks;
 			cep->ce_rsrcsize = filerec.resourceFork.logicalSize;
 			cep->ce_rsrcblks = filerec.resourceFork.totalBlocks;
+			bcopy(filerec.dataFork.extents, cep->ce_dataext, sizeof(cep->ce_dataext));
 		}
 	}
 
@@ -3593,6 +3654,7 @@ cat_getdirentries(struct hfsmount *hfsmp, u_int32_t entrycnt, directoryhint_t *d
 	if (dirhint->dh_desc.cd_namelen != 0) {
 		if (buildkey(hfsmp, &dirhint->dh_desc, (HFSPlusCatalogKey *)key, 0) == 0) {
 			iterator->hint.nodeNum = dirhint->dh_desc.cd_hint;
+			iterator->hint.index = dirhint->dh_recindex;
 			have_key = 1;
 		}
 	}
@@ -3734,6 +3796,7 @@ cat_getdirentries(struct hfsmount *hfsmp, u_int32_t entrycnt, directoryhint_t *d
 	
 	/* Finish updating the catalog iterator. */
 	dirhint->dh_desc.cd_hint = iterator->hint.nodeNum;
+	dirhint->dh_recindex = iterator->hint.index;
 	dirhint->dh_desc.cd_flags |= CD_DECOMPOSED;
 	dirhint->dh_index = index - 1;
 	
@@ -170,9 +170,11 @@ void hfs_fork_copy(struct cat_fork *dst, const struct cat_fork *src,
  */
 struct directoryhint {
 	TAILQ_ENTRY(directoryhint) dh_link; /* chain */
+	LIST_ENTRY(directoryhint) dh_hash;  /* mount's table of kept hints */
 	int     dh_index;                   /* index into directory (zero relative) */
 	u_int32_t  dh_threadhint;           /* node hint of a directory's thread record */
 	u_int32_t  dh_time;
+	u_int16_t  dh_recindex;             /* record index of entry in node dh_desc.cd_hint */
 	struct  cat_desc  dh_desc;          /* entry's descriptor */
 };
 typedef struct directoryhint directoryhint_t;
@@ -199,7 +201,7 @@ struct cookiedata {
 /*
  * Catalog Node Entry
  *
- * A cat_entry is used for bulk enumerations (hfs_readdirattr).
+ * A cat_entry is used for bulk enumerations (hfs_readdirattr, hfs_readdirplus).
  */
 struct cat_entry {
 	struct cat_desc	ce_desc;
@@ -208,6 +210,7 @@ struct cat_entry {
 	off_t		ce_rsrcsize;
 	u_int32_t		ce_datablks;
 	u_int32_t		ce_rsrcblks;
+	struct HFSPlusExtentDescriptor	ce_dataext[kHFSPlusExtentDensity];	/* for hfs_readdirplus() priming */
 };
 
 /*
@@ -362,6 +365,13 @@ extern int cat_lookup (	struct hfsmount *hfsmp,
 			struct cat_fork *forkp,
     			cnid_t          *desc_cnid);
 
+extern int cat_lookup_unlocked (struct hfsmount *hfsmp,
+			struct cat_desc *descp,
+			int force_casesensitive_lookup,
+			struct cat_desc *outdescp,
+			struct cat_attr *attrp,
+			struct cat_fork *forkp);
+
 extern int cat_idlookup (struct hfsmount *hfsmp,
 			cnid_t cnid,
 			int allow_system_files,
@@ -0,0 +1,203 @@
+//
+//  hfs_cksum.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Journal checksums.  See hfs_cksum.h.  Also built into fsck_hfs.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/libkern.h>
+#else
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#endif
+#endif
+
+#include "hfs_cksum.h"
+
+//
+// this isn't a great checksum routine but it will do for now.
+// we use it to checksum the journal header and the block list
+// headers that are at the start of each transaction.
+//
+u_int32_t
+hfs_jnl_cksum(const void *ptr, size_t len)
+{
+	const u_int8_t *p = ptr;
+	u_int32_t cksum = 0;
+	size_t i;
+
+	// this is a lame checksum but for now it'll do
+	for (i = 0; i < len; i++, p++) {
+		cksum = (cksum << 8) ^ (cksum + *p);
+	}
+
+	return (~cksum);
+}
+
+#ifdef _KERNEL
+
+u_int32_t
+hfs_crc32c(u_int32_t crc, const void *ptr, size_t len)
+{
+	return calculate_crc32c(crc, ptr, (unsigned int)len);
+}
+
+#else
+
+#define CRC32C_POLY		0x82f63b78		/* reflected */
+
+static u_int32_t crc32c_table[8][256];
+static u_int32_t (*crc32c_fn)(u_int32_t, const u_int8_t *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8: eight table lookups for every 8 bytes, none depending on the others. */
+static u_int32_t
+crc32c_sb8(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		u_int32_t lo, hi;
+
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = crc32c_table[7][lo & 0xff] ^
+			  crc32c_table[6][(lo >> 8) & 0xff] ^
+			  crc32c_table[5][(lo >> 16) & 0xff] ^
+			  crc32c_table[4][lo >> 24] ^
+			  crc32c_table[3][hi & 0xff] ^
+			  crc32c_table[2][(hi >> 8) & 0xff] ^
+			  crc32c_table[1][(hi >> 16) & 0xff] ^
+			  crc32c_table[0][hi >> 24];
+	}
+
+	for (; len > 0; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static u_int32_t
+crc32c_hw(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+	u_int64_t c;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+
+	for (c = crc; len >= 8; len -= 8, p += 8) {
+		u_int64_t w;
+
+		memcpy(&w, p, sizeof(w));
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	crc = (u_int32_t)c;
+
+	for (; len > 0; len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+
+	return crc;
+}
+
+static bool
+crc32c_hw_present(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__)
+
+#ifdef __clang__
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static u_int32_t
+crc32c_hw(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		u_int64_t w;
+
+		memcpy(&w, p, sizeof(w));
+		crc = __crc32cd(crc, w);
+	}
+
+	for (; len > 0; len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static bool
+crc32c_hw_present(void)
+{
+#ifdef __FreeBSD__
+	u_long hwcap = 0;
+
+	return elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) == 0 &&
+		   (hwcap & HWCAP_CRC32) != 0;
+#else
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+}
+
+#else
+
+#define crc32c_hw			crc32c_sb8
+#define crc32c_hw_present()	false
+
+#endif
+
+static void
+crc32c_init(void)
+{
+	u_int32_t i, k, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++) {
+			c = crc32c_table[k - 1][i];
+			crc32c_table[k][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+		}
+	}
+
+	crc32c_fn = crc32c_hw_present() ? crc32c_hw : crc32c_sb8;
+}
+
+u_int32_t
+hfs_crc32c(u_int32_t crc, const void *ptr, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_fn(crc, ptr, len);
+}
+
+#endif /* _KERNEL */
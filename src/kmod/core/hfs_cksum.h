@@ -0,0 +1,45 @@
+//
+//  hfs_cksum.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_CKSUM_H_
+#define _HFS_CKSUM_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/*
+ * Journal checksums, shared by the kernel and fsck_hfs (as <hfs/hfs_cksum.h>).
+ *
+ * hfs_jnl_cksum() is the checksum from TN1150 that every journal uses for
+ * its header and block list headers, and that journals used for the blocks
+ * themselves too.  It goes a byte at a time through a chain of shifts, so
+ * nothing overlaps; a block list header flagged BLHDR_CRC32C_CHECKSUMS has
+ * CRC32C checksums for its blocks instead.  Readers that don't know the flag
+ * don't check those blocks rather than rejecting them, so the flag needs no
+ * change to the journal header.
+ *
+ * hfs_crc32c() uses the CRC32 instructions of SSE4.2 or ARMv8 where the CPU
+ * has them, and slicing-by-8 where it doesn't.  In the kernel it is libkern's
+ * calculate_crc32c(), which does the same.
+ */
+
+__BEGIN_DECLS
+u_int32_t hfs_jnl_cksum(const void *ptr, size_t len);
+u_int32_t hfs_crc32c(u_int32_t crc, const void *ptr, size_t len);
+__END_DECLS
+
+/* Checksum of a journaled block, as its block list header says to take it. */
+static inline u_int32_t
+hfs_jnl_block_cksum(const void *ptr, size_t len, bool crc32c)
+{
+	if (crc32c)
+		return ~hfs_crc32c(~0u, ptr, len);
+	return hfs_jnl_cksum(ptr, len);
+}
+
+#endif /* ! _HFS_CKSUM_H_ */
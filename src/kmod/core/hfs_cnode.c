@@ -231,9 +231,11 @@ int hfs_cnode_teardown (struct vnode *vp, struct thread * ctx, int reclaim)
 	}
 
 	/* 
-	 * Remove any directory hints or cached origins
+	 * Remove any directory hints or cached origins; the directory's
+	 * recent hints are kept in the mount for its next vnode.
 	 */
 	if (v_type == VDIR) {
+		hfs_savedirhints(hfsmp, cp);
 		hfs_reldirhints(cp, 0);
 	}
 	if (cp->c_flag & C_HARDLINK) {
@@ -1263,6 +1265,9 @@ hfs_getnewvnode(
             if ( !(hfsmp->hfs_flags & HFS_READ_ONLY) )
                 cp->c_flag |= C_MODIFIED;
         }
+        /* Hand out readdir tags after those of the hints kept for it. */
+        if (vtype == VDIR)
+            cp->c_dirhinttag = hfs_dirhint_lasttag(hfsmp, cp->c_fileid);
 #if QUOTA
         if (hfsmp->hfs_flags & HFS_QUOTAS) {
             for (i = 0; i < MAXQUOTAS; i++)
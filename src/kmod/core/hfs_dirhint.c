@@ -0,0 +1,314 @@
+//
+//  hfs_dirhint.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Directory hints kept for directories that are no longer in core.
+ *
+ * A directory hint remembers where an enumeration stopped: the index of the
+ * last entry returned, its name, the leaf node it was in and its record
+ * index there.  The next readdir with that cookie builds the entry's key and
+ * carries on from the hinted node.  Without a hint, it has to go back to the
+ * directory's thread record and step over every entry before the cookie.
+ *
+ * Hints hang off the cnode, and used to be freed on the last close and when
+ * the vnode was torn down.  An NFS client, or anything else that enumerates
+ * a big directory a few pages at a time, then paid for a rescan from the
+ * start of the directory whenever the vnode had been recycled in between.
+ *
+ * So hfs_savedirhints() now moves a directory's hints here instead, into a
+ * table per mount keyed by directory ID and cookie (index and tag), and
+ * hfs_getdirhint() looks here before starting a hint from scratch.  A hint
+ * is in the table or on a cnode's list, never both: taking it out hands it
+ * back to the cnode as it was.  The table holds at most hfs_dirhint_max
+ * hints, least recently saved out first, and drops any hint older than
+ * hfs_dirhint_ttl seconds when it is looked up.
+ *
+ * A hint is only a place to start from, and is checked against the catalog
+ * when it is used, so one that is out of date costs a search and nothing
+ * else.  Hints of a directory that is deleted are dropped all the same.
+ *
+ * A kept hint must not answer a cookie it was not made for, though: its
+ * name would carry that enumeration on from the wrong entry.  Cookies are
+ * told apart by their tag, which a cnode counts up from zero, so a new
+ * cnode would hand out the tags of the hints kept for its directory again.
+ * So a new cnode starts counting after the highest tag kept for it
+ * (hfs_dirhint_lasttag()), and once the count wraps, hfs_newdirhinttag()
+ * drops any kept hint whose tag it hands out.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/sysctl.h>
+
+#include "hfs.h"
+#include "hfs_catalog.h"
+#include "hfs_cnode.h"
+
+extern lck_grp_t *hfs_mutex_group;
+extern lck_attr_t *hfs_lock_attr;
+
+#define HFS_DIRHINT_HASHSIZE	256
+
+static unsigned int hfs_dirhint_max = 4096;
+static unsigned int hfs_dirhint_ttl = 300;
+
+static struct {
+	uint64_t	saved;			// hints moved from a cnode into the table
+	uint64_t	restored;		// hints handed back to a cnode
+	uint64_t	expired;		// hints too old when they were looked up
+	uint64_t	evicted;		// hints pushed out by newer ones
+} hfs_dirhint_stats;
+
+HFS_SYSCTL(NODE, _vfs_generic_hfs, OID_AUTO, dirhint, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "Directory hints kept across vnode reuse")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_dirhint, OID_AUTO, max, CTLFLAG_RW, &hfs_dirhint_max, 0, "most hints kept per mount (0 to keep none)")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_dirhint, OID_AUTO, ttl, CTLFLAG_RW, &hfs_dirhint_ttl, 0, "seconds a kept hint stays usable")
+HFS_SYSCTL(U64, _vfs_generic_hfs_dirhint, OID_AUTO, saved, CTLFLAG_RD, &hfs_dirhint_stats.saved, 0, "hints kept for a later vnode")
+HFS_SYSCTL(U64, _vfs_generic_hfs_dirhint, OID_AUTO, restored, CTLFLAG_RD, &hfs_dirhint_stats.restored, 0, "kept hints used again")
+HFS_SYSCTL(U64, _vfs_generic_hfs_dirhint, OID_AUTO, expired, CTLFLAG_RD, &hfs_dirhint_stats.expired, 0, "kept hints dropped for age")
+HFS_SYSCTL(U64, _vfs_generic_hfs_dirhint, OID_AUTO, evicted, CTLFLAG_RD, &hfs_dirhint_stats.evicted, 0, "kept hints dropped for room")
+
+#define DIRHINTHASH(dhc, cnid)	(&(dhc)->dhc_hashtbl[(cnid) & (dhc)->dhc_hashmask])
+
+static void
+dirhint_free(directoryhint_t *hint)
+{
+	const u_int8_t *name = hint->dh_desc.cd_nameptr;
+
+	if ((hint->dh_desc.cd_flags & CD_HASBUF) && (name != NULL)) {
+		hint->dh_desc.cd_nameptr = NULL;
+		hint->dh_desc.cd_namelen = 0;
+		hint->dh_desc.cd_flags &= ~CD_HASBUF;
+		vfs_removename((const char *)name);
+	}
+	hfs_zfree(hint, HFS_DIRHINT_ZONE);
+}
+
+/* Take a hint out of the table.  Called with dhc_lock held. */
+static void
+dirhint_unlink(struct hfs_dirhints *dhc, directoryhint_t *hint)
+{
+	LIST_REMOVE(hint, dh_hash);
+	TAILQ_REMOVE(&dhc->dhc_lru, hint, dh_link);
+	--dhc->dhc_count;
+}
+
+void
+hfs_dirhint_init(struct hfsmount *hfsmp)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+
+	lck_mtx_init(&dhc->dhc_lock, hfs_mutex_group, hfs_lock_attr);
+	dhc->dhc_hashtbl = hashinit(HFS_DIRHINT_HASHSIZE, M_TEMP, &dhc->dhc_hashmask);
+	TAILQ_INIT(&dhc->dhc_lru);
+	dhc->dhc_count = 0;
+}
+
+void
+hfs_dirhint_destroy(struct hfsmount *hfsmp)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+
+	hfs_dirhint_purge(hfsmp, 0);
+	hashdestroy(dhc->dhc_hashtbl, M_TEMP, dhc->dhc_hashmask);
+	dhc->dhc_hashtbl = NULL;
+	lck_mtx_destroy(&dhc->dhc_lock, hfs_mutex_group);
+}
+
+/*
+ * Drop the kept hints of one directory, or of all of them when 'dircnid'
+ * is zero.
+ */
+void
+hfs_dirhint_purge(struct hfsmount *hfsmp, cnid_t dircnid)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+	struct hfs_hinthead doomed;
+	directoryhint_t *hint, *next;
+
+	TAILQ_INIT(&doomed);
+
+	lck_mtx_lock(&dhc->dhc_lock);
+	if (dircnid == 0) {
+		TAILQ_FOREACH_SAFE(hint, &dhc->dhc_lru, dh_link, next) {
+			dirhint_unlink(dhc, hint);
+			TAILQ_INSERT_TAIL(&doomed, hint, dh_link);
+		}
+	} else {
+		LIST_FOREACH_SAFE(hint, DIRHINTHASH(dhc, dircnid), dh_hash, next) {
+			if (hint->dh_desc.cd_parentcnid != dircnid)
+				continue;
+			dirhint_unlink(dhc, hint);
+			TAILQ_INSERT_TAIL(&doomed, hint, dh_link);
+		}
+	}
+	lck_mtx_unlock(&dhc->dhc_lock);
+
+	TAILQ_FOREACH_SAFE(hint, &doomed, dh_link, next)
+		dirhint_free(hint);
+}
+
+/*
+ * Move the hints of a directory that is going out of use into the table,
+ * but for those old enough to be released anyway, which are left on the
+ * cnode for hfs_reldirhints().
+ *
+ * Requires an exclusive lock on directory cnode.
+ */
+void
+hfs_savedirhints(struct hfsmount *hfsmp, struct cnode *dcp)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+	struct hfs_hinthead doomed;
+	struct timeval tv;
+	directoryhint_t *hint, *prev;
+	u_int32_t max = hfs_dirhint_max;
+
+	if (dcp->c_flag & (C_DELETED | C_NOEXISTS)) {
+		/* Nothing will enumerate it again; forget what was kept too. */
+		hfs_dirhint_purge(hfsmp, dcp->c_fileid);
+		return;
+	}
+	if (TAILQ_EMPTY(&dcp->c_hintlist) || max == 0)
+		return;
+
+	microuptime(&tv);
+	TAILQ_INIT(&doomed);
+
+	lck_mtx_lock(&dhc->dhc_lock);
+
+	/* Oldest first, so the newest end up at the head of the LRU list. */
+	for (hint = TAILQ_LAST(&dcp->c_hintlist, hfs_hinthead); hint != NULL; hint = prev) {
+		prev = TAILQ_PREV(hint, hfs_hinthead, dh_link);
+		if ((tv.tv_sec - hint->dh_time) >= HFS_DIRHINT_TTL)
+			continue;
+		TAILQ_REMOVE(&dcp->c_hintlist, hint, dh_link);
+		--dcp->c_dirhintcnt;
+
+		LIST_INSERT_HEAD(DIRHINTHASH(dhc, hint->dh_desc.cd_parentcnid), hint, dh_hash);
+		TAILQ_INSERT_HEAD(&dhc->dhc_lru, hint, dh_link);
+		++dhc->dhc_count;
+		atomic_add_64(&hfs_dirhint_stats.saved, 1);
+	}
+
+	while (dhc->dhc_count > max) {
+		hint = TAILQ_LAST(&dhc->dhc_lru, hfs_hinthead);
+		dirhint_unlink(dhc, hint);
+		TAILQ_INSERT_TAIL(&doomed, hint, dh_link);
+		atomic_add_64(&hfs_dirhint_stats.evicted, 1);
+	}
+
+	lck_mtx_unlock(&dhc->dhc_lock);
+
+	TAILQ_FOREACH_SAFE(hint, &doomed, dh_link, prev)
+		dirhint_free(hint);
+}
+
+/*
+ * Take the kept hint for cookie 'index' (index and tag) of a directory out
+ * of the table.  The caller owns it from then on, and puts it on the cnode.
+ */
+directoryhint_t *
+hfs_dirhint_restore(struct hfsmount *hfsmp, cnid_t dircnid, int index)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+	struct timeval tv;
+	directoryhint_t *hint;
+
+	if (dhc->dhc_count == 0)
+		return (NULL);
+
+	microuptime(&tv);
+
+	lck_mtx_lock(&dhc->dhc_lock);
+	LIST_FOREACH(hint, DIRHINTHASH(dhc, dircnid), dh_hash) {
+		if (hint->dh_desc.cd_parentcnid == dircnid && hint->dh_index == index)
+			break;
+	}
+	if (hint != NULL)
+		dirhint_unlink(dhc, hint);
+	lck_mtx_unlock(&dhc->dhc_lock);
+
+	if (hint == NULL)
+		return (NULL);
+
+	if ((tv.tv_sec - hint->dh_time) >= hfs_dirhint_ttl) {
+		dirhint_free(hint);
+		atomic_add_64(&hfs_dirhint_stats.expired, 1);
+		return (NULL);
+	}
+	atomic_add_64(&hfs_dirhint_stats.restored, 1);
+	return (hint);
+}
+
+/*
+ * The highest tag of the hints kept for a directory, for a new cnode of it
+ * to start counting from.
+ */
+int16_t
+hfs_dirhint_lasttag(struct hfsmount *hfsmp, cnid_t dircnid)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+	directoryhint_t *hint;
+	u_int32_t tag, last = 0;
+
+	if (dhc->dhc_count == 0)
+		return (0);
+
+	lck_mtx_lock(&dhc->dhc_lock);
+	LIST_FOREACH(hint, DIRHINTHASH(dhc, dircnid), dh_hash) {
+		if (hint->dh_desc.cd_parentcnid != dircnid)
+			continue;
+		tag = (u_int32_t)hint->dh_index >> HFS_INDEX_BITS;
+		if (tag > last)
+			last = tag;
+	}
+	lck_mtx_unlock(&dhc->dhc_lock);
+
+	return ((int16_t)last);
+}
+
+/*
+ * Hand out the tag for a new enumeration of a directory, as it is to be
+ * packed into the cookie, and drop any kept hint that has the same tag.
+ *
+ * Requires an exclusive lock on directory cnode.
+ */
+unsigned int
+hfs_newdirhinttag(struct hfsmount *hfsmp, struct cnode *dcp)
+{
+	struct hfs_dirhints *dhc = &hfsmp->hfs_dirhints;
+	struct hfs_hinthead doomed;
+	directoryhint_t *hint, *next;
+	unsigned int tag;
+
+	do {
+		tag = (++dcp->c_dirhinttag) << HFS_INDEX_BITS;
+	} while (tag == 0);
+
+	if (dhc->dhc_count == 0)
+		return (tag);
+
+	TAILQ_INIT(&doomed);
+
+	lck_mtx_lock(&dhc->dhc_lock);
+	LIST_FOREACH_SAFE(hint, DIRHINTHASH(dhc, dcp->c_fileid), dh_hash, next) {
+		if (hint->dh_desc.cd_parentcnid != dcp->c_fileid ||
+		    ((u_int32_t)hint->dh_index & ~HFS_INDEX_MASK) != tag)
+			continue;
+		dirhint_unlink(dhc, hint);
+		TAILQ_INSERT_TAIL(&doomed, hint, dh_link);
+	}
+
+	lck_mtx_unlock(&dhc->dhc_lock);
+
+	TAILQ_FOREACH_SAFE(hint, &doomed, dh_link, next)
+		dirhint_free(hint);
+
+	return (tag);
+}
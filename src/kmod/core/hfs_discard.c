@@ -0,0 +1,377 @@
+//
+//  hfs_discard.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Background discard (UNMAP, TRIM) of freed space.
+ *
+ * The journal used to issue a DKIOCUNMAP for the extents freed by every
+ * transaction before finishing it, and the mount-time bitmap scan issued its
+ * own as it went.  Both now queue the extents here instead, and a thread per
+ * mount unmaps them later.  The queue is a free extent index (hfs_freeext.h)
+ * in allocation blocks, so neighbouring extents merge as they arrive and an
+ * allocation that lands in the middle of one splits it.
+ *
+ * The thread waits until hfs_discard_delay_ms have passed since something was
+ * queued, or a full batch is waiting, then takes up to hfs_discard_batch
+ * extents, lowest block first, and unmaps them with one DKIOCUNMAP, no faster
+ * than hfs_discard_rate_mb a second.  Extents are whole allocation blocks, so
+ * every one starts and ends on a device block.
+ *
+ * Blocks being allocated are taken out of the queue by hfs_discard_remove().
+ * If they are in the batch being unmapped, it waits for the batch, so nothing
+ * is written to them before their unmap is done.  Forgetting an extent only
+ * costs the device a hint, so when the queue is out of memory or full it
+ * drops extents rather than failing.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/proc.h>
+#include <sys/sysctl.h>
+#include <sys/ddisk.h>
+
+#include "hfs.h"
+#include "FileMgrInternal.h"
+
+extern lck_grp_t *hfs_mutex_group;
+extern lck_attr_t *hfs_lock_attr;
+
+/* hd_flags */
+#define HD_STOP		0x0001		/* the thread should empty the queue and exit */
+#define HD_BUSY		0x0002		/* hd_batch is being unmapped */
+#define HD_WANTED	0x0004		/* someone is waiting for hd_batch */
+
+/* Most extents queued; past this the shortest are forgotten. */
+#define HFS_DISCARD_MAX_EXTENTS		32768
+
+/* Most extents in one DKIOCUNMAP, whatever hfs_discard_batch says */
+#define HFS_DISCARD_MAX_BATCH		1024
+
+static unsigned int hfs_discard_delay_ms = 1000;
+static unsigned int hfs_discard_batch = 256;
+static unsigned int hfs_discard_rate_mb = 0;
+
+static struct {
+	uint64_t	batches;		// DKIOCUNMAP requests issued
+	uint64_t	extents;		// extents in them
+	uint64_t	bytes;			// bytes in them
+	uint64_t	errors;			// requests that failed
+	uint64_t	waits;			// allocations that waited for a batch
+} hfs_discard_stats;
+
+HFS_SYSCTL(NODE, _vfs_generic_hfs, OID_AUTO, discard, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "Discard of freed space")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_discard, OID_AUTO, delay_ms, CTLFLAG_RW, &hfs_discard_delay_ms, 0, "milliseconds freed space waits before it is unmapped")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_discard, OID_AUTO, batch, CTLFLAG_RW, &hfs_discard_batch, 0, "most extents unmapped by one request")
+HFS_SYSCTL(UINT, _vfs_generic_hfs_discard, OID_AUTO, rate_mb, CTLFLAG_RW, &hfs_discard_rate_mb, 0, "most megabytes unmapped a second (0 for no limit)")
+HFS_SYSCTL(U64, _vfs_generic_hfs_discard, OID_AUTO, batches, CTLFLAG_RD, &hfs_discard_stats.batches, 0, "unmap requests issued")
+HFS_SYSCTL(U64, _vfs_generic_hfs_discard, OID_AUTO, extents, CTLFLAG_RD, &hfs_discard_stats.extents, 0, "extents unmapped")
+HFS_SYSCTL(U64, _vfs_generic_hfs_discard, OID_AUTO, bytes, CTLFLAG_RD, &hfs_discard_stats.bytes, 0, "bytes unmapped")
+HFS_SYSCTL(U64, _vfs_generic_hfs_discard, OID_AUTO, errors, CTLFLAG_RD, &hfs_discard_stats.errors, 0, "unmap requests that failed")
+HFS_SYSCTL(U64, _vfs_generic_hfs_discard, OID_AUTO, waits, CTLFLAG_RD, &hfs_discard_stats.waits, 0, "allocations that waited for an unmap")
+
+
+static inline u_int32_t
+hfs_discard_batch_max(void)
+{
+	return hfs_discard_batch ? MIN(hfs_discard_batch, HFS_DISCARD_MAX_BATCH) : 1;
+}
+
+/*
+ * Make sure the queue has the spare nodes for one update.  As with the free
+ * extent index, they are allocated without sleeping before the lock is taken.
+ */
+static void
+hfs_discard_prime(struct hfs_discard *hd)
+{
+	struct fe_chunk *chunk;
+
+	/* Unlocked peek; at worst we allocate a chunk we did not need. */
+	if (hd->hd_queue.fi_spare_count >= FE_SPARE_LOW)
+		return;
+
+	chunk = fe_chunk_alloc();
+	if (chunk == NULL)
+		return;
+
+	lck_mtx_lock(&hd->hd_lock);
+	fe_chunk_add(&hd->hd_queue, chunk);
+	lck_mtx_unlock(&hd->hd_lock);
+}
+
+/* Ticks until the queue should be unmapped, or 0 if it should be now. */
+static int
+hfs_discard_due(struct hfs_discard *hd)
+{
+	int delay, waited;
+
+	if (ISSET(hd->hd_flags, HD_STOP) || hd->hd_queue.fi_count >= hfs_discard_batch_max())
+		return 0;
+
+	delay = (int)(((uint64_t)hfs_discard_delay_ms * hz + 999) / 1000);
+	waited = ticks - hd->hd_queued_at;
+	if (waited < 0 || waited >= delay)
+		return 0;
+	return delay - waited;
+}
+
+/* Is any of the byte range [offset, offset + length) in hd_batch? */
+static bool
+hfs_discard_in_batch(struct hfs_discard *hd, u_int64_t offset, u_int64_t length)
+{
+	u_int64_t end = offset + length;
+	u_int32_t lower = 0, upper = hd->hd_batch_count, middle;
+
+	while (lower < upper) {
+		middle = (lower + upper) / 2;
+		if (hd->hd_batch[middle].offset >= end)
+			upper = middle;
+		else if (hd->hd_batch[middle].offset + hd->hd_batch[middle].length <= offset)
+			lower = middle + 1;
+		else
+			return true;
+	}
+	return false;
+}
+
+/* Move the lowest extents in the queue to hd_batch, as byte ranges. */
+static void
+hfs_discard_take(struct hfsmount *hfsmp)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+	u_int32_t start, count;
+
+	hd->hd_batch_count = 0;
+	while (hd->hd_batch_count < hfs_discard_batch_max() && fe_find_lowest(&hd->hd_queue, &start, &count)) {
+		/* Taking out a whole extent never needs a spare node */
+		(void) fe_remove(&hd->hd_queue, start, count);
+
+		hd->hd_batch[hd->hd_batch_count].offset = (u_int64_t) start * hfsmp->blockSize + (u_int64_t) hfsmp->hfsPlusIOPosOffset;
+		hd->hd_batch[hd->hd_batch_count].length = (u_int64_t) count * hfsmp->blockSize;
+		hd->hd_batch_count++;
+	}
+}
+
+static int
+hfs_discard_issue(struct hfsmount *hfsmp, u_int64_t *bytes)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+	dk_unmap_t unmap;
+	u_int32_t i;
+	int error;
+
+	*bytes = 0;
+	for (i = 0; i < hd->hd_batch_count; i++)
+		*bytes += hd->hd_batch[i].length;
+
+	bzero(&unmap, sizeof(unmap));
+	unmap.extents = hd->hd_batch;
+	unmap.extentsCount = hd->hd_batch_count;
+	error = VNOP_IOCTL(hfsmp->hfs_devvp, HFSTOCP(hfsmp), DKIOCUNMAP, (caddr_t)&unmap, 0);
+
+	atomic_add_64(&hfs_discard_stats.batches, 1);
+	atomic_add_64(&hfs_discard_stats.extents, hd->hd_batch_count);
+	atomic_add_64(&hfs_discard_stats.bytes, *bytes);
+	if (error)
+		atomic_add_64(&hfs_discard_stats.errors, 1);
+
+	return error;
+}
+
+static void
+hfs_discard_thread(void *arg)
+{
+	struct hfsmount *hfsmp = arg;
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+	u_int64_t bytes;
+	int timo;
+
+	lck_mtx_lock(&hd->hd_lock);
+	hd->hd_thread = curthread;
+	for (;;) {
+		if (hd->hd_queue.fi_count == 0) {
+			if (ISSET(hd->hd_flags, HD_STOP))
+				break;
+			msleep(hd, &hd->hd_lock.mtx, PRIBIO, "hfs_discard", 0);
+			continue;
+		}
+		if ((timo = hfs_discard_due(hd)) > 0) {
+			msleep(hd, &hd->hd_lock.mtx, PRIBIO, "hfs_discard", timo);
+			continue;
+		}
+
+		hfs_discard_take(hfsmp);
+		SET(hd->hd_flags, HD_BUSY);
+		wakeup(&hd->hd_queue);
+		lck_mtx_unlock(&hd->hd_lock);
+
+		(void) hfs_discard_issue(hfsmp, &bytes);
+
+		lck_mtx_lock(&hd->hd_lock);
+		CLR(hd->hd_flags, HD_BUSY);
+		hd->hd_batch_count = 0;
+		if (ISSET(hd->hd_flags, HD_WANTED)) {
+			CLR(hd->hd_flags, HD_WANTED);
+			wakeup(&hd->hd_batch);
+		}
+
+		/* Rate limit; unmounting does not wait for it */
+		if (hfs_discard_rate_mb && !ISSET(hd->hd_flags, HD_STOP)) {
+			timo = (int)(bytes * hz / ((uint64_t)hfs_discard_rate_mb << 20));
+			if (timo > 0)
+				msleep(&hd->hd_flags, &hd->hd_lock.mtx, PRIBIO, "hfs_discard_rate", timo);
+		}
+	}
+
+	hd->hd_thread = NULL;
+	wakeup(&hd->hd_thread);
+	lck_mtx_unlock(&hd->hd_lock);
+	kthread_exit();
+
+	/* hfs_discard_stop may return and the mount go away from here on. */
+}
+
+/* Set up the queue; it is only used if HFS_UNMAP is already set. */
+void
+hfs_discard_init(struct hfsmount *hfsmp)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+
+	lck_mtx_init(&hd->hd_lock, hfs_mutex_group, hfs_lock_attr);
+	fe_init(&hd->hd_queue, HFS_DISCARD_MAX_EXTENTS);
+	hd->hd_thread = NULL;
+	hd->hd_flags = 0;
+	hd->hd_batch = NULL;
+	hd->hd_batch_count = 0;
+	hd->hd_batch_alloc = 0;
+
+	if (ISSET(hfsmp->hfs_flags, HFS_UNMAP)) {
+		hd->hd_batch = hfs_malloc(HFS_DISCARD_MAX_BATCH * sizeof(dk_extent_t));
+		if (hd->hd_batch)
+			hd->hd_batch_alloc = HFS_DISCARD_MAX_BATCH;
+	}
+}
+
+/*
+ * Queue freed allocation blocks to be unmapped, on devices that support it.
+ * The blocks must be free on disk, or at least in a committed transaction.
+ *
+ * With 'wait', a full queue waits for the thread to take a batch out of it
+ * rather than forgetting extents.  The thread takes no file system locks.
+ */
+void
+hfs_discard_add(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks, bool wait)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+	bool start_thread = false;
+
+	if (hd->hd_batch == NULL || numBlocks == 0)
+		return;
+
+	hfs_discard_prime(hd);
+
+	lck_mtx_lock(&hd->hd_lock);
+	while (wait && hd->hd_queue.fi_count >= hd->hd_queue.fi_limit && hd->hd_thread != NULL) {
+		wakeup(hd);
+		msleep(&hd->hd_queue, &hd->hd_lock.mtx, PRIBIO, "hfs_discard_full", 0);
+	}
+
+	if (hd->hd_queue.fi_count == 0)
+		hd->hd_queued_at = ticks;
+	(void) fe_add(&hd->hd_queue, startBlock, numBlocks);
+
+	if (hd->hd_thread == NULL) {
+		/* Claim it so no one else starts one; the thread sets the real value. */
+		hd->hd_thread = (void *)1;
+		start_thread = true;
+	} else if (hd->hd_queue.fi_count >= hfs_discard_batch_max())
+		wakeup(hd);
+	lck_mtx_unlock(&hd->hd_lock);
+
+	if (start_thread &&
+		kthread_add(&hfs_discard_thread, hfsmp, NULL, NULL, 0, 0, "hfs_discard") != 0) {
+		/* The queue waits for the next try */
+		lck_mtx_lock(&hd->hd_lock);
+		hd->hd_thread = NULL;
+		wakeup(&hd->hd_thread);
+		wakeup(&hd->hd_queue);
+		lck_mtx_unlock(&hd->hd_lock);
+	}
+}
+
+/*
+ * The blocks are being allocated: make sure they are not unmapped from now
+ * on.  Waits if they are in the batch being unmapped.
+ */
+void
+hfs_discard_remove(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+	u_int64_t offset, length;
+
+	if (hd->hd_batch == NULL || numBlocks == 0)
+		return;
+
+	/* A split needs a spare node; without one the head of the extent is dropped. */
+	hfs_discard_prime(hd);
+
+	offset = (u_int64_t) startBlock * hfsmp->blockSize + (u_int64_t) hfsmp->hfsPlusIOPosOffset;
+	length = (u_int64_t) numBlocks * hfsmp->blockSize;
+
+	lck_mtx_lock(&hd->hd_lock);
+	if (hd->hd_queue.fi_count)
+		(void) fe_remove(&hd->hd_queue, startBlock, numBlocks);
+	if (ISSET(hd->hd_flags, HD_BUSY) && hfs_discard_in_batch(hd, offset, length)) {
+		atomic_add_64(&hfs_discard_stats.waits, 1);
+		/* Once that batch is done, no later one can have these blocks */
+		do {
+			SET(hd->hd_flags, HD_WANTED);
+			msleep(&hd->hd_batch, &hd->hd_lock.mtx, PRIBIO, "hfs_discard_busy", 0);
+		} while (ISSET(hd->hd_flags, HD_BUSY) && hfs_discard_in_batch(hd, offset, length));
+	}
+	lck_mtx_unlock(&hd->hd_lock);
+}
+
+/*
+ * Unmap everything queued and stop the thread.  Called once nothing more
+ * will be freed for a while: on unmount, once the journal is closed, and on
+ * a downgrade to read-only.  Queueing more starts the thread again.
+ */
+void
+hfs_discard_stop(struct hfsmount *hfsmp)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+
+	lck_mtx_lock(&hd->hd_lock);
+	if (hd->hd_thread != NULL) {
+		SET(hd->hd_flags, HD_STOP);
+		wakeup(hd);
+		wakeup(&hd->hd_flags);
+		while (hd->hd_thread != NULL)
+			msleep(&hd->hd_thread, &hd->hd_lock.mtx, PRIBIO, "hfs_discard_stop", 0);
+		CLR(hd->hd_flags, HD_STOP);
+	}
+	lck_mtx_unlock(&hd->hd_lock);
+}
+
+void
+hfs_discard_destroy(struct hfsmount *hfsmp)
+{
+	struct hfs_discard *hd = &hfsmp->hfs_discard;
+
+	hfs_discard_stop(hfsmp);
+
+	fe_chunk_free(fe_destroy(&hd->hd_queue));
+	if (hd->hd_batch) {
+		hfs_free(hd->hd_batch, hd->hd_batch_alloc * sizeof(dk_extent_t));
+		hd->hd_batch = NULL;
+		hd->hd_batch_alloc = 0;
+	}
+	lck_mtx_destroy(&hd->hd_lock, hfs_mutex_group);
+}
@@ -0,0 +1,578 @@
+//
+//  hfs_freeext.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Free extent index.  See hfs_freeext.h.
+ *
+ * The two treaps share their nodes and their priorities; each is a valid
+ * treap on its own key, which is all the balancing argument needs.  Updates
+ * never change a node's key in place: the node is taken out of both trees,
+ * changed, and put back.
+ */
+
+#if HFS_ALLOC_TEST
+#include <stdlib.h>
+#include <strings.h>
+#else
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include "hfs.h"
+#endif
+
+#include "hfs_freeext.h"
+
+#define FE_CHUNK_NODES	64
+
+struct fe_chunk {
+	struct fe_chunk	*fc_next;
+	struct fe_node	fc_nodes[FE_CHUNK_NODES];
+};
+
+
+static inline u_int32_t
+fe_max(u_int32_t a, u_int32_t b)
+{
+	return a > b ? a : b;
+}
+
+static inline u_int32_t
+fe_min(u_int32_t a, u_int32_t b)
+{
+	return a < b ? a : b;
+}
+
+/* (count, start) ordering of the length tree */
+static inline int
+fe_len_less(u_int32_t count_a, u_int32_t start_a, const struct fe_node *b)
+{
+	return count_a < b->fe_count || (count_a == b->fe_count && start_a < b->fe_start);
+}
+
+
+// -- Offset tree --
+
+static inline void
+fe_off_update(struct fe_node *n)
+{
+	u_int32_t max = n->fe_count;
+
+	if (n->fe_off_left)
+		max = fe_max(max, n->fe_off_left->fe_max_count);
+	if (n->fe_off_right)
+		max = fe_max(max, n->fe_off_right->fe_max_count);
+	n->fe_max_count = max;
+}
+
+static struct fe_node *
+fe_off_insert(struct fe_node *t, struct fe_node *n)
+{
+	struct fe_node *c;
+
+	if (t == NULL) {
+		n->fe_off_left = n->fe_off_right = NULL;
+		n->fe_max_count = n->fe_count;
+		return n;
+	}
+
+	if (n->fe_start < t->fe_start) {
+		t->fe_off_left = fe_off_insert(t->fe_off_left, n);
+		if (t->fe_off_left->fe_priority > t->fe_priority) {
+			c = t->fe_off_left;
+			t->fe_off_left = c->fe_off_right;
+			c->fe_off_right = t;
+			fe_off_update(t);
+			t = c;
+		}
+	} else {
+		t->fe_off_right = fe_off_insert(t->fe_off_right, n);
+		if (t->fe_off_right->fe_priority > t->fe_priority) {
+			c = t->fe_off_right;
+			t->fe_off_right = c->fe_off_left;
+			c->fe_off_left = t;
+			fe_off_update(t);
+			t = c;
+		}
+	}
+	fe_off_update(t);
+
+	return t;
+}
+
+static struct fe_node *
+fe_off_merge(struct fe_node *a, struct fe_node *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	if (a->fe_priority > b->fe_priority) {
+		a->fe_off_right = fe_off_merge(a->fe_off_right, b);
+		fe_off_update(a);
+		return a;
+	}
+	b->fe_off_left = fe_off_merge(a, b->fe_off_left);
+	fe_off_update(b);
+	return b;
+}
+
+static struct fe_node *
+fe_off_delete(struct fe_node *t, struct fe_node *n)
+{
+	if (t == n)
+		return fe_off_merge(t->fe_off_left, t->fe_off_right);
+
+	if (n->fe_start < t->fe_start)
+		t->fe_off_left = fe_off_delete(t->fe_off_left, n);
+	else
+		t->fe_off_right = fe_off_delete(t->fe_off_right, n);
+	fe_off_update(t);
+
+	return t;
+}
+
+/* Last extent starting at or before 'block' */
+static struct fe_node *
+fe_off_floor(struct fe_node *t, u_int32_t block)
+{
+	struct fe_node *found = NULL;
+
+	while (t) {
+		if (t->fe_start <= block) {
+			found = t;
+			t = t->fe_off_right;
+		} else
+			t = t->fe_off_left;
+	}
+
+	return found;
+}
+
+/*
+ * First extent starting at or after 'block' with at least 'min_count'
+ * blocks.  Subtrees lying wholly at or after 'block' are only entered when
+ * their fe_max_count says the search will succeed there, so this visits
+ * O(depth) nodes.
+ */
+static struct fe_node *
+fe_off_first_fit(struct fe_node *t, u_int32_t block, u_int32_t min_count)
+{
+	struct fe_node *found;
+
+	while (t && t->fe_max_count >= min_count) {
+		if (t->fe_start < block) {
+			t = t->fe_off_right;
+			continue;
+		}
+		found = fe_off_first_fit(t->fe_off_left, block, min_count);
+		if (found)
+			return found;
+		if (t->fe_count >= min_count)
+			return t;
+		t = t->fe_off_right;
+	}
+
+	return NULL;
+}
+
+
+// -- Length tree --
+
+static struct fe_node *
+fe_len_insert(struct fe_node *t, struct fe_node *n)
+{
+	struct fe_node *c;
+
+	if (t == NULL) {
+		n->fe_len_left = n->fe_len_right = NULL;
+		return n;
+	}
+
+	if (fe_len_less(n->fe_count, n->fe_start, t)) {
+		t->fe_len_left = fe_len_insert(t->fe_len_left, n);
+		if (t->fe_len_left->fe_priority > t->fe_priority) {
+			c = t->fe_len_left;
+			t->fe_len_left = c->fe_len_right;
+			c->fe_len_right = t;
+			t = c;
+		}
+	} else {
+		t->fe_len_right = fe_len_insert(t->fe_len_right, n);
+		if (t->fe_len_right->fe_priority > t->fe_priority) {
+			c = t->fe_len_right;
+			t->fe_len_right = c->fe_len_left;
+			c->fe_len_left = t;
+			t = c;
+		}
+	}
+
+	return t;
+}
+
+static struct fe_node *
+fe_len_merge(struct fe_node *a, struct fe_node *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	if (a->fe_priority > b->fe_priority) {
+		a->fe_len_right = fe_len_merge(a->fe_len_right, b);
+		return a;
+	}
+	b->fe_len_left = fe_len_merge(a, b->fe_len_left);
+	return b;
+}
+
+static struct fe_node *
+fe_len_delete(struct fe_node *t, struct fe_node *n)
+{
+	if (t == n)
+		return fe_len_merge(t->fe_len_left, t->fe_len_right);
+
+	if (fe_len_less(n->fe_count, n->fe_start, t))
+		t->fe_len_left = fe_len_delete(t->fe_len_left, n);
+	else
+		t->fe_len_right = fe_len_delete(t->fe_len_right, n);
+
+	return t;
+}
+
+
+// -- Nodes --
+
+static struct fe_node *
+fe_node_get(struct fe_index *fi)
+{
+	struct fe_node *n = fi->fi_spare;
+
+	if (n == NULL)
+		return NULL;
+	fi->fi_spare = n->fe_off_right;
+	fi->fi_spare_count--;
+
+	/* xorshift32; any spread of priorities will do */
+	fi->fi_seed ^= fi->fi_seed << 13;
+	fi->fi_seed ^= fi->fi_seed >> 17;
+	fi->fi_seed ^= fi->fi_seed << 5;
+	n->fe_priority = fi->fi_seed;
+
+	return n;
+}
+
+static void
+fe_node_put(struct fe_index *fi, struct fe_node *n)
+{
+	n->fe_off_right = fi->fi_spare;
+	fi->fi_spare = n;
+	fi->fi_spare_count++;
+}
+
+static void
+fe_link(struct fe_index *fi, struct fe_node *n, u_int32_t start, u_int32_t count)
+{
+	n->fe_start = start;
+	n->fe_count = count;
+	fi->fi_off_root = fe_off_insert(fi->fi_off_root, n);
+	fi->fi_len_root = fe_len_insert(fi->fi_len_root, n);
+	fi->fi_count++;
+	fi->fi_blocks += count;
+}
+
+static void
+fe_unlink(struct fe_index *fi, struct fe_node *n)
+{
+	fi->fi_off_root = fe_off_delete(fi->fi_off_root, n);
+	fi->fi_len_root = fe_len_delete(fi->fi_len_root, n);
+	fi->fi_count--;
+	fi->fi_blocks -= n->fe_count;
+}
+
+static struct fe_node *
+fe_len_lowest(struct fe_node *t)
+{
+	if (t)
+		while (t->fe_len_left)
+			t = t->fe_len_left;
+	return t;
+}
+
+
+// -- Index --
+
+void
+fe_init(struct fe_index *fi, u_int32_t limit)
+{
+	bzero(fi, sizeof(*fi));
+	fi->fi_limit = limit;
+	fi->fi_seed = 0x2545F491;
+}
+
+/*
+ * Empty the index and detach its memory.  The chunks returned must be
+ * released with fe_chunk_free(), which may be done after dropping the lock.
+ */
+struct fe_chunk *
+fe_destroy(struct fe_index *fi)
+{
+	struct fe_chunk *chunks = fi->fi_chunks;
+
+	fe_init(fi, fi->fi_limit);
+
+	return chunks;
+}
+
+struct fe_chunk *
+fe_chunk_alloc(void)
+{
+#if HFS_ALLOC_TEST
+	return calloc(1, sizeof(struct fe_chunk));
+#else
+	return hfs_malloc_nowait(sizeof(struct fe_chunk));
+#endif
+}
+
+void
+fe_chunk_add(struct fe_index *fi, struct fe_chunk *chunk)
+{
+	int i;
+
+	chunk->fc_next = fi->fi_chunks;
+	fi->fi_chunks = chunk;
+	for (i = 0; i < FE_CHUNK_NODES; i++)
+		fe_node_put(fi, &chunk->fc_nodes[i]);
+}
+
+void
+fe_chunk_free(struct fe_chunk *chunks)
+{
+	struct fe_chunk *next;
+
+	for (; chunks; chunks = next) {
+		next = chunks->fc_next;
+#if HFS_ALLOC_TEST
+		free(chunks);
+#else
+		hfs_free(chunks, sizeof(struct fe_chunk));
+#endif
+	}
+}
+
+/*
+ * Add a free extent, merging it with any extent it overlaps or touches.
+ * Returns false if the merged extent could not be kept.
+ */
+bool
+fe_add(struct fe_index *fi, u_int32_t start, u_int32_t count)
+{
+	struct fe_node *n;
+	u_int32_t end = start + count;
+
+	if (count == 0)
+		return true;
+
+	/* Absorb the neighbours; only the last extent starting by 'end' can touch. */
+	while ((n = fe_off_floor(fi->fi_off_root, end)) != NULL &&
+		   n->fe_start + n->fe_count >= start) {
+		start = fe_min(start, n->fe_start);
+		end = fe_max(end, n->fe_start + n->fe_count);
+		fe_unlink(fi, n);
+		fe_node_put(fi, n);
+	}
+	count = end - start;
+
+	if (fi->fi_count >= fi->fi_limit) {
+		/* Full: keep the longer extents, as the old fixed-size cache did. */
+		fi->fi_complete = false;
+		n = fe_len_lowest(fi->fi_len_root);
+		if (n == NULL || n->fe_count >= count)
+			return false;
+		fe_unlink(fi, n);
+		fe_node_put(fi, n);
+	}
+
+	n = fe_node_get(fi);
+	if (n == NULL) {
+		fi->fi_complete = false;
+		return false;
+	}
+	fe_link(fi, n, start, count);
+
+	return true;
+}
+
+/*
+ * Remove the blocks [start, start + count) from the index, trimming or
+ * splitting the extents they overlap.  Returns the number of extents that
+ * were touched.
+ */
+u_int32_t
+fe_remove(struct fe_index *fi, u_int32_t start, u_int32_t count)
+{
+	struct fe_node *n;
+	u_int32_t end = start + count;
+	u_int32_t n_start, n_end;
+	u_int32_t touched = 0;
+
+	if (count == 0)
+		return 0;
+
+	while ((n = fe_off_floor(fi->fi_off_root, end - 1)) != NULL &&
+		   n->fe_start + n->fe_count > start) {
+		n_start = n->fe_start;
+		n_end = n_start + n->fe_count;
+		fe_unlink(fi, n);
+		touched++;
+
+		if (n_end > end) {
+			fe_link(fi, n, end, n_end - end);
+			n = NULL;
+		}
+		if (n_start < start) {
+			/* Nothing before this extent can overlap; keep its head and stop. */
+			if (n == NULL)
+				n = fe_node_get(fi);
+			if (n == NULL) {
+				fi->fi_complete = false;
+				break;
+			}
+			fe_link(fi, n, n_start, start - n_start);
+			break;
+		}
+		if (n)
+			fe_node_put(fi, n);
+	}
+
+	return touched;
+}
+
+/* Smallest extent with at least 'min_count' blocks (lowest start on ties) */
+bool
+fe_find_best(const struct fe_index *fi, u_int32_t min_count,
+			 u_int32_t *start, u_int32_t *count)
+{
+	struct fe_node *t = fi->fi_len_root;
+	struct fe_node *found = NULL;
+
+	while (t) {
+		if (t->fe_count >= min_count) {
+			found = t;
+			t = t->fe_len_left;
+		} else
+			t = t->fe_len_right;
+	}
+	if (found == NULL)
+		return false;
+
+	*start = found->fe_start;
+	*count = found->fe_count;
+	return true;
+}
+
+bool
+fe_find_largest(const struct fe_index *fi, u_int32_t *start, u_int32_t *count)
+{
+	struct fe_node *t = fi->fi_len_root;
+
+	if (t == NULL)
+		return false;
+	while (t->fe_len_right)
+		t = t->fe_len_right;
+
+	*start = t->fe_start;
+	*count = t->fe_count;
+	return true;
+}
+
+bool
+fe_find_lowest(const struct fe_index *fi, u_int32_t *start, u_int32_t *count)
+{
+	struct fe_node *t = fi->fi_off_root;
+
+	if (t == NULL)
+		return false;
+	while (t->fe_off_left)
+		t = t->fe_off_left;
+
+	*start = t->fe_start;
+	*count = t->fe_count;
+	return true;
+}
+
+/*
+ * Lowest run of at least 'min_count' free blocks lying within [lo, hi).
+ * On success, returns its start and the number of free blocks from there
+ * to the end of the extent or to 'hi', whichever comes first.
+ */
+bool
+fe_find_range(const struct fe_index *fi, u_int32_t lo, u_int32_t hi,
+			  u_int32_t min_count, u_int32_t *start, u_int32_t *count)
+{
+	struct fe_node *n;
+	u_int32_t n_end;
+
+	if (min_count == 0)
+		min_count = 1;
+	if (lo >= hi || hi - lo < min_count)
+		return false;
+
+	/* An extent straddling 'lo' is usable from 'lo' on. */
+	n = fe_off_floor(fi->fi_off_root, lo);
+	if (n && n->fe_start < lo) {
+		n_end = fe_min(n->fe_start + n->fe_count, hi);
+		if (n_end > lo && n_end - lo >= min_count) {
+			*start = lo;
+			*count = n_end - lo;
+			return true;
+		}
+	}
+
+	/*
+	 * Otherwise the first long enough extent at or after 'lo'.  If 'hi' cuts
+	 * it short, every later one is cut shorter still.
+	 */
+	n = fe_off_first_fit(fi->fi_off_root, lo, min_count);
+	if (n == NULL || n->fe_start >= hi)
+		return false;
+	n_end = fe_min(n->fe_start + n->fe_count, hi);
+	if (n_end - n->fe_start < min_count)
+		return false;
+
+	*start = n->fe_start;
+	*count = n_end - n->fe_start;
+	return true;
+}
+
+static int
+fe_iterate_node(const struct fe_node *t, fe_callback_t callback, void *arg)
+{
+	int error;
+
+	for (; t; t = t->fe_off_right) {
+		error = fe_iterate_node(t->fe_off_left, callback, arg);
+		if (error)
+			return error;
+		error = callback(arg, t->fe_start, t->fe_count);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+/*
+ * Call 'callback' for each extent in order of start block, stopping at the
+ * first non-zero return, which is passed back.
+ */
+int
+fe_iterate(const struct fe_index *fi, fe_callback_t callback, void *arg)
+{
+	return fe_iterate_node(fi->fi_off_root, callback, arg);
+}
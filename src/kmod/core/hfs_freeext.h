@@ -0,0 +1,84 @@
+//
+//  hfs_freeext.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_FREEEXT_H_
+#define _HFS_FREEEXT_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/*
+ * Index of known free extents, used by the allocator in place of a short
+ * list of the largest ones.
+ *
+ * Every extent is kept in two treaps: one ordered by start block, where each
+ * node also records the longest extent in its subtree, and one ordered by
+ * (length, start block).  The first answers "lowest extent at or after block
+ * N with at least M blocks", the second "smallest extent with at least M
+ * blocks"; both in O(log n).  Extents in the index never overlap or touch;
+ * adding an extent merges it with its neighbours.
+ *
+ * The index does no locking of its own, and it never allocates: nodes come
+ * from chunks handed to it with fe_chunk_add(), which the caller allocates
+ * before taking whatever lock protects the index.  When it runs out of nodes,
+ * or reaches its node limit, it forgets extents rather than failing, and
+ * stops claiming to be complete.
+ */
+
+struct fe_node {
+	struct fe_node	*fe_off_left;		/* ordered by fe_start */
+	struct fe_node	*fe_off_right;
+	struct fe_node	*fe_len_left;		/* ordered by (fe_count, fe_start) */
+	struct fe_node	*fe_len_right;
+	u_int32_t		fe_priority;
+	u_int32_t		fe_start;
+	u_int32_t		fe_count;
+	u_int32_t		fe_max_count;		/* largest fe_count under fe_off_* */
+};
+
+struct fe_chunk;
+
+struct fe_index {
+	struct fe_node	*fi_off_root;
+	struct fe_node	*fi_len_root;
+	struct fe_node	*fi_spare;			/* free nodes, linked by fe_off_right */
+	struct fe_chunk	*fi_chunks;
+	u_int32_t		fi_count;			/* extents in the index */
+	u_int32_t		fi_spare_count;
+	u_int32_t		fi_limit;			/* most extents to keep */
+	u_int32_t		fi_seed;			/* treap priority generator */
+	u_int64_t		fi_blocks;			/* blocks in the index */
+	bool			fi_complete;		/* holds every known free extent */
+};
+
+/* Keep at least this many spare nodes; an update uses at most two. */
+#define FE_SPARE_LOW	4
+
+__BEGIN_DECLS
+void fe_init(struct fe_index *fi, u_int32_t limit);
+struct fe_chunk *fe_destroy(struct fe_index *fi);
+
+struct fe_chunk *fe_chunk_alloc(void);
+void fe_chunk_add(struct fe_index *fi, struct fe_chunk *chunk);
+void fe_chunk_free(struct fe_chunk *chunks);
+
+bool fe_add(struct fe_index *fi, u_int32_t start, u_int32_t count);
+u_int32_t fe_remove(struct fe_index *fi, u_int32_t start, u_int32_t count);
+
+bool fe_find_best(const struct fe_index *fi, u_int32_t min_count,
+				  u_int32_t *start, u_int32_t *count);
+bool fe_find_largest(const struct fe_index *fi, u_int32_t *start, u_int32_t *count);
+bool fe_find_lowest(const struct fe_index *fi, u_int32_t *start, u_int32_t *count);
+bool fe_find_range(const struct fe_index *fi, u_int32_t lo, u_int32_t hi,
+				   u_int32_t min_count, u_int32_t *start, u_int32_t *count);
+
+typedef int (*fe_callback_t)(void *arg, u_int32_t start, u_int32_t count);
+int fe_iterate(const struct fe_index *fi, fe_callback_t callback, void *arg);
+__END_DECLS
+
+#endif /* ! _HFS_FREEEXT_H_ */
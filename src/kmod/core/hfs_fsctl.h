@@ -248,6 +248,51 @@ enum {
 	HFS_FSINFO_SYMLINK_SIZE			= 12,
 };
 
+/*
+ * HFSIOC_READDIRPLUS reads a directory's entries together with what stat(2)
+ * would return for each, from the catalog records it reads the names from.
+ *
+ * rdp_offset is a directory offset as getdirentries(2) uses it, except that
+ * "." and ".." are never returned, so 0 starts at the first entry; on return
+ * it is where the next call carries on from.  rdp_buf is filled with
+ * hfs_direntplus records, each dp_reclen bytes long and 8 byte aligned, and
+ * rdp_count and rdp_eof say how many there are and whether the directory has
+ * no more.  With HFS_RDP_PRIME, entries that are not in memory are given a
+ * vnode and a name cache entry, so a stat(2) or open(2) of them that follows
+ * finds them without going to the catalog.
+ */
+struct hfs_direntplus {
+	uint64_t	dp_fileid;		/* st_ino */
+	uint64_t	dp_size;		/* st_size */
+	uint64_t	dp_bytes;		/* bytes allocated to the data fork */
+	uint64_t	dp_rdev;		/* st_rdev */
+	int64_t		dp_atime;		/* seconds */
+	int64_t		dp_mtime;
+	int64_t		dp_ctime;
+	int64_t		dp_birthtime;
+	uint32_t	dp_nlink;
+	uint32_t	dp_uid;
+	uint32_t	dp_gid;
+	uint32_t	dp_flags;		/* st_flags */
+	uint16_t	dp_mode;		/* st_mode, with the file type */
+	uint16_t	dp_reclen;		/* length of this record */
+	uint16_t	dp_namlen;		/* not counting the NUL */
+	uint8_t		dp_type;		/* DT_ */
+	uint8_t		dp_pad;
+	char		dp_name[];		/* UTF-8, NUL terminated */
+};
+
+struct hfs_readdirplus {
+	uint64_t	rdp_offset;		/* in, out: where to start */
+	void		*rdp_buf;		/* buffer for hfs_direntplus records */
+	uint32_t	rdp_bufsize;
+	uint32_t	rdp_flags;		/* HFS_RDP_ */
+	uint32_t	rdp_count;		/* out: records returned */
+	uint32_t	rdp_eof;		/* out: no more entries */
+};
+
+#define HFS_RDP_PRIME	0x0001	/* bring the entries into memory */
+
 
 /* HFS FS CONTROL COMMANDS */
 
@@ -373,6 +418,9 @@ enum {
 
 #define HFSIOC_FORCE_ENABLE_DEFRAG _IOWR('H', 49, u_int32_t)
 
+/* Read a directory's entries with their attributes; see struct hfs_readdirplus */
+#define HFSIOC_READDIRPLUS _IOWR('H', 60, struct hfs_readdirplus)
+
 /*
  * IOCTLs used for filesystem write suspension.
  */
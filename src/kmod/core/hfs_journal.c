@@ -104,6 +104,8 @@ HFS_SYSCTL(INT, _vfs_generic_hfs_jnl_kdebug, OID_AUTO, trim, CTLFLAG_RW|CTLFLAG_
 #endif   /* KERNEL */
 
 #include "hfs_journal.h"
+#include "hfs_replay.h"
+#include "hfs_cksum.h"
 
 MALLOC_DEFINE(M_HFS_JOURNAL, "HFS Journal", "HFS Journal");
 
@@ -123,6 +125,56 @@ unsigned int jnl_trim_flush_limit = JOURNAL_FLUSH_TRIM_EXTENTS;
 
 HFS_SYSCTL(UINT, _vfs_generic_hfs_jnl, OID_AUTO, trim_flush, CTLFLAG_RW, &jnl_trim_flush_limit, 0, "number of trimmed extents to cause a journal flush")
 
+//
+// Concurrent journal_flush() callers (fsync) share one journal write and one
+// cache flush: whoever comes first waits up to jnl_group_commit_usec for
+// others to join, then flushes for all of them.  Callers arriving while that
+// flush is in progress form the next group.
+//
+#define JOURNAL_MAX_GROUP_COMMIT_USEC	100000
+
+unsigned int jnl_group_commit_usec = 0;
+
+HFS_SYSCTL(UINT, _vfs_generic_hfs_jnl, OID_AUTO, group_commit_usec, CTLFLAG_RW, &jnl_group_commit_usec, 0, "microseconds a journal flush waits for others to join it")
+
+//
+// New block list headers have CRC32C checksums for their blocks
+// (BLHDR_CRC32C_CHECKSUMS) when jnl_crc32c is set, and the old ones
+// otherwise.  Replay checks either.  It is off by default: macOS and older
+// versions of this driver don't know the flag and replay such blocks
+// without checking them, so only volumes that stay with this driver gain.
+//
+unsigned int jnl_crc32c = 0;
+
+HFS_SYSCTL(UINT, _vfs_generic_hfs_jnl, OID_AUTO, crc32c, CTLFLAG_RW, &jnl_crc32c, 0, "checksum journaled blocks with CRC32C")
+
+static inline int32_t
+jnl_block_cksum_flag(void)
+{
+	return jnl_crc32c ? BLHDR_CRC32C_CHECKSUMS : BLHDR_CHECK_CHECKSUMS;
+}
+
+//
+// Transactions per journal write is txns / flushes, bytes per journal write
+// is bytes / flushes.
+//
+static struct {
+	uint64_t	flushes;		// transactions written to the journal
+	uint64_t	txns;			// journal transactions grouped into them
+	uint64_t	bytes;			// bytes written to the journal
+	uint64_t	cache_syncs;	// DKIOCSYNCHRONIZE requests issued
+	uint64_t	group_flushes;	// journal_flush calls that flushed for a group
+	uint64_t	group_joined;	// journal_flush calls another caller flushed for
+} jnl_stats;
+
+HFS_SYSCTL(NODE, _vfs_generic_hfs_jnl, OID_AUTO, stats, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "Journal statistics")
+HFS_SYSCTL(U64, _vfs_generic_hfs_jnl_stats, OID_AUTO, flushes, CTLFLAG_RD, &jnl_stats.flushes, 0, "transactions written to the journal")
+HFS_SYSCTL(U64, _vfs_generic_hfs_jnl_stats, OID_AUTO, txns, CTLFLAG_RD, &jnl_stats.txns, 0, "journal transactions grouped into them")
+HFS_SYSCTL(U64, _vfs_generic_hfs_jnl_stats, OID_AUTO, bytes, CTLFLAG_RD, &jnl_stats.bytes, 0, "bytes written to the journal")
+HFS_SYSCTL(U64, _vfs_generic_hfs_jnl_stats, OID_AUTO, cache_syncs, CTLFLAG_RD, &jnl_stats.cache_syncs, 0, "cache flushes issued by the journal")
+HFS_SYSCTL(U64, _vfs_generic_hfs_jnl_stats, OID_AUTO, group_flushes, CTLFLAG_RD, &jnl_stats.group_flushes, 0, "journal flushes done for a group of callers")
+HFS_SYSCTL(U64, _vfs_generic_hfs_jnl_stats, OID_AUTO, group_joined, CTLFLAG_RD, &jnl_stats.group_joined, 0, "journal flushes shared with another caller")
+
 // number of bytes to checksum in a block_list_header
 // NOTE: this should be enough to clear out the header
 //       fields as well as the first entry of binfo[]
@@ -147,21 +199,10 @@ static __inline__ void  unlock_flush(journal *jnl);
 //
 // 3105942 - Coalesce writes to the same block on journal replay
 //
-
-typedef struct bucket {
-	off_t     block_num;
-	uint32_t  jnl_offset;
-	uint32_t  block_size;
-	int32_t   cksum;
-} bucket;
-
-#define STARTING_BUCKETS 256
-
-static int add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
-static int grow_table(struct bucket **buf_ptr, int num_buckets, int new_size);
-static int lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full);
-static int do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
-static int insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting);
+// The blocks to replay are collected in a jr_index (hfs_replay.h) and
+// written in block order, JOURNAL_REPLAY_MAX_IO bytes at a time at most.
+//
+#define JOURNAL_REPLAY_MAX_IO	MAXBSIZE
 
 #define CHECK_JOURNAL(jnl) \
 	do {		   \
@@ -217,25 +258,6 @@ static int insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, of
 
 
 
-//
-// this isn't a great checksum routine but it will do for now.
-// we use it to checksum the journal header and the block list
-// headers that are at the start of each transaction.
-//
-static unsigned int
-calc_checksum(const char *ptr, int len)
-{
-	int i;
-	unsigned int cksum=0;
-
-	// this is a lame checksum but for now it'll do
-	for(i = 0; i < len; i++, ptr++) {
-		cksum = (cksum << 8) ^ (cksum + *(unsigned char *)ptr);
-	}
-
-	return (~cksum);
-}
-
 //
 // Journal Locking
 //
@@ -499,6 +521,7 @@ write_journal_header(journal *jnl, int updating_start, uint32_t sequence_num)
 			jnl->flush_counter++;
 		}
 
+		atomic_add_64(&jnl_stats.cache_syncs, 1);
 		ret = VNOP_IOCTL(jnl->jdev, jnl->jcp, DKIOCSYNCHRONIZE, (caddr_t)&sync_request, 0);
 	}
 	if (ret != 0) {
@@ -524,7 +547,7 @@ write_journal_header(journal *jnl, int updating_start, uint32_t sequence_num)
 
 	jnl->jhdr->sequence_num = sequence_num;
 	jnl->jhdr->checksum = 0;
-	jnl->jhdr->checksum = calc_checksum((char *)jnl->jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+	jnl->jhdr->checksum = hfs_jnl_cksum((char *)jnl->jhdr, JOURNAL_HEADER_CKSUM_SIZE);
 
 	if (do_journal_io(jnl, &jhdr_offset, jnl->header_buf, jnl->jhdr->jhdr_size, JNL_WRITE|JNL_HEADER) != (size_t)jnl->jhdr->jhdr_size) {
 		printf("jnl: %s: write_journal_header: error writing the journal header!\n", jnl->jdev_name);
@@ -555,6 +578,7 @@ write_journal_header(journal *jnl, int updating_start, uint32_t sequence_num)
 			jnl->flush_counter++;
 		}
 
+		atomic_add_64(&jnl_stats.cache_syncs, 1);
 		VNOP_IOCTL(jnl->jdev, jnl->jcp, DKIOCSYNCHRONIZE, (caddr_t)&sync_request, 0);
 	}
 
@@ -889,285 +913,6 @@ update_fs_block(journal *jnl, void *block_ptr, off_t fs_block, size_t bsize)
 	return 0;
 }
 
-static int
-grow_table(struct bucket **buf_ptr, int num_buckets, int new_size)
-{
-	struct bucket *newBuf;
-	int current_size = num_buckets, i;
-    
-	// return if newsize is less than the current size
-	if (new_size < num_buckets) {
-		return current_size;
-	}
-    
-	newBuf = hfs_malloc(new_size*sizeof(struct bucket));
-
-	//  printf("jnl: lookup_bucket: expanded co_buf to %d elems\n", new_size);
-    
-	// copy existing elements 
-	bcopy(*buf_ptr, newBuf, num_buckets*sizeof(struct bucket));
-    
-	// initialize the new ones
-	for(i = num_buckets; i < new_size; i++) {
-		newBuf[i].block_num = (off_t)-1;
-	}
-    
-	// free the old container
-	hfs_free(*buf_ptr, num_buckets * sizeof(struct bucket));
-    
-	// reset the buf_ptr
-	*buf_ptr = newBuf;
-    
-	return new_size;
-}
-
-static int
-lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full)
-{
-	int lo, hi, index, matches, i;
-    
-	if (num_full == 0) {
-		return 0; // table is empty, so insert at index=0
-	}
-    
-	lo = 0;
-	hi = num_full - 1;
-	index = -1;
-    
-	// perform binary search for block_num
-	do {
-		int mid = (hi - lo)/2 + lo;
-		off_t this_num = (*buf_ptr)[mid].block_num;
-	
-		if (block_num == this_num) {
-			index = mid;
-			break;
-		}
-	
-		if (block_num < this_num) {
-			hi = mid;
-			continue;
-		}
-	
-		if (block_num > this_num) {
-			lo = mid + 1;
-			continue;
-		}
-	} while (lo < hi);
-    
-	// check if lo and hi converged on the match
-	if (block_num == (*buf_ptr)[hi].block_num) {
-		index = hi;
-	}
-    
-	// if no existing entry found, find index for new one
-	if (index == -1) {
-		index = (block_num < (*buf_ptr)[hi].block_num) ? hi : hi + 1;
-	} else {
-		// make sure that we return the right-most index in the case of multiple matches
-		matches = 0;
-		i = index + 1;
-		while (i < num_full && block_num == (*buf_ptr)[i].block_num) {
-			matches++;
-			i++;
-		}
-
-		index += matches;
-	}
-    
-	return index;
-}
-
-static int
-insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting)
-{
-	if (!overwriting) {
-		// grow the table if we're out of space - we may index the table
-		// with *num_full_ptr (lookup_bucket() can return a maximum value == 
-		// *num_full_ptr), so we need to grow when we hit (*num_buckets_ptr - 1) 
-		// to prevent out-of-bounds indexing 
-		if (*num_full_ptr >= (*num_buckets_ptr - 1)) {
-			int new_size = *num_buckets_ptr * 2;
-			int grow_size = grow_table(buf_ptr, *num_buckets_ptr, new_size);
-	    
-			if (grow_size < new_size) {
-				printf("jnl: %s: add_block: grow_table returned an error!\n", jnl->jdev_name);
-				return -1;
-			}
-	    
-			*num_buckets_ptr = grow_size; //update num_buckets to reflect the new size
-		}
-	
-		// if we're not inserting at the end, we need to bcopy
-		if (blk_index != *num_full_ptr) {
-			bcopy( (*buf_ptr)+(blk_index), (*buf_ptr)+(blk_index+1), (*num_full_ptr-blk_index)*sizeof(struct bucket) );
-		}
-	
-		(*num_full_ptr)++; // increment only if we're not overwriting
-	}
-
-	// sanity check the values we're about to add
-	if ((off_t)offset >= jnl->jhdr->size) {
-		offset = jnl->jhdr->jhdr_size + (offset - jnl->jhdr->size);
-	}
-	if (size <= 0) {
-		panic("jnl: insert_block: bad size in insert_block (%zd)\n", size);
-	}	 
-
-	(*buf_ptr)[blk_index].block_num = num;
-	(*buf_ptr)[blk_index].block_size = (uint32_t)size;
-	(*buf_ptr)[blk_index].jnl_offset = (uint32_t)offset;
-	(*buf_ptr)[blk_index].cksum = cksum;
-    
-	return blk_index;
-}
-
-static int
-do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
-{
-	int	num_to_remove, index, i, overwrite, err;
-	size_t	jhdr_size = jnl->jhdr->jhdr_size, new_offset;
-	off_t	overlap, block_start, block_end;
-
-	block_start = block_num*jhdr_size;
-	block_end = block_start + size;
-	overwrite = (block_num == (*buf_ptr)[blk_index].block_num && size >= (*buf_ptr)[blk_index].block_size);
-
-	// first, eliminate any overlap with the previous entry
-	if (blk_index != 0 && !overwrite) {
-		off_t prev_block_start = (*buf_ptr)[blk_index-1].block_num*jhdr_size;
-		off_t prev_block_end = prev_block_start + (*buf_ptr)[blk_index-1].block_size;
-		overlap = prev_block_end - block_start;
-		if (overlap > 0) {
-			if (overlap % jhdr_size != 0) {
-				panic("jnl: do_overlap: overlap with previous entry not a multiple of %zd\n", jhdr_size);
-			}
-
-			// if the previous entry completely overlaps this one, we need to break it into two pieces.
-			if (prev_block_end > block_end) {
-				off_t new_num = block_end / jhdr_size;
-				size_t new_size = prev_block_end - block_end;
-
-				new_offset = (*buf_ptr)[blk_index-1].jnl_offset + (block_end - prev_block_start);
-		
-				err = insert_block(jnl, buf_ptr, blk_index, new_num, new_size, new_offset, cksum, num_buckets_ptr, num_full_ptr, 0);
-				if (err < 0) {
-					panic("jnl: do_overlap: error inserting during pre-overlap\n");
-				}
-			}
-	    
-			// Regardless, we need to truncate the previous entry to the beginning of the overlap
-			(*buf_ptr)[blk_index-1].block_size = (uint32_t)(block_start - prev_block_start);
-			(*buf_ptr)[blk_index-1].cksum = 0;   // have to blow it away because there's no way to check it
-		}
-	}
-
-	// then, bail out fast if there's no overlap with the entries that follow
-	if (!overwrite && block_end <= (off_t)((*buf_ptr)[blk_index].block_num*jhdr_size)) {
-		return 0; // no overlap, no overwrite
-	} else if (overwrite && (blk_index + 1 >= *num_full_ptr || block_end <= (off_t)((*buf_ptr)[blk_index+1].block_num*jhdr_size))) {
-
-		(*buf_ptr)[blk_index].cksum = cksum;   // update this
-		return 1; // simple overwrite
-	}
-    
-	// Otherwise, find all cases of total and partial overlap. We use the special
-	// block_num of -2 to designate entries that are completely overlapped and must
-	// be eliminated. The block_num, size, and jnl_offset of partially overlapped
-	// entries must be adjusted to keep the array consistent.
-	index = blk_index;
-	num_to_remove = 0;
-	while (index < *num_full_ptr && block_end > (off_t)((*buf_ptr)[index].block_num*jhdr_size)) {
-		if (block_end >= (off_t)(((*buf_ptr)[index].block_num*jhdr_size + (*buf_ptr)[index].block_size))) {
-			(*buf_ptr)[index].block_num = -2; // mark this for deletion
-			num_to_remove++;
-		} else {
-			overlap = block_end - (*buf_ptr)[index].block_num*jhdr_size;
-			if (overlap > 0) {
-				if (overlap % jhdr_size != 0) {
-					panic("jnl: do_overlap: overlap of %ld is not multiple of %zd\n", overlap, jhdr_size);
-				}
-				
-				// if we partially overlap this entry, adjust its block number, jnl offset, and size
-				(*buf_ptr)[index].block_num += (overlap / jhdr_size); // make sure overlap is multiple of jhdr_size, or round up
-				(*buf_ptr)[index].cksum = 0;
-		
-				new_offset = (*buf_ptr)[index].jnl_offset + overlap; // check for wrap-around
-				if ((off_t)new_offset >= jnl->jhdr->size) {
-					new_offset = jhdr_size + (new_offset - jnl->jhdr->size);
-				}
-				(*buf_ptr)[index].jnl_offset = (uint32_t)new_offset;
-		
-				(*buf_ptr)[index].block_size -= overlap; // sanity check for negative value
-				if ((*buf_ptr)[index].block_size <= 0) {
-					panic("jnl: do_overlap: after overlap, new block size is invalid (%u)\n", (*buf_ptr)[index].block_size);
-					// return -1; // if above panic is removed, return -1 for error
-				}
-			}
-			
-		}
-
-		index++;
-	}
-
-	// bcopy over any completely overlapped entries, starting at the right (where the above loop broke out)
-	index--; // start with the last index used within the above loop
-	while (index >= blk_index) {
-		if ((*buf_ptr)[index].block_num == -2) {
-			if (index == *num_full_ptr-1) {
-				(*buf_ptr)[index].block_num = -1; // it's the last item in the table... just mark as free
-			} else {
-				bcopy( (*buf_ptr)+(index+1), (*buf_ptr)+(index), (*num_full_ptr - (index + 1)) * sizeof(struct bucket) );
-			}
-			(*num_full_ptr)--;
-		}
-		index--;
-	}
-
-	// eliminate any stale entries at the end of the table
-	for(i = *num_full_ptr; i < (*num_full_ptr + num_to_remove); i++) {
-		(*buf_ptr)[i].block_num = -1;
-	}
-    
-	return 0; // if we got this far, we need to insert the entry into the table (rather than overwrite) 
-}
-
-// PR-3105942: Coalesce writes to the same block in journal replay
-// We coalesce writes by maintaining a dynamic sorted array of physical disk blocks
-// to be replayed and the corresponding location in the journal which contains
-// the most recent data for those blocks. The array is "played" once the all the
-// blocks in the journal have been coalesced. The code for the case of conflicting/
-// overlapping writes to a single block is the most dense. Because coalescing can
-// disrupt the existing time-ordering of blocks in the journal playback, care
-// is taken to catch any overlaps and keep the array consistent. 
-static int
-add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
-{
-	int	blk_index, overwriting;
-    
-	// on return from lookup_bucket(), blk_index is the index into the table where block_num should be
-	// inserted (or the index of the elem to overwrite). 
-	blk_index = lookup_bucket( buf_ptr, block_num, *num_full_ptr);
-    
-	// check if the index is within bounds (if we're adding this block to the end of
-	// the table, blk_index will be equal to num_full)
-	if (blk_index < 0 || blk_index > *num_full_ptr) {
-		//printf("jnl: add_block: trouble adding block to co_buf\n");
-		return -1;
-	} // else printf("jnl: add_block: adding block 0x%llx at i=%d\n", block_num, blk_index);
-    
-	// Determine whether we're overwriting an existing entry by checking for overlap
-	overwriting = do_overlap(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr);
-	if (overwriting < 0) {
-		return -1; // if we got an error, pass it along
-	}
-        
-	// returns the index, or -1 on error
-	blk_index = insert_block(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr, overwriting);
-    
-	return blk_index;
-}
-
 static int
 replay_journal(journal *jnl)
 {
@@ -1178,8 +923,10 @@ replay_journal(journal *jnl)
 	block_list_header *blhdr;
 	off_t		offset, txn_start_offset=0, blhdr_offset, orig_jnl_start;
 	char		*buff, *block_ptr=NULL;
-	struct bucket	*co_buf;
-	int		num_buckets = STARTING_BUCKETS, num_full, check_past_jnl_end = 1, in_uncharted_territory=0;
+	struct jr_index	ji;
+	int		check_past_jnl_end = 1, in_uncharted_territory=0;
+	u_int32_t	next, j, k, writes = 0;
+	int		error;
 	uint32_t	last_sequence_num = 0;
 	int 		replay_retry_count = 0;
     
@@ -1200,16 +947,15 @@ replay_journal(journal *jnl)
 	// allocate memory for the header_block.  we'll read each blhdr into this
 	buff = hfs_malloc(jnl->jhdr->blhdr_size);
 
-	// allocate memory for the coalesce buffer
-	co_buf = hfs_malloc(num_buckets*sizeof(struct bucket));
+	// set up the index of blocks to replay
+	if (jr_init(&ji, jnl->jhdr->jhdr_size, jnl->jhdr->size) != 0) {
+		hfs_free(buff, jnl->jhdr->blhdr_size);
+		return -1;
+	}
 
 restart_replay:
 
-	// initialize entries
-	for(i = 0; i < num_buckets; i++) {
-		co_buf[i].block_num = -1;
-	}
-	num_full = 0; // empty at first
+	jr_reset(&ji);
 
 
 	printf("jnl: %s: replay_journal: from: %ld to: %ld (joffset 0x%lx)\n",
@@ -1232,10 +978,10 @@ restart_replay:
 			// calculate the checksum based on the unswapped data
 			// because it is done byte-at-a-time.
 			orig_checksum = (unsigned int)SWAP32(orig_checksum);
-			checksum = calc_checksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
+			checksum = hfs_jnl_cksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
 			swap_block_list_header(jnl, blhdr);
 		} else {
-			checksum = calc_checksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
+			checksum = hfs_jnl_cksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
 		}
 
 
@@ -1324,7 +1070,7 @@ restart_replay:
 			}
 		}
 
-		if (blhdr->flags & BLHDR_CHECK_CHECKSUMS) {
+		if (blhdr->flags & (BLHDR_CHECK_CHECKSUMS | BLHDR_CRC32C_CHECKSUMS)) {
 			check_block_checksums = 1;
 			block_ptr = hfs_malloc(max_bsize);
 		} else {
@@ -1335,7 +1081,7 @@ restart_replay:
 			txn_start_offset = blhdr_offset;
 		}
 
-		//printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to co_buf\n", 
+		//printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to the index\n", 
 		//       blhdr->num_blocks-1, jnl->jhdr->start);
 		bad_blocks = 0;
 		for (i = 1; i < blhdr->num_blocks; i++) {
@@ -1364,7 +1110,7 @@ restart_replay:
 						goto bad_txn_handling;
 					}
 				
-					disk_cksum = calc_checksum(block_ptr, size);
+					disk_cksum = hfs_jnl_block_cksum(block_ptr, size, blhdr->flags & BLHDR_CRC32C_CHECKSUMS);
 
 					// there is no need to swap the checksum from disk because
 					// it got swapped when the blhdr was read in.
@@ -1381,14 +1127,14 @@ restart_replay:
 				}
 
 
-				// add this bucket to co_buf, coalescing where possible
+				// add this block to the index; a newer copy replaces an older one
 				// printf("jnl: replay_journal: adding block 0x%llx\n", number);
-				ret_val = add_block(jnl, &co_buf, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum, &num_buckets, &num_full);
+				ret_val = jr_add(&ji, number, size, offset, blhdr->binfo[i].u.bi.b.cksum);
 			    
-				if (ret_val == -1) {
-					printf("jnl: %s: replay_journal: trouble adding block to co_buf\n", jnl->jdev_name);
+				if (ret_val != 0) {
+					printf("jnl: %s: replay_journal: trouble adding block to the replay index (%d)\n", jnl->jdev_name, ret_val);
 					goto bad_replay;
-				} // else printf("jnl: replay_journal: added block 0x%llx at i=%d\n", number);
+				}
 			}
 			
 			// increment offset
@@ -1453,19 +1199,22 @@ restart_replay:
 		jnl->jhdr->end = jnl->jhdr->start;
 	}
 
-	//printf("jnl: replay_journal: replaying %d blocks\n", num_full);
+	// resolve overlapping writes and sort what is left by block number
+	error = jr_finish(&ji);
+	if (error != 0) {
+		printf("jnl: %s: replay_journal: could not sort the blocks to replay (%d)\n", jnl->jdev_name, error);
+		goto bad_replay;
+	}
+
+	//printf("jnl: replay_journal: replaying %d blocks\n", ji.ji_count);
     
 	/*
-	 * make sure it's at least one page in size, so
-	 * start max_bsize at PAGE_SIZE
+	 * make sure it's big enough for the largest write we put together,
+	 * so start max_bsize at JOURNAL_REPLAY_MAX_IO
 	 */
-	for (i = 0, max_bsize = PAGE_SIZE; i < num_full; i++) {
-
-		if (co_buf[i].block_num == (off_t)-1)
-			continue;
-
-		if (co_buf[i].block_size > max_bsize)
-			max_bsize = co_buf[i].block_size;
+	for (j = 0, max_bsize = MAX(PAGE_SIZE, JOURNAL_REPLAY_MAX_IO); j < ji.ji_count; j++) {
+		if (ji.ji_entries[j].je_size > max_bsize)
+			max_bsize = ji.ji_entries[j].je_size;
 	}
 	/*
 	 * round max_bsize up to the nearest PAGE_SIZE multiple
@@ -1476,31 +1225,38 @@ restart_replay:
 
 	block_ptr = hfs_malloc(max_bsize);
 	
-	// Replay the coalesced entries in the co-buf
-	for(i = 0; i < num_full; i++) {
-		size_t size = co_buf[i].block_size;
-		off_t jnl_offset = (off_t) co_buf[i].jnl_offset;
-		off_t number = co_buf[i].block_num;
-	
-	
-		// printf("replaying co_buf[%d]: block 0x%llx, size 0x%x, jnl_offset 0x%llx\n", i, co_buf[i].block_num,
-		//      co_buf[i].block_size, co_buf[i].jnl_offset);
-	
-		if (number == (off_t)-1) {
-			// printf("jnl: replay_journal: skipping killed fs block\n");
-		} else {
-	    
-			// do journal read, and set the phys. block 
-			ret = read_journal_data(jnl, &jnl_offset, block_ptr, size);
+	// Replay the blocks in block order, putting runs of adjacent blocks
+	// together into one write
+	for (j = 0; j < ji.ji_count; j = next) {
+		size_t run = ji.ji_entries[j].je_size;
+		size_t buf_offset = 0;
+
+		for (next = j + 1; next < ji.ji_count && jr_adjacent(&ji, next)
+			 && run + ji.ji_entries[next].je_size <= JOURNAL_REPLAY_MAX_IO; next++) {
+			run += ji.ji_entries[next].je_size;
+		}
+
+		// read the run from the journal, again as few reads as will do
+		for (k = j; k < next; ) {
+			off_t jnl_offset = ji.ji_entries[k].je_jnl_offset;
+			size_t size = ji.ji_entries[k].je_size;
+
+			for (k++; k < next && ji.ji_entries[k].je_jnl_offset == jnl_offset + size; k++) {
+				size += ji.ji_entries[k].je_size;
+			}
+
+			ret = read_journal_data(jnl, &jnl_offset, block_ptr + buf_offset, size);
 			if (ret != size) {
 				printf("jnl: %s: replay_journal: Could not read journal entry data @ offset 0x%lx!\n", jnl->jdev_name, jnl_offset);
 				goto bad_replay;
 			}
-	    	    
-			if (update_fs_block(jnl, block_ptr, number, size) != 0) {
-				goto bad_replay;
-			}
+			buf_offset += size;
 		}
+
+		if (update_fs_block(jnl, block_ptr, ji.ji_entries[j].je_block, run) != 0) {
+			goto bad_replay;
+		}
+		writes++;
 	}
     
 	
@@ -1509,7 +1265,7 @@ restart_replay:
 		goto bad_replay;
 	}
 
-	printf("jnl: %s: journal replay done.\n", jnl->jdev_name);
+	printf("jnl: %s: journal replay done (%u blocks in %u writes).\n", jnl->jdev_name, ji.ji_count, writes);
     
 	// free block_ptr
 	if (block_ptr) {
@@ -1517,16 +1273,15 @@ restart_replay:
 		block_ptr = NULL;
 	}
     
-	// free the coalesce buffer
-	hfs_free(co_buf, num_buckets*sizeof(struct bucket));
-	co_buf = NULL;
+	// free the replay index
+	jr_destroy(&ji);
   
 	hfs_free(buff, jnl->jhdr->blhdr_size);
 	return 0;
 
 bad_replay:
 	hfs_free(block_ptr, max_bsize);
-	hfs_free(co_buf, num_buckets*sizeof(struct bucket));
+	jr_destroy(&ji);
 	hfs_free(buff, jnl->jhdr->blhdr_size);
 
 	return -1;
@@ -1967,11 +1722,11 @@ journal_open(struct vnode *jvp,
 	if (jnl->jhdr->magic == SWAP32(JOURNAL_HEADER_MAGIC)) {
 		// do this before the swap since it's done byte-at-a-time
 		orig_checksum = SWAP32(orig_checksum);
-		checksum = calc_checksum((char *)jnl->jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+		checksum = hfs_jnl_cksum((char *)jnl->jhdr, JOURNAL_HEADER_CKSUM_SIZE);
 		swap_journal_header(jnl);
 		jnl->flags |= JOURNAL_NEED_SWAP;
 	} else {
-		checksum = calc_checksum((char *)jnl->jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+		checksum = hfs_jnl_cksum((char *)jnl->jhdr, JOURNAL_HEADER_CKSUM_SIZE);
 	}
 
 	if (jnl->jhdr->magic != JOURNAL_HEADER_MAGIC && jnl->jhdr->magic != OLD_JOURNAL_HEADER_MAGIC) {
@@ -2208,11 +1963,11 @@ journal_is_clean(struct vnode *jvp,
 	if (jnl.jhdr->magic == SWAP32(JOURNAL_HEADER_MAGIC)) {
 		// do this before the swap since it's done byte-at-a-time
 		orig_checksum = SWAP32(orig_checksum);
-		checksum = calc_checksum((char *)jnl.jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+		checksum = hfs_jnl_cksum((char *)jnl.jhdr, JOURNAL_HEADER_CKSUM_SIZE);
 		swap_journal_header(&jnl);
 		jnl.flags |= JOURNAL_NEED_SWAP;
 	} else {
-		checksum = calc_checksum((char *)jnl.jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+		checksum = hfs_jnl_cksum((char *)jnl.jhdr, JOURNAL_HEADER_CKSUM_SIZE);
 	}
 
 	if (jnl.jhdr->magic != JOURNAL_HEADER_MAGIC && jnl.jhdr->magic != OLD_JOURNAL_HEADER_MAGIC) {
@@ -2553,7 +2308,7 @@ journal_allocate_transaction(journal *jnl)
 	tr->blhdr->max_blocks = (jnl->jhdr->blhdr_size / sizeof(block_info)) - 1;
 	tr->blhdr->num_blocks = 1;      // accounts for this header block
 	tr->blhdr->bytes_used = jnl->jhdr->blhdr_size;
-	tr->blhdr->flags = BLHDR_CHECK_CHECKSUMS | BLHDR_FIRST_HEADER;
+	tr->blhdr->flags = jnl_block_cksum_flag() | BLHDR_FIRST_HEADER;
 
 	tr->sequence_num = ++jnl->sequence_num;
 	tr->num_blhdrs  = 1;
@@ -2909,7 +2664,7 @@ journal_modify_block_end(journal *jnl, struct buf *bp, void (*func)(struct buf *
 		nblhdr->max_blocks = (jnl->jhdr->blhdr_size / sizeof(block_info)) - 1;
 		nblhdr->num_blocks = 1;      // accounts for this header block
 		nblhdr->bytes_used = jnl->jhdr->blhdr_size;
-		nblhdr->flags = BLHDR_CHECK_CHECKSUMS;
+		nblhdr->flags = jnl_block_cksum_flag();
 	    
 		tr->num_blhdrs++;
 		tr->total_bytes += jnl->jhdr->blhdr_size;
@@ -3091,6 +2846,32 @@ journal_trim_set_callback(journal *jnl, jnl_trim_callback_t callback, void *arg)
 	jnl->trim_callback_arg = arg;
 }
 
+/*
+;________________________________________________________________________________
+;
+; Routine:		journal_trim_set_unmap
+;
+; Function:		Choose whether the journal issues the DKIOCUNMAP for the extents
+;				freed by a transaction itself, once the transaction is in the
+;				on-disk journal (the default), or only hands them to the trim
+;				callback, which then owns unmapping them.  HFS queues them for
+;				its discard thread, so that finishing a transaction does not
+;				wait for the device to unmap them.
+;
+; Input Arguments:
+;	jnl			- The journal structure for the filesystem.
+;	unmap		- TRUE if the journal should issue the DKIOCUNMAP.
+;________________________________________________________________________________
+*/
+void
+journal_trim_set_unmap(journal *jnl, boolean_t unmap)
+{
+	if (unmap)
+		jnl->flags &= ~JOURNAL_TRIM_NO_UNMAP;
+	else
+		jnl->flags |= JOURNAL_TRIM_NO_UNMAP;
+}
+
 
 /*
 ;________________________________________________________________________________
@@ -3702,7 +3483,7 @@ journal_trim_flush(journal *jnl, transaction *tr)
 		dk_unmap_t unmap;
 				
 		bzero(&unmap, sizeof(unmap));
-		if (jnl->flags & JOURNAL_USE_UNMAP) {
+		if ((jnl->flags & (JOURNAL_USE_UNMAP | JOURNAL_TRIM_NO_UNMAP)) == JOURNAL_USE_UNMAP) {
 			unmap.extents = tr->trim.extents;
 			unmap.extentsCount = tr->trim.extent_count;
 			if (jnl_kdebug)
@@ -3865,6 +3646,10 @@ end_transaction(transaction *tr, int force_it, int (*callback)(void*), void *cal
 
 	KERNEL_DEBUG(0xbbbbc018|DBG_FUNC_START, jnl, tr, drop_lock, must_wait, 0);
 
+	atomic_add_64(&jnl_stats.flushes, 1);
+	atomic_add_64(&jnl_stats.txns, tr->num_txns);
+	atomic_add_64(&jnl_stats.bytes, tr->total_bytes);
+
 	lock_condition(jnl, &jnl->flushing, "end_transaction");
 
 	/*
@@ -4161,7 +3946,7 @@ finish_end_transaction(transaction *tr, int (*callback)(void*), void *callback_a
 		blhdr->binfo[0].u.bi.b.sequence_num = tr->sequence_num;
 
 		blhdr->checksum = 0;
-		blhdr->checksum = calc_checksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
+		blhdr->checksum = hfs_jnl_cksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
 
 		bparray = hfs_malloc(blhdr->num_blocks * sizeof(struct buf *));
 		tbuffer_offset = jnl->jhdr->blhdr_size;
@@ -4240,7 +4025,8 @@ finish_end_transaction(transaction *tr, int (*callback)(void*), void *callback_a
 				bparray[i] = bp;
 				bsize = (int) bp->b_bufsize;
 				blhdr->binfo[i].u.bi.bsize = bsize;
-				blhdr->binfo[i].u.bi.b.cksum = calc_checksum(&((char *)blhdr)[tbuffer_offset], bsize);
+				blhdr->binfo[i].u.bi.b.cksum = hfs_jnl_block_cksum(&((char *)blhdr)[tbuffer_offset], bsize,
+						blhdr->flags & BLHDR_CRC32C_CHECKSUMS);
 			} else {
 				bparray[i] = NULL;
 				bsize = blhdr->binfo[i].u.bi.bsize;
@@ -4629,6 +4415,7 @@ journal_end_transaction(journal *jnl)
 
 	tr = jnl->active_tr;
 	CHECK_TRANSACTION(tr);
+	tr->num_txns++;
 
 	// clear this out here so that when check_free_space() calls
 	// the FS flush function, we don't panic in journal_flush()
@@ -4680,8 +4467,8 @@ journal_end_transaction(journal *jnl)
  *  	sufficient for file system data integrity as it 
  *  	guarantees consistent journal content on the disk.
  */
-int
-journal_flush(journal *jnl, journal_flush_options_t options)
+static int
+journal_flush_now(journal *jnl, journal_flush_options_t options)
 {
 	boolean_t drop_lock = FALSE;
 	int error = 0;
@@ -4749,12 +4536,16 @@ journal_flush(journal *jnl, journal_flush_options_t options)
 		};
 
 		// We need a full cache flush. If it has not been done, do it here.
-		if (flush_count == jnl->flush_counter)
+		if (flush_count == jnl->flush_counter) {
+			atomic_add_64(&jnl_stats.cache_syncs, 1);
 			error = VNOP_IOCTL(jnl->jdev, jnl->jcp, DKIOCSYNCHRONIZE, (caddr_t)&sync_request, 0);
+		}
 
 		// If external journal partition is enabled, flush filesystem data partition.
-		if (jnl->jdev != jnl->fsdev)
+		if (jnl->jdev != jnl->fsdev) {
+			atomic_add_64(&jnl_stats.cache_syncs, 1);
 			error = VNOP_IOCTL(jnl->fsdev, jnl->jcp, DKIOCSYNCHRONIZE, (caddr_t)&sync_request, 0);
+		}
 
 	}
 
@@ -4763,6 +4554,71 @@ journal_flush(journal *jnl, journal_flush_options_t options)
 	return 0;
 }
 
+/*
+ * Group commit for journal_flush: callers that arrive while a flush is being
+ * gathered or written share one.  The first caller of a group (the leader)
+ * waits jnl_group_commit_usec for others to join, closes the group, and
+ * flushes with the options every member asked for.  Since each member had
+ * ended its transactions before it joined, the one flush covers them all.
+ * Callers that join after the group is closed wait for the leader to finish
+ * and then form the next group.
+ *
+ * Callers that own the journal (they are inside a transaction) and those
+ * that want to wait for the metadata I/O as well flush on their own.
+ */
+int
+journal_flush(journal *jnl, journal_flush_options_t options)
+{
+	uint32_t group;
+	unsigned int usec;
+	int error;
+
+	CHECK_JOURNAL(jnl);
+
+	if (ISSET(options, JOURNAL_WAIT_FOR_IO)
+		|| jnl->owner == curthread
+		|| (jnl->flags & JOURNAL_NO_GROUP_COMMIT)) {
+		return journal_flush_now(jnl, options);
+	}
+
+	lock_flush(jnl);
+	group = jnl->gc_seq;
+	jnl->gc_options |= options;
+	while (jnl->gc_leader && (int32_t)(jnl->gc_done - group) <= 0)
+		msleep(&jnl->gc_done, &jnl->flock.mtx, PRIBIO, "jnl_group", 0);
+	if ((int32_t)(jnl->gc_done - group) > 0) {
+		/* Our group has been flushed by its leader */
+		error = jnl->gc_error;
+		unlock_flush(jnl);
+		atomic_add_64(&jnl_stats.group_joined, 1);
+		return error;
+	}
+	jnl->gc_leader = TRUE;
+	unlock_flush(jnl);
+
+	usec = MIN(jnl_group_commit_usec, JOURNAL_MAX_GROUP_COMMIT_USEC);
+	if (usec && jnl->cur_tr)
+		pause_sbt("jnl_group", ustosbt(usec), 0, 0);
+
+	lock_flush(jnl);
+	options = jnl->gc_options;
+	jnl->gc_options = 0;
+	jnl->gc_seq++;
+	unlock_flush(jnl);
+
+	error = journal_flush_now(jnl, options);
+	atomic_add_64(&jnl_stats.group_flushes, 1);
+
+	lock_flush(jnl);
+	jnl->gc_error = error;
+	jnl->gc_done = group + 1;
+	jnl->gc_leader = FALSE;
+	wakeup(&jnl->gc_done);
+	unlock_flush(jnl);
+
+	return error;
+}
+
 int
 journal_active(journal *jnl)
 {
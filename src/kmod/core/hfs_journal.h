@@ -71,6 +71,7 @@ typedef struct block_list_header {
 
 #define BLHDR_CHECK_CHECKSUMS   0x0001
 #define BLHDR_FIRST_HEADER      0x0002
+#define BLHDR_CRC32C_CHECKSUMS  0x0004      // like BLHDR_CHECK_CHECKSUMS, but CRC32C
 
 
 struct journal;
@@ -99,6 +100,7 @@ typedef struct transaction {
 	struct jnl_trim_list trim;
     boolean_t		delayed_header_write;
 	boolean_t       flush_on_completion; //flush transaction immediately upon txn end.
+    int32_t             num_txns;      // how many journal transactions were grouped into it
 } transaction;
 
 
@@ -188,6 +190,13 @@ typedef struct journal {
 
     int                 last_flush_err;    // last error from flushing the cache
     uint32_t            flush_counter;     // a monotonically increasing value assigned on track cache flush
+
+    // group commit of journal_flush() callers, protected by flock
+    uint32_t            gc_seq;            // group that new callers join
+    uint32_t            gc_done;           // groups flushed so far
+    boolean_t           gc_leader;         // a caller is flushing for its group
+    int32_t             gc_options;        // journal_flush options wanted by the group
+    int                 gc_error;          // result of the last group flush
 } journal;
 
 /* internal-only journal flags (top 16 bits) */
@@ -198,6 +207,7 @@ typedef struct journal {
 #define JOURNAL_DO_FUA_WRITES     0x00100000   // do force-unit-access writes
 #define JOURNAL_USE_UNMAP         0x00200000   // device supports UNMAP (TRIM)
 #define JOURNAL_FEATURE_BARRIER   0x00400000   // device supports barrier-only flush
+#define JOURNAL_TRIM_NO_UNMAP     0x00800000   // the trim callback does the UNMAP, not us
 
 
 /* journal_open/create options are always in the low-16 bits */
@@ -331,7 +341,8 @@ void      journal_close(journal *journalp);
  * journal_trim_add_extent() marks a range of bytes on the device which should
  * be trimmed (invalidated, unmapped).  journal_trim_remove_extent() marks a
  * range of bytes which should no longer be trimmed.  Accumulated extents
- * will be trimmed when the transaction is flushed to the on-disk journal.
+ * will be trimmed when the transaction is flushed to the on-disk journal,
+ * unless journal_trim_set_unmap() has left that to the trim callback.
  */
 int   journal_start_transaction(journal *jnl);
 int   journal_modify_block_start(journal *jnl, struct buf *bp);
@@ -341,6 +352,7 @@ int   journal_kill_block(journal *jnl, struct buf *bp);
 int   journal_trim_add_extent(journal *jnl, uint64_t offset, uint64_t length);
 int   journal_trim_remove_extent(journal *jnl, uint64_t offset, uint64_t length);
 void  journal_trim_set_callback(journal *jnl, jnl_trim_callback_t callback, void *arg);
+void  journal_trim_set_unmap(journal *jnl, boolean_t unmap);
 int   journal_trim_extent_overlap (journal *jnl, uint64_t offset, uint64_t length, uint64_t *end);
 /* Mark state in the journal that requests an immediate journal flush upon txn completion */
 int   journal_request_immediate_flush (journal *jnl);
@@ -217,11 +217,18 @@ hfs_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, int
 		cndesc.cd_parentcnid = dcp->c_fileid;
 		cndesc.cd_hint = dcp->c_childhint;
 
-		lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+		/*
+		 * Try the catalog without its lock first, so as not to wait for
+		 * writers busy elsewhere in it.
+		 */
+		retval = cat_lookup_unlocked(hfsmp, &cndesc, force_casesensitive_lookup, &desc, &attr, &fork);
+		if (retval == EAGAIN) {
+			lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
 
-		retval = cat_lookup(hfsmp, &cndesc, 0, force_casesensitive_lookup, &desc, &attr, &fork, NULL);
+			retval = cat_lookup(hfsmp, &cndesc, 0, force_casesensitive_lookup, &desc, &attr, &fork, NULL);
 		
-		hfs_systemfile_unlock(hfsmp, lockflags);
+			hfs_systemfile_unlock(hfsmp, lockflags);
+		}
 
 		if (retval == 0) {
 			dcp->c_childhint = desc.cd_hint;
@@ -569,11 +576,14 @@ hfs_vnop_lookup(struct vop_lookup_args *ap)
 			 * in the cache at all.
 			 */
 
-			lockflags = hfs_systemfile_lock(VTOHFS(dvp), SFL_CATALOG, HFS_SHARED_LOCK);		
+			error = cat_lookup_unlocked(VTOHFS(vp), &desc, 0, &desc, &lookup_attr, NULL);
+			if (error == EAGAIN) {
+				lockflags = hfs_systemfile_lock(VTOHFS(dvp), SFL_CATALOG, HFS_SHARED_LOCK);		
 		
-			error = cat_lookup(VTOHFS(vp), &desc, 0, 0, &desc, &lookup_attr, NULL, NULL);	
+				error = cat_lookup(VTOHFS(vp), &desc, 0, 0, &desc, &lookup_attr, NULL, NULL);	
 			
-			hfs_systemfile_unlock(VTOHFS(dvp), lockflags);
+				hfs_systemfile_unlock(VTOHFS(dvp), lockflags);
+			}
 
 			/* 
 			 * Note that cat_lookup may fail to find something with the name provided in the
@@ -0,0 +1,331 @@
+//
+//  hfs_readdirplus.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * HFSIOC_READDIRPLUS: a directory's entries together with their attributes.
+ *
+ * hfs_vnop_readdir() returns names only, so find(1), du(1) or rsync(1) go on
+ * to stat every entry they read, and each stat is a hfs_lookup(): a catalog
+ * search for the name and, for an entry not in memory, a second one to check
+ * the record before a vnode is made for it.  The leaf records readdir walked
+ * already held everything stat returns.  This reads the entries with
+ * cat_getentriesattr(), as readdirattr does on Darwin, and packs what stat
+ * needs of each into the caller's buffer, so a directory of any size costs
+ * one walk along its leaf records.
+ *
+ * Entries that are in memory are reported from their cnode, as getattr would
+ * report them.  With HFS_RDP_PRIME, those that are not are given a vnode and
+ * a name cache entry, so a stat or open of them that follows is answered by
+ * the name cache.  Making the vnode checks the record again, as it does for
+ * hfs_lookup(), but the search hfs_lookup() would have made first is saved.
+ * Hard links are not primed.
+ *
+ * The offsets are those of hfs_vnop_readdir(), and so are the directory
+ * hints that carry a read on from one call to the next.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/proc.h>
+#include <sys/ucred.h>
+#include <sys/vnode.h>
+#include <sys/namei.h>
+#include <sys/dirent.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+#include "hfs.h"
+#include "hfs_catalog.h"
+#include "hfs_cnode.h"
+
+/* Most entries read by one call, however big the buffer */
+#define HFS_RDP_MAXENTRIES	512
+
+/* Most of the caller's buffer filled by one call */
+#define HFS_RDP_MAXBUF		(256 * 1024)
+
+#define RDP_RECLEN(namelen)	\
+	roundup2(offsetof(struct hfs_direntplus, dp_name) + (namelen) + 1, 8)
+
+static struct {
+	uint64_t	calls;			// HFSIOC_READDIRPLUS requests
+	uint64_t	entries;		// entries returned by them
+	uint64_t	primed;			// entries given a vnode
+} hfs_rdp_stats;
+
+HFS_SYSCTL(NODE, _vfs_generic_hfs, OID_AUTO, readdirplus, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "Directory reads with attributes")
+HFS_SYSCTL(U64, _vfs_generic_hfs_readdirplus, OID_AUTO, calls, CTLFLAG_RD, &hfs_rdp_stats.calls, 0, "HFSIOC_READDIRPLUS requests")
+HFS_SYSCTL(U64, _vfs_generic_hfs_readdirplus, OID_AUTO, entries, CTLFLAG_RD, &hfs_rdp_stats.entries, 0, "entries returned")
+HFS_SYSCTL(U64, _vfs_generic_hfs_readdirplus, OID_AUTO, primed, CTLFLAG_RD, &hfs_rdp_stats.primed, 0, "entries given a vnode")
+
+
+/*
+ * Fill in the record for one entry, from its cnode if it has one, as
+ * hfs_vnop_getattr() would, or else from the catalog.  The cnode is only
+ * referenced, not locked, as for readdirattr.
+ */
+static void
+rdp_pack(struct hfsmount *hfsmp, struct hfs_direntplus *dp,
+		 const struct cat_entry *cep, struct cnode *cp)
+{
+	const struct cat_attr *attrp = cp ? &cp->c_attr : &cep->ce_attr;
+	const struct cat_desc *descp = &cep->ce_desc;
+
+	bzero(dp, offsetof(struct hfs_direntplus, dp_name));
+
+	if (S_ISDIR(attrp->ca_mode)) {
+		/* See hfs_vnop_getattr() */
+		if ((hfsmp->hfs_flags & HFS_FOLDERCOUNT) &&
+			(attrp->ca_recflags & kHFSHasFolderCountMask))
+			dp->dp_nlink = attrp->ca_dircount + 2;
+		else
+			dp->dp_nlink = attrp->ca_entries + 2;
+		dp->dp_size = (attrp->ca_entries + 2) * AVERAGE_HFSDIRENTRY_SIZE;
+	} else {
+		dp->dp_nlink = attrp->ca_linkcount;
+		if (cp && cp->c_datafork) {
+			dp->dp_size = cp->c_datafork->ff_size;
+			dp->dp_bytes = (u_int64_t)cp->c_datafork->ff_blocks * hfsmp->blockSize;
+		} else {
+			dp->dp_size = cep->ce_datasize;
+			dp->dp_bytes = (u_int64_t)cep->ce_datablks * hfsmp->blockSize;
+		}
+		if (S_ISBLK(attrp->ca_mode) || S_ISCHR(attrp->ca_mode))
+			dp->dp_rdev = attrp->ca_rdev;
+	}
+	dp->dp_fileid = attrp->ca_fileid;
+	dp->dp_atime = attrp->ca_atime;
+	dp->dp_mtime = attrp->ca_mtime;
+	dp->dp_ctime = attrp->ca_ctime;
+	dp->dp_birthtime = attrp->ca_itime;
+	dp->dp_uid = attrp->ca_uid;
+	dp->dp_gid = attrp->ca_gid;
+	dp->dp_flags = attrp->ca_flags;
+	dp->dp_mode = attrp->ca_mode;
+	dp->dp_type = IFTODT(attrp->ca_mode);
+
+	dp->dp_namlen = descp->cd_namelen;
+	bcopy(descp->cd_nameptr, dp->dp_name, descp->cd_namelen);
+	dp->dp_name[descp->cd_namelen] = '\0';
+	dp->dp_reclen = RDP_RECLEN(descp->cd_namelen);
+}
+
+/*
+ * Make a vnode for an entry that has none and enter it in the name cache.
+ * The directory's cnode must not be locked: vnode locks come before cnode
+ * locks, and hfs_lookup() drops the parent's before hfs_getnewvnode() too.
+ */
+static void
+rdp_prime(struct hfsmount *hfsmp, struct vnode *dvp, struct cat_entry *cep)
+{
+	struct componentname cn = {
+		.cn_nameiop = LOOKUP,
+		.cn_flags	= ISLASTCN | MAKEENTRY,
+		.cn_nameptr = (char *)cep->ce_desc.cd_nameptr,
+		.cn_namelen = cep->ce_desc.cd_namelen,
+	};
+	struct cat_desc desc;
+	struct cat_fork fork;
+	struct vnode *vp = NULL;
+	int newvnode_flags = 0;
+
+	/* hfs_getnewvnode() takes the name, and the entry still needs it. */
+	desc = cep->ce_desc;
+	desc.cd_nameptr = (const u_int8_t *)vfs_addname((const char *)cep->ce_desc.cd_nameptr,
+												  cep->ce_desc.cd_namelen, 0, 0);
+	desc.cd_flags |= CD_HASBUF;
+
+	bzero(&fork, sizeof(fork));
+	if (!S_ISDIR(cep->ce_attr.ca_mode)) {
+		fork.cf_size = cep->ce_datasize;
+		fork.cf_blocks = cep->ce_datablks;
+		bcopy(cep->ce_dataext, fork.cf_extents, sizeof(fork.cf_extents));
+	}
+
+	if (hfs_getnewvnode(hfsmp, dvp, &cn, &desc, gnv_dfl, &cep->ce_attr,
+						&fork, &vp, &newvnode_flags) == 0) {
+		if (VTOC(vp)->c_cnid == cep->ce_desc.cd_cnid)
+			cache_enter(dvp, vp, &cn);
+		vput(vp);
+		atomic_add_64(&hfs_rdp_stats.primed, 1);
+	}
+	cat_releasedesc(&desc);
+}
+
+/*
+ * Read the entries of dvp from rdp->rdp_offset on into rdp->rdp_buf.
+ */
+int
+hfs_readdirplus(struct vnode *dvp, struct hfs_readdirplus *rdp, struct thread *td)
+{
+	struct hfsmount *hfsmp = VTOHFS(dvp);
+	struct cnode *dcp = VTOC(dvp);
+	struct cat_entrylist *ce_list = NULL;
+	struct cat_desc *lastdescp = NULL;
+	directoryhint_t *dirhint = NULL;
+	char *buf = NULL;
+	size_t bufsize, used = 0;
+	u_int64_t offset;
+	unsigned int tag;
+	int maxentries;
+	int lockflags;
+	int reachedeof = 0;
+	int count = 0;
+	int index;
+	int prime;
+	int error;
+	int i;
+
+	if (dvp->v_type != VDIR)
+		return (ENOTDIR);
+	if (rdp->rdp_bufsize < RDP_RECLEN(kHFSPlusMaxFileNameBytes))
+		return (EINVAL);
+
+	/* Reading the attributes is as good as looking the names up. */
+	vn_lock(dvp, LK_SHARED | LK_RETRY);
+	error = VOP_ACCESS(dvp, VEXEC, td->td_ucred, td);
+	VOP_UNLOCK(dvp);
+	if (error)
+		return (error);
+
+	atomic_add_64(&hfs_rdp_stats.calls, 1);
+	prime = (rdp->rdp_flags & HFS_RDP_PRIME) && !(hfsmp->hfs_flags & HFS_STANDARD);
+
+	bufsize = MIN(rdp->rdp_bufsize, HFS_RDP_MAXBUF);
+	maxentries = bufsize / (offsetof(struct hfs_direntplus, dp_name) + HFS_AVERAGE_NAME_SIZE);
+	maxentries = MAX(1, MIN(maxentries, HFS_RDP_MAXENTRIES));
+
+	buf = hfs_malloc(bufsize);
+	ce_list = hfs_mallocz(CE_LIST_SIZE(maxentries));
+	ce_list->maxentries = maxentries;
+
+	/* "." and ".." are not returned, so 0 means the first entry. */
+	offset = rdp->rdp_offset ? rdp->rdp_offset : 2;
+	index = (offset & HFS_INDEX_MASK) - 2;
+	tag = offset & ~HFS_INDEX_MASK;
+	if (index < 0) {
+		error = EINVAL;
+		goto out;
+	}
+
+	/* Take an exclusive directory lock since we manipulate the directory hints */
+	if ((error = hfs_lock(dcp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT)))
+		goto out;
+
+	/* Get a detached directory hint, as the lock is dropped below */
+	dirhint = hfs_getdirhint(dcp, ((index - 1) & HFS_INDEX_MASK) | tag, TRUE);
+
+	/* Hide tag from catalog layer. */
+	dirhint->dh_index &= HFS_INDEX_MASK;
+	if (dirhint->dh_index == HFS_INDEX_MASK) {
+		dirhint->dh_index = -1;
+	}
+
+	lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+	error = cat_getentriesattr(hfsmp, dirhint, ce_list, &reachedeof);
+	hfs_systemfile_unlock(hfsmp, lockflags);
+
+	if ((error == ENOENT) || (reachedeof != 0)) {
+		reachedeof = 1;
+		error = 0;
+	}
+	if (error) {
+		hfs_reldirhint(dcp, dirhint);
+		hfs_unlock(dcp);
+		goto out;
+	}
+	dcp->c_touch_acctime = TRUE;
+
+	/*
+	 * Drop the directory before going near the entries' vnodes.  Vnode
+	 * locks are taken before cnode locks (hfs_vnop_remove() holds the
+	 * child's vnode lock when it locks the pair), so holding the directory
+	 * here while waiting for a child's vnode could deadlock.  The detached
+	 * hint and the entry list are ours alone until the relock below.
+	 */
+	hfs_unlock(dcp);
+
+	for (i = 0; i < (int)ce_list->realentries; ++i) {
+		struct cat_entry *cep = &ce_list->entry[i];
+		struct vnode *vp;
+
+		if (used + RDP_RECLEN(cep->ce_desc.cd_namelen) > bufsize)
+			break;
+
+		/* A reference only, as hfs_readdirattr_internal() takes. */
+		vp = hfs_chash_getvnode(hfsmp, cep->ce_attr.ca_fileid, 0, 0, 0);
+		rdp_pack(hfsmp, (struct hfs_direntplus *)(buf + used), cep, vp ? VTOC(vp) : NULL);
+		if (vp != NULL)
+			vrele(vp);
+		else if (prime && cep->ce_attr.ca_linkref == 0 &&
+				 !(cep->ce_attr.ca_recflags & kHFSHasLinkChainMask))
+			rdp_prime(hfsmp, dvp, cep);
+
+		used += RDP_RECLEN(cep->ce_desc.cd_namelen);
+		lastdescp = &cep->ce_desc;
+		index++;
+		count++;
+	}
+
+	/* Nothing is locked while the records are copied out. */
+	if (used)
+		error = copyout(buf, rdp->rdp_buf, used);
+
+	(void) hfs_lock(dcp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS);
+
+	/* If the records did not all fit, it's not EOF. */
+	if (count < (int)ce_list->realentries)
+		reachedeof = 0;
+
+	/* Count the reserved entries the catalog skipped, as readdir does. */
+	index += ce_list->skipentries;
+
+	/* Remember the last entry, so the next call carries on after it. */
+	if (error == 0 && reachedeof == 0 && lastdescp != NULL) {
+		if ((dirhint->dh_desc.cd_flags & CD_HASBUF) &&
+		    (dirhint->dh_desc.cd_nameptr != NULL)) {
+			dirhint->dh_desc.cd_flags &= ~CD_HASBUF;
+			vfs_removename((const char *)dirhint->dh_desc.cd_nameptr);
+		}
+		dirhint->dh_desc.cd_namelen = lastdescp->cd_namelen;
+		dirhint->dh_desc.cd_nameptr = (const u_int8_t *)
+			vfs_addname((const char *)lastdescp->cd_nameptr, lastdescp->cd_namelen, 0, 0);
+		dirhint->dh_desc.cd_flags |= CD_HASBUF;
+		dirhint->dh_index = index - 1;
+		dirhint->dh_desc.cd_cnid = lastdescp->cd_cnid;
+		dirhint->dh_desc.cd_hint = lastdescp->cd_hint;
+		dirhint->dh_desc.cd_encoding = lastdescp->cd_encoding;
+	}
+
+	if (error == 0) {
+		/* Pack directory index and tag into the offset. */
+		if (tag == 0)
+			tag = hfs_newdirhinttag(hfsmp, dcp);
+		rdp->rdp_offset = (index + 2) | tag;
+		rdp->rdp_count = count;
+		rdp->rdp_eof = reachedeof;
+		dirhint->dh_index |= tag;
+		atomic_add_64(&hfs_rdp_stats.entries, count);
+	}
+
+	if (error || reachedeof || count == 0)
+		hfs_reldirhint(dcp, dirhint);
+	else
+		hfs_insertdirhint(dcp, dirhint);
+	hfs_unlock(dcp);
+
+out:
+	if (ce_list) {
+		for (i = 0; i < (int)ce_list->realentries; ++i)
+			cat_releasedesc(&ce_list->entry[i].ce_desc);
+		hfs_free(ce_list, CE_LIST_SIZE(maxentries));
+	}
+	hfs_free(buf, bufsize);
+	return (error);
+}
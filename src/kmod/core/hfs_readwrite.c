@@ -596,6 +596,30 @@ again:
 		goto exit;
 #endif /* QUOTA */
 
+	/*
+	 * Delayed allocation: if the whole extension can be put on loan,
+	 * nothing goes to disk until the data is written out, when
+	 * hfs_vnop_blockmap allocates all of the file's loaned blocks in one
+	 * request.  So there is no transaction to start here.  The bitmap
+	 * lock keeps the free space check in step with the allocator.
+	 */
+	if (eflags & kEFDeferMask) {
+		lockflags = hfs_systemfile_lock(hfsmp, SFL_BITMAP, HFS_EXCLUSIVE_LOCK);
+		retval = MacToVFSError(LoanFileBlocksC(hfsmp, (FCB*)fp, bytesToAdd,
+				eflags, &actualBytesAdded));
+		hfs_systemfile_unlock(hfsmp, lockflags);
+
+		if (retval == E_NONE) {
+			/* Files that are changing size are not hot file candidates. */
+			if (hfsmp->hfc_stage == HFC_RECORDING) {
+				fp->ff_bytesread = 0;
+			}
+			filebytes = (off_t)fp->ff_blocks * (off_t)hfsmp->blockSize;
+			goto sizeok;
+		}
+		retval = E_NONE;
+	}
+
 	if (hfs_start_transaction(hfsmp) != 0) {
 		retval = EINVAL;
 		goto exit;
@@ -2660,6 +2684,11 @@ fail_change_next_allocation:
 		jip->jsize = jnl_size;
 		break;
 
+	case HFSIOC_READDIRPLUS:
+		if ((ap->a_fflag & FREAD) == 0)
+			return (EBADF);
+		return hfs_readdirplus(vp, (struct hfs_readdirplus *)ap->a_data, td);
+
 	case HFSIOC_SET_ALWAYS_ZEROFILL: {
 	    struct cnode *cp = VTOC(vp);
 
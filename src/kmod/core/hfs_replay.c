@@ -0,0 +1,347 @@
+//
+//  hfs_replay.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Journal replay index.  See hfs_replay.h.  Also built into fsck_hfs, which
+ * replays the journal the same way.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include "hfs.h"
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include "hfs_replay.h"
+
+#define JR_MIN_ENTRIES	256
+
+
+static void *
+jr_alloc(size_t size)
+{
+#ifdef _KERNEL
+	return hfs_mallocz(size);
+#else
+	return calloc(1, size);
+#endif
+}
+
+static void
+jr_free(void *p, size_t size)
+{
+	if (p == NULL)
+		return;
+#ifdef _KERNEL
+	hfs_free(p, size);
+#else
+	(void)size;
+	free(p);
+#endif
+}
+
+static inline off_t
+jr_wrap(const struct jr_index *ji, off_t jnl_offset)
+{
+	if (jnl_offset >= ji->ji_jnl_size)
+		jnl_offset = ji->ji_block_size + (jnl_offset - ji->ji_jnl_size);
+	return jnl_offset;
+}
+
+static inline off_t
+jr_start(const struct jr_index *ji, const struct jr_entry *je)
+{
+	return je->je_block * ji->ji_block_size;
+}
+
+static inline off_t
+jr_end(const struct jr_index *ji, const struct jr_entry *je)
+{
+	return jr_start(ji, je) + je->je_size;
+}
+
+/* Slot holding 'block', or the empty slot where it would go. */
+static u_int32_t
+jr_lookup(const struct jr_index *ji, off_t block)
+{
+	u_int32_t mask = ji->ji_hash_size - 1;
+	u_int32_t slot = (u_int32_t)(((u_int64_t)block * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+	u_int32_t i;
+
+	while ((i = ji->ji_hash[slot]) != 0 && ji->ji_entries[i - 1].je_block != block)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/*
+ * Size the hash for ji_alloc entries and fill it in.  Where several entries
+ * have the same block number, the last one (the newest) is the one found.
+ */
+static int
+jr_rehash(struct jr_index *ji)
+{
+	u_int32_t size = 1;
+	u_int32_t i;
+
+	while (size < 2 * ji->ji_alloc)
+		size <<= 1;
+
+	if (size != ji->ji_hash_size || ji->ji_hash == NULL) {
+		u_int32_t *hash = jr_alloc(size * sizeof(*hash));
+
+		if (hash == NULL)
+			return ENOMEM;
+		jr_free(ji->ji_hash, ji->ji_hash_size * sizeof(*hash));
+		ji->ji_hash = hash;
+		ji->ji_hash_size = size;
+	} else
+		memset(ji->ji_hash, 0, size * sizeof(*ji->ji_hash));
+
+	for (i = 0; i < ji->ji_count; i++)
+		ji->ji_hash[jr_lookup(ji, ji->ji_entries[i].je_block)] = i + 1;
+
+	return 0;
+}
+
+static int
+jr_grow(struct jr_index *ji)
+{
+	u_int32_t alloc = ji->ji_alloc ? 2 * ji->ji_alloc : JR_MIN_ENTRIES;
+	struct jr_entry *entries;
+
+	if (alloc <= ji->ji_alloc)
+		return ENOMEM;
+	entries = jr_alloc(alloc * sizeof(*entries));
+	if (entries == NULL)
+		return ENOMEM;
+	if (ji->ji_count)
+		memcpy(entries, ji->ji_entries, ji->ji_count * sizeof(*entries));
+	jr_free(ji->ji_entries, ji->ji_alloc * sizeof(*entries));
+	ji->ji_entries = entries;
+	ji->ji_alloc = alloc;
+
+	return jr_rehash(ji);
+}
+
+int
+jr_init(struct jr_index *ji, u_int32_t block_size, off_t jnl_size)
+{
+	memset(ji, 0, sizeof(*ji));
+	if (block_size == 0 || jnl_size <= block_size)
+		return EINVAL;
+	ji->ji_block_size = block_size;
+	ji->ji_jnl_size = jnl_size;
+
+	return jr_grow(ji);
+}
+
+void
+jr_destroy(struct jr_index *ji)
+{
+	jr_free(ji->ji_entries, ji->ji_alloc * sizeof(*ji->ji_entries));
+	jr_free(ji->ji_hash, ji->ji_hash_size * sizeof(*ji->ji_hash));
+	memset(ji, 0, sizeof(*ji));
+}
+
+/* Forget every block added, to start the replay over. */
+void
+jr_reset(struct jr_index *ji)
+{
+	ji->ji_count = 0;
+	ji->ji_seq = 0;
+	if (jr_rehash(ji) != 0) {
+		/* Keep the old hash; with no entries it only has to be cleared */
+		memset(ji->ji_hash, 0, ji->ji_hash_size * sizeof(*ji->ji_hash));
+	}
+}
+
+/*
+ * Record that the journal has 'size' bytes for 'block' at 'jnl_offset',
+ * newer than anything added before.
+ */
+int
+jr_add(struct jr_index *ji, off_t block, u_int32_t size, off_t jnl_offset,
+	   int32_t cksum)
+{
+	struct jr_entry *je;
+	u_int32_t slot, i;
+	int error;
+
+	if (block < 0 || size == 0)
+		return EINVAL;
+
+	slot = jr_lookup(ji, block);
+	i = ji->ji_hash[slot];
+	if (i != 0 && ji->ji_entries[i - 1].je_size <= size) {
+		/* Rewrites all of the last entry for this block */
+		je = &ji->ji_entries[i - 1];
+	} else {
+		if (ji->ji_count == ji->ji_alloc || 2 * ji->ji_count >= ji->ji_hash_size) {
+			error = jr_grow(ji);
+			if (error)
+				return error;
+			slot = jr_lookup(ji, block);
+		}
+		je = &ji->ji_entries[ji->ji_count++];
+		ji->ji_hash[slot] = ji->ji_count;
+	}
+
+	je->je_block = block;
+	je->je_size = size;
+	je->je_jnl_offset = (u_int32_t)jr_wrap(ji, jnl_offset);
+	je->je_cksum = cksum;
+	je->je_seq = ji->ji_seq++;
+
+	return 0;
+}
+
+static int
+jr_cmp(const void *a, const void *b)
+{
+	const struct jr_entry *ea = a, *eb = b;
+
+	if (ea->je_block != eb->je_block)
+		return ea->je_block < eb->je_block ? -1 : 1;
+	if (ea->je_seq != eb->je_seq)
+		return ea->je_seq < eb->je_seq ? -1 : 1;
+	return 0;
+}
+
+/* Max-heap of entry indices by je_seq. */
+static void
+jr_heap_push(const struct jr_entry *e, u_int32_t *heap, u_int32_t *n, u_int32_t i)
+{
+	u_int32_t c = (*n)++;
+
+	while (c > 0 && e[heap[(c - 1) / 2]].je_seq < e[i].je_seq) {
+		heap[c] = heap[(c - 1) / 2];
+		c = (c - 1) / 2;
+	}
+	heap[c] = i;
+}
+
+static void
+jr_heap_pop(const struct jr_entry *e, u_int32_t *heap, u_int32_t *n)
+{
+	u_int32_t last = heap[--(*n)];
+	u_int32_t c = 0;
+
+	for (;;) {
+		u_int32_t child = 2 * c + 1;
+
+		if (child >= *n)
+			break;
+		if (child + 1 < *n && e[heap[child + 1]].je_seq > e[heap[child]].je_seq)
+			child++;
+		if (e[heap[child]].je_seq < e[last].je_seq)
+			break;
+		heap[c] = heap[child];
+		c = child;
+	}
+	if (*n)
+		heap[c] = last;
+}
+
+/*
+ * Resolve the overlaps between entries, keeping the newest writer of every
+ * byte, and leave the entries sorted by block number.  Afterwards no two
+ * entries overlap, and an entry that had to be cut down has a checksum of 0.
+ *
+ * The sweep goes through the entries in block order with a heap of the ones
+ * covering the current position; the newest of those supplies the bytes up
+ * to where it ends or the next entry starts, whichever comes first.  That
+ * piece can only start part way into a block if an entry ends part way into
+ * one and a larger, older one carries on past it, which the journal never
+ * writes; it is rejected with EINVAL.
+ *
+ * The hash is not updated; the only thing to do with the index afterwards,
+ * apart from reading the entries, is jr_reset() it.
+ */
+int
+jr_finish(struct jr_index *ji)
+{
+	struct jr_entry *e = ji->ji_entries;
+	u_int32_t n = ji->ji_count;
+	struct jr_entry *out;
+	u_int32_t *heap;
+	u_int32_t nout = 0, hn = 0, i = 0;
+	u_int32_t last_src = 0;
+	off_t pos = 0;
+	int error = 0;
+
+	if (n == 0)
+		return 0;
+
+	qsort(e, n, sizeof(*e), jr_cmp);
+
+	out = jr_alloc(2 * (size_t)n * sizeof(*out));
+	heap = jr_alloc((size_t)n * sizeof(*heap));
+	if (out == NULL || heap == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+
+	while (i < n || hn > 0) {
+		const struct jr_entry *top;
+		off_t next;
+
+		if (hn == 0)
+			pos = jr_start(ji, &e[i]);
+		while (i < n && jr_start(ji, &e[i]) <= pos)
+			jr_heap_push(e, heap, &hn, i++);
+		while (hn > 0 && jr_end(ji, &e[heap[0]]) <= pos)
+			jr_heap_pop(e, heap, &hn);
+		if (hn == 0)
+			continue;
+
+		top = &e[heap[0]];
+		next = jr_end(ji, top);
+		if (i < n && jr_start(ji, &e[i]) < next)
+			next = jr_start(ji, &e[i]);
+
+		if (nout > 0 && last_src == heap[0] &&
+			jr_end(ji, &out[nout - 1]) == pos) {
+			out[nout - 1].je_size += (u_int32_t)(next - pos);
+		} else {
+			struct jr_entry *o = &out[nout++];
+
+			if (pos % ji->ji_block_size != 0) {
+				error = EINVAL;
+				goto done;
+			}
+			o->je_block = pos / ji->ji_block_size;
+			o->je_size = (u_int32_t)(next - pos);
+			o->je_jnl_offset = (u_int32_t)jr_wrap(ji, top->je_jnl_offset +
+												 (pos - jr_start(ji, top)));
+			o->je_seq = top->je_seq;
+			last_src = heap[0];
+		}
+		out[nout - 1].je_cksum =
+			(out[nout - 1].je_block == top->je_block &&
+			 out[nout - 1].je_size == top->je_size) ? top->je_cksum : 0;
+
+		pos = next;
+	}
+
+	jr_free(ji->ji_entries, ji->ji_alloc * sizeof(*ji->ji_entries));
+	ji->ji_entries = out;
+	ji->ji_alloc = 2 * n;
+	ji->ji_count = nout;
+	out = NULL;
+
+done:
+	jr_free(out, 2 * (size_t)n * sizeof(*out));
+	jr_free(heap, (size_t)n * sizeof(*heap));
+
+	return error;
+}
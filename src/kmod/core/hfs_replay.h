@@ -0,0 +1,75 @@
+//
+//  hfs_replay.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_REPLAY_H_
+#define _HFS_REPLAY_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/*
+ * Index of the blocks written by the transactions being replayed from the
+ * journal, used to replay each block once, with its newest contents, in
+ * block order.
+ *
+ * Blocks are added in journal order.  A block that is written again, at the
+ * same block number and at least the same size, is updated in place through
+ * a hash of the block numbers, so an index holds one entry per distinct
+ * block however often each was written.  Other overlaps are left for
+ * jr_finish(), which sorts the entries by block number and sweeps them once,
+ * keeping the newest writer of every byte.  Adding is O(1) and finishing
+ * O(n log n); the sorted array this replaces was O(n) per block.
+ *
+ * Block numbers are in units of ji_block_size bytes (the journal header
+ * size), and journal offsets wrap from the end of the journal to just past
+ * its header, as in the journal itself.
+ */
+
+struct jr_entry {
+	off_t		je_block;		/* block number */
+	u_int32_t	je_size;		/* bytes */
+	u_int32_t	je_jnl_offset;	/* where the contents are in the journal */
+	int32_t		je_cksum;		/* 0 once an entry has been cut down */
+	u_int32_t	je_seq;			/* order added; the newest wins */
+};
+
+struct jr_index {
+	struct jr_entry	*ji_entries;
+	u_int32_t		ji_count;
+	u_int32_t		ji_alloc;
+	u_int32_t		*ji_hash;		/* entry index + 1 by block number, 0 if none */
+	u_int32_t		ji_hash_size;	/* power of two, at least twice ji_alloc */
+	u_int32_t		ji_seq;
+	u_int32_t		ji_block_size;
+	off_t			ji_jnl_size;
+};
+
+__BEGIN_DECLS
+int jr_init(struct jr_index *ji, u_int32_t block_size, off_t jnl_size);
+void jr_destroy(struct jr_index *ji);
+void jr_reset(struct jr_index *ji);
+
+int jr_add(struct jr_index *ji, off_t block, u_int32_t size, off_t jnl_offset,
+		   int32_t cksum);
+int jr_finish(struct jr_index *ji);
+__END_DECLS
+
+/*
+ * After jr_finish(): can entry i be written in the same I/O as the one
+ * before it?
+ */
+static inline bool
+jr_adjacent(const struct jr_index *ji, u_int32_t i)
+{
+	const struct jr_entry *prev = &ji->ji_entries[i - 1];
+
+	return prev->je_block * ji->ji_block_size + prev->je_size ==
+		   ji->ji_entries[i].je_block * ji->ji_block_size;
+}
+
+#endif /* ! _HFS_REPLAY_H_ */
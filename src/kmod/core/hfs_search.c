@@ -58,6 +58,7 @@
 #include "hfs_catalog.h"
 #include "hfs_attrlist.h"
 #include "hfs_endian.h"
+#include "hfs_unifold.h"
 
 #include "FileMgrInternal.h"
 #include "HFSUnicodeWrappers.h"
@@ -85,6 +86,9 @@ struct searchinfospec
 {
 	u_char			name[kHFSPlusMaxFileNameBytes];
 	u_int32_t			nameLength;
+	u_int16_t		foldedName[kHFSPlusMaxFileNameChars];	// see FastUnicodeFold()
+	u_int32_t			foldedLength;
+	boolean_t		foldedASCII;		// name is ASCII, and foldedName is set
 	char			attributes;		// see IM:Files 2-100
 	u_int32_t			nodeID;
 	u_int32_t			parentDirID;
@@ -496,9 +500,15 @@ CompareMasked(const u_int32_t *thisValue, const u_int32_t *compareData,
 }
 
 
+/*
+ * Is 'find' anywhere in 'str'?  Case-insensitive matches compare the name
+ * folded once, 'folded', with each f_len characters of 'str' in turn, or
+ * 'find' itself when 'folded' is NULL.
+ */
 static boolean_t
 ComparePartialUnicodeName (register ConstUniCharArrayPtr str, register ItemCount s_len,
-			   register ConstUniCharArrayPtr find, register ItemCount f_len, int caseSensitive )
+			   register ConstUniCharArrayPtr find, register ItemCount f_len,
+			   const u_int16_t *folded, u_int32_t foldedLength, int caseSensitive )
 {
 	if (f_len == 0 || s_len == 0) {
 		return FALSE;
@@ -510,6 +520,12 @@ ComparePartialUnicodeName (register ConstUniCharArrayPtr str, register ItemCount
 				return FALSE;
 		} while (UnicodeBinaryCompare(str++, f_len, find, f_len) != 0);
 	}
+	else if (folded != NULL) {
+		do {
+			if (s_len-- < f_len)
+				return FALSE;
+		} while (FastUnicodeCompareFolded(folded, foldedLength, str++, f_len) != 0);
+	}
 	else {
 		do {
 			if (s_len-- < f_len)
@@ -760,7 +776,10 @@ CheckCriteria(	ExtendedVCB *vcb,
 				matched = ComparePartialUnicodeName(key->hfsPlus.nodeName.unicode,
 								    key->hfsPlus.nodeName.length,
 								    (UniChar*)searchInfo1->name,
-								    searchInfo1->nameLength, 0);
+								    searchInfo1->nameLength,
+								    searchInfo1->foldedASCII ?
+									searchInfo1->foldedName : NULL,
+								    searchInfo1->foldedLength, 0);
 			} 
 			else {
 				/* Full name match.  Are we HFSX (case sensitive) or HFS+ ? */
@@ -770,6 +789,12 @@ CheckCriteria(	ExtendedVCB *vcb,
 								(UniChar*)searchInfo1->name,
 								searchInfo1->nameLength ) == 0);
 				}
+				else if (searchInfo1->foldedASCII) {
+					matched = (FastUnicodeCompareFolded(searchInfo1->foldedName,
+								searchInfo1->foldedLength,
+								key->hfsPlus.nodeName.unicode,
+								key->hfsPlus.nodeName.length ) == 0);
+				}
 				else {
 					matched = (FastUnicodeCompare(key->hfsPlus.nodeName.unicode,
 								key->hfsPlus.nodeName.length,
@@ -1229,6 +1254,14 @@ UnpackSearchAttributeBlock( struct hfsmount *hfsmp, struct attrlist	*alist,
 					} else {
 						searchInfo->nameLength = 0;
 					}
+					/* Other names are compared by FastUnicodeCompare() */
+					searchInfo->foldedASCII = FastUnicodeIsASCII((u_int16_t *)searchInfo->name,
+																 searchInfo->nameLength);
+					searchInfo->foldedLength = 0;
+					if (searchInfo->foldedASCII)
+						searchInfo->foldedLength = FastUnicodeFold((u_int16_t *)searchInfo->name,
+																   searchInfo->nameLength,
+																   searchInfo->foldedName);
 				}
 #if CONFIG_HFS_STD
 				else {
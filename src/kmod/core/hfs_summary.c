@@ -0,0 +1,255 @@
+//
+//  hfs_summary.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Bitmap summary table.  See hfs_summary.h.
+ */
+
+#if HFS_ALLOC_TEST
+#include <errno.h>
+#include <stdlib.h>
+#else
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include "hfs.h"
+#endif
+
+#include "hfs_summary.h"
+
+
+static inline u_int64_t
+sum_min64(u_int64_t a, u_int64_t b)
+{
+	return a < b ? a : b;
+}
+
+static inline size_t
+sum_table_size(u_int32_t chunks, u_int32_t supers)
+{
+	return ((size_t)chunks + supers) * sizeof(u_int32_t);
+}
+
+/* Set a chunk's count, keeping the superchunk and total sums in step. */
+static inline void
+sum_update(struct sum_table *st, u_int32_t chunk, u_int32_t free_blocks)
+{
+	u_int32_t old = st->st_chunk_free[chunk];
+
+	st->st_chunk_free[chunk] = free_blocks;
+	st->st_super_free[chunk / SUM_SUPER_CHUNKS] += free_blocks - old;
+	st->st_free += free_blocks;
+	st->st_free -= old;
+}
+
+/*
+ * Allocate the table for 'chunks' chunks, every one of them counted as
+ * entirely free.  The caller fills in the real counts as it scans.
+ */
+int
+sum_init(struct sum_table *st, u_int32_t chunks, u_int32_t chunk_blocks)
+{
+	u_int32_t supers = (chunks + SUM_SUPER_CHUNKS - 1) / SUM_SUPER_CHUNKS;
+	u_int32_t *table;
+	u_int32_t i;
+
+	if (chunks == 0 || chunk_blocks == 0)
+		return EINVAL;
+
+#if HFS_ALLOC_TEST
+	table = calloc(1, sum_table_size(chunks, supers));
+	if (table == NULL)
+		return ENOMEM;
+#else
+	table = hfs_mallocz(sum_table_size(chunks, supers));
+#endif
+
+	st->st_chunk_free = table;
+	st->st_super_free = table + chunks;
+	st->st_chunks = chunks;
+	st->st_supers = supers;
+	st->st_chunk_blocks = chunk_blocks;
+	st->st_free = 0;
+
+	for (i = 0; i < chunks; i++)
+		sum_update(st, i, chunk_blocks);
+
+	return 0;
+}
+
+void
+sum_destroy(struct sum_table *st)
+{
+	if (st->st_chunk_free) {
+#if HFS_ALLOC_TEST
+		free(st->st_chunk_free);
+#else
+		hfs_free(st->st_chunk_free, sum_table_size(st->st_chunks, st->st_supers));
+#endif
+	}
+	st->st_chunk_free = NULL;
+	st->st_super_free = NULL;
+	st->st_chunks = 0;
+	st->st_supers = 0;
+	st->st_free = 0;
+}
+
+/*
+ * Grow or shrink the table to 'chunks' chunks, keeping the counts of the
+ * chunks both sizes have.  New chunks count as entirely free.
+ */
+int
+sum_resize(struct sum_table *st, u_int32_t chunks)
+{
+	struct sum_table new_st;
+	u_int32_t i;
+	int error;
+
+	if (chunks == st->st_chunks)
+		return 0;
+
+	error = sum_init(&new_st, chunks, st->st_chunk_blocks);
+	if (error)
+		return error;
+
+	for (i = 0; i < chunks && i < st->st_chunks; i++)
+		sum_update(&new_st, i, st->st_chunk_free[i]);
+
+	sum_destroy(st);
+	*st = new_st;
+
+	return 0;
+}
+
+/* Record the free block count of a chunk that has just been scanned. */
+void
+sum_set(struct sum_table *st, u_int32_t chunk, u_int32_t free_blocks)
+{
+	if (chunk >= st->st_chunks)
+		return;
+	if (free_blocks > st->st_chunk_blocks)
+		free_blocks = st->st_chunk_blocks;
+	sum_update(st, chunk, free_blocks);
+}
+
+/*
+ * Account for blocks set or cleared in the bitmap.  Counts are clamped
+ * rather than trusted to stay in range: a bitmap update over bits that were
+ * already in the new state must not push a count outside [0, chunk size].
+ */
+void
+sum_allocated(struct sum_table *st, u_int32_t start, u_int32_t count)
+{
+	u_int64_t cb = st->st_chunk_blocks;
+	u_int64_t end = (u_int64_t)start + count;
+	u_int32_t chunk;
+
+	for (chunk = start / cb; chunk < st->st_chunks && chunk * cb < end; chunk++) {
+		u_int32_t n = (u_int32_t)(sum_min64(end, (chunk + 1) * cb) -
+								  (chunk * cb > start ? chunk * cb : start));
+		u_int32_t f = st->st_chunk_free[chunk];
+
+		sum_update(st, chunk, f > n ? f - n : 0);
+	}
+}
+
+void
+sum_freed(struct sum_table *st, u_int32_t start, u_int32_t count)
+{
+	u_int64_t cb = st->st_chunk_blocks;
+	u_int64_t end = (u_int64_t)start + count;
+	u_int32_t chunk;
+
+	for (chunk = start / cb; chunk < st->st_chunks && chunk * cb < end; chunk++) {
+		u_int32_t n = (u_int32_t)(sum_min64(end, (chunk + 1) * cb) -
+								  (chunk * cb > start ? chunk * cb : start));
+
+		sum_update(st, chunk, (u_int32_t)sum_min64((u_int64_t)st->st_chunk_free[chunk] + n, cb));
+	}
+}
+
+/*
+ * Could a run of 'min_count' free blocks start in 'chunk' and end in or
+ * before 'last'?  The run takes what it can from the first chunk, passes
+ * through any number of entirely free chunks and ends in the next one.
+ */
+static bool
+sum_run_fits(const struct sum_table *st, u_int32_t chunk, u_int32_t last,
+			 u_int32_t min_count)
+{
+	u_int64_t avail = st->st_chunk_free[chunk];
+
+	if (avail == 0)
+		return false;
+
+	while (avail < min_count) {
+		u_int32_t f;
+
+		if (++chunk > last)
+			return false;
+		f = st->st_chunk_free[chunk];
+		if (avail + f >= min_count)
+			return true;
+		if (f != st->st_chunk_blocks)
+			return false;
+		avail += f;
+	}
+
+	return true;
+}
+
+/*
+ * Find where to start scanning the bitmap for a run of at least 'min_count'
+ * free blocks at or after 'block' and ending before 'limit'.  Returns 'block'
+ * itself if its own chunk qualifies, otherwise the first block of the first
+ * chunk that does.  Returns false if no chunk can hold such a run.
+ */
+bool
+sum_find(const struct sum_table *st, u_int32_t block, u_int32_t limit,
+		 u_int32_t min_count, u_int32_t *found)
+{
+	u_int32_t cb = st->st_chunk_blocks;
+	u_int64_t super_blocks = (u_int64_t)cb * SUM_SUPER_CHUNKS;
+	u_int32_t first, chunk, last;
+
+	if (st->st_chunks == 0 || block >= limit)
+		return false;
+	if (min_count == 0)
+		min_count = 1;
+
+	first = chunk = block / cb;
+	last = (limit - 1) / cb;
+	if (last >= st->st_chunks)
+		last = st->st_chunks - 1;
+
+	while (chunk <= last) {
+		u_int32_t super = chunk / SUM_SUPER_CHUNKS;
+		u_int64_t avail = st->st_super_free[super];
+
+		/*
+		 * A run no longer than a superchunk that starts in this one ends
+		 * in it or the next, so the two of them must hold enough.
+		 */
+		if (min_count <= super_blocks && super + 1 < st->st_supers)
+			avail += st->st_super_free[super + 1];
+
+		if (st->st_super_free[super] == 0 ||
+			(min_count <= super_blocks && avail < min_count)) {
+			chunk = (super + 1) * SUM_SUPER_CHUNKS;
+			continue;
+		}
+
+		if (sum_run_fits(st, chunk, last, min_count)) {
+			*found = (chunk == first) ? block : chunk * cb;
+			return true;
+		}
+		chunk++;
+	}
+
+	return false;
+}
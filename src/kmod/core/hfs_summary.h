@@ -0,0 +1,65 @@
+//
+//  hfs_summary.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_SUMMARY_H_
+#define _HFS_SUMMARY_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/*
+ * Summary of the volume bitmap, used by the bitmap scanners to skip space
+ * that cannot satisfy a request without reading it.
+ *
+ * The bitmap is split into chunks of one bitmap I/O (8 * vcbVBMIOSize
+ * allocation blocks), and the chunks into superchunks of SUM_SUPER_CHUNKS.
+ * For every chunk the table holds an upper bound on the number of free
+ * blocks in it, and for every superchunk the sum of its chunks.  A chunk
+ * nobody has looked at yet counts as entirely free; the bound is made exact
+ * when the chunk is scanned and kept exact by the bitmap update routines.
+ *
+ * Since the counts never understate free space, a chunk with a count of zero
+ * is full, and a run of N free blocks can only start in chunk c if the
+ * counts of c and the chunks after it add up to N with every chunk in
+ * between entirely free.  sum_find() uses that to go from a hint to the
+ * first chunk worth scanning, one superchunk at a time where it can.
+ *
+ * The table does no locking of its own; the bitmap lock covers it.
+ */
+
+#define SUM_SUPER_CHUNKS	32
+
+struct sum_table {
+	u_int32_t	*st_chunk_free;		/* free blocks in each chunk, at most */
+	u_int32_t	*st_super_free;		/* sum of st_chunk_free per superchunk */
+	u_int32_t	st_chunks;
+	u_int32_t	st_supers;
+	u_int32_t	st_chunk_blocks;	/* allocation blocks per chunk */
+	u_int64_t	st_free;			/* sum of st_chunk_free */
+};
+
+__BEGIN_DECLS
+int sum_init(struct sum_table *st, u_int32_t chunks, u_int32_t chunk_blocks);
+void sum_destroy(struct sum_table *st);
+int sum_resize(struct sum_table *st, u_int32_t chunks);
+
+void sum_set(struct sum_table *st, u_int32_t chunk, u_int32_t free_blocks);
+void sum_allocated(struct sum_table *st, u_int32_t start, u_int32_t count);
+void sum_freed(struct sum_table *st, u_int32_t start, u_int32_t count);
+
+bool sum_find(const struct sum_table *st, u_int32_t block, u_int32_t limit,
+			  u_int32_t min_count, u_int32_t *found);
+__END_DECLS
+
+static inline u_int32_t
+sum_chunk_free(const struct sum_table *st, u_int32_t chunk)
+{
+	return chunk < st->st_chunks ? st->st_chunk_free[chunk] : 0;
+}
+
+#endif /* ! _HFS_SUMMARY_H_ */
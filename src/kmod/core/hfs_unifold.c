@@ -0,0 +1,177 @@
+//
+//  hfs_unifold.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Case-folded name comparison.  See hfs_unifold.h.  The folding tables are
+ * the ones FastUnicodeCompare() uses, from UCStringCompareData.h.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#include "hfs_unifold.h"
+
+extern u_int16_t gLatinCaseFold[];
+extern u_int16_t gLowerCaseTable[];
+
+#define UF_LANES		0x0001000100010001ULL
+
+/* Fold one character; 0 if it is ignorable. */
+static inline u_int16_t
+uf_fold(u_int16_t c)
+{
+	u_int16_t temp;
+
+	if (c < 0x0100)
+		return gLatinCaseFold[c];
+	if ((temp = gLowerCaseTable[c >> 8]) != 0)
+		return gLowerCaseTable[temp + (c & 0x00FF)];
+	return c;
+}
+
+/*
+ * Are the four characters in 'w' all ASCII, and none of them NUL (which
+ * folds to 0xFFFF)?
+ */
+static inline bool
+uf_ascii4(u_int64_t w)
+{
+	return (w & (0xFF80 * UF_LANES)) == 0 &&
+		   ((w - UF_LANES) & ~w & (0x8000 * UF_LANES)) == 0;
+}
+
+/*
+ * Fold four ASCII characters: A-Z become a-z, and nothing else changes.  No
+ * lane carries into the next, as every one is below 0x80.
+ */
+static inline u_int64_t
+uf_fold4(u_int64_t w)
+{
+	u_int64_t ge_a = w + (0x80 - 'A') * UF_LANES;
+	u_int64_t gt_z = w + (0x80 - 'Z' - 1) * UF_LANES;
+
+	return w | ((ge_a & ~gt_z & (0x0080 * UF_LANES)) >> 2);
+}
+
+/*
+ * Fold 'length' characters of 'str' into 'folded', which has room for as
+ * many, and return how many are left once the ignorable ones are dropped.
+ */
+u_int32_t
+FastUnicodeFold(const u_int16_t *str, u_int32_t length, u_int16_t *folded)
+{
+	u_int32_t count = 0;
+	u_int64_t w;
+	u_int16_t c;
+
+	while (length >= 4) {
+		memcpy(&w, str, sizeof(w));
+		if (!uf_ascii4(w))
+			break;
+		w = uf_fold4(w);
+		memcpy(folded + count, &w, sizeof(w));
+		count += 4;
+		str += 4;
+		length -= 4;
+	}
+
+	while (length--) {
+		c = uf_fold(*str++);
+		if (c != 0)
+			folded[count++] = c;
+	}
+
+	return count;
+}
+
+/*
+ * Is every character of 'str' ASCII, and none of them NUL?  Only then does
+ * FastUnicodeCompareFolded() pay for itself.
+ */
+bool
+FastUnicodeIsASCII(const u_int16_t *str, u_int32_t length)
+{
+	u_int64_t w;
+
+	for (; length >= 4; str += 4, length -= 4) {
+		memcpy(&w, str, sizeof(w));
+		if (!uf_ascii4(w))
+			return false;
+	}
+	while (length--) {
+		if (*str == 0 || *str >= 0x80)
+			return false;
+		str++;
+	}
+	return true;
+}
+
+/*
+ * Compare a folded name (from FastUnicodeFold()) with 'str'.  Returns -1, 0
+ * or 1 as FastUnicodeCompare() would for the name that was folded and 'str'.
+ * Right for any folded name, but only faster for one FastUnicodeIsASCII()
+ * passes.
+ */
+int32_t
+FastUnicodeCompareFolded(const u_int16_t *folded, u_int32_t foldedLength,
+						 const u_int16_t *str, u_int32_t length)
+{
+	u_int16_t c1, c2, four[4];
+	u_int64_t w, f;
+	int i;
+
+	for (;;) {
+		/*
+		 * Four ASCII characters at a time.  None of them is ignorable, so
+		 * where they differ from the folded name is where the names do.
+		 */
+		if (foldedLength >= 4 && length >= 4 && *folded < 0x80) {
+			memcpy(&w, str, sizeof(w));
+			if (uf_ascii4(w)) {
+				w = uf_fold4(w);
+				memcpy(&f, folded, sizeof(f));
+				if (w == f) {
+					folded += 4;
+					foldedLength -= 4;
+					str += 4;
+					length -= 4;
+					continue;
+				}
+				memcpy(four, &w, sizeof(four));
+				for (i = 0; folded[i] == four[i]; i++)
+					;
+				return folded[i] < four[i] ? -1 : 1;
+			}
+		}
+
+		/* Otherwise one; 0 past the end of either name */
+		c1 = 0;
+		if (foldedLength) {
+			c1 = *folded++;
+			foldedLength--;
+		}
+		c2 = 0;
+		while (length && c2 == 0) {
+			c2 = uf_fold(*str++);
+			length--;
+		}
+
+		if (c1 != c2)
+			break;
+		if (c1 == 0)
+			return 0;
+	}
+
+	return c1 < c2 ? -1 : 1;
+}
@@ -0,0 +1,44 @@
+//
+//  hfs_unifold.h
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+#ifndef _HFS_UNIFOLD_H_
+#define _HFS_UNIFOLD_H_
+
+#include <sys/types.h>
+#ifndef _KERNEL
+#include <stdbool.h>
+#endif
+
+/*
+ * Case-folded names, for comparing one name with many in the HFS+ order.
+ *
+ * FastUnicodeCompare() folds both of its names through the case folding
+ * tables, a character at a time, every time it is called; a B-tree search
+ * or a catalog scan calls it over and over with the same search name.
+ * FastUnicodeFold() folds a name once, dropping the ignorable characters,
+ * and FastUnicodeCompareFolded() compares a folded name with a name as
+ * stored, with the same result as FastUnicodeCompare() would have given
+ * for the two names.
+ *
+ * Both go through the name four characters at a time while those are
+ * non-NUL ASCII, which is the whole of most names: four characters are
+ * folded together in a 64-bit word, and compared with the folded name in
+ * one go.  Anything else takes the table lookup path of
+ * FastUnicodeCompare().  Those four-character probes cost more than they save
+ * when the search name is not ASCII, so callers check the folded name with
+ * FastUnicodeIsASCII() and use FastUnicodeCompare() for any other name.
+ */
+
+__BEGIN_DECLS
+u_int32_t FastUnicodeFold(const u_int16_t *str, u_int32_t length, u_int16_t *folded);
+bool FastUnicodeIsASCII(const u_int16_t *str, u_int32_t length);
+int32_t FastUnicodeCompareFolded(const u_int16_t *folded, u_int32_t foldedLength,
+								 const u_int16_t *str, u_int32_t length);
+__END_DECLS
+
+#endif /* ! _HFS_UNIFOLD_H_ */
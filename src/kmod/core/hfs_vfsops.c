@@ -329,6 +329,9 @@ hfs_mount(struct mount *mp)
                 CLR(hfsmp->hfs_mp->mnt_flag, MNT_JOURNALED);
 			}
 
+			/* Nothing more will be freed; unmap what has been */
+			hfs_discard_stop(hfsmp);
+
 			/*
 			 * Write out any pending I/O still outstanding against the device node
 			 * now that the journal has been closed.
@@ -348,9 +351,12 @@ hfs_mount(struct mount *mp)
 				hfsmp->hfs_flags &= ~HFS_READ_ONLY;
 				goto out;
 			}
+
+			/* Nothing more will be allocated; empty the allocation pools */
+			hfs_alloc_pools_drain(hfsmp);
 		
 			if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
-				if (hfsmp->hfs_summary_table) {
+				if (hfsmp->hfs_summary.st_chunk_free) {
 					int err = 0;
 					/* 
 					 * Take the bitmap lock to serialize against a concurrent bitmap scan still in progress 
@@ -358,8 +364,7 @@ hfs_mount(struct mount *mp)
 					if (hfsmp->hfs_allocation_vp) {
 						err = hfs_lock (VTOC(hfsmp->hfs_allocation_vp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT);
 					}
-					hfs_free(hfsmp->hfs_summary_table, hfsmp->hfs_summary_bytes);
-					hfsmp->hfs_summary_table = NULL;
+					sum_destroy(&hfsmp->hfs_summary);
 					hfsmp->hfs_flags &= ~HFS_SUMMARY_TABLE;
 					if (err == 0 && hfsmp->hfs_allocation_vp){
 						hfs_unlock (VTOC(hfsmp->hfs_allocation_vp));
@@ -422,10 +427,14 @@ hfs_mount(struct mount *mp)
 				 * Set up the trim callback function so that we can add
 				 * recently freed extents to the free extent cache once
 				 * the transaction that freed them is written to the
-				 * journal on disk.
+				 * journal on disk.  The callback also queues them for
+				 * the discard thread, rather than the journal unmapping
+				 * them there and then.
 				 */
-				if (hfsmp->jnl)
-                    journal_trim_set_callback(hfsmp->jnl, &hfs_trim_callback, hfsmp);
+				if (hfsmp->jnl) {
+					journal_trim_set_callback(hfsmp->jnl, &hfs_trim_callback, hfsmp);
+					journal_trim_set_unmap(hfsmp->jnl, FALSE);
+				}
 				
 				hfs_unlock_global (hfsmp);
 
@@ -847,6 +856,9 @@ hfs_reload(struct mount *mountp, struct thread *td, int flags)
 	if (vinvalbuf(devvp, 0, 0, 0))
 		panic("hfs_reload: dirty1");
 
+	/* Hints kept for directories no longer in core are stale too. */
+	hfs_dirhint_purge(hfsmp, 0);
+
 	/*
 	 * hfs_reload_callback will be called for each vnode
 	 * hung off of this mount point that can't be recycled...
@@ -1461,6 +1473,9 @@ hfs_mountfs(struct vnode *devvp, struct mount *mp, struct hfs_mount_args *args,
 	lck_mtx_init(&hfsmp->hfc_mutex, hfs_mutex_group, hfs_lock_attr);
 	lck_rw_init(&hfsmp->hfs_global_lock, hfs_rwlock_group, hfs_lock_attr);
 	lck_spin_init(&hfsmp->vcbFreeExtLock, hfs_spinlock_group, hfs_lock_attr);
+	fe_init(&hfsmp->vcbFreeExt, kMaxFreeExtents);
+	hfs_discard_init(hfsmp);
+	hfs_dirhint_init(hfsmp);
 
 	if (mp) {
         mp->mnt_data = hfsmp;
@@ -1527,6 +1542,7 @@ hfs_mountfs(struct vnode *devvp, struct mount *mp, struct hfs_mount_args *args,
 	// Reservations
 	rl_init(&hfsmp->hfs_reserved_ranges[0]);
 	rl_init(&hfsmp->hfs_reserved_ranges[1]);
+	hfs_alloc_pools_init(hfsmp);
 
 	// record the current time at which we're mounting this volume
 	struct timeval tv;
@@ -2067,6 +2083,9 @@ error_exit:
 	if (bp != NULL)
 		brelse(bp);
 
+	if (hfsmp)
+		hfs_discard_stop(hfsmp);
+
 	if (cp != NULL){
 		g_topology_lock();
 		g_vfs_close(cp);
@@ -2081,6 +2100,10 @@ error_exit:
 		if (hfsmp->hfs_devvp) {
 			vrele(hfsmp->hfs_devvp);
 		}
+		ResetVCBFreeExtCache(hfsmp);
+		hfs_alloc_pools_destroy(hfsmp);
+		hfs_discard_destroy(hfsmp);
+		hfs_dirhint_destroy(hfsmp);
 		hfs_locks_destroy(hfsmp);
 		hfs_delete_chash(hfsmp);
 		hfs_idhash_destroy (hfsmp);
@@ -2139,9 +2162,12 @@ hfs_unmount(struct mount *mp, int mntflags)
 		(void) hfs_recording_suspend(hfsmp);
     
 	hfs_syncer_free(hfsmp);
+
+	/* Give back the blocks still held by the allocation pools */
+	hfs_alloc_pools_drain(hfsmp);
     
 	if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
-		if (hfsmp->hfs_summary_table) {
+		if (hfsmp->hfs_summary.st_chunk_free) {
 			int err = 0;
 			/* 
 		 	 * Take the bitmap lock to serialize against a concurrent bitmap scan still in progress 
@@ -2149,8 +2175,7 @@ hfs_unmount(struct mount *mp, int mntflags)
 			if (hfsmp->hfs_allocation_vp) {
 				err = hfs_lock (VTOC(hfsmp->hfs_allocation_vp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT);
 			}
-			hfs_free(hfsmp->hfs_summary_table, hfsmp->hfs_summary_bytes);
-			hfsmp->hfs_summary_table = NULL;
+			sum_destroy(&hfsmp->hfs_summary);
 			hfsmp->hfs_flags &= ~HFS_SUMMARY_TABLE;
 			
 			if (err == 0 && hfsmp->hfs_allocation_vp){
@@ -2223,17 +2248,13 @@ hfs_unmount(struct mount *mp, int mntflags)
 		}
 
 		if (hfsmp->hfs_flags & HFS_HAS_SPARSE_DEVICE) {
-			int i;
 			u_int32_t min_start = hfsmp->totalBlocks;
+			u_int32_t min_count;
 			
 			// set the nextAllocation pointer to the smallest free block number
 			// we've seen so on the next mount we won't rescan unnecessarily
 			lck_spin_lock(&hfsmp->vcbFreeExtLock);
-			for(i=0; i < (int)hfsmp->vcbFreeExtCnt; i++) {
-				if (hfsmp->vcbFreeExt[i].startBlock < min_start) {
-					min_start = hfsmp->vcbFreeExt[i].startBlock;
-				}
-			}
+			(void) fe_find_lowest(&hfsmp->vcbFreeExt, &min_start, &min_count);
 			lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 			if (min_start < hfsmp->nextAllocation) {
 				hfsmp->nextAllocation = min_start;
@@ -2274,6 +2295,9 @@ hfs_unmount(struct mount *mp, int mntflags)
 	    hfsmp->jnl = NULL;
 	}
 
+	/* The journal has handed over the last freed extents; unmap them */
+	hfs_discard_stop(hfsmp);
+
 	VOP_FSYNC(hfsmp->hfs_devvp, MNT_WAIT, td);
 
 	hfs_close_jvp(hfsmp, td);
@@ -2301,6 +2325,10 @@ hfs_unmount(struct mount *mp, int mntflags)
 
 	vrele(hfsmp->hfs_devvp);
 
+	ResetVCBFreeExtCache(hfsmp);
+	hfs_alloc_pools_destroy(hfsmp);
+	hfs_discard_destroy(hfsmp);
+	hfs_dirhint_destroy(hfsmp);
 	hfs_locks_destroy(hfsmp);
 	hfs_delete_chash(hfsmp);
 	hfs_idhash_destroy(hfsmp);
@@ -3158,10 +3186,14 @@ hfs_sysctl(struct mount *mp, fsctlop_t op,struct sysctl_req *req)
 		 * Set up the trim callback function so that we can add
 		 * recently freed extents to the free extent cache once
 		 * the transaction that freed them is written to the
-		 * journal on disk.
+		 * journal on disk.  The callback also queues them for
+		 * the discard thread, rather than the journal unmapping
+		 * them there and then.
 		 */
-		if (jnl)
+		if (jnl) {
 			journal_trim_set_callback(jnl, hfs_trim_callback, hfsmp);
+			journal_trim_set_unmap(jnl, FALSE);
+		}
 
 		if (jnl == NULL) {
 			printf("hfs: FAILED to create the journal!\n");
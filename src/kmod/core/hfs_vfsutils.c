@@ -69,6 +69,7 @@
 #include "hfs_cnode.h"
 #include "hfs_fsctl.h"
 #include "hfs_cprotect.h"
+#include "hfs_btseq.h"
 
 #include "FileMgrInternal.h"
 #include "BTreesInternal.h"
@@ -1727,6 +1728,11 @@ _hfs_systemfile_unlock(struct hfsmount *hfsmp, int flags, const char *func, cons
 				hfs_btsync(hfsmp->hfs_catalog_vp, HFS_SYNCTRANS);
 			}
 		}
+		/* A writer's changes are all in place; unlocked searches may use them */
+		if (hfsmp->hfs_catalog_cp->c_lockowner == curthread) {
+			hfs_btseq_commit((struct BTreeControlBlock *)
+							 VTOF(hfsmp->hfs_catalog_vp)->fcbBTCBPtr);
+		}
 		_hfs_unlock(hfsmp->hfs_catalog_cp, file, line);
 	}
 	if (flags & SFL_BITMAP && hfsmp->hfs_allocation_cp) {
@@ -2403,17 +2409,18 @@ directoryhint_t *
 hfs_getdirhint(struct cnode *dcp, int index, int detach)
 {
 	struct timeval tv;
-	directoryhint_t *hint;
+	directoryhint_t *hint, *prev;
 	boolean_t need_remove, need_init;
 	const u_int8_t * name;
 
 	microuptime(&tv);
 
 	/*
-	 *  Look for an existing hint first.  If not found, create a new one (when
-	 *  the list is not full) or recycle the oldest hint.  Since new hints are
-	 *  always added to the head of the list, the last hint is always the
-	 *  oldest.
+	 *  Look for an existing hint first, then for one kept in the mount's
+	 *  table since an earlier vnode of this directory.  If not found, create
+	 *  a new one (when the list is not full) or recycle the oldest hint.
+	 *  Since new hints are always added to the head of the list, the last
+	 *  hint is always the oldest.
 	 */
 	TAILQ_FOREACH(hint, &dcp->c_hintlist, dh_link) {
 		if (hint->dh_index == index)
@@ -2422,6 +2429,24 @@ hfs_getdirhint(struct cnode *dcp, int index, int detach)
 	if (hint != NULL) { /* found an existing hint */
 		need_init = false;
 		need_remove = true;
+	} else if ((hint = hfs_dirhint_restore(VTOHFS(dcp->c_vp), dcp->c_fileid, index)) != NULL) {
+		/* a hint kept from before the directory went out of use */
+		need_init = false;
+		need_remove = false;
+		if (dcp->c_dirhintcnt < HFS_MAXDIRHINTS) {
+			++dcp->c_dirhintcnt;
+		} else {				/* make room by releasing the oldest hint */
+			prev = TAILQ_LAST(&dcp->c_hintlist, hfs_hinthead);
+			TAILQ_REMOVE(&dcp->c_hintlist, prev, dh_link);
+			if ((prev->dh_desc.cd_flags & CD_HASBUF) &&
+			    (name = prev->dh_desc.cd_nameptr)) {
+				prev->dh_desc.cd_nameptr = NULL;
+				prev->dh_desc.cd_namelen = 0;
+				prev->dh_desc.cd_flags &= ~CD_HASBUF;
+				vfs_removename((const char *)name);
+			}
+			hfs_zfree(prev, HFS_DIRHINT_ZONE);
+		}
 	} else { /* cannot find an existing hint */
 		need_init = true;
 		if (dcp->c_dirhintcnt < HFS_MAXDIRHINTS) { /* we don't need recycling */
@@ -2459,6 +2484,7 @@ hfs_getdirhint(struct cnode *dcp, int index, int detach)
 		hint->dh_desc.cd_parentcnid = dcp->c_fileid;
 		hint->dh_desc.cd_hint = dcp->c_childhint;
 		hint->dh_desc.cd_cnid = 0;
+		hint->dh_recindex = 0;
 	}
 	hint->dh_time = (u_int) tv.tv_sec;
 	return (hint);
@@ -2853,8 +2879,10 @@ hfs_early_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp,
 									arg_tbufsz,
 									hfs_sync_metadata, hfsmp->hfs_mp,
 									hfsmp->hfs_mp);
-		if (hfsmp->jnl)
+		if (hfsmp->jnl) {
 			journal_trim_set_callback(hfsmp->jnl, hfs_trim_callback, hfsmp);
+			journal_trim_set_unmap(hfsmp->jnl, FALSE);
+		}
 
 		// no need to start a transaction here... if this were to fail
 		// we'd just re-init it on the next mount.
@@ -2878,8 +2906,10 @@ hfs_early_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp,
 								  arg_tbufsz,
 								  hfs_sync_metadata, hfsmp->hfs_mp,
 								  hfsmp->hfs_mp);
-		if (hfsmp->jnl)
+		if (hfsmp->jnl) {
 			journal_trim_set_callback(hfsmp->jnl, hfs_trim_callback, hfsmp);
+			journal_trim_set_unmap(hfsmp->jnl, FALSE);
+		}
 
 		if (write_jibp) {
 			bwrite(jinfo_bp);
@@ -3120,8 +3150,10 @@ hfs_late_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp, void *_a
 									arg_tbufsz,
 									hfs_sync_metadata, hfsmp->hfs_mp,
 									hfsmp->hfs_mp);
-		if (hfsmp->jnl)
+		if (hfsmp->jnl) {
 			journal_trim_set_callback(hfsmp->jnl, hfs_trim_callback, hfsmp);
+			journal_trim_set_unmap(hfsmp->jnl, FALSE);
+		}
 
 		// no need to start a transaction here... if this were to fail
 		// we'd just re-init it on the next mount.
@@ -3153,8 +3185,10 @@ hfs_late_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp, void *_a
 								  arg_tbufsz,
 								  hfs_sync_metadata, hfsmp->hfs_mp,
 								  hfsmp->hfs_mp);
-		if (hfsmp->jnl)
+		if (hfsmp->jnl) {
 			journal_trim_set_callback(hfsmp->jnl, hfs_trim_callback, hfsmp);
+			journal_trim_set_unmap(hfsmp->jnl, FALSE);
+		}
 	}
 			
 
@@ -4409,6 +4443,24 @@ void *hfs_malloc(size_t size)
 	return ptr;
 }
 
+/*
+ * Like hfs_malloc, but never sleeps, so it can be called with a mutex held.
+ * Returns NULL if no memory is available right away.
+ */
+void *hfs_malloc_nowait(size_t size)
+{
+#if HFS_MALLOC_DEBUG
+	return hfs_malloc(size);
+#else
+	void *ptr;
+	ptr = malloc(size, M_HFS, M_NOWAIT | M_ZERO);
+	if (ptr)
+		atomic_add_long(&hfs_allocated, size);
+
+	return ptr;
+#endif
+}
+
 void hfs_free(void *ptr, size_t size)
 {
 	if (!ptr)
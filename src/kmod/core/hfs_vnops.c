@@ -718,6 +718,8 @@ hfs_vnop_close(struct vop_close_args *ap)
 		hfs_touchtimes(VTOHFS(vp), cp);	
 	}
 	if ((vp->v_type & VDIR)) {
+		if (!busy)
+			hfs_savedirhints(hfsmp, cp);
 		hfs_reldirhints(cp, busy);
 	} else if (vp->v_vflag & VV_SYSTEM && !busy) {
 		vrecycle(vp);
@@ -6592,6 +6594,7 @@ hfs_vnop_readdir(struct vop_readdir_args *ap)
 			if ( localhint.dh_desc.cd_parentcnid == cp->c_fileid) {
 				localhint.dh_index = index - 1;
 				localhint.dh_time = 0;
+				localhint.dh_recindex = 0;
 				bzero(&localhint.dh_link, sizeof(localhint.dh_link));
 				dirhint = &localhint;  /* don't forget to release the descriptor */
 			} else {
@@ -6708,8 +6711,8 @@ hfs_vnop_readdir(struct vop_readdir_args *ap)
 
 
 	/* Convert catalog directory index back into an offset. */
-	while (tag == 0)
-		tag = (++cp->c_dirhinttag) << HFS_INDEX_BITS;	
+	if (tag == 0)
+		tag = hfs_newdirhinttag(hfsmp, cp);
 	uio->uio_offset = (index + 2) | tag;
 	dirhint->dh_index |= tag;
 
@@ -0,0 +1 @@
+../../core/hfs_bitmap.h
\ No newline at end of file
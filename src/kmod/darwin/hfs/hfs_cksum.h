@@ -0,0 +1 @@
+../../core/hfs_cksum.h
\ No newline at end of file
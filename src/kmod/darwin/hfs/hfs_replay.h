@@ -0,0 +1 @@
+../../core/hfs_replay.h
\ No newline at end of file
@@ -0,0 +1,353 @@
+//
+//  hfs_bitmap_bench.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Check and time the bit-run routines in core/hfs_bitmap.h against the
+ * one-32-bit-word-at-a-time loops they replace.
+ *
+ * First compares every routine with the reference on random unaligned
+ * ranges of a small random bitmap, and fails on the first difference.  Then
+ * builds a large synthetic bitmap (by default the largest an HFS+ volume can
+ * have: 2^32 - 1 blocks, 512 MB of bitmap) and times, for each pattern:
+ *
+ *	count	free blocks in the whole bitmap (the mount-time scan)
+ *	runs	every run of -m free blocks, first fit, start to end
+ *		(BlockFindContiguous, fsck's FindContigClearedBitmapBits)
+ *	fill	setting then clearing the runs found above
+ *		(BlockMarkAllocatedInternal / BlockMarkFreeInternal)
+ *
+ *	cc -O2 -I../core -o hfs_bitmap_bench hfs_bitmap_bench.c
+ *
+ *	hfs_bitmap_bench [-b blocks] [-m run] [-p passes] [-s seed]
+ */
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfs_bitmap.h"
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t
+rnd(u_int32_t n)
+{
+	return n ? (u_int32_t)(random() % n) : 0;
+}
+
+
+// -- Reference: 32-bit big-endian words, a bit at a time within a word --
+
+static inline bool
+ref_test(const u_int32_t *map, u_int32_t bit)
+{
+	return (ntohl(map[bit / 32]) & (0x80000000u >> (bit % 32))) != 0;
+}
+
+static u_int32_t
+ref_find(const u_int32_t *map, u_int32_t start, u_int32_t end, bool set)
+{
+	u_int32_t bit = start;
+
+	while (bit < end) {
+		u_int32_t word = ntohl(map[bit / 32]);
+
+		if ((bit % 32) == 0 && end - bit >= 32 && word == (set ? 0 : 0xffffffffu)) {
+			bit += 32;
+			continue;
+		}
+		if (((word & (0x80000000u >> (bit % 32))) != 0) == set)
+			return bit;
+		bit++;
+	}
+	return end;
+}
+
+static u_int32_t
+ref_find_clear_run(const u_int32_t *map, u_int32_t start, u_int32_t end, u_int32_t count)
+{
+	u_int32_t first = 0, found = 0;
+	u_int32_t bit;
+
+	for (bit = start; bit < end; bit++) {
+		if (ref_test(map, bit)) {
+			found = 0;
+			continue;
+		}
+		if (found++ == 0)
+			first = bit;
+		if (found == count)
+			return first;
+	}
+	return end;
+}
+
+static u_int32_t
+ref_count(const u_int32_t *map, u_int32_t start, u_int32_t end, bool set)
+{
+	u_int32_t bit, n = 0;
+
+	for (bit = start; bit < end; bit++)
+		n += ref_test(map, bit) == set;
+	return n;
+}
+
+static bool
+ref_fill(u_int32_t *map, u_int32_t start, u_int32_t count, bool set)
+{
+	u_int32_t first = start % 32;
+	u_int32_t *word = map + start / 32;
+	u_int32_t mask, seen = 0;
+
+	if (first) {
+		mask = 0xffffffffu >> first;
+		if (first + count < 32) {
+			mask &= ~(0xffffffffu >> (first + count));
+			count = 0;
+		} else
+			count -= 32 - first;
+		seen |= (set ? *word : ~*word) & htonl(mask);
+		*word = set ? *word | htonl(mask) : *word & ~htonl(mask);
+		word++;
+	}
+	for (; count >= 32; count -= 32, word++) {
+		seen |= set ? *word : ~*word;
+		*word = set ? 0xffffffffu : 0;
+	}
+	if (count) {
+		mask = ~(0xffffffffu >> count);
+		seen |= (set ? *word : ~*word) & htonl(mask);
+		*word = set ? *word | htonl(mask) : *word & ~htonl(mask);
+	}
+	return seen != 0;
+}
+
+
+// -- Bitmaps --
+
+static void
+pattern(u_int32_t *map, u_int64_t bits, u_int32_t max_run, unsigned fill)
+{
+	u_int64_t bit, run;
+
+	memset(map, 0, ((bits + 31) / 32) * 4);
+	for (bit = 0; bit < bits; bit += run) {
+		bool set = rnd(100) < fill;
+
+		run = 1 + rnd(max_run);
+		if (run > bits - bit)
+			run = bits - bit;
+		if (set)
+			hfs_bm_set(map, (u_int32_t)bit, (u_int32_t)run);
+	}
+}
+
+static void
+check(void)
+{
+	const u_int32_t bits = 1 << 16;
+	u_int32_t *map = calloc(bits / 32, 4);
+	u_int32_t *ref = calloc(bits / 32, 4);
+	int i;
+
+	if (map == NULL || ref == NULL)
+		err(1, "check");
+	for (i = 0; i < 200000; i++) {
+		u_int32_t start = rnd(bits), end = start + rnd(bits - start + 1);
+		u_int32_t count = 1 + rnd(i % 3 ? 40 : 700);
+		bool set = rnd(2);
+
+		if (i % 5000 == 0) {
+			pattern(map, bits, 1 + rnd(300), rnd(101));
+			memcpy(ref, map, bits / 8);
+		}
+		switch (rnd(4)) {
+		case 0:
+			if (hfs_bm_find(map, start, end, set) != ref_find(ref, start, end, set))
+				errx(1, "find %d [%u, %u): %u, expected %u", set, start, end,
+					 hfs_bm_find(map, start, end, set), ref_find(ref, start, end, set));
+			break;
+		case 1:
+			if (hfs_bm_find_clear_run(map, start, end, count) !=
+				ref_find_clear_run(ref, start, end, count))
+				errx(1, "find_clear_run [%u, %u) %u: %u, expected %u", start, end, count,
+					 hfs_bm_find_clear_run(map, start, end, count),
+					 ref_find_clear_run(ref, start, end, count));
+			break;
+		case 2:
+			if (hfs_bm_count(map, start, end, set) != ref_count(ref, start, end, set))
+				errx(1, "count %d [%u, %u): %u, expected %u", set, start, end,
+					 hfs_bm_count(map, start, end, set), ref_count(ref, start, end, set));
+			break;
+		default:
+			if (count > bits - start)
+				count = bits - start;
+			if (hfs_bm_fill(map, start, count, set) != ref_fill(ref, start, count, set))
+				errx(1, "fill %d %u+%u: wrong overlap", set, start, count);
+			if (memcmp(map, ref, bits / 8) != 0)
+				errx(1, "fill %d %u+%u: bitmaps differ", set, start, count);
+			break;
+		}
+	}
+	free(map);
+	free(ref);
+}
+
+
+// -- Timing --
+
+struct result {
+	u_int64_t	count_ns;
+	u_int64_t	runs_ns;
+	u_int64_t	fill_ns;
+	u_int64_t	free_blocks;
+	u_int64_t	runs;
+};
+
+static void
+run(bool ref, u_int32_t *map, u_int32_t bits, u_int32_t want, struct result *r)
+{
+	u_int32_t start;
+	u_int64_t t;
+
+	t = now_ns();
+	r->free_blocks += ref ? ref_count(map, 0, bits, false) : hfs_bm_count_clear(map, 0, bits);
+	r->count_ns += now_ns() - t;
+
+	t = now_ns();
+	for (start = 0; ; start += want) {
+		start = ref ? ref_find_clear_run(map, start, bits, want)
+					: hfs_bm_find_clear_run(map, start, bits, want);
+		if (start >= bits)
+			break;
+		r->runs++;
+		if (bits - start <= want)
+			break;
+	}
+	r->runs_ns += now_ns() - t;
+
+	t = now_ns();
+	for (start = 0; ; ) {
+		u_int32_t end;
+
+		start = hfs_bm_find_clear_run(map, start, bits, want);
+		if (start >= bits)
+			break;
+		end = hfs_bm_find_set(map, start, bits);
+		if (ref) {
+			ref_fill(map, start, end - start, true);
+			ref_fill(map, start, end - start, false);
+		} else {
+			hfs_bm_set(map, start, end - start);
+			hfs_bm_clear(map, start, end - start);
+		}
+		start = end;
+	}
+	r->fill_ns += now_ns() - t;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_bitmap_bench [-b blocks] [-m run] [-p passes] [-s seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		u_int32_t	max_run;
+		unsigned	fill;
+	} patterns[] = {
+		{ "fragmented",	64,		50 },
+		{ "aged",		4096,	90 },
+		{ "empty",		1 << 20, 0 },
+	};
+	u_int64_t bits = 0xffffffffULL;
+	u_int32_t want = 256;
+	u_int32_t *map;
+	unsigned p;
+	int passes = 1;
+	int ch, i;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "b:m:p:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bits = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			want = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || bits == 0 || bits > 0xffffffffULL || want == 0 || passes <= 0)
+		usage();
+
+	check();
+	printf("hfs_bitmap_bench: routines agree with the reference\n");
+
+	map = malloc(((bits + 31) / 32) * 4);
+	if (map == NULL)
+		err(1, "bitmap");
+	printf("%llu blocks, %.1f MB of bitmap, %d pass(es), runs of %u\n",
+		   (unsigned long long)bits, bits / 8 / 1048576.0, passes, want);
+	printf("%-11s %-8s %9s %9s %9s %12s %10s\n",
+		   "pattern", "code", "count GB/s", "runs GB/s", "fill s", "free", "runs");
+
+	for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+		struct result res[2];
+		int which;
+
+		memset(res, 0, sizeof(res));
+		pattern(map, bits, patterns[p].max_run, patterns[p].fill);
+		for (i = 0; i < passes; i++) {
+			for (which = 0; which < 2; which++)
+				run(which == 1, map, (u_int32_t)bits, want, &res[which]);
+		}
+		if (res[0].free_blocks != res[1].free_blocks || res[0].runs != res[1].runs)
+			errx(1, "%s: results differ", patterns[p].name);
+		for (which = 0; which < 2; which++) {
+			double gb = (double)bits / 8 * passes / 1e9;
+
+			printf("%-11s %-8s %9.2f %9.2f %9.2f %12llu %10llu\n",
+				   patterns[p].name, which ? "word32" : "bitmap.h",
+				   gb / (res[which].count_ns / 1e9), gb / (res[which].runs_ns / 1e9),
+				   res[which].fill_ns / 1e9,
+				   (unsigned long long)res[which].free_blocks / passes,
+				   (unsigned long long)res[which].runs / passes);
+		}
+	}
+	free(map);
+
+	return 0;
+}
@@ -0,0 +1,468 @@
+//
+//  hfs_freeext_test.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Userspace check of the allocator's free extent index (core/hfs_freeext.c).
+ *
+ * Loads a volume bitmap (a copy of an HFS+ allocation file, or a random one),
+ * builds the index from it the way the mount-time scan does, then runs a
+ * random mix of allocations, frees and queries against both the index and a
+ * plain scan of the bitmap, and fails on the first disagreement.
+ *
+ *	cc -DHFS_ALLOC_TEST=1 -I../core -o hfs_freeext_test \
+ *		hfs_freeext_test.c ../core/hfs_freeext.c
+ *
+ *	hfs_freeext_test [-v] [-b blocks] [-n ops] [-s seed] [bitmap-file]
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfs_freeext.h"
+
+#define SCAN_RANGE_BLOCKS	(1024 * 8)	/* blocks per mount-scan range */
+
+static u_int8_t *bitmap;
+static u_int32_t total_blocks;
+static struct fe_index fi;
+static int verbose;
+static u_int64_t index_ns, scan_ns;
+
+static inline bool
+is_allocated(u_int32_t block)
+{
+	return (bitmap[block >> 3] & (0x80 >> (block & 7))) != 0;
+}
+
+static void
+mark(u_int32_t start, u_int32_t count, bool allocated)
+{
+	for (; count; start++, count--) {
+		if (allocated)
+			bitmap[start >> 3] |= 0x80 >> (start & 7);
+		else
+			bitmap[start >> 3] &= ~(0x80 >> (start & 7));
+	}
+}
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t
+rnd(u_int32_t n)
+{
+	return n ? (u_int32_t)(random() % n) : 0;
+}
+
+static void
+prime(void)
+{
+	struct fe_chunk *chunk;
+
+	if (fi.fi_spare_count >= FE_SPARE_LOW)
+		return;
+	chunk = fe_chunk_alloc();
+	if (chunk == NULL)
+		err(1, "fe_chunk_alloc");
+	fe_chunk_add(&fi, chunk);
+}
+
+static void
+index_add(u_int32_t start, u_int32_t count)
+{
+	prime();
+	if (!fe_add(&fi, start, count))
+		errx(1, "fe_add(%u, %u) dropped an extent", start, count);
+}
+
+static void
+index_remove(u_int32_t start, u_int32_t count)
+{
+	prime();
+	(void) fe_remove(&fi, start, count);
+}
+
+
+// -- Bitmap scanner --
+
+/* Next free run at or after 'block'; returns false at the end of the volume. */
+static bool
+scan_next_run(u_int32_t block, u_int32_t *start, u_int32_t *count)
+{
+	while (block < total_blocks && is_allocated(block))
+		block++;
+	if (block >= total_blocks)
+		return false;
+	*start = block;
+	while (block < total_blocks && !is_allocated(block))
+		block++;
+	*count = block - *start;
+	return true;
+}
+
+static bool
+scan_find_best(u_int32_t min_count, u_int32_t *start, u_int32_t *count)
+{
+	u_int32_t s, c, block = 0;
+	bool found = false;
+
+	while (scan_next_run(block, &s, &c)) {
+		if (c >= min_count && (!found || c < *count)) {
+			*start = s;
+			*count = c;
+			found = true;
+		}
+		block = s + c;
+	}
+	return found;
+}
+
+static bool
+scan_find_largest(u_int32_t *start, u_int32_t *count)
+{
+	u_int32_t s, c, block = 0;
+	bool found = false;
+
+	/* Ties go to the highest start, as in the index. */
+	while (scan_next_run(block, &s, &c)) {
+		if (!found || c >= *count) {
+			*start = s;
+			*count = c;
+			found = true;
+		}
+		block = s + c;
+	}
+	return found;
+}
+
+static bool
+scan_find_range(u_int32_t lo, u_int32_t hi, u_int32_t min_count,
+				u_int32_t *start, u_int32_t *count)
+{
+	u_int32_t block, s;
+
+	if (min_count == 0)
+		min_count = 1;
+	if (hi > total_blocks)
+		hi = total_blocks;
+	for (block = lo; block < hi; ) {
+		if (is_allocated(block)) {
+			block++;
+			continue;
+		}
+		s = block;
+		while (block < hi && !is_allocated(block))
+			block++;
+		if (block - s >= min_count) {
+			*start = s;
+			*count = block - s;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// -- Checks --
+
+struct walk {
+	u_int32_t	block;
+	u_int32_t	extents;
+};
+
+static int
+check_extent(void *arg, u_int32_t start, u_int32_t count)
+{
+	struct walk *w = arg;
+	u_int32_t s, c;
+
+	if (!scan_next_run(w->block, &s, &c))
+		errx(1, "index has (%u, %u) past the last free run", start, count);
+	if (s != start || c != count)
+		errx(1, "index has (%u, %u), bitmap has (%u, %u)", start, count, s, c);
+	w->block = s + c;
+	w->extents++;
+	return 0;
+}
+
+static void
+check_all(void)
+{
+	struct walk w = { 0, 0 };
+	u_int32_t s, c;
+
+	fe_iterate(&fi, check_extent, &w);
+	if (scan_next_run(w.block, &s, &c))
+		errx(1, "bitmap run (%u, %u) is missing from the index", s, c);
+	if (w.extents != fi.fi_count)
+		errx(1, "index counts %u extents, holds %u", fi.fi_count, w.extents);
+}
+
+static void
+check_query(const char *what, bool found_i, u_int32_t s_i, u_int32_t c_i,
+			bool found_s, u_int32_t s_s, u_int32_t c_s)
+{
+	if (found_i != found_s || (found_i && (s_i != s_s || c_i != c_s)))
+		errx(1, "%s: index %s (%u, %u), bitmap %s (%u, %u)", what,
+			 found_i ? "found" : "missed", s_i, c_i,
+			 found_s ? "found" : "missed", s_s, c_s);
+}
+
+static void
+check_queries(void)
+{
+	u_int32_t min_count = 1 + rnd(rnd(2) ? 8 : 4096);
+	u_int32_t lo = rnd(total_blocks);
+	u_int32_t hi = lo + rnd(total_blocks - lo) + 1;
+	u_int32_t s_i = 0, c_i = 0, s_s = 0, c_s = 0;
+	bool found_i, found_s;
+	u_int64_t t;
+
+	t = now_ns();
+	found_i = fe_find_best(&fi, min_count, &s_i, &c_i);
+	index_ns += now_ns() - t;
+	t = now_ns();
+	found_s = scan_find_best(min_count, &s_s, &c_s);
+	scan_ns += now_ns() - t;
+	check_query("best fit", found_i, s_i, c_i, found_s, s_s, c_s);
+
+	found_i = fe_find_largest(&fi, &s_i, &c_i);
+	found_s = scan_find_largest(&s_s, &c_s);
+	check_query("largest", found_i, s_i, c_i, found_s, s_s, c_s);
+
+	t = now_ns();
+	found_i = fe_find_range(&fi, lo, hi, min_count, &s_i, &c_i);
+	index_ns += now_ns() - t;
+	t = now_ns();
+	found_s = scan_find_range(lo, hi, min_count, &s_s, &c_s);
+	scan_ns += now_ns() - t;
+	check_query("range", found_i, s_i, c_i, found_s, s_s, c_s);
+}
+
+
+// -- Operations --
+
+static void
+do_allocate(void)
+{
+	u_int32_t want = 1 + rnd(rnd(4) ? 16 : 2048);
+	u_int32_t start, count;
+
+	if (rnd(2)) {
+		if (!fe_find_best(&fi, want, &start, &count) &&
+			!fe_find_largest(&fi, &start, &count))
+			return;
+	} else {
+		u_int32_t from = rnd(total_blocks);
+
+		if (!fe_find_range(&fi, from, total_blocks, want, &start, &count) &&
+			!fe_find_range(&fi, 0, from, want, &start, &count))
+			return;
+	}
+	if (count > want)
+		count = want;
+	mark(start, count, true);
+	index_remove(start, count);
+}
+
+static void
+do_free(void)
+{
+	u_int32_t block = rnd(total_blocks);
+	u_int32_t start, count;
+
+	/* Free (part of) the allocated run at or after a random block. */
+	while (block < total_blocks && !is_allocated(block))
+		block++;
+	if (block >= total_blocks)
+		return;
+	start = block;
+	count = 1 + rnd(rnd(4) ? 16 : 2048);
+	while (block < total_blocks && block - start < count && is_allocated(block))
+		block++;
+	count = block - start;
+	mark(start, count, false);
+	index_add(start, count);
+}
+
+static void
+do_claim(void)
+{
+	u_int32_t start = rnd(total_blocks);
+	u_int32_t count = 1 + rnd(512);
+
+	/* Allocate a fixed range, whatever is in it (a resize or a journal) */
+	if (count > total_blocks - start)
+		count = total_blocks - start;
+	mark(start, count, true);
+	index_remove(start, count);
+}
+
+
+// -- Setup --
+
+static void
+load_bitmap(const char *path, u_int32_t blocks)
+{
+	ssize_t n;
+	off_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(1, "%s", path);
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0)
+		errx(1, "%s: empty", path);
+	if (blocks == 0 || (off_t)blocks > size * 8)
+		blocks = (u_int32_t)(size * 8 > UINT32_MAX ? UINT32_MAX : size * 8);
+	total_blocks = blocks;
+	bitmap = calloc(1, ((size_t)blocks + 7) / 8);
+	if (bitmap == NULL)
+		err(1, "bitmap");
+	n = pread(fd, bitmap, ((size_t)blocks + 7) / 8, 0);
+	if (n != (ssize_t)(((size_t)blocks + 7) / 8))
+		err(1, "%s: read", path);
+	close(fd);
+}
+
+static void
+random_bitmap(u_int32_t blocks)
+{
+	u_int32_t block, run;
+	bool allocated = true;
+
+	total_blocks = blocks;
+	bitmap = calloc(1, ((size_t)blocks + 7) / 8);
+	if (bitmap == NULL)
+		err(1, "bitmap");
+	for (block = 0; block < blocks; block += run) {
+		run = 1 + rnd(rnd(8) ? 32 : 4096);
+		if (run > blocks - block)
+			run = blocks - block;
+		if (allocated)
+			mark(block, run, true);
+		allocated = !allocated;
+	}
+}
+
+/* Add the free runs one scan range at a time, as hfs_alloc_scan_range does. */
+static void
+build_index(void)
+{
+	u_int32_t range, range_end, block, start, count;
+
+	for (range = 0; range < total_blocks; range = range_end) {
+		range_end = range + SCAN_RANGE_BLOCKS;
+		if (range_end > total_blocks || range_end < range)
+			range_end = total_blocks;
+		for (block = range; scan_next_run(block, &start, &count) && start < range_end; ) {
+			if (start + count > range_end)
+				count = range_end - start;
+			index_add(start, count);
+			block = start + count;
+		}
+	}
+	fi.fi_complete = true;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_freeext_test [-v] [-b blocks] [-n ops] [-s seed] [bitmap-file]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	u_int32_t blocks = 0;
+	long ops = 100000;
+	long i;
+	int ch;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "b:n:s:v")) != -1) {
+		switch (ch) {
+		case 'b':
+			blocks = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		load_bitmap(argv[0], blocks);
+	else
+		random_bitmap(blocks ? blocks : 1 << 20);
+
+	fe_init(&fi, UINT32_MAX);
+	build_index();
+	check_all();
+	if (verbose)
+		printf("%u blocks, %u free extents, %llu free blocks\n",
+			   total_blocks, fi.fi_count, (unsigned long long)fi.fi_blocks);
+
+	for (i = 0; i < ops; i++) {
+		switch (rnd(8)) {
+		case 0: case 1: case 2:
+			do_allocate();
+			break;
+		case 3: case 4: case 5:
+			do_free();
+			break;
+		case 6:
+			do_claim();
+			break;
+		default:
+			check_queries();
+			break;
+		}
+		if (i % 1024 == 0)
+			check_all();
+	}
+	check_all();
+
+	if (verbose)
+		printf("%ld operations, %u free extents; queries: index %.3f ms, bitmap scan %.3f ms\n",
+			   ops, fi.fi_count, index_ns / 1e6, scan_ns / 1e6);
+
+	fe_chunk_free(fe_destroy(&fi));
+	free(bitmap);
+	printf("hfs_freeext_test: ok\n");
+
+	return 0;
+}
@@ -0,0 +1,713 @@
+//
+//  hfs_replay_bench.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Check and time the journal replay index (core/hfs_replay.c) against the
+ * sorted bucket array replay_journal() used before it.
+ *
+ * Writes a synthetic journal image the size of a large HFS+ journal, full of
+ * B-tree node writes: a working set of nodes rewritten over and over, with
+ * some short writes inside a node and some long ones spanning several, so
+ * that every kind of overlap comes up.  Then replays it onto two disk
+ * images, once through each table, issuing the writes the way
+ * replay_journal() does (the old table one block at a time, the index in
+ * runs of up to 64 KB), and fails unless the two images come out the same.
+ *
+ * Each journaled write carries a block checksum, which the replay checks
+ * against the data in the journal before indexing the write, as
+ * replay_journal() does for a block list header flagged
+ * BLHDR_CHECK_CHECKSUMS or BLHDR_CRC32C_CHECKSUMS.  The index replays the
+ * journal once with each kind of checksum (core/hfs_cksum.c), and the time
+ * spent checksumming is reported apart.
+ *
+ *	cc -O2 -I../core -o hfs_replay_bench \
+ *		hfs_replay_bench.c ../core/hfs_replay.c ../core/hfs_cksum.c -lpthread
+ *
+ *	hfs_replay_bench [-r] [-j journal-MB] [-w nodes] [-s seed] [directory]
+ *
+ * The images (journal.img, disk-old.img, disk-new.img) go in 'directory',
+ * /tmp by default.  -r skips the old table, which is quadratic in the
+ * working set.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfs_cksum.h"
+#include "hfs_replay.h"
+
+#define JHDR_SIZE	512				/* journal header and block number unit */
+#define NODE_SIZE	4096			/* B-tree node */
+#define MAX_IO		(64 * 1024)		/* JOURNAL_REPLAY_MAX_IO */
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t
+rnd(u_int32_t n)
+{
+	return n ? (u_int32_t)(random() % n) : 0;
+}
+
+
+// -- The bucket array from replay_journal(), unchanged --
+
+struct journal_header {
+	int32_t		jhdr_size;
+	off_t		size;
+};
+
+typedef struct journal {
+	struct journal_header	*jhdr;
+	const char				*jdev_name;
+} journal;
+
+#define __unused			__attribute__((unused))
+#define panic(...)			errx(1, __VA_ARGS__)
+#define hfs_malloc(size)	malloc(size)
+#define hfs_free(p, size)	free(p)
+
+typedef struct bucket {
+	off_t     block_num;
+	uint32_t  jnl_offset;
+	uint32_t  block_size;
+	int32_t   cksum;
+} bucket;
+
+#define STARTING_BUCKETS 256
+
+static int
+grow_table(struct bucket **buf_ptr, int num_buckets, int new_size)
+{
+	struct bucket *newBuf;
+	int current_size = num_buckets, i;
+    
+	// return if newsize is less than the current size
+	if (new_size < num_buckets) {
+		return current_size;
+	}
+    
+	newBuf = hfs_malloc(new_size*sizeof(struct bucket));
+
+	//  printf("jnl: lookup_bucket: expanded co_buf to %d elems\n", new_size);
+    
+	// copy existing elements 
+	bcopy(*buf_ptr, newBuf, num_buckets*sizeof(struct bucket));
+    
+	// initialize the new ones
+	for(i = num_buckets; i < new_size; i++) {
+		newBuf[i].block_num = (off_t)-1;
+	}
+    
+	// free the old container
+	hfs_free(*buf_ptr, num_buckets * sizeof(struct bucket));
+    
+	// reset the buf_ptr
+	*buf_ptr = newBuf;
+    
+	return new_size;
+}
+
+static int
+lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full)
+{
+	int lo, hi, index, matches, i;
+    
+	if (num_full == 0) {
+		return 0; // table is empty, so insert at index=0
+	}
+    
+	lo = 0;
+	hi = num_full - 1;
+	index = -1;
+    
+	// perform binary search for block_num
+	do {
+		int mid = (hi - lo)/2 + lo;
+		off_t this_num = (*buf_ptr)[mid].block_num;
+	
+		if (block_num == this_num) {
+			index = mid;
+			break;
+		}
+	
+		if (block_num < this_num) {
+			hi = mid;
+			continue;
+		}
+	
+		if (block_num > this_num) {
+			lo = mid + 1;
+			continue;
+		}
+	} while (lo < hi);
+    
+	// check if lo and hi converged on the match
+	if (block_num == (*buf_ptr)[hi].block_num) {
+		index = hi;
+	}
+    
+	// if no existing entry found, find index for new one
+	if (index == -1) {
+		index = (block_num < (*buf_ptr)[hi].block_num) ? hi : hi + 1;
+	} else {
+		// make sure that we return the right-most index in the case of multiple matches
+		matches = 0;
+		i = index + 1;
+		while (i < num_full && block_num == (*buf_ptr)[i].block_num) {
+			matches++;
+			i++;
+		}
+
+		index += matches;
+	}
+    
+	return index;
+}
+
+static int
+insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting)
+{
+	if (!overwriting) {
+		// grow the table if we're out of space - we may index the table
+		// with *num_full_ptr (lookup_bucket() can return a maximum value == 
+		// *num_full_ptr), so we need to grow when we hit (*num_buckets_ptr - 1) 
+		// to prevent out-of-bounds indexing 
+		if (*num_full_ptr >= (*num_buckets_ptr - 1)) {
+			int new_size = *num_buckets_ptr * 2;
+			int grow_size = grow_table(buf_ptr, *num_buckets_ptr, new_size);
+	    
+			if (grow_size < new_size) {
+				printf("jnl: %s: add_block: grow_table returned an error!\n", jnl->jdev_name);
+				return -1;
+			}
+	    
+			*num_buckets_ptr = grow_size; //update num_buckets to reflect the new size
+		}
+	
+		// if we're not inserting at the end, we need to bcopy
+		if (blk_index != *num_full_ptr) {
+			bcopy( (*buf_ptr)+(blk_index), (*buf_ptr)+(blk_index+1), (*num_full_ptr-blk_index)*sizeof(struct bucket) );
+		}
+	
+		(*num_full_ptr)++; // increment only if we're not overwriting
+	}
+
+	// sanity check the values we're about to add
+	if ((off_t)offset >= jnl->jhdr->size) {
+		offset = jnl->jhdr->jhdr_size + (offset - jnl->jhdr->size);
+	}
+	if (size <= 0) {
+		panic("jnl: insert_block: bad size in insert_block (%zd)\n", size);
+	}	 
+
+	(*buf_ptr)[blk_index].block_num = num;
+	(*buf_ptr)[blk_index].block_size = (uint32_t)size;
+	(*buf_ptr)[blk_index].jnl_offset = (uint32_t)offset;
+	(*buf_ptr)[blk_index].cksum = cksum;
+    
+	return blk_index;
+}
+
+static int
+do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
+{
+	int	num_to_remove, index, i, overwrite, err;
+	size_t	jhdr_size = jnl->jhdr->jhdr_size, new_offset;
+	off_t	overlap, block_start, block_end;
+
+	block_start = block_num*jhdr_size;
+	block_end = block_start + size;
+	overwrite = (block_num == (*buf_ptr)[blk_index].block_num && size >= (*buf_ptr)[blk_index].block_size);
+
+	// first, eliminate any overlap with the previous entry
+	if (blk_index != 0 && !overwrite) {
+		off_t prev_block_start = (*buf_ptr)[blk_index-1].block_num*jhdr_size;
+		off_t prev_block_end = prev_block_start + (*buf_ptr)[blk_index-1].block_size;
+		overlap = prev_block_end - block_start;
+		if (overlap > 0) {
+			if (overlap % jhdr_size != 0) {
+				panic("jnl: do_overlap: overlap with previous entry not a multiple of %zd\n", jhdr_size);
+			}
+
+			// if the previous entry completely overlaps this one, we need to break it into two pieces.
+			if (prev_block_end > block_end) {
+				off_t new_num = block_end / jhdr_size;
+				size_t new_size = prev_block_end - block_end;
+
+				new_offset = (*buf_ptr)[blk_index-1].jnl_offset + (block_end - prev_block_start);
+		
+				err = insert_block(jnl, buf_ptr, blk_index, new_num, new_size, new_offset, cksum, num_buckets_ptr, num_full_ptr, 0);
+				if (err < 0) {
+					panic("jnl: do_overlap: error inserting during pre-overlap\n");
+				}
+			}
+	    
+			// Regardless, we need to truncate the previous entry to the beginning of the overlap
+			(*buf_ptr)[blk_index-1].block_size = (uint32_t)(block_start - prev_block_start);
+			(*buf_ptr)[blk_index-1].cksum = 0;   // have to blow it away because there's no way to check it
+		}
+	}
+
+	// then, bail out fast if there's no overlap with the entries that follow
+	if (!overwrite && block_end <= (off_t)((*buf_ptr)[blk_index].block_num*jhdr_size)) {
+		return 0; // no overlap, no overwrite
+	} else if (overwrite && (blk_index + 1 >= *num_full_ptr || block_end <= (off_t)((*buf_ptr)[blk_index+1].block_num*jhdr_size))) {
+
+		(*buf_ptr)[blk_index].cksum = cksum;   // update this
+		return 1; // simple overwrite
+	}
+    
+	// Otherwise, find all cases of total and partial overlap. We use the special
+	// block_num of -2 to designate entries that are completely overlapped and must
+	// be eliminated. The block_num, size, and jnl_offset of partially overlapped
+	// entries must be adjusted to keep the array consistent.
+	index = blk_index;
+	num_to_remove = 0;
+	while (index < *num_full_ptr && block_end > (off_t)((*buf_ptr)[index].block_num*jhdr_size)) {
+		if (block_end >= (off_t)(((*buf_ptr)[index].block_num*jhdr_size + (*buf_ptr)[index].block_size))) {
+			(*buf_ptr)[index].block_num = -2; // mark this for deletion
+			num_to_remove++;
+		} else {
+			overlap = block_end - (*buf_ptr)[index].block_num*jhdr_size;
+			if (overlap > 0) {
+				if (overlap % jhdr_size != 0) {
+					panic("jnl: do_overlap: overlap of %ld is not multiple of %zd\n", overlap, jhdr_size);
+				}
+				
+				// if we partially overlap this entry, adjust its block number, jnl offset, and size
+				(*buf_ptr)[index].block_num += (overlap / jhdr_size); // make sure overlap is multiple of jhdr_size, or round up
+				(*buf_ptr)[index].cksum = 0;
+		
+				new_offset = (*buf_ptr)[index].jnl_offset + overlap; // check for wrap-around
+				if ((off_t)new_offset >= jnl->jhdr->size) {
+					new_offset = jhdr_size + (new_offset - jnl->jhdr->size);
+				}
+				(*buf_ptr)[index].jnl_offset = (uint32_t)new_offset;
+		
+				(*buf_ptr)[index].block_size -= overlap; // sanity check for negative value
+				if ((*buf_ptr)[index].block_size <= 0) {
+					panic("jnl: do_overlap: after overlap, new block size is invalid (%u)\n", (*buf_ptr)[index].block_size);
+					// return -1; // if above panic is removed, return -1 for error
+				}
+			}
+			
+		}
+
+		index++;
+	}
+
+	// bcopy over any completely overlapped entries, starting at the right (where the above loop broke out)
+	index--; // start with the last index used within the above loop
+	while (index >= blk_index) {
+		if ((*buf_ptr)[index].block_num == -2) {
+			if (index == *num_full_ptr-1) {
+				(*buf_ptr)[index].block_num = -1; // it's the last item in the table... just mark as free
+			} else {
+				bcopy( (*buf_ptr)+(index+1), (*buf_ptr)+(index), (*num_full_ptr - (index + 1)) * sizeof(struct bucket) );
+			}
+			(*num_full_ptr)--;
+		}
+		index--;
+	}
+
+	// eliminate any stale entries at the end of the table
+	for(i = *num_full_ptr; i < (*num_full_ptr + num_to_remove); i++) {
+		(*buf_ptr)[i].block_num = -1;
+	}
+    
+	return 0; // if we got this far, we need to insert the entry into the table (rather than overwrite) 
+}
+
+// PR-3105942: Coalesce writes to the same block in journal replay
+// We coalesce writes by maintaining a dynamic sorted array of physical disk blocks
+// to be replayed and the corresponding location in the journal which contains
+// the most recent data for those blocks. The array is "played" once the all the
+// blocks in the journal have been coalesced. The code for the case of conflicting/
+// overlapping writes to a single block is the most dense. Because coalescing can
+// disrupt the existing time-ordering of blocks in the journal playback, care
+// is taken to catch any overlaps and keep the array consistent. 
+static int
+add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
+{
+	int	blk_index, overwriting;
+    
+	// on return from lookup_bucket(), blk_index is the index into the table where block_num should be
+	// inserted (or the index of the elem to overwrite). 
+	blk_index = lookup_bucket( buf_ptr, block_num, *num_full_ptr);
+    
+	// check if the index is within bounds (if we're adding this block to the end of
+	// the table, blk_index will be equal to num_full)
+	if (blk_index < 0 || blk_index > *num_full_ptr) {
+		//printf("jnl: add_block: trouble adding block to co_buf\n");
+		return -1;
+	} // else printf("jnl: add_block: adding block 0x%llx at i=%d\n", block_num, blk_index);
+    
+	// Determine whether we're overwriting an existing entry by checking for overlap
+	overwriting = do_overlap(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr);
+	if (overwriting < 0) {
+		return -1; // if we got an error, pass it along
+	}
+        
+	// returns the index, or -1 on error
+	blk_index = insert_block(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr, overwriting);
+    
+	return blk_index;
+}
+
+
+
+// -- Images --
+
+struct jwrite {
+	off_t		block;
+	u_int32_t	size;
+	off_t		jnl_offset;
+	int32_t		cksum[2];		/* legacy, CRC32C */
+};
+
+static int jfd, old_fd, new_fd;
+static off_t jnl_size;
+static off_t disk_size;
+static u_int64_t nwrites;
+
+static void
+fill(char *buf, u_int32_t size, u_int32_t seq, off_t block)
+{
+	u_int32_t *w = (u_int32_t *)buf;
+	u_int32_t i;
+
+	for (i = 0; i < size / 4; i++)
+		w[i] = seq * 0x9e3779b1u ^ (u_int32_t)(block * JHDR_SIZE / 4 + i);
+}
+
+/* read_journal_data(): wrap from the end of the journal to past its header */
+static void
+jnl_read(off_t offset, char *buf, size_t len)
+{
+	while (len) {
+		size_t n = len;
+
+		if (offset >= jnl_size)
+			offset = JHDR_SIZE + (offset - jnl_size);
+		if (offset + (off_t)n > jnl_size)
+			n = (size_t)(jnl_size - offset);
+		if (pread(jfd, buf, n, offset) != (ssize_t)n)
+			err(1, "journal read");
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void
+jnl_write(off_t offset, const char *buf, size_t len)
+{
+	while (len) {
+		size_t n = len;
+
+		if (offset >= jnl_size)
+			offset = JHDR_SIZE + (offset - jnl_size);
+		if (offset + (off_t)n > jnl_size)
+			n = (size_t)(jnl_size - offset);
+		if (pwrite(jfd, buf, n, offset) != (ssize_t)n)
+			err(1, "journal write");
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void
+disk_write(int fd, off_t block, const char *buf, size_t len)
+{
+	if (pwrite(fd, buf, len, block * JHDR_SIZE) != (ssize_t)len)
+		err(1, "disk write");
+	nwrites++;
+}
+
+/*
+ * Fill the journal with node writes, starting near its end so that it wraps.
+ * Most writes are one node of the working set; some are a sector inside one
+ * (a header update), some span two to four nodes.
+ */
+static struct jwrite *
+make_journal(u_int32_t nodes, u_int32_t *countp)
+{
+	u_int32_t max = (u_int32_t)((jnl_size - JHDR_SIZE) / NODE_SIZE) - 4;
+	struct jwrite *w = calloc(max, sizeof(*w));
+	char *buf = malloc(4 * NODE_SIZE);
+	off_t offset = jnl_size - 7 * NODE_SIZE / 2;
+	u_int32_t i;
+	u_int64_t bytes = 0;
+
+	if (w == NULL || buf == NULL)
+		err(1, "journal");
+	for (i = 0; bytes + 4 * NODE_SIZE < (u_int64_t)(jnl_size - JHDR_SIZE); i++) {
+		u_int32_t node = rnd(nodes);
+		u_int32_t kind = rnd(100);
+
+		w[i].block = (off_t)node * (NODE_SIZE / JHDR_SIZE);
+		if (kind < 5) {
+			w[i].block += rnd(NODE_SIZE / JHDR_SIZE);
+			w[i].size = JHDR_SIZE;
+		} else if (kind < 10)
+			w[i].size = NODE_SIZE * (2 + rnd(3));
+		else
+			w[i].size = NODE_SIZE;
+		w[i].jnl_offset = offset >= jnl_size ? JHDR_SIZE + (offset - jnl_size) : offset;
+
+		fill(buf, w[i].size, i + 1, w[i].block);
+		w[i].cksum[0] = (int32_t)hfs_jnl_block_cksum(buf, w[i].size, false);
+		w[i].cksum[1] = (int32_t)hfs_jnl_block_cksum(buf, w[i].size, true);
+		jnl_write(w[i].jnl_offset, buf, w[i].size);
+
+		offset = w[i].jnl_offset + w[i].size;
+		bytes += w[i].size;
+	}
+	free(buf);
+	*countp = i;
+	return w;
+}
+
+static int
+open_image(const char *dir, const char *name, off_t size)
+{
+	char path[1024];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, size) != 0)
+		err(1, "%s", path);
+	return fd;
+}
+
+static void
+compare_images(void)
+{
+	const size_t chunk = 1 << 20;
+	char *a = malloc(chunk), *b = malloc(chunk);
+	off_t off;
+
+	if (a == NULL || b == NULL)
+		err(1, "compare");
+	for (off = 0; off < disk_size; off += chunk) {
+		if (pread(old_fd, a, chunk, off) < 0 || pread(new_fd, b, chunk, off) < 0)
+			err(1, "compare");
+		if (memcmp(a, b, chunk) != 0)
+			errx(1, "disk images differ near byte %lld", (long long)off);
+	}
+	free(a);
+	free(b);
+}
+
+
+// -- Replays --
+
+/* Read a journaled write back and check its checksum, timing the checksum */
+static int32_t
+check_block(const struct jwrite *w, char *buf, bool crc32c, u_int64_t *cksum_ns)
+{
+	int32_t cksum;
+	u_int64_t t;
+
+	jnl_read(w->jnl_offset, buf, w->size);
+	t = now_ns();
+	cksum = (int32_t)hfs_jnl_block_cksum(buf, w->size, crc32c);
+	*cksum_ns += now_ns() - t;
+	if (cksum != w->cksum[crc32c])
+		errx(1, "block %lld: checksum 0x%.8x, journal says 0x%.8x",
+			 (long long)w->block, cksum, w->cksum[crc32c]);
+	return cksum;
+}
+
+static void
+replay_old(struct jwrite *w, u_int32_t count, bool crc32c, u_int64_t *index_ns,
+		   u_int64_t *cksum_ns)
+{
+	struct journal_header jhdr = { JHDR_SIZE, jnl_size };
+	journal jnl = { &jhdr, "bench" };
+	int num_buckets = STARTING_BUCKETS, num_full = 0;
+	struct bucket *co_buf = malloc(num_buckets * sizeof(struct bucket));
+	char *buf = malloc(4 * NODE_SIZE);
+	u_int64_t t;
+	int i;
+
+	if (co_buf == NULL || buf == NULL)
+		err(1, "replay_old");
+	for (i = 0; i < num_buckets; i++)
+		co_buf[i].block_num = -1;
+
+	*index_ns = *cksum_ns = 0;
+	for (i = 0; i < (int)count; i++) {
+		int32_t cksum = check_block(&w[i], buf, crc32c, cksum_ns);
+
+		t = now_ns();
+		if (add_block(&jnl, &co_buf, w[i].block, w[i].size, (size_t)w[i].jnl_offset,
+					  cksum, &num_buckets, &num_full) < 0)
+			errx(1, "add_block failed");
+		*index_ns += now_ns() - t;
+	}
+
+	for (i = 0; i < num_full; i++) {
+		if (co_buf[i].block_num == (off_t)-1)
+			continue;
+		jnl_read(co_buf[i].jnl_offset, buf, co_buf[i].block_size);
+		disk_write(old_fd, co_buf[i].block_num, buf, co_buf[i].block_size);
+	}
+	free(co_buf);
+	free(buf);
+}
+
+static void
+replay_new(struct jwrite *w, u_int32_t count, bool crc32c, u_int64_t *index_ns,
+		   u_int64_t *cksum_ns)
+{
+	struct jr_index ji;
+	char *buf = malloc(MAX_IO > 4 * NODE_SIZE ? MAX_IO : 4 * NODE_SIZE);
+	u_int64_t t;
+	u_int32_t i, j, k, next;
+
+	if (buf == NULL || jr_init(&ji, JHDR_SIZE, jnl_size) != 0)
+		err(1, "replay_new");
+
+	*index_ns = *cksum_ns = 0;
+	for (i = 0; i < count; i++) {
+		int32_t cksum = check_block(&w[i], buf, crc32c, cksum_ns);
+
+		t = now_ns();
+		if (jr_add(&ji, w[i].block, w[i].size, w[i].jnl_offset, cksum) != 0)
+			errx(1, "jr_add failed");
+		*index_ns += now_ns() - t;
+	}
+	t = now_ns();
+	if (jr_finish(&ji) != 0)
+		errx(1, "jr_finish failed");
+	*index_ns += now_ns() - t;
+
+	/* As replay_journal() does it */
+	for (j = 0; j < ji.ji_count; j = next) {
+		size_t run = ji.ji_entries[j].je_size;
+		size_t buf_offset = 0;
+
+		for (next = j + 1; next < ji.ji_count && jr_adjacent(&ji, next)
+			 && run + ji.ji_entries[next].je_size <= MAX_IO; next++)
+			run += ji.ji_entries[next].je_size;
+
+		for (k = j; k < next; ) {
+			off_t jnl_offset = ji.ji_entries[k].je_jnl_offset;
+			size_t size = ji.ji_entries[k].je_size;
+
+			for (k++; k < next && ji.ji_entries[k].je_jnl_offset == jnl_offset + size; k++)
+				size += ji.ji_entries[k].je_size;
+			jnl_read(jnl_offset, buf + buf_offset, size);
+			buf_offset += size;
+		}
+		disk_write(new_fd, ji.ji_entries[j].je_block, buf, run);
+	}
+	jr_destroy(&ji);
+	free(buf);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_replay_bench [-r] [-j journal-MB] [-w nodes] [-s seed] [directory]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dir = "/tmp";
+	u_int32_t nodes = 40000, count;
+	u_int64_t index_ns, cksum_ns, t, total;
+	struct jwrite *w;
+	bool skip_old = false;
+	int ch, mb = 256, mode;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "j:rs:w:")) != -1) {
+		switch (ch) {
+		case 'j':
+			mb = atoi(optarg);
+			break;
+		case 'r':
+			skip_old = true;
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		case 'w':
+			nodes = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || mb <= 0 || mb > 2047 || nodes == 0)
+		usage();
+	if (argc == 1)
+		dir = argv[0];
+
+	jnl_size = (off_t)mb << 20;
+	disk_size = ((off_t)nodes + 4) * NODE_SIZE;
+	jfd = open_image(dir, "journal.img", jnl_size);
+	old_fd = open_image(dir, "disk-old.img", disk_size);
+	new_fd = open_image(dir, "disk-new.img", disk_size);
+
+	w = make_journal(nodes, &count);
+	printf("%u journaled writes to %u nodes, %d MB journal\n", count, nodes, mb);
+
+	printf("%-8s %-7s %10s %10s %10s %10s\n", "table", "cksum", "cksum s", "index s",
+		   "replay s", "writes");
+	if (!skip_old) {
+		t = now_ns();
+		replay_old(w, count, false, &index_ns, &cksum_ns);
+		total = now_ns() - t;
+		printf("%-8s %-7s %10.3f %10.3f %10.3f %10llu\n", "bucket", "legacy",
+			   cksum_ns / 1e9, index_ns / 1e9, total / 1e9, (unsigned long long)nwrites);
+	}
+	for (mode = 0; mode < 2; mode++) {
+		bool crc32c = mode == 1;
+
+		nwrites = 0;
+		t = now_ns();
+		replay_new(w, count, crc32c, &index_ns, &cksum_ns);
+		total = now_ns() - t;
+		printf("%-8s %-7s %10.3f %10.3f %10.3f %10llu\n", "jr_index",
+			   crc32c ? "crc32c" : "legacy", cksum_ns / 1e9, index_ns / 1e9, total / 1e9,
+			   (unsigned long long)nwrites);
+		if (!skip_old)
+			compare_images();
+	}
+	if (!skip_old)
+		printf("hfs_replay_bench: disk images match\n");
+	free(w);
+
+	return 0;
+}
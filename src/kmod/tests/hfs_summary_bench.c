@@ -0,0 +1,450 @@
+//
+//  hfs_summary_bench.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Allocation latency of the bitmap scanner with and without the summary table
+ * (core/hfs_summary.c), on an aged volume at 50%, 90% and 99% full.
+ *
+ * The volume is filled with extents of random length, then random extents
+ * are freed until it is at the fill level wanted.  Each allocation asks for a
+ * run of a random power of two blocks (or -m blocks) from a random hint, the
+ * way BlockFindContiguous does: scan from the hint to the end, then from the
+ * start to the hint, looking at the summary at every bitmap page boundary.
+ * Three versions of the scan run against the same state:
+ *
+ *	bitmap	no summary; read every page
+ *	flat	skip pages known to be full, walking one entry at a time (the
+ *		one-bit-per-page table this replaces)
+ *	tree	skip whole superchunks and pages whose counts cannot hold the run
+ *
+ * They must all return the same block, which checks the table as a side
+ * effect; the counts are also compared with the bitmap after every level.
+ * A random allocated extent is freed after each allocation to hold the fill,
+ * and the levels run from fullest to emptiest.
+ *
+ *	cc -O2 -DHFS_ALLOC_TEST=1 -I../core -o hfs_summary_bench \
+ *		hfs_summary_bench.c ../core/hfs_summary.c
+ *
+ *	hfs_summary_bench [-b blocks] [-c page-blocks] [-f percent] [-m blocks]
+ *		[-n ops] [-s seed]
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfs_summary.h"
+
+enum { S_BITMAP, S_FLAT, S_TREE, S_COUNT };
+static const char *strategy_name[S_COUNT] = { "bitmap", "flat", "tree" };
+
+struct extent {
+	u_int32_t	start;
+	u_int32_t	count;
+};
+
+static u_int8_t *bitmap;
+static u_int32_t total_blocks;
+static u_int64_t free_blocks;
+static struct sum_table st;
+
+static struct extent *extents;		/* allocated extents, in no order */
+static size_t nextents, extents_size;
+
+static u_int64_t bytes_read;		/* bitmap bytes looked at by the current scan */
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t
+rnd(u_int32_t n)
+{
+	return n ? (u_int32_t)(random() % n) : 0;
+}
+
+static inline bool
+is_allocated(u_int32_t block)
+{
+	return (bitmap[block >> 3] & (0x80 >> (block & 7))) != 0;
+}
+
+static void
+mark(u_int32_t start, u_int32_t count, bool allocated)
+{
+	u_int32_t block;
+
+	for (block = start; block < start + count; block++) {
+		if (allocated)
+			bitmap[block >> 3] |= 0x80 >> (block & 7);
+		else
+			bitmap[block >> 3] &= ~(0x80 >> (block & 7));
+	}
+	if (allocated) {
+		free_blocks -= count;
+		sum_allocated(&st, start, count);
+	} else {
+		free_blocks += count;
+		sum_freed(&st, start, count);
+	}
+}
+
+static void
+push_extent(u_int32_t start, u_int32_t count)
+{
+	if (nextents == extents_size) {
+		extents_size = extents_size ? extents_size * 2 : 1024;
+		extents = realloc(extents, extents_size * sizeof(*extents));
+		if (extents == NULL)
+			err(1, "extents");
+	}
+	extents[nextents].start = start;
+	extents[nextents].count = count;
+	nextents++;
+}
+
+static void
+free_random_extent(void)
+{
+	size_t i = rnd((u_int32_t)nextents);
+
+	mark(extents[i].start, extents[i].count, false);
+	extents[i] = extents[--nextents];
+}
+
+
+// -- Bitmap scanning --
+
+/*
+ * First block in [block, end) whose bit is 'allocated', or 'end'.  Eight
+ * bytes at a time over uniform stretches, which is as close as this gets to
+ * the word loops in VolumeAllocation.c.
+ */
+static u_int32_t
+next_bit(u_int32_t block, u_int32_t end, bool allocated)
+{
+	const u_int64_t skip = allocated ? 0 : ~0ULL;
+	const u_int8_t skip_byte = allocated ? 0 : 0xff;
+
+	while (block < end) {
+		u_int64_t word;
+
+		if ((block & 63) == 0 && end - block >= 64) {
+			memcpy(&word, &bitmap[block >> 3], sizeof(word));
+			bytes_read += 8;
+			if (word == skip) {
+				block += 64;
+				continue;
+			}
+		}
+		if ((block & 7) == 0 && end - block >= 8) {
+			bytes_read++;
+			if (bitmap[block >> 3] == skip_byte) {
+				block += 8;
+				continue;
+			}
+		}
+		if (is_allocated(block) == allocated)
+			return block;
+		block++;
+	}
+	return end;
+}
+
+/* Where to go on from a page boundary, or false if nothing after it will do. */
+static bool
+skip_pages(int strategy, u_int32_t block, u_int32_t end, u_int32_t want,
+		   u_int32_t *next)
+{
+	u_int32_t cb = st.st_chunk_blocks;
+	u_int32_t chunk;
+
+	switch (strategy) {
+	case S_FLAT:
+		for (chunk = block / cb; (u_int64_t)chunk * cb < end; chunk++) {
+			if (st.st_chunk_free[chunk] != 0) {
+				*next = chunk == block / cb ? block : chunk * cb;
+				return true;
+			}
+		}
+		return false;
+	case S_TREE:
+		return sum_find(&st, block, end, want, next);
+	default:
+		*next = block;
+		return true;
+	}
+}
+
+/* First run of 'want' free blocks that starts at or after 'block' and ends by 'end'. */
+static bool
+scan(int strategy, u_int32_t block, u_int32_t end, u_int32_t want, u_int32_t *found)
+{
+	u_int32_t cb = st.st_chunk_blocks;
+
+	if (end - block < want || !skip_pages(strategy, block, end, want, &block))
+		return false;
+
+	while (block < end) {
+		u_int64_t page_end = ((u_int64_t)block / cb + 1) * cb;
+		u_int32_t limit = page_end < end ? (u_int32_t)page_end : end;
+		u_int32_t first, used;
+
+		first = next_bit(block, limit, false);
+		if (first == limit) {
+			/* Nothing free in the rest of this page */
+			if (limit == end || !skip_pages(strategy, limit, end, want, &block))
+				return false;
+			continue;
+		}
+		if (end - first < want)
+			return false;
+		used = next_bit(first, first + want, true);
+		if (used - first >= want) {
+			*found = first;
+			return true;
+		}
+		block = used;
+	}
+	return false;
+}
+
+
+// -- Setup and checks --
+
+static void
+age_volume(u_int32_t blocks)
+{
+	u_int32_t block, count;
+
+	total_blocks = blocks;
+	bitmap = calloc(1, ((size_t)blocks + 7) / 8);
+	if (bitmap == NULL)
+		err(1, "bitmap");
+	free_blocks = blocks;
+	for (block = 0; block < blocks; block += count) {
+		count = 1 + rnd(rnd(8) ? 64 : 4096);
+		if (count > blocks - block)
+			count = blocks - block;
+		mark(block, count, true);
+		push_extent(block, count);
+	}
+}
+
+static void
+check_table(void)
+{
+	u_int32_t cb = st.st_chunk_blocks;
+	u_int32_t chunk, block;
+	u_int64_t total = 0;
+
+	for (chunk = 0; chunk < st.st_chunks; chunk++) {
+		u_int32_t n = 0;
+
+		for (block = chunk * cb; block < total_blocks && block < (chunk + 1) * cb; block++)
+			n += !is_allocated(block);
+		if (st.st_chunk_free[chunk] != n)
+			errx(1, "page %u: table says %u free, bitmap has %u",
+				 chunk, st.st_chunk_free[chunk], n);
+		total += n;
+	}
+	for (chunk = 0; chunk < st.st_supers; chunk++) {
+		u_int32_t i, n = 0;
+
+		for (i = 0; i < SUM_SUPER_CHUNKS && chunk * SUM_SUPER_CHUNKS + i < st.st_chunks; i++)
+			n += st.st_chunk_free[chunk * SUM_SUPER_CHUNKS + i];
+		if (st.st_super_free[chunk] != n)
+			errx(1, "superchunk %u: %u free, its pages add up to %u",
+				 chunk, st.st_super_free[chunk], n);
+	}
+	if (st.st_free != total || total != free_blocks)
+		errx(1, "table total %llu, bitmap %llu, expected %llu",
+			 (unsigned long long)st.st_free, (unsigned long long)total,
+			 (unsigned long long)free_blocks);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	u_int64_t x = *(const u_int64_t *)a, y = *(const u_int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static int
+cmp_desc(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+	return x > y ? -1 : x < y;
+}
+
+
+// -- Benchmark --
+
+static void
+run_level(unsigned percent, long ops, u_int32_t fixed_want)
+{
+	u_int64_t target_free = (u_int64_t)total_blocks * (100 - percent) / 100;
+	u_int64_t *lat[S_COUNT], bytes[S_COUNT] = { 0 };
+	long i, failed = 0;
+	int s;
+
+	while (free_blocks < target_free && nextents)
+		free_random_extent();
+	check_table();
+
+	for (s = 0; s < S_COUNT; s++) {
+		lat[s] = calloc(ops, sizeof(u_int64_t));
+		if (lat[s] == NULL)
+			err(1, "latencies");
+	}
+
+	for (i = 0; i < ops; i++) {
+		u_int32_t want = fixed_want ? fixed_want : 1U << rnd(11);
+		u_int32_t hint = rnd(total_blocks);
+		u_int32_t found[S_COUNT];
+		bool ok[S_COUNT];
+
+		for (s = 0; s < S_COUNT; s++) {
+			u_int64_t t0 = now_ns();
+
+			bytes_read = 0;
+			ok[s] = scan(s, hint, total_blocks, want, &found[s]) ||
+					scan(s, 0, hint, want, &found[s]);
+			lat[s][i] = now_ns() - t0;
+			bytes[s] += bytes_read;
+		}
+		for (s = 1; s < S_COUNT; s++) {
+			if (ok[s] != ok[0] || (ok[0] && found[s] != found[0]))
+				errx(1, "%u%% op %ld: %s found %d/%u, bitmap found %d/%u (want %u from %u)",
+					 percent, i, strategy_name[s], ok[s], found[s], ok[0], found[0],
+					 want, hint);
+		}
+
+		if (!ok[0]) {
+			failed++;
+			continue;
+		}
+		mark(found[0], want, true);
+		push_extent(found[0], want);
+		while (free_blocks < target_free && nextents)
+			free_random_extent();
+	}
+	check_table();
+
+	for (s = 0; s < S_COUNT; s++) {
+		u_int64_t sum = 0;
+		long j;
+
+		for (j = 0; j < ops; j++)
+			sum += lat[s][j];
+		qsort(lat[s], ops, sizeof(u_int64_t), cmp_u64);
+		printf("%3u%%  %-7s %10.0f %10llu %10llu %12.1f",
+			   percent, strategy_name[s], (double)sum / ops,
+			   (unsigned long long)lat[s][ops / 2],
+			   (unsigned long long)lat[s][ops * 99 / 100],
+			   (double)bytes[s] / ops / 1024);
+		if (s == 0)
+			printf("  %ld of %ld failed", failed, ops);
+		printf("\n");
+		free(lat[s]);
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_summary_bench [-b blocks] [-c page-blocks] [-f percent] "
+			"[-m blocks] [-n ops] [-s seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned default_levels[] = { 99, 90, 50 };
+	unsigned levels[8];
+	int nlevels = 0;
+	u_int32_t blocks = 1U << 26;
+	u_int32_t chunk_blocks = 4096 * 8;
+	u_int32_t want = 0;
+	long ops = 5000;
+	int ch, i;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "b:c:f:m:n:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			blocks = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			chunk_blocks = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (nlevels == (int)(sizeof(levels) / sizeof(levels[0])))
+				usage();
+			levels[nlevels] = (unsigned)strtoul(optarg, NULL, 0);
+			if (levels[nlevels] > 100)
+				usage();
+			nlevels++;
+			break;
+		case 'm':
+			want = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || blocks == 0 || chunk_blocks == 0 || ops <= 0)
+		usage();
+	if (nlevels == 0) {
+		memcpy(levels, default_levels, sizeof(default_levels));
+		nlevels = sizeof(default_levels) / sizeof(default_levels[0]);
+	}
+
+	if (sum_init(&st, (u_int32_t)(((u_int64_t)blocks + chunk_blocks - 1) / chunk_blocks),
+				 chunk_blocks))
+		errx(1, "sum_init failed");
+	age_volume(blocks);
+	/* The volume is full; this also zeroes the tail of a partial last page */
+	for (i = 0; i < (int)st.st_chunks; i++)
+		sum_set(&st, (u_int32_t)i, 0);
+	/* The volume starts full and only ever gets emptier */
+	qsort(levels, nlevels, sizeof(levels[0]), cmp_desc);
+
+	printf("%u blocks, %u blocks per page, %u pages, %u superchunks, %ld allocations per level\n",
+		   total_blocks, st.st_chunk_blocks, st.st_chunks, st.st_supers, ops);
+	printf("fill  scan      mean(ns) median(ns)    p99(ns)  bitmap KB/op\n");
+	for (i = 0; i < nlevels; i++)
+		run_level(levels[i], ops, want);
+
+	sum_destroy(&st);
+	free(extents);
+	free(bitmap);
+
+	return 0;
+}
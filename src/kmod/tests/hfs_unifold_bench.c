@@ -0,0 +1,461 @@
+//
+//  hfs_unifold_bench.c
+//  hfs-freebsd
+//
+//  Copyright © 2023-present jothwolo. All rights reserved.
+//  This file is covered under the MPL2.0. See LICENSE file for more details.
+//
+
+/*
+ * Check and time the folded name compare in core/hfs_unifold.c against
+ * FastUnicodeCompare().
+ *
+ * First compares FastUnicodeCompareFolded() of every folded name with
+ * FastUnicodeCompare() on random pairs of names, including NULs, ignorable
+ * characters and names that differ only in case, and fails on the first
+ * disagreement.  Then, for each corpus of file names, sorts it in catalog
+ * order and times binary searches for case-changed copies of its names, the
+ * way a catalog lookup probes a leaf node:
+ *
+ *	compare	FastUnicodeCompare() on every probe
+ *	folded	the search name folded once, FastUnicodeCompareFolded() per probe
+ *		if it is ASCII, as the callers do, else FastUnicodeCompare()
+ *
+ * The built-in corpora are made up to look like a source tree, a camera's
+ * photos, a maildir, and names in several scripts; -f reads one from a
+ * file of UTF-8 names, one a line.
+ *
+ *	cc -O2 -I../core -I../darwin -o hfs_unifold_bench hfs_unifold_bench.c
+ *
+ *	hfs_unifold_bench [-f names] [-n names] [-p passes] [-s seed]
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* gLatinCaseFold and gLowerCaseTable */
+#define KERNEL 1
+#include "UCStringCompareData.h"
+#undef KERNEL
+
+#include "hfs_unifold.c"
+
+#define MAXNAME		255
+
+struct name {
+	u_int16_t	len;
+	u_int16_t	str[MAXNAME];
+};
+
+static u_int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* FastUnicodeCompare() as it is in UnicodeWrappers.c */
+static int32_t
+FastUnicodeCompare(const u_int16_t *str1, u_int32_t length1,
+				   const u_int16_t *str2, u_int32_t length2)
+{
+	u_int16_t c1, c2;
+	u_int16_t temp;
+	u_int16_t *lowerCaseTable;
+
+	lowerCaseTable = (u_int16_t *)gLowerCaseTable;
+
+	while (1) {
+		c1 = 0;
+		c2 = 0;
+
+		while (length1 && c1 == 0) {
+			c1 = *(str1++);
+			--length1;
+			if (c1 < 0x0100) {
+				c1 = gLatinCaseFold[c1];
+				break;
+			}
+			if ((temp = lowerCaseTable[c1 >> 8]) != 0)
+				c1 = lowerCaseTable[temp + (c1 & 0x00FF)];
+		}
+
+		while (length2 && c2 == 0) {
+			c2 = *(str2++);
+			--length2;
+			if (c2 < 0x0100) {
+				c2 = gLatinCaseFold[c2];
+				break;
+			}
+			if ((temp = lowerCaseTable[c2 >> 8]) != 0)
+				c2 = lowerCaseTable[temp + (c2 & 0x00FF)];
+		}
+
+		if (c1 != c2)
+			break;
+		if (c1 == 0)
+			return 0;
+	}
+
+	return c1 < c2 ? -1 : 1;
+}
+
+static int
+sign(int32_t v)
+{
+	return (v > 0) - (v < 0);
+}
+
+static void
+add_ascii(struct name *n, const char *s)
+{
+	while (*s && n->len < MAXNAME)
+		n->str[n->len++] = (u_char)*s++;
+}
+
+static void
+add_char(struct name *n, u_int16_t c)
+{
+	if (n->len < MAXNAME)
+		n->str[n->len++] = c;
+}
+
+static const char *words[] = {
+	"main", "util", "test", "parse", "buffer", "config", "index", "node",
+	"catalog", "extent", "journal", "vnode", "mount", "Makefile", "README",
+	"CMakeLists", "LICENSE", "string", "alloc", "hash", "tree", "cache",
+};
+static const char *exts[] = {
+	".c", ".h", ".cpp", ".o", ".txt", ".md", ".py", ".json", "", ".orig",
+};
+
+/* A source tree: word_word.ext in mixed case */
+static void
+make_source(struct name *n, int i)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%s%s%s%d%s", words[random() % 22],
+			 random() % 2 ? "_" : "", random() % 3 ? words[random() % 22] : "",
+			 i % 100, exts[random() % 10]);
+	add_ascii(n, buf);
+}
+
+/* A camera: long shared prefixes, differing at the end */
+static void
+make_photos(struct name *n, int i)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), random() % 4 ? "IMG_%05d.JPG" : "DSC%05d.NEF", i);
+	add_ascii(n, buf);
+}
+
+/* A maildir: time.Mmicro.Ppid.host,S=size:2,flags */
+static void
+make_mail(struct name *n, int i)
+{
+	char buf[96];
+
+	snprintf(buf, sizeof(buf), "%u.M%06uP%u.mx%02d.example.org,S=%u,W=%u:2,%s",
+			 1700000000 + i * 7, (unsigned)(random() % 1000000),
+			 (unsigned)(random() % 99999), (int)(random() % 8),
+			 (unsigned)(random() % 100000), (unsigned)(random() % 100000),
+			 random() % 2 ? "S" : "RS");
+	add_ascii(n, buf);
+}
+
+/* Latin with accents, Greek, Cyrillic and CJK, now and then an ignorable */
+static void
+make_intl(struct name *n, int i)
+{
+	static const u_int16_t latin[] = { 0xC9, 0xE9, 0xC0, 0xE8, 0xD6, 0xF6, 0xDF, 0xC7, 0xE7 };
+	int script = random() % 4, len = 3 + random() % 12, k;
+
+	for (k = 0; k < len; k++) {
+		switch (script) {
+		case 0:
+			add_char(n, random() % 3 ? 'a' + random() % 26 : latin[random() % 9]);
+			break;
+		case 1:
+			add_char(n, 0x391 + random() % 0x30);
+			break;
+		case 2:
+			add_char(n, 0x410 + random() % 0x40);
+			break;
+		default:
+			add_char(n, 0x4E00 + random() % 0x5000);
+			break;
+		}
+		if (random() % 32 == 0)
+			add_char(n, 0x200C);
+	}
+	if (random() % 2) {
+		char buf[16];
+
+		snprintf(buf, sizeof(buf), " %d.txt", i);
+		add_ascii(n, buf);
+	}
+}
+
+/* One UTF-8 line as UTF-16; characters past the BMP are dropped. */
+static void
+decode_utf8(struct name *n, const u_char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		u_int32_t c = s[i];
+
+		if (c < 0x80) {
+			i += 1;
+		} else if ((c & 0xE0) == 0xC0 && i + 1 < len) {
+			c = ((c & 0x1F) << 6) | (s[i + 1] & 0x3F);
+			i += 2;
+		} else if ((c & 0xF0) == 0xE0 && i + 2 < len) {
+			c = ((c & 0x0F) << 12) | ((s[i + 1] & 0x3F) << 6) | (s[i + 2] & 0x3F);
+			i += 3;
+		} else {
+			i += 1;
+			continue;
+		}
+		add_char(n, (u_int16_t)c);
+	}
+}
+
+static struct name *
+read_names(const char *path, int *count)
+{
+	struct name *names = NULL;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int n = 0, alloc = 0;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while ((len = getline(&line, &cap, f)) > 0) {
+		if (line[len - 1] == '\n')
+			len--;
+		if (len == 0)
+			continue;
+		if (n == alloc) {
+			alloc = alloc ? 2 * alloc : 1024;
+			if ((names = realloc(names, alloc * sizeof(*names))) == NULL)
+				err(1, "realloc");
+		}
+		names[n].len = 0;
+		decode_utf8(&names[n], (u_char *)line, len);
+		if (names[n].len > 0)
+			n++;
+	}
+	free(line);
+	fclose(f);
+	*count = n;
+	return names;
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	const struct name *na = a, *nb = b;
+
+	return FastUnicodeCompare(na->str, na->len, nb->str, nb->len);
+}
+
+/* The same name, with the case of its ASCII letters shuffled */
+static void
+recase(struct name *to, const struct name *from)
+{
+	int k;
+
+	*to = *from;
+	for (k = 0; k < to->len; k++) {
+		u_int16_t c = to->str[k];
+
+		if (random() % 2 && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+			to->str[k] = c ^ 0x20;
+	}
+}
+
+static void
+check(void)
+{
+	static const u_int16_t chars[] = {
+		'a', 'A', 'b', 'B', 'z', 'Z', '.', '_', '@', '[', '`', '{', 0x7F, 0,
+		0xC9, 0xE9, 0xDF, 0x130, 0x3A3, 0x3C3, 0x3C2, 0x4E00, 0x200C, 0xFEFF, 0xFFFF,
+	};
+	struct name a, b;
+	u_int16_t folded[MAXNAME];
+	u_int32_t flen;
+	int i, k;
+
+	for (i = 0; i < 1000000; i++) {
+		a.len = random() % 12;
+		if (random() % 50 == 0)
+			a.len = random() % (MAXNAME + 1);
+		for (k = 0; k < a.len; k++)
+			a.str[k] = random() % 4 ? 'a' + random() % 26 : chars[random() % 25];
+		if (random() % 2)
+			recase(&b, &a);
+		else {
+			b.len = random() % 12;
+			for (k = 0; k < b.len; k++)
+				b.str[k] = random() % 4 ? 'A' + random() % 26 : chars[random() % 25];
+		}
+		if (random() % 4 == 0 && b.len > 0)
+			b.str[random() % b.len] = chars[random() % 25];
+
+		flen = FastUnicodeFold(a.str, a.len, folded);
+		if (flen > a.len)
+			errx(1, "FastUnicodeFold made %u characters of %u", flen, a.len);
+		if (sign(FastUnicodeCompareFolded(folded, flen, b.str, b.len)) !=
+			sign(FastUnicodeCompare(a.str, a.len, b.str, b.len)))
+			errx(1, "FastUnicodeCompareFolded differs on pair %d", i);
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hfs_unifold_bench [-f names] [-n names] [-p passes] [-s seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*make)(struct name *, int);
+	} corpora[] = {
+		{ "source", make_source },
+		{ "photos", make_photos },
+		{ "mail", make_mail },
+		{ "intl", make_intl },
+	};
+	const char *path = NULL;
+	int count = 100000, passes = 3, ch, c, i, k, pass, how;
+	volatile int32_t sink = 0;
+
+	srandom(1);
+	while ((ch = getopt(argc, argv, "f:n:p:s:")) != -1) {
+		switch (ch) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 's':
+			srandom((unsigned)strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || count <= 0 || passes <= 0)
+		usage();
+
+	check();
+	printf("hfs_unifold_bench: folded compares agree with FastUnicodeCompare\n");
+
+	printf("lookups of every name in each corpus, best of %d\n", passes);
+	printf("%-8s %8s %7s %12s %12s %8s\n", "corpus", "names", "probes",
+		   "compare ns", "folded ns", "speedup");
+	for (c = path ? -1 : 0; c < (path ? 0 : 4); c++) {
+		struct name *names, *search;
+		u_int64_t best[2] = { ~0ULL, ~0ULL };
+		u_int64_t probes = 0;
+		int n = count;
+
+		if (c < 0) {
+			names = read_names(path, &n);
+			if (n == 0)
+				errx(1, "%s: no names", path);
+		} else {
+			if ((names = calloc(n, sizeof(*names))) == NULL)
+				err(1, "calloc");
+			for (i = 0; i < n; i++)
+				corpora[c].make(&names[i], i);
+		}
+		qsort(names, n, sizeof(*names), name_cmp);
+
+		if ((search = malloc(n * sizeof(*search))) == NULL)
+			err(1, "malloc");
+		for (i = 0; i < n; i++)
+			recase(&search[i], &names[random() % n]);
+
+		for (how = 0; how < 2; how++) {
+			for (pass = 0; pass < passes; pass++) {
+				u_int64_t t = now_ns();
+
+				probes = 0;
+				for (i = 0; i < n; i++) {
+					const struct name *s = &search[i];
+					u_int16_t folded[MAXNAME];
+					u_int32_t flen = 0;
+					bool ascii = false;
+					int lo = 0, hi = n - 1, mid;
+					int32_t r;
+
+					if (how == 1 && (ascii = FastUnicodeIsASCII(s->str, s->len)))
+						flen = FastUnicodeFold(s->str, s->len, folded);
+					while (lo <= hi) {
+						mid = (lo + hi) >> 1;
+						if (!ascii)
+							r = FastUnicodeCompare(s->str, s->len, names[mid].str, names[mid].len);
+						else
+							r = FastUnicodeCompareFolded(folded, flen, names[mid].str, names[mid].len);
+						probes++;
+						if (r < 0)
+							hi = mid - 1;
+						else if (r > 0)
+							lo = mid + 1;
+						else
+							break;
+					}
+					sink += lo;
+				}
+				t = now_ns() - t;
+				if (t < best[how])
+					best[how] = t;
+			}
+		}
+
+		/* Both ways have to find the same names */
+		for (i = 0; i < n; i++) {
+			u_int16_t folded[MAXNAME];
+			u_int32_t flen = FastUnicodeFold(search[i].str, search[i].len, folded);
+
+			for (k = 0; k < 8; k++) {
+				const struct name *t = &names[random() % n];
+
+				if (sign(FastUnicodeCompareFolded(folded, flen, t->str, t->len)) !=
+					sign(FastUnicodeCompare(search[i].str, search[i].len, t->str, t->len)))
+					errx(1, "%s: FastUnicodeCompareFolded differs", c < 0 ? path : corpora[c].name);
+			}
+		}
+
+		printf("%-8s %8d %7.1f %12.1f %12.1f %7.2fx\n", c < 0 ? "file" : corpora[c].name,
+			   n, (double)probes / n, (double)best[0] / probes, (double)best[1] / probes,
+			   (double)best[0] / best[1]);
+		free(search);
+		free(names);
+	}
+
+	return 0;
+}